@@ -0,0 +1,269 @@
+#include "aio.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#ifdef HAVE_LIBURING
+#include <sys/eventfd.h>
+#endif
+
+#include "cpu.h"
+#include "replay.h"
+
+AsyncIO::AsyncIO()
+{
+    cpu = NULL;
+    stopping = false;
+    inflight = 0;
+    pthread_mutex_init(&lock, NULL);
+    pthread_cond_init(&cond, NULL);
+
+#ifdef HAVE_LIBURING
+    ring_enabled = io_uring_queue_init(AIO_QUEUE_DEPTH, &ring, 0) == 0;
+    if (!ring_enabled) {
+        printf("AsyncIO: io_uring is unavailable, using thread pool\n");
+    }
+    event_fd = -1;
+    if (ring_enabled) {
+        event_fd = eventfd(0, 0);
+        if (event_fd >= 0 && io_uring_register_eventfd(&ring, event_fd) == 0) {
+            pthread_create(&notifier, NULL, notifier_main, this);
+        } else if (event_fd >= 0) {
+            close(event_fd);
+            event_fd = -1;
+        }
+    }
+#endif
+
+    for (int i = 0; i < AIO_THREAD_COUNT; i++) {
+        pthread_create(&workers[i], NULL, worker_main, this);
+    }
+}
+
+AsyncIO::~AsyncIO()
+{
+    pthread_mutex_lock(&lock);
+    __atomic_store_n(&stopping, true, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&cond);
+    pthread_mutex_unlock(&lock);
+
+    for (int i = 0; i < AIO_THREAD_COUNT; i++) {
+        pthread_join(workers[i], NULL);
+    }
+
+#ifdef HAVE_LIBURING
+    if (event_fd >= 0) {
+        // Wake the notifier to see stopping
+        uint64_t value = 1;
+        if (write(event_fd, &value, sizeof(value)) != sizeof(value)) {
+            printf("AsyncIO: Failed to stop notifier\n");
+        }
+        pthread_join(notifier, NULL);
+        close(event_fd);
+    }
+    if (ring_enabled) {
+        io_uring_queue_exit(&ring);
+    }
+#endif
+
+    pthread_cond_destroy(&cond);
+    pthread_mutex_destroy(&lock);
+}
+
+void AsyncIO::submit(aio_request *request)
+{
+    __atomic_fetch_add(&inflight, 1, __ATOMIC_RELAXED);
+
+    // Under record/replay, completions have to reach the guest at the
+    // same point in both runs. Done right away, they are all collected by
+    // the next poll, before the guest runs again.
+    if (replay_mode != REPLAY_OFF) {
+        execute(request);
+        pthread_mutex_lock(&lock);
+        completed.push_back(request);
+        pthread_mutex_unlock(&lock);
+        return;
+    }
+
+#ifdef HAVE_LIBURING
+    if (ring_enabled && submit_uring(request)) {
+        return;
+    }
+#endif
+
+    pthread_mutex_lock(&lock);
+    pending.push_back(request);
+    pthread_cond_signal(&cond);
+    pthread_mutex_unlock(&lock);
+}
+
+void AsyncIO::connect_cpu(CPU *cpu)
+{
+    __atomic_store_n(&this->cpu, cpu, __ATOMIC_RELEASE);
+}
+
+void AsyncIO::kick_cpu()
+{
+    CPU *cpu = __atomic_load_n(&this->cpu, __ATOMIC_ACQUIRE);
+    if (cpu != NULL) {
+        cpu->kick();
+    }
+}
+
+int AsyncIO::poll_completions()
+{
+    int count = 0;
+
+#ifdef HAVE_LIBURING
+    struct io_uring_cqe *cqe;
+    while (ring_enabled && io_uring_peek_cqe(&ring, &cqe) == 0) {
+        aio_request *request = (aio_request*)io_uring_cqe_get_data(cqe);
+        request->result = cqe->res;
+        io_uring_cqe_seen(&ring, cqe);
+
+        complete(request);
+        count++;
+    }
+#endif
+
+    pthread_mutex_lock(&lock);
+    std::deque<aio_request*> done;
+    done.swap(completed);
+    pthread_mutex_unlock(&lock);
+
+    for (size_t i = 0; i < done.size(); i++) {
+        complete(done[i]);
+        count++;
+    }
+
+    for (size_t i = 0; i < batch_handlers.size(); i++) {
+        batch_handlers[i]->aio_complete_batch();
+    }
+    batch_handlers.clear();
+
+    return count;
+}
+
+void AsyncIO::complete(aio_request *request)
+{
+    AIOHandler *handler = request->handler;
+
+    handler->aio_complete(request);
+    __atomic_fetch_sub(&inflight, 1, __ATOMIC_RELEASE);
+
+    for (size_t i = 0; i < batch_handlers.size(); i++) {
+        if (batch_handlers[i] == handler) {
+            return;
+        }
+    }
+    batch_handlers.push_back(handler);
+}
+
+int AsyncIO::get_inflight()
+{
+    return __atomic_load_n(&inflight, __ATOMIC_ACQUIRE);
+}
+
+void *AsyncIO::worker_main(void *arg)
+{
+    ((AsyncIO*)arg)->run_worker();
+
+    return NULL;
+}
+
+void AsyncIO::run_worker()
+{
+    pthread_mutex_lock(&lock);
+    while (true) {
+        while (pending.empty() && !stopping) {
+            pthread_cond_wait(&cond, &lock);
+        }
+        if (stopping) {
+            break;
+        }
+
+        aio_request *request = pending.front();
+        pending.pop_front();
+
+        pthread_mutex_unlock(&lock);
+        execute(request);
+        pthread_mutex_lock(&lock);
+
+        completed.push_back(request);
+        kick_cpu();
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+void AsyncIO::execute(aio_request *request)
+{
+    switch (request->op) {
+    case AIO_OP_READ:
+        request->result = request->backend->preadv(request->iov,
+                request->iovcnt, request->offset);
+        break;
+    case AIO_OP_WRITE:
+        request->result = request->backend->pwritev(request->iov,
+                request->iovcnt, request->offset);
+        break;
+    case AIO_OP_FLUSH:
+        request->result = request->backend->flush();
+        break;
+    }
+}
+
+#ifdef HAVE_LIBURING
+void *AsyncIO::notifier_main(void *arg)
+{
+    ((AsyncIO*)arg)->run_notifier();
+
+    return NULL;
+}
+
+void AsyncIO::run_notifier()
+{
+    for (;;) {
+        uint64_t value;
+        if (read(event_fd, &value, sizeof(value)) < 0 && errno != EINTR) {
+            break;
+        }
+        if (__atomic_load_n(&stopping, __ATOMIC_ACQUIRE)) {
+            break;
+        }
+        kick_cpu();
+    }
+}
+
+bool AsyncIO::submit_uring(aio_request *request)
+{
+    int fd = request->backend->get_fd();
+    if (fd < 0) {
+        return false;
+    }
+
+    struct io_uring_sqe *sqe = io_uring_get_sqe(&ring);
+    if (sqe == NULL) {
+        // Ring is full; the thread pool takes the overflow
+        return false;
+    }
+
+    switch (request->op) {
+    case AIO_OP_READ:
+        io_uring_prep_readv(sqe, fd, request->iov, request->iovcnt,
+                request->offset);
+        break;
+    case AIO_OP_WRITE:
+        io_uring_prep_writev(sqe, fd, request->iov, request->iovcnt,
+                request->offset);
+        break;
+    case AIO_OP_FLUSH:
+        io_uring_prep_fsync(sqe, fd, 0);
+        break;
+    }
+    io_uring_sqe_set_data(sqe, request);
+    io_uring_submit(&ring);
+
+    return true;
+}
+#endif
@@ -0,0 +1,99 @@
+#ifndef __AIO_H__
+#define __AIO_H__
+
+#include <stdint.h>
+#include <pthread.h>
+#include <deque>
+#include <vector>
+
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+#include "block.h"
+
+#define AIO_THREAD_COUNT    (4)
+#define AIO_QUEUE_DEPTH     (128)
+
+typedef enum {
+    AIO_OP_READ,
+    AIO_OP_WRITE,
+    AIO_OP_FLUSH,
+} aio_op_t;
+
+class AIOHandler;
+class CPU;
+
+struct aio_request {
+    aio_op_t op;
+    BlockBackend *backend;
+    const struct iovec *iov;
+    int iovcnt;
+    uint64_t offset;
+    // Bytes transferred, or -errno on failure
+    ssize_t result;
+    AIOHandler *handler;
+};
+
+class AIOHandler {
+public:
+    virtual ~AIOHandler() {}
+    // Called from AsyncIO::poll_completions on the polling thread
+    virtual void aio_complete(aio_request *request) = 0;
+    // Called once per poll after all completions of this handler, so that
+    // devices can coalesce their interrupts
+    virtual void aio_complete_batch() {};
+};
+
+// Services block requests without blocking the vCPU. Requests go to
+// io_uring when the backend has a plain fd, and to a thread pool otherwise.
+// Under record/replay they are done synchronously in submit() instead, so
+// that completions don't depend on host timing.
+class AsyncIO {
+public:
+    AsyncIO();
+    ~AsyncIO();
+    void submit(aio_request *request);
+    // CPU to wake when a request finishes, since completions are only
+    // polled for and a halted vCPU doesn't poll
+    void connect_cpu(CPU *cpu);
+    // Run handlers of finished requests. Return number of completions.
+    int poll_completions();
+    // Requests submitted whose handlers haven't run yet. Guest memory they
+    // point to may change at any time until then.
+    int get_inflight();
+private:
+    static void *worker_main(void *arg);
+    void run_worker();
+    void execute(aio_request *request);
+    void complete(aio_request *request);
+    void kick_cpu();
+
+    CPU *cpu;
+    pthread_t workers[AIO_THREAD_COUNT];
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool stopping;
+    int inflight;
+    // Requests waiting for a worker thread
+    std::deque<aio_request*> pending;
+    // Requests finished by worker threads
+    std::deque<aio_request*> completed;
+    // Handlers that got completions in the current poll
+    std::vector<AIOHandler*> batch_handlers;
+
+#ifdef HAVE_LIBURING
+    bool submit_uring(aio_request *request);
+    static void *notifier_main(void *arg);
+    void run_notifier();
+
+    struct io_uring ring;
+    bool ring_enabled;
+    // Signalled by the kernel for each completion on the ring, and waited
+    // on by the notifier thread to kick the CPU
+    int event_fd;
+    pthread_t notifier;
+#endif
+};
+
+#endif
@@ -0,0 +1,697 @@
+#include "ata.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "log.h"
+
+ATA::ATA(Memory *memory, AsyncIO *aio)
+{
+    this->memory = memory;
+    this->aio = aio;
+    disk = NULL;
+    pic = NULL;
+
+    features = 0;
+    error = 0;
+    control = 0;
+    set_signature();
+    status = ATA_SR_DRDY | ATA_SR_DSC;
+
+    bm_base_port = ATA_BMIDE_BASE_PORT;
+    bm_command = 0;
+    bm_status = ATA_BM_ST_DMA0_CAP;
+    bm_prd_address = 0;
+
+    transfer = ATA_XFER_NONE;
+    transfer_sector = 0;
+    transfer_count = 0;
+    transfer_done = 0;
+    buffer_pos = 0;
+    buffer_end = 0;
+    irq_raised = false;
+    request_busy = false;
+    reset_pending = false;
+}
+
+ATA::~ATA()
+{
+}
+
+void ATA::attach_disk(BlockBackend *disk)
+{
+    this->disk = disk;
+}
+
+void ATA::connect_pic(PIC *pic)
+{
+    this->pic = pic;
+}
+
+void ATA::set_bus_master_base(uint32_t port)
+{
+    bm_base_port = port;
+}
+
+uint8_t ATA::access_width(uint32_t port)
+{
+    if (port == ATA_BASE_PORT
+            || (port >= bm_base_port && port < bm_base_port + 8)) {
+        return 4;
+    }
+
+    return 1;
+}
+
+void ATA::write(uint32_t port, const uint32_t *value, uint8_t size)
+{
+    if (port == ATA_BASE_PORT) {
+        pio_write_data((const uint8_t*)value, size);
+        return;
+    }
+
+    if (port >= bm_base_port && port < bm_base_port + 8) {
+        write_bus_master(port - bm_base_port, *value, size);
+        return;
+    }
+
+    if (size != 1) {
+        LOG_WARN("ATA: Task file only supports single-byte R/W\n");
+        return;
+    }
+
+    if (port == ATA_CONTROL_PORT) {
+        write_control(*value);
+    } else {
+        write_register(port - ATA_BASE_PORT, *value);
+    }
+}
+
+void ATA::read(uint32_t port, uint32_t *value, uint8_t size)
+{
+    if (port == ATA_BASE_PORT) {
+        *value = 0;
+        pio_read_data((uint8_t*)value, size);
+        return;
+    }
+
+    if (port >= bm_base_port && port < bm_base_port + 8) {
+        *value = read_bus_master(port - bm_base_port);
+        return;
+    }
+
+    if (size != 1) {
+        LOG_WARN("ATA: Task file only supports single-byte R/W\n");
+        return;
+    }
+
+    if (port == ATA_CONTROL_PORT) {
+        // Alternate status doesn't acknowledge the interrupt
+        *value = disk != NULL ? status : 0;
+    } else {
+        *value = read_register(port - ATA_BASE_PORT);
+    }
+}
+
+void ATA::write_block(uint32_t port, const uint8_t *data, uint8_t size,
+        uint32_t count)
+{
+    if (port != ATA_BASE_PORT) {
+        IODevice::write_block(port, data, size, count);
+        return;
+    }
+
+    pio_write_data(data, size * count);
+}
+
+void ATA::read_block(uint32_t port, uint8_t *data, uint8_t size,
+        uint32_t count)
+{
+    if (port != ATA_BASE_PORT) {
+        IODevice::read_block(port, data, size, count);
+        return;
+    }
+
+    pio_read_data(data, size * count);
+}
+
+bool ATA::poll_irq()
+{
+    // Completions raise the IRQ from aio_complete
+    aio->poll_completions();
+
+    bool raised = irq_raised;
+    irq_raised = false;
+
+    return raised;
+}
+
+void ATA::write_register(uint8_t reg, uint8_t value)
+{
+    switch (reg) {
+    case 1:
+        features = value;
+        break;
+    case 2:
+        sector_count = value;
+        break;
+    case 3:
+        lba_low = value;
+        break;
+    case 4:
+        lba_mid = value;
+        break;
+    case 5:
+        lba_high = value;
+        break;
+    case 6:
+        device_head = value;
+        break;
+    case 7:
+        execute_command(value);
+        break;
+    }
+}
+
+uint8_t ATA::read_register(uint8_t reg)
+{
+    // No device on the slave position
+    if (disk == NULL || (device_head & ATA_DH_SLAVE)) {
+        return 0;
+    }
+
+    switch (reg) {
+    case 1:
+        return error;
+    case 2:
+        return sector_count;
+    case 3:
+        return lba_low;
+    case 4:
+        return lba_mid;
+    case 5:
+        return lba_high;
+    case 6:
+        return device_head | 0xa0;
+    case 7:
+        return status;
+    }
+
+    return 0xff;
+}
+
+void ATA::write_control(uint8_t value)
+{
+    // Software reset on falling edge of SRST, once the disk is idle
+    if ((control & ATA_DC_SRST) && !(value & ATA_DC_SRST)) {
+        if (request_busy) {
+            reset_pending = true;
+        } else {
+            soft_reset();
+        }
+    } else if (value & ATA_DC_SRST) {
+        status = ATA_SR_BSY;
+    }
+
+    control = value;
+}
+
+void ATA::soft_reset()
+{
+    transfer = ATA_XFER_NONE;
+    buffer_pos = buffer_end = 0;
+    error = 0x01;
+    set_signature();
+    status = ATA_SR_DRDY | ATA_SR_DSC;
+    reset_pending = false;
+}
+
+void ATA::reset()
+{
+    control = 0;
+    features = 0;
+    irq_raised = false;
+    // A request in flight clears ACTIVE when it completes
+    bm_command = 0;
+    bm_status = (bm_status & ATA_BM_ST_ACTIVE) | ATA_BM_ST_DMA0_CAP;
+    bm_prd_address = 0;
+
+    if (request_busy) {
+        reset_pending = true;
+    } else {
+        soft_reset();
+    }
+}
+
+void ATA::write_bus_master(uint8_t reg, uint32_t value, uint8_t size)
+{
+    switch (reg) {
+    case 0: {
+        bool start = !(bm_command & ATA_BM_CMD_START)
+            && (value & ATA_BM_CMD_START);
+        bm_command = value & (ATA_BM_CMD_START | ATA_BM_CMD_READ);
+        if (!(bm_command & ATA_BM_CMD_START)) {
+            bm_status &= ~ATA_BM_ST_ACTIVE;
+        } else if (start && !request_busy && (transfer == ATA_XFER_DMA_READ
+                    || transfer == ATA_XFER_DMA_WRITE)) {
+            start_dma();
+        }
+    }
+        break;
+    case 2:
+        // Interrupt and error bits are write 1 to clear
+        bm_status = (bm_status & ATA_BM_ST_ACTIVE)
+            | ((bm_status & ~value) & (ATA_BM_ST_ERROR | ATA_BM_ST_IRQ))
+            | (value & 0x60);
+        break;
+    case 4:
+        if (size == 4) {
+            bm_prd_address = value & ~0x3;
+        } else {
+            bm_prd_address = (bm_prd_address & ~0xff) | (value & 0xfc);
+        }
+        break;
+    case 5:
+    case 6:
+    case 7: {
+        int shift = (reg - 4) * 8;
+        bm_prd_address = (bm_prd_address & ~(0xff << shift))
+            | (value & 0xff) << shift;
+    }
+        break;
+    }
+}
+
+uint32_t ATA::read_bus_master(uint8_t reg)
+{
+    switch (reg) {
+    case 0:
+        return bm_command;
+    case 2:
+        return bm_status;
+    case 4:
+    case 5:
+    case 6:
+    case 7:
+        return bm_prd_address >> ((reg - 4) * 8);
+    }
+
+    return 0;
+}
+
+void ATA::execute_command(uint8_t command)
+{
+    if (disk == NULL || (device_head & ATA_DH_SLAVE)) {
+        return;
+    }
+
+    if (status & ATA_SR_BSY) {
+        LOG_WARN("ATA: Command 0x%02x issued while busy\n", command);
+        return;
+    }
+
+    error = 0;
+    transfer_sector = get_sector();
+    transfer_count = get_sector_count();
+    transfer_done = 0;
+    buffer_pos = buffer_end = 0;
+
+    switch (command) {
+    case ATA_CMD_READ_SECTORS:
+    case ATA_CMD_READ_SECTORS_NR:
+        transfer = ATA_XFER_PIO_READ;
+        status = ATA_SR_BSY | ATA_SR_DRDY;
+        submit(AIO_OP_READ, transfer_sector, transfer_count);
+        break;
+    case ATA_CMD_WRITE_SECTORS:
+    case ATA_CMD_WRITE_SECTORS_NR:
+        // No interrupt before the first sector
+        transfer = ATA_XFER_PIO_WRITE;
+        buffer_end = BLOCK_SECTOR_SIZE;
+        status = ATA_SR_DRDY | ATA_SR_DSC | ATA_SR_DRQ;
+        break;
+    case ATA_CMD_READ_DMA:
+    case ATA_CMD_WRITE_DMA:
+        transfer = command == ATA_CMD_READ_DMA
+            ? ATA_XFER_DMA_READ : ATA_XFER_DMA_WRITE;
+        status = ATA_SR_BSY | ATA_SR_DRDY;
+        // Transfer starts once the bus master is started, in either order
+        if (bm_command & ATA_BM_CMD_START) {
+            start_dma();
+        }
+        break;
+    case ATA_CMD_FLUSH_CACHE:
+        transfer = ATA_XFER_FLUSH;
+        status = ATA_SR_BSY | ATA_SR_DRDY;
+        submit(AIO_OP_FLUSH, 0, 0);
+        break;
+    case ATA_CMD_IDENTIFY:
+        identify();
+        break;
+    case ATA_CMD_DIAGNOSTIC:
+        error = 0x01;
+        set_signature();
+        status = ATA_SR_DRDY | ATA_SR_DSC;
+        raise_irq();
+        break;
+    case ATA_CMD_READ_VERIFY:
+    case ATA_CMD_INIT_PARAMS:
+    case ATA_CMD_SET_FEATURES:
+        status = ATA_SR_DRDY | ATA_SR_DSC;
+        raise_irq();
+        break;
+    default:
+        LOG_WARN("ATA: Unsupported command 0x%02x\n", command);
+        abort_command();
+        break;
+    }
+}
+
+void ATA::identify()
+{
+    uint16_t *words = (uint16_t*)buffer;
+    uint64_t sectors = disk->get_size() / BLOCK_SECTOR_SIZE;
+    uint32_t lba28_sectors = sectors > 0x0fffffff ? 0x0fffffff : sectors;
+    uint32_t cylinders = sectors / (ATA_HEADS * ATA_SECTORS_PER_TRACK);
+    if (cylinders > 16383) {
+        cylinders = 16383;
+    }
+
+    memset(buffer, 0, BLOCK_SECTOR_SIZE);
+
+    words[0] = 0x0040;
+    words[1] = cylinders;
+    words[3] = ATA_HEADS;
+    words[6] = ATA_SECTORS_PER_TRACK;
+    // Serial number, firmware revision and model are byte-swapped ASCII
+    const char *serial = "HV86000000000001    ";
+    const char *firmware = "0.1     ";
+    const char *model = "HV86 HARDDISK                           ";
+    for (int i = 0; i < 10; i++) {
+        words[10 + i] = serial[i * 2] << 8 | serial[i * 2 + 1];
+    }
+    for (int i = 0; i < 4; i++) {
+        words[23 + i] = firmware[i * 2] << 8 | firmware[i * 2 + 1];
+    }
+    for (int i = 0; i < 20; i++) {
+        words[27 + i] = model[i * 2] << 8 | model[i * 2 + 1];
+    }
+    words[47] = 0x8000;
+    // LBA and DMA supported
+    words[49] = 0x0300;
+    // Words 54-58, 64-70 and 88 are valid
+    words[53] = 0x0007;
+    words[54] = cylinders;
+    words[55] = ATA_HEADS;
+    words[56] = ATA_SECTORS_PER_TRACK;
+    words[57] = cylinders * ATA_HEADS * ATA_SECTORS_PER_TRACK;
+    words[58] = (cylinders * ATA_HEADS * ATA_SECTORS_PER_TRACK) >> 16;
+    words[60] = lba28_sectors;
+    words[61] = lba28_sectors >> 16;
+    // Multiword DMA mode 0-2 supported, mode 2 selected
+    words[63] = 0x0407;
+    // PIO mode 3-4 supported
+    words[64] = 0x0003;
+    // ATA-1 to ATA-6
+    words[80] = 0x007e;
+    words[83] = 0x4000;
+    words[86] = 0x4000;
+
+    transfer = ATA_XFER_PIO_READ;
+    transfer_count = 1;
+    buffer_end = BLOCK_SECTOR_SIZE;
+    status = ATA_SR_DRDY | ATA_SR_DSC | ATA_SR_DRQ;
+    raise_irq();
+}
+
+void ATA::set_signature()
+{
+    // ATA (non-packet) device signature
+    sector_count = 1;
+    lba_low = 1;
+    lba_mid = 0;
+    lba_high = 0;
+    device_head = 0;
+}
+
+uint64_t ATA::get_sector()
+{
+    if (device_head & ATA_DH_LBA) {
+        return (uint64_t)(device_head & 0xf) << 24
+            | lba_high << 16 | lba_mid << 8 | lba_low;
+    }
+
+    uint32_t cylinder = lba_high << 8 | lba_mid;
+    uint32_t head = device_head & 0xf;
+
+    return ((uint64_t)cylinder * ATA_HEADS + head) * ATA_SECTORS_PER_TRACK
+        + lba_low - 1;
+}
+
+uint32_t ATA::get_sector_count()
+{
+    return sector_count == 0 ? ATA_MAX_SECTORS : sector_count;
+}
+
+void ATA::abort_command()
+{
+    transfer = ATA_XFER_NONE;
+    error = ATA_ER_ABRT;
+    status = ATA_SR_DRDY | ATA_SR_ERR;
+    raise_irq();
+}
+
+void ATA::pio_read_data(uint8_t *data, uint32_t length)
+{
+    while (length > 0 && transfer == ATA_XFER_PIO_READ
+            && buffer_pos < buffer_end) {
+        // Copy up to the next sector boundary
+        uint32_t chunk = BLOCK_SECTOR_SIZE - buffer_pos % BLOCK_SECTOR_SIZE;
+        if (chunk > length) {
+            chunk = length;
+        }
+
+        memcpy(data, buffer + buffer_pos, chunk);
+        data += chunk;
+        length -= chunk;
+        buffer_pos += chunk;
+
+        if (buffer_pos % BLOCK_SECTOR_SIZE == 0) {
+            pio_sector_done();
+        }
+    }
+}
+
+void ATA::pio_write_data(const uint8_t *data, uint32_t length)
+{
+    while (length > 0 && transfer == ATA_XFER_PIO_WRITE
+            && buffer_pos < buffer_end && !(status & ATA_SR_BSY)) {
+        uint32_t chunk = BLOCK_SECTOR_SIZE - buffer_pos % BLOCK_SECTOR_SIZE;
+        if (chunk > length) {
+            chunk = length;
+        }
+
+        memcpy(buffer + buffer_pos, data, chunk);
+        data += chunk;
+        length -= chunk;
+        buffer_pos += chunk;
+
+        if (buffer_pos % BLOCK_SECTOR_SIZE == 0) {
+            pio_sector_done();
+        }
+    }
+}
+
+void ATA::pio_sector_done()
+{
+    if (transfer == ATA_XFER_PIO_WRITE) {
+        // Write back the sector, the interrupt follows on completion
+        status = ATA_SR_BSY | ATA_SR_DRDY;
+        submit(AIO_OP_WRITE, transfer_sector + transfer_done, 1);
+        return;
+    }
+
+    transfer_done++;
+    if (transfer_done < transfer_count) {
+        // Next sector is already in the buffer
+        raise_irq();
+        return;
+    }
+
+    transfer = ATA_XFER_NONE;
+    status = ATA_SR_DRDY | ATA_SR_DSC;
+}
+
+void ATA::start_dma()
+{
+    uint32_t remaining = transfer_count * BLOCK_SECTOR_SIZE;
+    uint32_t prd = bm_prd_address;
+    int iovcnt = 0;
+
+    // Map the physical region descriptor table straight into guest memory
+    while (remaining > 0 && iovcnt < ATA_MAX_PRD) {
+        uint32_t *entry = (uint32_t*)memory->get_pointer(prd, 8);
+        if (entry == NULL) {
+            break;
+        }
+
+        uint32_t address = entry[0];
+        uint32_t length = entry[1] & 0xffff;
+        if (length == 0) {
+            length = 0x10000;
+        }
+        if (length > remaining) {
+            length = remaining;
+        }
+
+        void *base = memory->get_pointer(address, length);
+        if (base == NULL) {
+            break;
+        }
+
+        iov[iovcnt].iov_base = base;
+        iov[iovcnt].iov_len = length;
+        iovcnt++;
+        remaining -= length;
+
+        if (entry[1] & ATA_PRD_EOT) {
+            break;
+        }
+        prd += 8;
+    }
+
+    if (iovcnt == 0 || remaining > 0) {
+        LOG_WARN("ATA: Invalid PRD table at 0x%08x\n", bm_prd_address);
+        bm_status |= ATA_BM_ST_ERROR;
+        abort_command();
+        return;
+    }
+
+    bm_status |= ATA_BM_ST_ACTIVE;
+
+    request.op = transfer == ATA_XFER_DMA_READ ? AIO_OP_READ : AIO_OP_WRITE;
+    request.backend = disk;
+    request.iov = iov;
+    request.iovcnt = iovcnt;
+    request.offset = transfer_sector * BLOCK_SECTOR_SIZE;
+    request.handler = this;
+    request_busy = true;
+    aio->submit(&request);
+}
+
+void ATA::submit(aio_op_t op, uint64_t sector, uint32_t count)
+{
+    uint32_t offset = (sector - transfer_sector) * BLOCK_SECTOR_SIZE;
+
+    iov[0].iov_base = buffer + offset;
+    iov[0].iov_len = count * BLOCK_SECTOR_SIZE;
+
+    request.op = op;
+    request.backend = disk;
+    request.iov = iov;
+    request.iovcnt = 1;
+    request.offset = sector * BLOCK_SECTOR_SIZE;
+    request.handler = this;
+    request_busy = true;
+    aio->submit(&request);
+}
+
+void ATA::aio_complete(aio_request *request)
+{
+    request_busy = false;
+    uint32_t expected = 0;
+    for (int i = 0; i < request->iovcnt; i++) {
+        expected += request->iov[i].iov_len;
+    }
+    if (request->op == AIO_OP_FLUSH) {
+        expected = 0;
+    }
+    // Even a failed read may have written some of guest memory
+    if (transfer == ATA_XFER_DMA_READ) {
+        memory->mark_dirty_iov(request->iov, request->iovcnt);
+    }
+
+    // A reset during the request takes effect now, or when SRST is
+    // released, and drops the result
+    if (reset_pending || (control & ATA_DC_SRST)) {
+        bm_status &= ~ATA_BM_ST_ACTIVE;
+        transfer = ATA_XFER_NONE;
+        if (reset_pending) {
+            soft_reset();
+        }
+        return;
+    }
+
+    if (request->result < 0 || (uint32_t)request->result != expected) {
+        LOG_ERROR("ATA: I/O error at sector %llu\n",
+                (unsigned long long)transfer_sector);
+        if (transfer == ATA_XFER_DMA_READ || transfer == ATA_XFER_DMA_WRITE) {
+            bm_status = (bm_status & ~ATA_BM_ST_ACTIVE) | ATA_BM_ST_ERROR
+                | ATA_BM_ST_IRQ;
+        }
+        abort_command();
+        return;
+    }
+
+    switch (transfer) {
+    case ATA_XFER_PIO_READ:
+        // Whole transfer is buffered; guest drains it sector by sector
+        buffer_pos = 0;
+        buffer_end = transfer_count * BLOCK_SECTOR_SIZE;
+        status = ATA_SR_DRDY | ATA_SR_DSC | ATA_SR_DRQ;
+        break;
+    case ATA_XFER_PIO_WRITE:
+        transfer_done++;
+        if (transfer_done < transfer_count) {
+            buffer_end += BLOCK_SECTOR_SIZE;
+            status = ATA_SR_DRDY | ATA_SR_DSC | ATA_SR_DRQ;
+        } else {
+            transfer = ATA_XFER_NONE;
+            status = ATA_SR_DRDY | ATA_SR_DSC;
+        }
+        break;
+    case ATA_XFER_DMA_READ:
+    case ATA_XFER_DMA_WRITE:
+        bm_status = (bm_status & ~ATA_BM_ST_ACTIVE) | ATA_BM_ST_IRQ;
+        transfer = ATA_XFER_NONE;
+        status = ATA_SR_DRDY | ATA_SR_DSC;
+        break;
+    case ATA_XFER_FLUSH:
+        transfer = ATA_XFER_NONE;
+        status = ATA_SR_DRDY | ATA_SR_DSC;
+        break;
+    case ATA_XFER_NONE:
+        return;
+    }
+
+    raise_irq();
+}
+
+void ATA::raise_irq()
+{
+    if (control & ATA_DC_NIEN) {
+        return;
+    }
+
+    irq_raised = true;
+    if (pic != NULL) {
+        // IRQ14 is IRQ6 of the slave PIC
+        pic->push_irq(ATA_IRQ - PIC_IRQ_COUNT);
+    }
+}
+
+void ATA::debug_status()
+{
+    printf("------------------------------\n");
+    printf("ATA:\n");
+    printf("Status: 0x%02x, error: 0x%02x, control: 0x%02x\n",
+            status, error, control);
+    printf("Count: %d, LBA: 0x%02x%02x%02x, device: 0x%02x\n",
+            sector_count, lba_high, lba_mid, lba_low, device_head);
+    printf("Transfer: %d, sector: %llu, done: %u/%u, buffer: %u/%u\n",
+            transfer, (unsigned long long)transfer_sector,
+            transfer_done, transfer_count, buffer_pos, buffer_end);
+    printf("Bus master: command 0x%02x, status 0x%02x, PRD 0x%08x\n",
+            bm_command, bm_status, bm_prd_address);
+    printf("------------------------------\n");
+}
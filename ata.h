@@ -0,0 +1,164 @@
+#ifndef __ATA_H__
+#define __ATA_H__
+
+#include <stdint.h>
+#include <sys/uio.h>
+
+#include "aio.h"
+#include "block.h"
+#include "io_device.h"
+#include "memory.h"
+#include "pic.h"
+
+// Primary channel. Ports to connect: ATA_BASE_PORT (8 ports),
+// ATA_CONTROL_PORT (1 port) and ATA_BMIDE_BASE_PORT (8 ports).
+#define ATA_BASE_PORT           (0x1f0)
+#define ATA_CONTROL_PORT        (0x3f6)
+#define ATA_BMIDE_BASE_PORT     (0xc000)
+#define ATA_IRQ                 (14)
+#define ATA_MAX_SECTORS         (256)
+#define ATA_MAX_PRD             (256)
+
+// Status register
+#define ATA_SR_BSY              (0x80)
+#define ATA_SR_DRDY             (0x40)
+#define ATA_SR_DSC              (0x10)
+#define ATA_SR_DRQ              (0x08)
+#define ATA_SR_ERR              (0x01)
+// Error register
+#define ATA_ER_ABRT             (0x04)
+// Device control register
+#define ATA_DC_NIEN             (0x02)
+#define ATA_DC_SRST             (0x04)
+// Device/head register
+#define ATA_DH_LBA              (0x40)
+#define ATA_DH_SLAVE            (0x10)
+
+#define ATA_CMD_READ_SECTORS    (0x20)
+#define ATA_CMD_READ_SECTORS_NR (0x21)
+#define ATA_CMD_WRITE_SECTORS   (0x30)
+#define ATA_CMD_WRITE_SECTORS_NR (0x31)
+#define ATA_CMD_READ_VERIFY     (0x40)
+#define ATA_CMD_DIAGNOSTIC      (0x90)
+#define ATA_CMD_INIT_PARAMS     (0x91)
+#define ATA_CMD_READ_DMA        (0xc8)
+#define ATA_CMD_WRITE_DMA       (0xca)
+#define ATA_CMD_FLUSH_CACHE     (0xe7)
+#define ATA_CMD_IDENTIFY        (0xec)
+#define ATA_CMD_SET_FEATURES    (0xef)
+
+// Bus master IDE registers
+#define ATA_BM_CMD_START        (0x01)
+#define ATA_BM_CMD_READ         (0x08)
+#define ATA_BM_ST_ACTIVE        (0x01)
+#define ATA_BM_ST_ERROR         (0x02)
+#define ATA_BM_ST_IRQ           (0x04)
+#define ATA_BM_ST_DMA0_CAP      (0x20)
+#define ATA_PRD_EOT             (0x8000)
+
+#define ATA_HEADS               (16)
+#define ATA_SECTORS_PER_TRACK   (63)
+
+typedef enum {
+    ATA_XFER_NONE,
+    ATA_XFER_PIO_READ,
+    ATA_XFER_PIO_WRITE,
+    ATA_XFER_DMA_READ,
+    ATA_XFER_DMA_WRITE,
+    ATA_XFER_FLUSH,
+} ata_transfer_t;
+
+class ATA : public IODevice, public AIOHandler {
+public:
+    ATA(Memory *memory, AsyncIO *aio);
+    ~ATA();
+    void attach_disk(BlockBackend *disk);
+    // IRQ14 is wired to the slave PIC
+    void connect_pic(PIC *pic);
+    // Bus master registers move when the PCI BAR is reprogrammed
+    void set_bus_master_base(uint32_t port);
+
+    void write(uint32_t port, const uint32_t *value, uint8_t size);
+    void read(uint32_t port, uint32_t *value, uint8_t size);
+    // Data port and bus master registers support 16/32-bit access
+    uint8_t access_width(uint32_t port);
+    bool poll_irq();
+    // Hardware reset: like a software reset, once the disk is idle, and
+    // the bus master stopped
+    void reset();
+    void write_block(uint32_t port, const uint8_t *data, uint8_t size,
+            uint32_t count);
+    void read_block(uint32_t port, uint8_t *data, uint8_t size,
+            uint32_t count);
+    void aio_complete(aio_request *request);
+    void debug_status();
+private:
+    void write_register(uint8_t reg, uint8_t value);
+    uint8_t read_register(uint8_t reg);
+    void write_control(uint8_t value);
+    void write_bus_master(uint8_t reg, uint32_t value, uint8_t size);
+    uint32_t read_bus_master(uint8_t reg);
+
+    // Back to the power-on task file; nothing may be in flight
+    void soft_reset();
+    void execute_command(uint8_t command);
+    void identify();
+    void set_signature();
+    // Sector address from LBA or CHS registers
+    uint64_t get_sector();
+    uint32_t get_sector_count();
+    void abort_command();
+
+    // Copy PIO data between guest and the sector buffer
+    void pio_read_data(uint8_t *data, uint32_t length);
+    void pio_write_data(const uint8_t *data, uint32_t length);
+    // Called when guest has transferred a whole sector
+    void pio_sector_done();
+    void start_dma();
+    void submit(aio_op_t op, uint64_t sector, uint32_t count);
+    void raise_irq();
+
+    Memory *memory;
+    AsyncIO *aio;
+    BlockBackend *disk;
+    PIC *pic;
+
+    // Task file
+    uint8_t features;
+    uint8_t sector_count;
+    uint8_t lba_low;
+    uint8_t lba_mid;
+    uint8_t lba_high;
+    uint8_t device_head;
+    uint8_t status;
+    uint8_t error;
+    uint8_t control;
+
+    // Bus master IDE
+    uint32_t bm_base_port;
+    uint8_t bm_command;
+    uint8_t bm_status;
+    uint32_t bm_prd_address;
+
+    // Current transfer
+    ata_transfer_t transfer;
+    uint64_t transfer_sector;
+    uint32_t transfer_count;
+    // Sectors completed so far
+    uint32_t transfer_done;
+    // Byte position in buffer and end of data valid for the guest
+    uint32_t buffer_pos;
+    uint32_t buffer_end;
+    uint8_t buffer[ATA_MAX_SECTORS * BLOCK_SECTOR_SIZE];
+    bool irq_raised;
+
+    // In-flight request (one per channel). It owns buffer and iov until it
+    // completes, so the device stays busy until then, even across a reset.
+    aio_request request;
+    struct iovec iov[ATA_MAX_PRD];
+    bool request_busy;
+    // SRST was released while the request was in flight
+    bool reset_pending;
+};
+
+#endif
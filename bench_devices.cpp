@@ -0,0 +1,400 @@
+// Microbenchmarks of device hot paths
+//
+// Usage: bench_devices [filter]
+//   Runs benchmarks whose name contains filter (all by default) and
+//   prints ns/op and operator new calls/op for each.
+
+#include "cmos.h"
+#include "io_bus.h"
+#include "memory.h"
+#include "pic.h"
+#include "pit.h"
+#include "rep_string.h"
+#include "soft_mmu.h"
+#include "stats.h"
+#include "text_display.h"
+#include "uart.h"
+#include "vga.h"
+
+#include <fcntl.h>
+#include <new>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// Each benchmark runs for at least this long
+#define BENCH_MIN_TIME      (200000000ULL)
+#define BENCH_MAX_ITERATIONS (1ULL << 30)
+
+static uint64_t allocation_count = 0;
+
+void *operator new(size_t size)
+{
+    allocation_count++;
+    void *p = malloc(size ? size : 1);
+    if (p == NULL) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void *operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+void operator delete(void *p) noexcept
+{
+    free(p);
+}
+
+void operator delete[](void *p) noexcept
+{
+    free(p);
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+    free(p);
+}
+
+void operator delete[](void *p, size_t) noexcept
+{
+    free(p);
+}
+
+static uint64_t get_time()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Keep the compiler from discarding results
+static volatile uint32_t sink;
+
+template <typename F>
+static void run_benchmark(const char *filter, const char *name, F body)
+{
+    if (filter != NULL && strstr(name, filter) == NULL) {
+        return;
+    }
+
+    // Warm up, and grow iteration count until the run is long enough
+    uint64_t iterations = 1;
+    uint64_t elapsed = 0;
+    uint64_t allocations = 0;
+    while (true) {
+        uint64_t start_allocations = allocation_count;
+        uint64_t start = get_time();
+        for (uint64_t i = 0; i < iterations; i++) {
+            body();
+        }
+        elapsed = get_time() - start;
+        allocations = allocation_count - start_allocations;
+
+        if (elapsed >= BENCH_MIN_TIME || iterations >= BENCH_MAX_ITERATIONS) {
+            break;
+        }
+        iterations *= elapsed < BENCH_MIN_TIME / 100 ? 10 : 2;
+    }
+
+    fprintf(stderr, "%-32s %12llu %10.1f ns/op %8.3f allocs/op\n", name,
+            (unsigned long long)iterations, (double)elapsed / iterations,
+            (double)allocations / iterations);
+}
+
+// Run body with stdout sent to /dev/null, for devices that print
+template <typename F>
+static void run_silenced(const char *filter, const char *name, F body)
+{
+    fflush(stdout);
+    int saved = dup(STDOUT_FILENO);
+    int null_fd = open("/dev/null", O_WRONLY);
+    dup2(null_fd, STDOUT_FILENO);
+    close(null_fd);
+
+    run_benchmark(filter, name, body);
+
+    fflush(stdout);
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+}
+
+static void bench_pit(const char *filter)
+{
+    PIT pit;
+    uint32_t value;
+
+    // Channel 2, lobyte/hibyte, mode 3
+    value = 0xb6;
+    pit.write(0x43, &value, 1);
+    value = 0x98;
+    pit.write(0x42, &value, 1);
+    value = 0x0a;
+    pit.write(0x42, &value, 1);
+
+    run_benchmark(filter, "pit/latch_read", [&]() {
+        uint32_t lo, hi;
+        value = 0x80;
+        pit.write(0x43, &value, 1);
+        pit.read(0x42, &lo, 1);
+        pit.read(0x42, &hi, 1);
+        sink = lo | hi << 8;
+    });
+    run_benchmark(filter, "pit/poll_irq", [&]() {
+        sink = pit.poll_irq();
+    });
+}
+
+static void bench_cmos(const char *filter)
+{
+    CMOS cmos;
+    uint32_t value;
+
+    run_benchmark(filter, "cmos/read_seconds", [&]() {
+        value = 0x00;
+        cmos.write(0x70, &value, 1);
+        cmos.read(0x71, &value, 1);
+        sink = value;
+    });
+    run_benchmark(filter, "cmos/read_time", [&]() {
+        static const uint8_t regs[] = { 0x00, 0x02, 0x04, 0x07, 0x08, 0x09 };
+        for (int i = 0; i < (int)sizeof(regs); i++) {
+            value = regs[i];
+            cmos.write(0x70, &value, 1);
+            cmos.read(0x71, &value, 1);
+        }
+        sink = value;
+    });
+}
+
+static void bench_pic(const char *filter)
+{
+    PIC pic;
+    uint32_t value;
+
+    // ICW1-4: edge triggered, vector 0x20, 8086 mode
+    value = 0x11;
+    pic.write(PIC_BASE_PORT, &value, 1);
+    value = 0x20;
+    pic.write(PIC_BASE_PORT + 1, &value, 1);
+    value = 0x04;
+    pic.write(PIC_BASE_PORT + 1, &value, 1);
+    value = 0x01;
+    pic.write(PIC_BASE_PORT + 1, &value, 1);
+    value = 0x00;
+    pic.write(PIC_BASE_PORT + 1, &value, 1);
+
+    run_benchmark(filter, "pic/raise_ack_eoi", [&]() {
+        pic.push_irq(0);
+        sink = pic.poll_irq();
+        // Non-specific EOI
+        value = 0x20;
+        pic.write(PIC_BASE_PORT, &value, 1);
+    });
+}
+
+static void bench_uart(const char *filter)
+{
+    UART uart;
+    uint32_t value;
+
+    run_silenced(filter, "uart/tx_byte", [&]() {
+        value = 'x';
+        uart.write(UART_BASE_PORT, &value, 1);
+    });
+
+    uint8_t line[64];
+    memset(line, 'x', sizeof(line));
+    run_silenced(filter, "uart/tx_string_64", [&]() {
+        uart.write_block(UART_BASE_PORT, line, 1, sizeof(line));
+    });
+
+    // RX at each FIFO trigger level: host delivers a trigger's worth of
+    // bytes and the driver drains them polling LSR
+    static const uint8_t trigger_levels[] = { 1, 4, 8, 14 };
+    for (int i = 0; i < 4; i++) {
+        char name[64];
+        snprintf(name, sizeof(name), "uart/rx_trigger_%d",
+                trigger_levels[i]);
+
+        value = 0x01 | i << 6;
+        uart.write(UART_BASE_PORT + 2, &value, 1);
+
+        run_benchmark(filter, name, [&]() {
+            uart.receive(line, trigger_levels[i]);
+            sink = uart.poll_irq();
+            while (true) {
+                uart.read(UART_BASE_PORT + 5, &value, 1);
+                if (!(value & UART_LSR_RX)) {
+                    break;
+                }
+                uart.read(UART_BASE_PORT, &value, 1);
+                sink = value;
+            }
+        });
+    }
+}
+
+static void bench_io_bus(const char *filter)
+{
+    IOBus io_bus;
+    PIC pic;
+    Stats stats;
+    uint32_t value;
+
+    io_bus.connect_io_device(PIC_BASE_PORT, 2, &pic);
+
+    run_benchmark(filter, "io_bus/direct_read", [&]() {
+        pic.read(PIC_BASE_PORT + 1, &value, 1);
+        sink = value;
+    });
+    run_benchmark(filter, "io_bus/dispatch_read", [&]() {
+        io_bus.read(PIC_BASE_PORT + 1, &value, 1);
+        sink = value;
+    });
+    run_benchmark(filter, "io_bus/dispatch_read_unmapped", [&]() {
+        io_bus.read(0x80, &value, 1);
+        sink = value;
+    });
+    // 16-bit access split into two byte-wide device calls
+    run_benchmark(filter, "io_bus/dispatch_read_split", [&]() {
+        io_bus.read(PIC_BASE_PORT, &value, 2);
+        sink = value;
+    });
+
+    io_bus.connect_stats(&stats);
+    run_benchmark(filter, "io_bus/dispatch_read_stats", [&]() {
+        io_bus.read(PIC_BASE_PORT + 1, &value, 1);
+        sink = value;
+    });
+}
+
+static void bench_soft_mmu(const char *filter)
+{
+    Memory memory(16 << 20);
+    SoftMMU mmu(&memory);
+    uint32_t value = 0;
+
+    // Identity-map 16 MB with 4 KB pages
+    uint32_t *dir = (uint32_t*)memory.get_pointer(0x1000, 0x1000);
+    uint32_t *tables = (uint32_t*)memory.get_pointer(0x2000, 0x4000);
+    for (int i = 0; i < 4096; i++) {
+        tables[i] = (i << 12) | SOFT_MMU_PTE_P | SOFT_MMU_PTE_RW;
+    }
+    for (int i = 0; i < 4; i++) {
+        dir[i] = (0x2000 + i * 0x1000) | SOFT_MMU_PTE_P | SOFT_MMU_PTE_RW;
+    }
+    mmu.set_cr3(0x1000);
+    mmu.set_cr0(SOFT_MMU_CR0_PG);
+
+    uint64_t address = 0x100000;
+    run_benchmark(filter, "soft_mmu/read_hit", [&]() {
+        mmu.read(address, &value, 4, false);
+        sink = value;
+    });
+    run_benchmark(filter, "soft_mmu/write_hit", [&]() {
+        mmu.write(address, &value, 4, false);
+    });
+    // Strided over more pages than the TLB holds
+    run_benchmark(filter, "soft_mmu/read_miss", [&]() {
+        address = (address + 0x1000 * (SOFT_TLB_SIZE + 1)) & 0xfff000;
+        mmu.read(address, &value, 4, false);
+        sink = value;
+    });
+    run_benchmark(filter, "soft_mmu/walk", [&]() {
+        uint64_t physical;
+        mmu.translate(0x123456, SOFT_MMU_READ, false, &physical);
+        sink = physical;
+    });
+}
+
+// 4 KB strings, bulk against one element per access through the TLB
+static void bench_rep_string(const char *filter)
+{
+    Memory memory(4 << 20);
+    SoftMMU mmu(&memory);
+    rep_string_state state;
+    memset(&state, 0, sizeof(state));
+    state.address_mask = 0xffffffff;
+
+    run_benchmark(filter, "rep_string/stosd_4k", [&]() {
+        state.rdi = 0x100000;
+        state.rcx = 1024;
+        state.size = 4;
+        rep_stos(&mmu, &memory, &state, 0x12345678);
+    });
+    run_benchmark(filter, "rep_string/stosd_4k_elements", [&]() {
+        uint32_t value = 0x12345678;
+        for (uint64_t i = 0; i < 1024; i++) {
+            mmu.write(0x100000 + i * 4, &value, 4, false);
+        }
+    });
+    run_benchmark(filter, "rep_string/movsb_4k", [&]() {
+        state.rsi = 0x200000;
+        state.rdi = 0x100000;
+        state.rcx = 4096;
+        state.size = 1;
+        rep_movs(&mmu, &memory, &state);
+    });
+    run_benchmark(filter, "rep_string/movsb_4k_elements", [&]() {
+        for (uint64_t i = 0; i < 4096; i++) {
+            uint8_t value;
+            mmu.read(0x200000 + i, &value, 1, false);
+            mmu.write(0x100000 + i, &value, 1, false);
+        }
+    });
+}
+
+// Refresh of an 80x25 screen, against a headless display
+static void bench_vga(const char *filter)
+{
+    Memory memory(2 << 20);
+    EventScheduler scheduler;
+    VGA vga(&memory, &scheduler);
+    MemoryTextDisplay display;
+    uint16_t *screen = (uint16_t*)memory.get_pointer(VGA_TEXT_BASE,
+            VGA_TEXT_WINDOW);
+    vga.connect_display(&display);
+    vga.refresh();
+
+    run_benchmark(filter, "vga/refresh_idle", [&]() {
+        vga.refresh();
+    });
+    uint16_t c = 0;
+    run_benchmark(filter, "vga/refresh_one_cell", [&]() {
+        screen[80 * 12 + 40] = c++;
+        vga.refresh();
+    });
+    run_benchmark(filter, "vga/refresh_full", [&]() {
+        c++;
+        for (int i = 0; i < 80 * 25; i++) {
+            screen[i] = c;
+        }
+        vga.refresh();
+    });
+    vga.connect_display(NULL);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *filter = argc > 1 ? argv[1] : NULL;
+
+    fprintf(stderr, "%-32s %12s %16s %18s\n", "benchmark", "iterations",
+            "time", "allocations");
+
+    bench_pit(filter);
+    bench_cmos(filter);
+    bench_pic(filter);
+    bench_uart(filter);
+    bench_io_bus(filter);
+    bench_soft_mmu(filter);
+    bench_rep_string(filter);
+    bench_vga(filter);
+
+    return 0;
+}
@@ -0,0 +1,101 @@
+#include "block.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+RawImage::RawImage()
+{
+    fd = -1;
+    size = 0;
+}
+
+RawImage::~RawImage()
+{
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+bool RawImage::open(const char *filename, bool read_only)
+{
+    fd = ::open(filename, read_only ? O_RDONLY : O_RDWR);
+    if (fd < 0) {
+        printf("RawImage: Failed to open image '%s'\n", filename);
+        return false;
+    }
+
+    struct stat st;
+    fstat(fd, &st);
+    size = st.st_size;
+
+    return true;
+}
+
+ssize_t RawImage::preadv(const struct iovec *iov, int iovcnt, uint64_t offset)
+{
+    ssize_t ret = ::preadv(fd, iov, iovcnt, offset);
+
+    return ret < 0 ? -errno : ret;
+}
+
+ssize_t RawImage::pwritev(const struct iovec *iov, int iovcnt, uint64_t offset)
+{
+    ssize_t ret = ::pwritev(fd, iov, iovcnt, offset);
+
+    return ret < 0 ? -errno : ret;
+}
+
+int RawImage::flush()
+{
+    return fsync(fd) < 0 ? -errno : 0;
+}
+
+uint64_t RawImage::get_size()
+{
+    return size;
+}
+
+int RawImage::get_fd()
+{
+    return fd;
+}
+
+int iov_slice(const struct iovec *iov, int iovcnt, uint64_t skip,
+        uint64_t length, struct iovec *out, int max_iov)
+{
+    int count = 0;
+
+    for (int i = 0; i < iovcnt && length > 0 && count < max_iov; i++) {
+        if (skip >= iov[i].iov_len) {
+            skip -= iov[i].iov_len;
+            continue;
+        }
+
+        uint64_t len = iov[i].iov_len - skip;
+        if (len > length) {
+            len = length;
+        }
+
+        out[count].iov_base = (uint8_t*)iov[i].iov_base + skip;
+        out[count].iov_len = len;
+        count++;
+        length -= len;
+        skip = 0;
+    }
+
+    return count;
+}
+
+uint64_t iov_length(const struct iovec *iov, int iovcnt)
+{
+    uint64_t length = 0;
+
+    for (int i = 0; i < iovcnt; i++) {
+        length += iov[i].iov_len;
+    }
+
+    return length;
+}
@@ -0,0 +1,49 @@
+#ifndef __BLOCK_H__
+#define __BLOCK_H__
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#define BLOCK_SECTOR_SIZE   (512)
+
+// Host storage behind an emulated disk
+class BlockBackend {
+public:
+    virtual ~BlockBackend() {}
+    // Return bytes transferred, or -errno on failure
+    virtual ssize_t preadv(const struct iovec *iov, int iovcnt,
+            uint64_t offset) = 0;
+    virtual ssize_t pwritev(const struct iovec *iov, int iovcnt,
+            uint64_t offset) = 0;
+    virtual int flush() = 0;
+    // Virtual disk size in bytes
+    virtual uint64_t get_size() = 0;
+    // File descriptor that maps 1:1 to the disk contents, so that requests
+    // can be submitted to the kernel directly. -1 if there is no such file.
+    virtual int get_fd() { return -1; };
+};
+
+// Plain disk image file
+class RawImage : public BlockBackend {
+public:
+    RawImage();
+    ~RawImage();
+    bool open(const char *filename, bool read_only);
+    ssize_t preadv(const struct iovec *iov, int iovcnt, uint64_t offset);
+    ssize_t pwritev(const struct iovec *iov, int iovcnt, uint64_t offset);
+    int flush();
+    uint64_t get_size();
+    int get_fd();
+private:
+    int fd;
+    uint64_t size;
+};
+
+// Select [skip, skip + length) of iov into out, which has room for max_iov
+// elements. Return element count.
+int iov_slice(const struct iovec *iov, int iovcnt, uint64_t skip,
+        uint64_t length, struct iovec *out, int max_iov);
+uint64_t iov_length(const struct iovec *iov, int iovcnt);
+
+#endif
@@ -0,0 +1,227 @@
+// End-to-end boot benchmark
+//
+// Usage: boot_bench [options] <BIOS image>
+//   -d <image>   Attach disk image with the test payload as primary master
+//   -x <image>   Attach disk image as virtio-blk at 0xd0000000, IRQ 10
+//   -b <image>   Load VGA BIOS option ROM
+//   -s <file>    Write the final VGA text screen to file
+//   -k <text>    Type text on the PS/2 keyboard once the VM starts (about
+//                40 keys; the rest is dropped if the guest isn't reading)
+//   -m <marker>  Stop when the guest writes marker to the serial port
+//                (default "BOOT OK")
+//   -t <seconds> Give up after this long (default 30)
+//   -r <MB>      Guest RAM size (default 64)
+//   -o <file>    Write JSON report to file instead of stdout
+//   -w <file>    Record nondeterministic inputs to file
+//   -p <file>    Replay inputs recorded with -w
+//   -v           Virtual time: skip idle periods instead of waiting
+//   -z           Give zero pages back to the host and merge identical ones
+//
+// Boots headlessly with serial output kept in memory, and reports wall
+// time to the marker, host CPU time and VM exits by reason and device.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "char_backend.h"
+#include "host_clock.h"
+#include "machine.h"
+#include "replay.h"
+
+static double timeval_ms(const struct timeval *tv)
+{
+    return tv->tv_sec * 1000.0 + tv->tv_usec / 1000.0;
+}
+
+// JSON string with quotes, backslashes and control characters escaped
+static void write_json_string(FILE *fp, const char *s)
+{
+    fputc('"', fp);
+    for (; *s != '\0'; s++) {
+        unsigned char c = *s;
+        if (c == '"' || c == '\\') {
+            fprintf(fp, "\\%c", c);
+        } else if (c < 0x20) {
+            fprintf(fp, "\\u%04x", c);
+        } else {
+            fputc(c, fp);
+        }
+    }
+    fputc('"', fp);
+}
+
+static void usage(const char *name)
+{
+    printf("Usage: %s [-d image] [-x image] [-b VGA BIOS] [-s screen] [-k keys] "
+            "[-m marker] [-t seconds] [-r MB] [-o report] [-w|-p log] "
+            "[-v] [-z] <BIOS image>\n", name);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *disk_path = NULL;
+    const char *virtio_disk_path = NULL;
+    const char *vga_bios_path = NULL;
+    const char *screen_path = NULL;
+    const char *keys = NULL;
+    const char *marker = "BOOT OK";
+    const char *report_path = NULL;
+    const char *record_path = NULL;
+    const char *replay_path = NULL;
+    bool virtual_time = false;
+    bool reclaim_memory = false;
+    int timeout = 30;
+    size_t ram_size = 64;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "d:x:b:s:k:m:t:r:o:w:p:vz")) != -1) {
+        switch (opt) {
+        case 'd':
+            disk_path = optarg;
+            break;
+        case 'x':
+            virtio_disk_path = optarg;
+            break;
+        case 'b':
+            vga_bios_path = optarg;
+            break;
+        case 's':
+            screen_path = optarg;
+            break;
+        case 'k':
+            keys = optarg;
+            break;
+        case 'm':
+            marker = optarg;
+            break;
+        case 't':
+            timeout = atoi(optarg);
+            break;
+        case 'r':
+            ram_size = atoi(optarg);
+            break;
+        case 'o':
+            report_path = optarg;
+            break;
+        case 'w':
+            record_path = optarg;
+            break;
+        case 'p':
+            replay_path = optarg;
+            break;
+        case 'v':
+            virtual_time = true;
+            break;
+        case 'z':
+            reclaim_memory = true;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind >= argc) {
+        usage(argv[0]);
+        return 1;
+    }
+    ram_size *= 1024 * 1024;
+
+    // Devices sample time when constructed, so start before creating them
+    if (record_path != NULL && !replay_start_record(record_path)) {
+        return 1;
+    }
+    if (replay_path != NULL && !replay_start_play(replay_path)) {
+        return 1;
+    }
+
+    uint64_t start = host_clock_ns();
+
+    machine_config config;
+    config.ram_size = ram_size;
+    config.bios_path = argv[optind];
+    config.vga_bios_path = vga_bios_path;
+    config.disk_path = disk_path;
+    config.virtio_disk_path = virtio_disk_path;
+    // Every run boots from the same images
+    config.disk_read_only = true;
+    config.virtual_time = virtual_time;
+    config.reclaim_memory = reclaim_memory;
+    config.balloon = false;
+    config.serial_fd = -1;
+    config.event_loop = NULL;
+
+    MemoryCharBackend serial(marker);
+    MemoryTextDisplay screen;
+    Machine machine;
+    if (!machine.init(&config)) {
+        return 1;
+    }
+    machine.connect_serial(&serial);
+    if (screen_path != NULL) {
+        machine.connect_display(&screen);
+    }
+    replay_connect_input(machine.get_uart());
+    replay_connect_input(machine.get_keyboard());
+
+    uint64_t boot_start = host_clock_ns();
+    machine.start();
+    if (keys != NULL) {
+        machine.get_keyboard()->receive((const uint8_t*)keys, strlen(keys));
+    }
+
+    uint64_t deadline = boot_start + (uint64_t)timeout * 1000000000ULL;
+    while (!serial.marker_seen() && host_clock_ns() < deadline) {
+        struct timespec ts = { 0, 1000000 };
+        nanosleep(&ts, NULL);
+    }
+
+    machine.stop();
+    replay_stop();
+
+    if (screen_path != NULL) {
+        // Pick up what changed since the last refresh
+        machine.get_vga()->refresh();
+        FILE *screen_fp = fopen(screen_path, "w");
+        if (screen_fp != NULL) {
+            fputs(screen.get_text().c_str(), screen_fp);
+            fclose(screen_fp);
+        } else {
+            printf("Failed to open %s\n", screen_path);
+        }
+    }
+
+    uint64_t marker_time = serial.get_marker_time();
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+    FILE *fp = report_path != NULL ? fopen(report_path, "w") : stdout;
+    if (fp == NULL) {
+        printf("Failed to open %s\n", report_path);
+        fp = stdout;
+    }
+
+    fprintf(fp, "{\"marker\":");
+    write_json_string(fp, marker);
+    fprintf(fp, ",\"marker_seen\":%s,", marker_time != 0 ? "true" : "false");
+    // Time to marker from VM start, and including setup
+    fprintf(fp, "\"boot_time_ms\":%.3f,\"total_time_ms\":%.3f,",
+            marker_time != 0 ? (marker_time - boot_start) / 1e6 : -1.0,
+            marker_time != 0 ? (marker_time - start) / 1e6 : -1.0);
+    fprintf(fp, "\"host_cpu_ms\":{\"user\":%.3f,\"system\":%.3f},",
+            timeval_ms(&usage.ru_utime), timeval_ms(&usage.ru_stime));
+    fprintf(fp, "\"exits\":%llu,\"serial_bytes\":%zu,\"stats\":",
+            (unsigned long long)machine.get_cpu()->get_exit_count(),
+            serial.get_output().size());
+    machine.get_stats()->write_json(fp);
+    fprintf(fp, "}\n");
+
+    if (fp != stdout) {
+        fclose(fp);
+    }
+
+    return marker_time != 0 ? 0 : 2;
+}
@@ -0,0 +1,133 @@
+#include "char_backend.h"
+
+#include <errno.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "cpu.h"
+#include "host_clock.h"
+#include "uart.h"
+
+MemoryCharBackend::MemoryCharBackend(const char *marker)
+{
+    this->marker = marker != NULL ? marker : "";
+    seen = false;
+    marker_time = 0;
+}
+
+MemoryCharBackend::~MemoryCharBackend()
+{
+}
+
+void MemoryCharBackend::write(const uint8_t *data, uint32_t length)
+{
+    size_t old_length = output.size();
+    output.append((const char*)data, length);
+
+    if (seen || marker.empty()) {
+        return;
+    }
+
+    // Marker may straddle the previous write
+    size_t start = old_length >= marker.size()
+        ? old_length - marker.size() + 1 : 0;
+    if (output.find(marker, start) == std::string::npos) {
+        return;
+    }
+
+    marker_time = host_clock_ns();
+    __atomic_store_n(&seen, true, __ATOMIC_RELEASE);
+}
+
+bool MemoryCharBackend::marker_seen()
+{
+    return __atomic_load_n(&seen, __ATOMIC_ACQUIRE);
+}
+
+uint64_t MemoryCharBackend::get_marker_time()
+{
+    return marker_seen() ? marker_time : 0;
+}
+
+const std::string &MemoryCharBackend::get_output()
+{
+    return output;
+}
+
+FdCharBackend::FdCharBackend(int fd, EventLoop *loop)
+{
+    this->fd = fd;
+    this->loop = loop;
+    uart = NULL;
+    cpu = NULL;
+#ifdef SO_NOSIGPIPE
+    // A peer going away must not kill every VM in the process. Without
+    // SO_NOSIGPIPE (Linux) writes pass MSG_NOSIGNAL instead.
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#endif
+}
+
+FdCharBackend::~FdCharBackend()
+{
+    if (uart != NULL) {
+        loop->remove_fd(fd);
+    }
+    close(fd);
+}
+
+void FdCharBackend::connect_uart(UART *uart)
+{
+    if (this->uart == NULL) {
+        loop->add_fd(fd, this);
+    }
+    this->uart = uart;
+}
+
+void FdCharBackend::connect_cpu(CPU *cpu)
+{
+    this->cpu = cpu;
+}
+
+void FdCharBackend::write(const uint8_t *data, uint32_t length)
+{
+    while (length > 0) {
+#ifdef MSG_NOSIGNAL
+        // ptys aren't sockets and take a plain write
+        ssize_t n = send(fd, data, length, MSG_NOSIGNAL);
+        if (n < 0 && errno == ENOTSOCK) {
+            n = ::write(fd, data, length);
+        }
+#else
+        ssize_t n = ::write(fd, data, length);
+#endif
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            // Peer is gone; the guest doesn't care
+            return;
+        }
+        data += n;
+        length -= n;
+    }
+}
+
+void FdCharBackend::handle_readable(int fd)
+{
+    uint8_t buf[256];
+    ssize_t n = read(fd, buf, sizeof(buf));
+    if (n <= 0) {
+        if (n < 0 && (errno == EINTR || errno == EAGAIN)) {
+            return;
+        }
+        // Hung up; stop watching so the loop doesn't spin
+        loop->remove_fd(fd);
+        return;
+    }
+
+    uart->receive(buf, n);
+    if (cpu != NULL) {
+        cpu->kick();
+    }
+}
@@ -0,0 +1,58 @@
+#ifndef __CHAR_BACKEND_H__
+#define __CHAR_BACKEND_H__
+
+#include <stdint.h>
+#include <string>
+
+#include "event_loop.h"
+
+class CPU;
+class UART;
+
+// Host end of a serial line
+class CharBackend {
+public:
+    virtual ~CharBackend() {};
+    virtual void write(const uint8_t *data, uint32_t length) = 0;
+};
+
+// Keeps guest output in memory for headless runs, and notes when a marker
+// string first appears in it
+class MemoryCharBackend : public CharBackend {
+public:
+    MemoryCharBackend(const char *marker);
+    ~MemoryCharBackend();
+    void write(const uint8_t *data, uint32_t length);
+    // Safe to call from any thread
+    bool marker_seen();
+    // host_clock_ns time the marker was written, 0 if not yet
+    uint64_t get_marker_time();
+    // Only call once the writer has stopped
+    const std::string &get_output();
+private:
+    std::string output;
+    std::string marker;
+    bool seen;
+    uint64_t marker_time;
+};
+
+// Serial line on a host file descriptor such as a socket or pty. Input is
+// read on a shared EventLoop and handed to the UART.
+class FdCharBackend : public CharBackend, public EventLoopHandler {
+public:
+    // Takes ownership of fd
+    FdCharBackend(int fd, EventLoop *loop);
+    ~FdCharBackend();
+    void connect_uart(UART *uart);
+    // Wake the vCPU when input arrives
+    void connect_cpu(CPU *cpu);
+    void write(const uint8_t *data, uint32_t length);
+    void handle_readable(int fd);
+private:
+    int fd;
+    EventLoop *loop;
+    UART *uart;
+    CPU *cpu;
+};
+
+#endif
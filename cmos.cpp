@@ -2,6 +2,10 @@
 
 #include <stdio.h>
 
+#include "host_clock.h"
+#include "log.h"
+#include "replay.h"
+
 CMOS::CMOS()
 {
     address = 0;
@@ -21,16 +25,29 @@ CMOS::CMOS()
     alarm_second = 0;
     
     periodic_interrupt_divider = 6;
+
+    scheduler = NULL;
+    base_calendar = 0;
+    base_time = 0;
+    cached_time = -1;
 }
 
 CMOS::~CMOS()
 {
 }
 
+void CMOS::connect_scheduler(EventScheduler *scheduler)
+{
+    this->scheduler = scheduler;
+    base_calendar = replay_time(REPLAY_CLOCK_CMOS,
+            host_clock_realtime_ns() / HOST_CLOCK_S_IN_NS);
+    base_time = scheduler->get_time();
+}
+
 void CMOS::write(uint32_t port, const uint32_t *value, uint8_t size)
 {
     if (size != 1) {
-        printf("CMOS: CMOS only supports single-byte R/W\n");
+        LOG_WARN("CMOS: CMOS only supports single-byte R/W\n");
         return;
     }
 
@@ -47,13 +64,13 @@ void CMOS::write(uint32_t port, const uint32_t *value, uint8_t size)
 void CMOS::read(uint32_t port, uint32_t *value, uint8_t size)
 {
     if (size != 1) {
-        printf("CMOS: CMOS only supports single-byte R/W\n");
+        LOG_WARN("CMOS: CMOS only supports single-byte R/W\n");
         return;
     }
 
     switch (port - CMOS_BASE_PORT) {
     case 0:
-        printf("CMOS: Address register is write only\n");
+        LOG_WARN("CMOS: Address register is write only\n");
         break;
     case 1:
         read_data((uint8_t*)value);
@@ -248,11 +265,23 @@ uint8_t CMOS::decode_hour(uint8_t value)
 struct tm *CMOS::get_time_components()
 {
     time_t time_since_epoch;
-    struct tm *calendar;
-    
-    time(&time_since_epoch);
 
-    return localtime(&time_since_epoch);
+    if (scheduler != NULL) {
+        time_since_epoch = base_calendar
+            + (scheduler->get_time() - base_time) / HOST_CLOCK_S_IN_NS;
+    } else {
+        time_since_epoch = replay_time(REPLAY_CLOCK_CMOS,
+                host_clock_realtime_ns() / HOST_CLOCK_S_IN_NS);
+    }
+
+    // Converting to local time is far slower than reading the clock, and
+    // a guest reads several fields within the same second
+    if (time_since_epoch != cached_time) {
+        localtime_r(&time_since_epoch, &cached_components);
+        cached_time = time_since_epoch;
+    }
+
+    return &cached_components;
 }
 
 void CMOS::debug_status()
@@ -4,6 +4,7 @@
 #include <stdint.h>
 #include <time.h>
 
+#include "event_scheduler.h"
 #include "io_device.h"
 
 #define CMOS_BASE_PORT  (0x70)
@@ -12,12 +13,14 @@
 #define CMOS_EQUIPMENT  (0x01)
 #define CMOS_BOOT_ORDER (0x123)
 
-class CMOS : IODevice {
+class CMOS : public IODevice {
 public:
     CMOS();
     ~CMOS();
     void write(uint32_t port, const uint32_t *value, uint8_t size);
     void read(uint32_t port, uint32_t *value, uint8_t size);
+    // Advance the RTC with scheduler time instead of the host calendar
+    void connect_scheduler(EventScheduler *scheduler);
     void debug_status();
 private:
     void write_address(uint8_t value);
@@ -44,6 +47,14 @@ private:
     uint8_t alarm_minute;
     uint8_t alarm_second;
     uint8_t periodic_interrupt_divider;
+
+    EventScheduler *scheduler;
+    // Calendar time and scheduler time when the scheduler was connected
+    time_t base_calendar;
+    uint64_t base_time;
+    // Last result of get_time_components
+    time_t cached_time;
+    struct tm cached_components;
 };
 
 #endif
@@ -0,0 +1,494 @@
+#include "cow_image.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define COW_CLUSTER_MASK    ((uint64_t)COW_CLUSTER_SIZE - 1)
+
+static void zero_iov(const struct iovec *iov, int iovcnt)
+{
+    for (int i = 0; i < iovcnt; i++) {
+        memset(iov[i].iov_base, 0, iov[i].iov_len);
+    }
+}
+
+CowImage::CowImage()
+{
+    fd = -1;
+    read_only = true;
+    memset(&header, 0, sizeof(header));
+    l1_table = NULL;
+    backing = NULL;
+    file_end = 0;
+
+    for (int i = 0; i < COW_L2_CACHE_SIZE; i++) {
+        l2_cache[i].offset = 0;
+        l2_cache[i].table = NULL;
+        l2_cache[i].last_used = 0;
+    }
+    l2_cache_clock = 0;
+    l2_cache_hits = 0;
+    l2_cache_misses = 0;
+
+    pthread_mutex_init(&lock, NULL);
+}
+
+CowImage::~CowImage()
+{
+    for (int i = 0; i < COW_L2_CACHE_SIZE; i++) {
+        free(l2_cache[i].table);
+    }
+    free(l1_table);
+    delete backing;
+
+    if (fd >= 0) {
+        close(fd);
+    }
+
+    pthread_mutex_destroy(&lock);
+}
+
+bool CowImage::create(const char *filename, uint64_t size,
+        const char *backing_filename)
+{
+    uint32_t backing_length = 0;
+
+    if (backing_filename != NULL) {
+        backing_length = strlen(backing_filename);
+        if (backing_length > COW_MAX_BACKING_NAME) {
+            printf("CowImage: Backing file name is too long\n");
+            return false;
+        }
+
+        if (size == 0) {
+            BlockBackend *base = open_block_image(backing_filename, true);
+            if (base == NULL) {
+                return false;
+            }
+            size = base->get_size();
+            delete base;
+        }
+    }
+
+    int fd = ::open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        printf("CowImage: Failed to create image '%s'\n", filename);
+        return false;
+    }
+
+    // Cluster 0: header and backing file name, then the L1 table
+    uint64_t l1_entry_span = (uint64_t)COW_CLUSTER_SIZE * COW_L2_ENTRIES;
+    cow_header h;
+    memset(&h, 0, sizeof(h));
+    h.magic = COW_MAGIC;
+    h.version = COW_VERSION;
+    h.size = size;
+    h.cluster_bits = COW_CLUSTER_BITS;
+    h.l1_size = (size + l1_entry_span - 1) / l1_entry_span;
+    h.l1_offset = COW_CLUSTER_SIZE;
+    h.backing_offset = backing_length > 0 ? sizeof(h) : 0;
+    h.backing_length = backing_length;
+
+    uint64_t l1_bytes = (uint64_t)h.l1_size * 8;
+    uint64_t file_size = COW_CLUSTER_SIZE
+        + ((l1_bytes + COW_CLUSTER_MASK) & ~COW_CLUSTER_MASK);
+
+    bool ok = pwrite(fd, &h, sizeof(h), 0) == sizeof(h)
+        && pwrite(fd, backing_filename, backing_length, sizeof(h))
+            == (ssize_t)backing_length
+        // L1 table is all zero (unallocated)
+        && ftruncate(fd, file_size) == 0;
+    close(fd);
+
+    if (!ok) {
+        printf("CowImage: Failed to write image '%s'\n", filename);
+    }
+
+    return ok;
+}
+
+bool CowImage::open(const char *filename, bool read_only)
+{
+    this->read_only = read_only;
+
+    fd = ::open(filename, read_only ? O_RDONLY : O_RDWR);
+    if (fd < 0) {
+        printf("CowImage: Failed to open image '%s'\n", filename);
+        return false;
+    }
+
+    if (pread(fd, &header, sizeof(header), 0) != sizeof(header)
+            || header.magic != COW_MAGIC
+            || header.version != COW_VERSION
+            || header.cluster_bits != COW_CLUSTER_BITS) {
+        printf("CowImage: '%s' is not a valid image\n", filename);
+        return false;
+    }
+
+    l1_table = (uint64_t*)calloc(header.l1_size, 8);
+    ssize_t l1_bytes = (ssize_t)header.l1_size * 8;
+    if (pread(fd, l1_table, l1_bytes, header.l1_offset) != l1_bytes) {
+        printf("CowImage: Failed to read L1 table of '%s'\n", filename);
+        return false;
+    }
+
+    if (header.backing_length > 0) {
+        char backing_filename[COW_MAX_BACKING_NAME + 1];
+        if (header.backing_length > COW_MAX_BACKING_NAME
+                || pread(fd, backing_filename, header.backing_length,
+                    header.backing_offset) != header.backing_length) {
+            printf("CowImage: Invalid backing file name in '%s'\n", filename);
+            return false;
+        }
+        backing_filename[header.backing_length] = '\0';
+
+        // Backing images are shared between overlays, never written
+        backing = open_block_image(backing_filename, true);
+        if (backing == NULL) {
+            return false;
+        }
+    }
+
+    struct stat st;
+    fstat(fd, &st);
+    file_end = (st.st_size + COW_CLUSTER_MASK) & ~COW_CLUSTER_MASK;
+
+    return true;
+}
+
+ssize_t CowImage::preadv(const struct iovec *iov, int iovcnt, uint64_t offset)
+{
+    struct iovec slice[COW_MAX_IOV];
+    uint64_t total = iov_length(iov, iovcnt);
+    uint64_t pos = 0;
+
+    if (offset >= header.size) {
+        return 0;
+    }
+    if (total > header.size - offset) {
+        total = header.size - offset;
+    }
+
+    while (pos < total) {
+        uint64_t start = offset + pos;
+        uint64_t run = COW_CLUSTER_SIZE - (start & COW_CLUSTER_MASK);
+        if (run > total - pos) {
+            run = total - pos;
+        }
+
+        pthread_mutex_lock(&lock);
+        uint64_t host = lookup_cluster(start);
+        if (host != 0) {
+            host += start & COW_CLUSTER_MASK;
+        }
+
+        // Merge following clusters that are contiguous in the image file,
+        // or unallocated, into a single request
+        while (pos + run < total) {
+            uint64_t next = lookup_cluster(start + run);
+            if ((host == 0) != (next == 0)
+                    || (host != 0 && next != host + run)) {
+                break;
+            }
+
+            run += COW_CLUSTER_SIZE;
+            if (run > total - pos) {
+                run = total - pos;
+            }
+        }
+        pthread_mutex_unlock(&lock);
+
+        int count = iov_slice(iov, iovcnt, pos, run, slice, COW_MAX_IOV);
+        ssize_t ret;
+        if (host != 0) {
+            ret = ::preadv(fd, slice, count, host);
+            ret = ret < 0 ? -errno : ret;
+        } else {
+            // Zero-copy fall through to the backing image
+            ret = read_backing(slice, count, start, run);
+        }
+
+        if (ret < 0) {
+            return ret;
+        }
+        if ((uint64_t)ret != run) {
+            return -EIO;
+        }
+
+        pos += run;
+    }
+
+    return total;
+}
+
+ssize_t CowImage::pwritev(const struct iovec *iov, int iovcnt, uint64_t offset)
+{
+    struct iovec slice[COW_MAX_IOV];
+    uint64_t total = iov_length(iov, iovcnt);
+    uint64_t pos = 0;
+
+    if (read_only) {
+        return -EROFS;
+    }
+    if (offset >= header.size || total > header.size - offset) {
+        return -ENOSPC;
+    }
+
+    while (pos < total) {
+        uint64_t start = offset + pos;
+        uint64_t run = COW_CLUSTER_SIZE - (start & COW_CLUSTER_MASK);
+        if (run > total - pos) {
+            run = total - pos;
+        }
+
+        int count = iov_slice(iov, iovcnt, pos, run, slice, COW_MAX_IOV);
+
+        pthread_mutex_lock(&lock);
+        uint64_t host = lookup_cluster(start);
+        if (host == 0) {
+            // Copy on write; data is written as part of the allocation
+            host = allocate_cluster(start, slice, count, run);
+            pthread_mutex_unlock(&lock);
+
+            if (host == 0) {
+                return -EIO;
+            }
+            pos += run;
+            continue;
+        }
+        pthread_mutex_unlock(&lock);
+
+        ssize_t ret = ::pwritev(fd, slice, count,
+                host + (start & COW_CLUSTER_MASK));
+        if (ret < 0) {
+            return -errno;
+        }
+        if ((uint64_t)ret != run) {
+            return -EIO;
+        }
+
+        pos += run;
+    }
+
+    return total;
+}
+
+int CowImage::flush()
+{
+    return fsync(fd) < 0 ? -errno : 0;
+}
+
+uint64_t CowImage::get_size()
+{
+    return header.size;
+}
+
+uint64_t CowImage::lookup_cluster(uint64_t offset)
+{
+    uint64_t l1_index = offset >> (COW_CLUSTER_BITS + COW_L2_BITS);
+    uint64_t l2_index = (offset >> COW_CLUSTER_BITS) & (COW_L2_ENTRIES - 1);
+
+    if (l1_index >= header.l1_size || l1_table[l1_index] == 0) {
+        return 0;
+    }
+
+    uint64_t *table = get_l2_table(l1_table[l1_index]);
+    if (table == NULL) {
+        return 0;
+    }
+
+    return table[l2_index];
+}
+
+uint64_t CowImage::allocate_cluster(uint64_t offset, const struct iovec *iov,
+        int iovcnt, uint64_t length)
+{
+    uint64_t cluster_start = offset & ~COW_CLUSTER_MASK;
+    uint64_t within = offset & COW_CLUSTER_MASK;
+    uint8_t *data = (uint8_t*)malloc(COW_CLUSTER_SIZE);
+
+    // Partial write: start from the backing contents
+    if (within != 0 || length != COW_CLUSTER_SIZE) {
+        struct iovec whole = {data, COW_CLUSTER_SIZE};
+        if (read_backing(&whole, 1, cluster_start, COW_CLUSTER_SIZE) < 0) {
+            free(data);
+            return 0;
+        }
+    }
+
+    uint64_t pos = within;
+    for (int i = 0; i < iovcnt; i++) {
+        memcpy(data + pos, iov[i].iov_base, iov[i].iov_len);
+        pos += iov[i].iov_len;
+    }
+
+    uint64_t l1_index = cluster_start >> (COW_CLUSTER_BITS + COW_L2_BITS);
+    uint64_t l2_index = (cluster_start >> COW_CLUSTER_BITS)
+        & (COW_L2_ENTRIES - 1);
+
+    // Data goes to disk before the metadata that points to it, so a crash
+    // can only leak a cluster, never expose garbage
+    uint64_t host = allocate_host_cluster();
+    bool ok = pwrite(fd, data, COW_CLUSTER_SIZE, host) == COW_CLUSTER_SIZE;
+    free(data);
+    if (!ok) {
+        return 0;
+    }
+
+    if (l1_table[l1_index] == 0) {
+        uint64_t l2_offset = allocate_host_cluster();
+        if (ftruncate(fd, file_end) != 0) {
+            return 0;
+        }
+        l1_table[l1_index] = l2_offset;
+        if (pwrite(fd, &l1_table[l1_index], 8,
+                    header.l1_offset + l1_index * 8) != 8) {
+            return 0;
+        }
+    }
+
+    uint64_t *table = get_l2_table(l1_table[l1_index]);
+    if (table == NULL) {
+        return 0;
+    }
+    table[l2_index] = host;
+    if (pwrite(fd, &table[l2_index], 8,
+                l1_table[l1_index] + l2_index * 8) != 8) {
+        return 0;
+    }
+
+    return host;
+}
+
+uint64_t *CowImage::get_l2_table(uint64_t l2_offset)
+{
+    int victim = 0;
+
+    l2_cache_clock++;
+
+    for (int i = 0; i < COW_L2_CACHE_SIZE; i++) {
+        if (l2_cache[i].offset == l2_offset) {
+            l2_cache[i].last_used = l2_cache_clock;
+            l2_cache_hits++;
+            return l2_cache[i].table;
+        }
+        if (l2_cache[i].last_used < l2_cache[victim].last_used) {
+            victim = i;
+        }
+    }
+
+    // Evict least recently used table. Tables are written through, so
+    // nothing needs to be written back.
+    l2_cache_misses++;
+    cow_l2_cache_entry *entry = &l2_cache[victim];
+    if (entry->table == NULL) {
+        entry->table = (uint64_t*)malloc(COW_CLUSTER_SIZE);
+    }
+
+    if (pread(fd, entry->table, COW_CLUSTER_SIZE, l2_offset)
+            != COW_CLUSTER_SIZE) {
+        entry->offset = 0;
+        entry->last_used = 0;
+        return NULL;
+    }
+
+    entry->offset = l2_offset;
+    entry->last_used = l2_cache_clock;
+
+    return entry->table;
+}
+
+uint64_t CowImage::allocate_host_cluster()
+{
+    uint64_t offset = file_end;
+    file_end += COW_CLUSTER_SIZE;
+
+    return offset;
+}
+
+ssize_t CowImage::read_backing(const struct iovec *iov, int iovcnt,
+        uint64_t offset, uint64_t length)
+{
+    uint64_t backing_size = backing != NULL ? backing->get_size() : 0;
+
+    if (offset >= backing_size) {
+        zero_iov(iov, iovcnt);
+        return length;
+    }
+
+    if (offset + length <= backing_size) {
+        return backing->preadv(iov, iovcnt, offset);
+    }
+
+    // Overlay is larger than backing; the tail reads as zero
+    struct iovec slice[COW_MAX_IOV];
+    uint64_t head = backing_size - offset;
+    int count = iov_slice(iov, iovcnt, 0, head, slice, COW_MAX_IOV);
+    ssize_t ret = backing->preadv(slice, count, offset);
+    if (ret < 0) {
+        return ret;
+    }
+
+    count = iov_slice(iov, iovcnt, head, length - head, slice,
+            COW_MAX_IOV);
+    zero_iov(slice, count);
+
+    return length;
+}
+
+void CowImage::debug_status()
+{
+    uint64_t allocated = 0;
+
+    printf("------------------------------\n");
+    printf("CowImage:\n");
+    printf("Size: %llu, L1 entries: %u, file size: %llu\n",
+            (unsigned long long)header.size, header.l1_size,
+            (unsigned long long)file_end);
+    for (uint32_t i = 0; i < header.l1_size; i++) {
+        if (l1_table[i] != 0) {
+            allocated++;
+        }
+    }
+    printf("L2 tables: %llu, cache hits: %llu, misses: %llu\n",
+            (unsigned long long)allocated,
+            (unsigned long long)l2_cache_hits,
+            (unsigned long long)l2_cache_misses);
+    printf("Backing: %s\n", backing != NULL ? "yes" : "none");
+    printf("------------------------------\n");
+}
+
+BlockBackend *open_block_image(const char *filename, bool read_only)
+{
+    uint32_t magic = 0;
+
+    int fd = ::open(filename, O_RDONLY);
+    if (fd < 0) {
+        printf("Block: Failed to open image '%s'\n", filename);
+        return NULL;
+    }
+    pread(fd, &magic, sizeof(magic), 0);
+    close(fd);
+
+    if (magic == COW_MAGIC) {
+        CowImage *image = new CowImage();
+        if (!image->open(filename, read_only)) {
+            delete image;
+            return NULL;
+        }
+        return image;
+    }
+
+    RawImage *image = new RawImage();
+    if (!image->open(filename, read_only)) {
+        delete image;
+        return NULL;
+    }
+
+    return image;
+}
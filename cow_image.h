@@ -0,0 +1,89 @@
+#ifndef __COW_IMAGE_H__
+#define __COW_IMAGE_H__
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "block.h"
+
+#define COW_MAGIC               (0x57435648) // "HVCW"
+#define COW_VERSION             (1)
+#define COW_CLUSTER_BITS        (16)
+#define COW_CLUSTER_SIZE        (1 << COW_CLUSTER_BITS)
+// Entries per L2 table (one cluster of 64-bit offsets)
+#define COW_L2_BITS             (COW_CLUSTER_BITS - 3)
+#define COW_L2_ENTRIES          (1 << COW_L2_BITS)
+#define COW_L2_CACHE_SIZE       (16)
+#define COW_MAX_IOV             (1024)
+#define COW_MAX_BACKING_NAME    (1024)
+
+// On-disk header, little-endian. L1 and L2 entries are host offsets of
+// L2 tables and data clusters; 0 means unallocated.
+struct cow_header {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t size;
+    uint32_t cluster_bits;
+    uint32_t l1_size;
+    uint64_t l1_offset;
+    uint64_t backing_offset;
+    uint32_t backing_length;
+    uint32_t reserved;
+} __attribute__((packed));
+
+struct cow_l2_cache_entry {
+    uint64_t offset;
+    uint64_t *table;
+    // Larger value means more recently used
+    uint64_t last_used;
+};
+
+// Sparse copy-on-write image. Clusters that were never written are read
+// from the backing image, which can be another CowImage.
+class CowImage : public BlockBackend {
+public:
+    CowImage();
+    ~CowImage();
+    // Create an empty overlay. size may be 0 to inherit it from backing.
+    static bool create(const char *filename, uint64_t size,
+            const char *backing_filename);
+    bool open(const char *filename, bool read_only);
+    ssize_t preadv(const struct iovec *iov, int iovcnt, uint64_t offset);
+    ssize_t pwritev(const struct iovec *iov, int iovcnt, uint64_t offset);
+    int flush();
+    uint64_t get_size();
+    void debug_status();
+private:
+    // Host offset of the cluster containing offset, 0 if unallocated
+    uint64_t lookup_cluster(uint64_t offset);
+    // Allocate data cluster for offset, filling it with the backing data
+    // overlaid by the write. Return host offset or 0 on error.
+    uint64_t allocate_cluster(uint64_t offset, const struct iovec *iov,
+            int iovcnt, uint64_t length);
+    uint64_t *get_l2_table(uint64_t l2_offset);
+    uint64_t allocate_host_cluster();
+    // Read from backing image, zero-filling past its end
+    ssize_t read_backing(const struct iovec *iov, int iovcnt,
+            uint64_t offset, uint64_t length);
+
+    int fd;
+    bool read_only;
+    cow_header header;
+    uint64_t *l1_table;
+    BlockBackend *backing;
+    // End of file; new clusters are appended here
+    uint64_t file_end;
+
+    cow_l2_cache_entry l2_cache[COW_L2_CACHE_SIZE];
+    uint64_t l2_cache_clock;
+    uint64_t l2_cache_hits;
+    uint64_t l2_cache_misses;
+
+    // Protects metadata; AsyncIO workers call in concurrently
+    pthread_mutex_t lock;
+};
+
+// Open a raw or copy-on-write image depending on its header
+BlockBackend *open_block_image(const char *filename, bool read_only);
+
+#endif
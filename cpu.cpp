@@ -0,0 +1,952 @@
+#include "cpu.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <Hypervisor/hv_arch_vmx.h>
+#include <Hypervisor/hv_vmx.h>
+
+#include "host_clock.h"
+#include "log.h"
+#include "mmio_decode.h"
+#include "replay.h"
+
+// Register encoding used by VM exit qualifications, instruction info and
+// REX/ModRM
+static const hv_x86_reg_t gpr_map[16] = {
+    HV_X86_RAX, HV_X86_RCX, HV_X86_RDX, HV_X86_RBX,
+    HV_X86_RSP, HV_X86_RBP, HV_X86_RSI, HV_X86_RDI,
+    HV_X86_R8, HV_X86_R9, HV_X86_R10, HV_X86_R11,
+    HV_X86_R12, HV_X86_R13, HV_X86_R14, HV_X86_R15,
+};
+
+static const uint32_t segment_base_fields[6] = {
+    VMCS_GUEST_ES_BASE, VMCS_GUEST_CS_BASE, VMCS_GUEST_SS_BASE,
+    VMCS_GUEST_DS_BASE, VMCS_GUEST_FS_BASE, VMCS_GUEST_GS_BASE,
+};
+
+// Set bits required by the capability, and clear bits it doesn't allow
+static uint64_t cap2ctrl(uint64_t cap, uint64_t ctrl)
+{
+    return (ctrl | (cap & 0xffffffff)) & (cap >> 32);
+}
+
+CPU::CPU()
+{
+    vcpu = 0;
+    created = false;
+    memory = NULL;
+    io_bus = NULL;
+    pic = NULL;
+    stats = NULL;
+    scheduler = NULL;
+    pvclock = NULL;
+    aio = NULL;
+    reset_handler = NULL;
+    mmu = NULL;
+    stopping = false;
+    reset_requested = false;
+    halted = false;
+    async_exit = false;
+    memset(pending_vectors, 0, sizeof(pending_vectors));
+    exit_count = 0;
+
+    pthread_mutex_init(&halt_lock, NULL);
+#ifdef __APPLE__
+    // No pthread_condattr_setclock; wait_for_kick uses relative timeouts
+    pthread_cond_init(&halt_cond, NULL);
+#else
+    // Timeouts on the wall clock would stretch or cut short when it's set
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&halt_cond, &attr);
+    pthread_condattr_destroy(&attr);
+#endif
+    kicked = false;
+    halt_poll_ns = CPU_HALT_POLL_MIN;
+    halt_polls = 0;
+    halt_sleeps = 0;
+}
+
+CPU::~CPU()
+{
+    delete mmu;
+    pthread_cond_destroy(&halt_cond);
+    pthread_mutex_destroy(&halt_lock);
+}
+
+bool CPU::init()
+{
+    if (hv_vcpu_create(&vcpu, HV_VCPU_DEFAULT) != HV_SUCCESS) {
+        printf("CPU: Failed to create vCPU\n");
+        return false;
+    }
+    created = true;
+
+    uint64_t cap_pinbased, cap_procbased, cap_procbased2, cap_entry;
+    hv_vmx_read_capability(HV_VMX_CAP_PINBASED, &cap_pinbased);
+    hv_vmx_read_capability(HV_VMX_CAP_PROCBASED, &cap_procbased);
+    hv_vmx_read_capability(HV_VMX_CAP_PROCBASED2, &cap_procbased2);
+    hv_vmx_read_capability(HV_VMX_CAP_ENTRY, &cap_entry);
+
+    write_vmcs(VMCS_CTRL_PIN_BASED, cap2ctrl(cap_pinbased,
+                PIN_BASED_INTR | PIN_BASED_NMI));
+    write_vmcs(VMCS_CTRL_CPU_BASED, cap2ctrl(cap_procbased,
+                CPU_BASED_HLT | CPU_BASED_UNCOND_IO
+                | CPU_BASED_SECONDARY_CTLS));
+    // Real mode runs natively
+    write_vmcs(VMCS_CTRL_CPU_BASED2, cap2ctrl(cap_procbased2,
+                CPU_BASED2_UNRESTRICTED));
+    write_vmcs(VMCS_CTRL_VMENTRY_CONTROLS, cap2ctrl(cap_entry, 0));
+    write_vmcs(VMCS_CTRL_EXC_BITMAP, 0);
+
+    reset();
+
+    return true;
+}
+
+void CPU::destroy()
+{
+    if (created) {
+        hv_vcpu_destroy(vcpu);
+        created = false;
+    }
+}
+
+void CPU::connect_io_bus(IOBus *io_bus)
+{
+    this->io_bus = io_bus;
+}
+
+void CPU::connect_memory(Memory *memory)
+{
+    this->memory = memory;
+    delete mmu;
+    mmu = new SoftMMU(memory);
+}
+
+void CPU::connect_pic(PIC *pic)
+{
+    this->pic = pic;
+}
+
+void CPU::connect_stats(Stats *stats)
+{
+    this->stats = stats;
+}
+
+void CPU::connect_scheduler(EventScheduler *scheduler)
+{
+    this->scheduler = scheduler;
+}
+
+void CPU::connect_pvclock(PVClock *pvclock)
+{
+    this->pvclock = pvclock;
+}
+
+void CPU::connect_aio(AsyncIO *aio)
+{
+    this->aio = aio;
+}
+
+void CPU::connect_reset_handler(ResetHandler *reset_handler)
+{
+    this->reset_handler = reset_handler;
+}
+
+void CPU::reset()
+{
+    // CR0.NE and CR4.VMXE must stay set in VMX operation; the guest sees
+    // them clear through the shadows
+    write_vmcs(VMCS_CTRL_CR0_MASK, CPU_CR0_NE);
+    write_vmcs(VMCS_CTRL_CR0_SHADOW, 0);
+    write_vmcs(VMCS_GUEST_CR0, CPU_CR0_NE);
+    write_vmcs(VMCS_CTRL_CR4_MASK, CPU_CR4_VMXE);
+    write_vmcs(VMCS_CTRL_CR4_SHADOW, 0);
+    write_vmcs(VMCS_GUEST_CR4, CPU_CR4_VMXE);
+    write_vmcs(VMCS_GUEST_CR3, 0);
+    write_vmcs(VMCS_GUEST_IA32_EFER, 0);
+
+    // BIOS is mirrored below 1MB, so CS base points there rather than at
+    // 0xffff0000 and RAM doesn't need to reach 4GB
+    write_vmcs(VMCS_GUEST_CS, 0xf000);
+    write_vmcs(VMCS_GUEST_CS_BASE, 0xf0000);
+    write_vmcs(VMCS_GUEST_CS_LIMIT, 0xffff);
+    write_vmcs(VMCS_GUEST_CS_AR, 0x9b);
+
+    static const uint32_t data_segments[][4] = {
+        { VMCS_GUEST_DS, VMCS_GUEST_DS_BASE, VMCS_GUEST_DS_LIMIT,
+            VMCS_GUEST_DS_AR },
+        { VMCS_GUEST_ES, VMCS_GUEST_ES_BASE, VMCS_GUEST_ES_LIMIT,
+            VMCS_GUEST_ES_AR },
+        { VMCS_GUEST_FS, VMCS_GUEST_FS_BASE, VMCS_GUEST_FS_LIMIT,
+            VMCS_GUEST_FS_AR },
+        { VMCS_GUEST_GS, VMCS_GUEST_GS_BASE, VMCS_GUEST_GS_LIMIT,
+            VMCS_GUEST_GS_AR },
+        { VMCS_GUEST_SS, VMCS_GUEST_SS_BASE, VMCS_GUEST_SS_LIMIT,
+            VMCS_GUEST_SS_AR },
+    };
+    for (int i = 0; i < 5; i++) {
+        write_vmcs(data_segments[i][0], 0);
+        write_vmcs(data_segments[i][1], 0);
+        write_vmcs(data_segments[i][2], 0xffff);
+        write_vmcs(data_segments[i][3], 0x93);
+    }
+
+    write_vmcs(VMCS_GUEST_LDTR, 0);
+    write_vmcs(VMCS_GUEST_LDTR_BASE, 0);
+    write_vmcs(VMCS_GUEST_LDTR_LIMIT, 0xffff);
+    write_vmcs(VMCS_GUEST_LDTR_AR, 0x82);
+    write_vmcs(VMCS_GUEST_TR, 0);
+    write_vmcs(VMCS_GUEST_TR_BASE, 0);
+    write_vmcs(VMCS_GUEST_TR_LIMIT, 0xffff);
+    write_vmcs(VMCS_GUEST_TR_AR, 0x8b);
+    write_vmcs(VMCS_GUEST_GDTR_BASE, 0);
+    write_vmcs(VMCS_GUEST_GDTR_LIMIT, 0xffff);
+    write_vmcs(VMCS_GUEST_IDTR_BASE, 0);
+    write_vmcs(VMCS_GUEST_IDTR_LIMIT, 0xffff);
+    write_vmcs(VMCS_GUEST_INTERRUPTIBILITY, 0);
+
+    static const hv_x86_reg_t zeroed[] = {
+        HV_X86_RAX, HV_X86_RBX, HV_X86_RCX, HV_X86_RSI, HV_X86_RDI,
+        HV_X86_RSP, HV_X86_RBP,
+    };
+    for (size_t i = 0; i < sizeof(zeroed) / sizeof(zeroed[0]); i++) {
+        write_register(zeroed[i], 0);
+    }
+    // Family 6 signature in DX
+    write_register(HV_X86_RDX, 0x600);
+    write_register(HV_X86_RIP, 0xfff0);
+    write_register(HV_X86_RFLAGS, 0x2);
+
+    // Nothing left over from before a reset is delivered
+    write_vmcs(VMCS_CTRL_VMENTRY_IRQ_INFO, 0);
+    for (int i = 0; i < 4; i++) {
+        __atomic_store_n(&pending_vectors[i], 0, __ATOMIC_RELAXED);
+    }
+
+    halted = false;
+}
+
+void CPU::run()
+{
+    while (!__atomic_load_n(&stopping, __ATOMIC_RELAXED)) {
+        if (scheduler != NULL) {
+            scheduler->run_expired();
+        }
+        if (aio != NULL && aio->get_inflight() > 0) {
+            aio->poll_completions();
+        }
+
+        if (__atomic_exchange_n(&reset_requested, false, __ATOMIC_ACQUIRE)) {
+            if (reset_handler != NULL) {
+                reset_handler->handle_reset();
+            }
+            reset();
+        }
+
+        if (halted) {
+            handle_hlt();
+            continue;
+        }
+
+        // Under record/replay, interrupts are only taken at exits the
+        // guest caused, so they land at the same point in both runs
+        if (replay_mode == REPLAY_OFF || !async_exit) {
+            replay_poll();
+            inject_interrupt();
+        }
+
+        bool virtual_time = scheduler != NULL
+            && scheduler->get_clock_mode() == EVENT_CLOCK_VIRTUAL;
+        uint64_t start = virtual_time ? scheduler->get_host_time() : 0;
+
+        if (hv_vcpu_run(vcpu) != HV_SUCCESS) {
+            printf("CPU: hv_vcpu_run failed\n");
+            break;
+        }
+        exit_count++;
+
+        // Guest time only passes while the guest runs
+        if (virtual_time) {
+            scheduler->advance(scheduler->get_host_time() - start);
+        }
+
+        // Event interrupted by the exit has to be delivered again
+        uint64_t idt_info = read_vmcs(VMCS_RO_IDT_VECTOR_INFO);
+        if (idt_info & IRQ_INFO_VALID) {
+            write_vmcs(VMCS_CTRL_VMENTRY_IRQ_INFO, idt_info);
+            if (idt_info & (1 << 11)) {
+                write_vmcs(VMCS_CTRL_VMENTRY_EXC_ERROR,
+                        read_vmcs(VMCS_RO_IDT_VECTOR_ERROR));
+            }
+            // INT n, INT3 and INTO are injected as the instruction, e.g.
+            // after pushing onto a write-protected stack page
+            uint32_t type = CPU_IRQ_INFO_TYPE(idt_info);
+            if (type == CPU_IRQ_TYPE_SOFT_INT
+                    || type == CPU_IRQ_TYPE_PRIV_SOFT_EXC
+                    || type == CPU_IRQ_TYPE_SOFT_EXC) {
+                write_vmcs(VMCS_CTRL_VMENTRY_INSTR_LEN,
+                        read_vmcs(VMCS_RO_VMEXIT_INSTR_LEN));
+            }
+        }
+
+        uint64_t reason = read_vmcs(VMCS_RO_EXIT_REASON) & 0xffff;
+        async_exit = reason == VMX_REASON_IRQ;
+        if (!async_exit) {
+            replay_advance();
+        }
+        if (!handle_exit(reason)) {
+            break;
+        }
+    }
+}
+
+void CPU::stop()
+{
+    __atomic_store_n(&stopping, true, __ATOMIC_RELAXED);
+    // Kick the vCPU out of the guest
+    hv_vcpu_interrupt(&vcpu, 1);
+    kick();
+}
+
+void CPU::kick()
+{
+    pthread_mutex_lock(&halt_lock);
+    kicked = true;
+    pthread_cond_signal(&halt_cond);
+    pthread_mutex_unlock(&halt_lock);
+}
+
+void CPU::request_reset()
+{
+    __atomic_store_n(&reset_requested, true, __ATOMIC_RELEASE);
+    hv_vcpu_interrupt(&vcpu, 1);
+    kick();
+}
+
+void CPU::external_interrupt(uint8_t vector_number)
+{
+    // Replayed interrupts come from the log
+    if (replay_mode == REPLAY_PLAY) {
+        return;
+    }
+    __atomic_or_fetch(&pending_vectors[vector_number / 64],
+            1ULL << (vector_number % 64), __ATOMIC_RELEASE);
+    hv_vcpu_interrupt(&vcpu, 1);
+    kick();
+}
+
+uint64_t CPU::get_exit_count()
+{
+    return exit_count;
+}
+
+uint64_t CPU::read_vmcs(uint32_t field)
+{
+    uint64_t value = 0;
+    hv_vmx_vcpu_read_vmcs(vcpu, field, &value);
+
+    return value;
+}
+
+void CPU::write_vmcs(uint32_t field, uint64_t value)
+{
+    hv_vmx_vcpu_write_vmcs(vcpu, field, value);
+}
+
+uint64_t CPU::read_register(hv_x86_reg_t reg)
+{
+    uint64_t value = 0;
+    hv_vcpu_read_register(vcpu, reg, &value);
+
+    return value;
+}
+
+void CPU::write_register(hv_x86_reg_t reg, uint64_t value)
+{
+    hv_vcpu_write_register(vcpu, reg, value);
+}
+
+void CPU::advance_rip()
+{
+    write_register(HV_X86_RIP, read_register(HV_X86_RIP)
+            + read_vmcs(VMCS_RO_VMEXIT_INSTR_LEN));
+
+    // The STI or MOV SS shadow only covers the emulated instruction, e.g.
+    // the HLT in sti; hlt
+    uint64_t interruptibility = read_vmcs(VMCS_GUEST_INTERRUPTIBILITY);
+    if (interruptibility & (CPU_BLOCKING_STI | CPU_BLOCKING_MOV_SS)) {
+        write_vmcs(VMCS_GUEST_INTERRUPTIBILITY, interruptibility
+                & ~(uint64_t)(CPU_BLOCKING_STI | CPU_BLOCKING_MOV_SS));
+    }
+}
+
+bool CPU::handle_exit(uint64_t reason)
+{
+    uint64_t qualification = read_vmcs(VMCS_RO_EXIT_QUALIFIC);
+
+    switch (reason) {
+    case VMX_REASON_IO:
+        if (stats != NULL) {
+            stats->record_exit(STATS_EXIT_IO);
+        }
+        handle_io(qualification);
+        break;
+    case VMX_REASON_HLT:
+        if (stats != NULL) {
+            stats->record_exit(STATS_EXIT_HLT);
+        }
+        advance_rip();
+        if (!(read_register(HV_X86_RFLAGS) & CPU_RFLAGS_IF)
+                && pending_vectors[0] == 0 && pending_vectors[1] == 0
+                && pending_vectors[2] == 0 && pending_vectors[3] == 0) {
+            printf("CPU: Halted with interrupts disabled\n");
+            return false;
+        }
+        halted = true;
+        break;
+    case VMX_REASON_IRQ:
+        if (stats != NULL) {
+            stats->record_exit(STATS_EXIT_EXTERNAL_IRQ);
+        }
+        break;
+    case VMX_REASON_IRQ_WND:
+        if (stats != NULL) {
+            stats->record_exit(STATS_EXIT_IRQ_WINDOW);
+        }
+        break;
+    case VMX_REASON_CPUID:
+        if (stats != NULL) {
+            stats->record_exit(STATS_EXIT_CPUID);
+        }
+        handle_cpuid();
+        break;
+    case VMX_REASON_RDMSR:
+        if (stats != NULL) {
+            stats->record_exit(STATS_EXIT_MSR);
+        }
+        handle_rdmsr();
+        break;
+    case VMX_REASON_WRMSR:
+        if (stats != NULL) {
+            stats->record_exit(STATS_EXIT_MSR);
+        }
+        handle_wrmsr();
+        break;
+    case VMX_REASON_MOV_CR: {
+        if (stats != NULL) {
+            stats->record_exit(STATS_EXIT_OTHER);
+        }
+        // Only MOV to CR0 touching NE exits, because of the CR0 mask
+        if ((qualification & 0xf) != 0 || ((qualification >> 4) & 0x3) != 0) {
+            printf("CPU: Unhandled CR access 0x%llx\n",
+                    (unsigned long long)qualification);
+            return false;
+        }
+        uint64_t value = read_register(gpr_map[(qualification >> 8) & 0x7]);
+        write_vmcs(VMCS_CTRL_CR0_SHADOW, value & CPU_CR0_NE);
+        write_vmcs(VMCS_GUEST_CR0, value | CPU_CR0_NE);
+        advance_rip();
+    }
+        break;
+    case VMX_REASON_EPT_VIOLATION: {
+        if (stats != NULL) {
+            stats->record_exit(STATS_EXIT_EPT_VIOLATION);
+        }
+        uint64_t address = read_vmcs(VMCS_GUEST_PHYSICAL_ADDRESS);
+        // Write to a page protected for dirty logging; retry the instruction
+        if ((qualification & CPU_EPT_WRITE)
+                && memory->handle_write_fault(address)) {
+            break;
+        }
+        if (memory->find_mmio(address) == NULL) {
+            printf("CPU: Access to unmapped memory at 0x%llx\n",
+                    (unsigned long long)address);
+            return false;
+        }
+        if (!handle_mmio(address)) {
+            return false;
+        }
+    }
+        break;
+    case VMX_REASON_TRIPLE_FAULT:
+        printf("CPU: Triple fault\n");
+        return false;
+    default:
+        if (stats != NULL) {
+            stats->record_exit(STATS_EXIT_OTHER);
+        }
+        printf("CPU: Unhandled exit reason %llu\n",
+                (unsigned long long)reason);
+        return false;
+    }
+
+    return true;
+}
+
+void CPU::handle_io(uint64_t qualification)
+{
+    uint8_t size = (qualification & 0x7) + 1;
+    bool in = (qualification & 0x8) != 0;
+    uint16_t port = qualification >> 16;
+
+    if (qualification & 0x10) {
+        handle_string_io(qualification, port, size, in);
+        return;
+    }
+
+    uint64_t rax = read_register(HV_X86_RAX);
+    uint64_t mask = 0xffffffffULL >> ((4 - size) * 8);
+
+    if (in) {
+        uint32_t value = 0;
+        io_bus->read(port, &value, size);
+        // 32-bit IN zero-extends into RAX like any 32-bit operation
+        if (size == 4) {
+            rax = value;
+        } else {
+            rax = (rax & ~mask) | (value & mask);
+        }
+        write_register(HV_X86_RAX, rax);
+    } else {
+        uint32_t value = rax & mask;
+        io_bus->write(port, &value, size);
+    }
+
+    advance_rip();
+}
+
+void CPU::handle_string_io(uint64_t qualification, uint16_t port,
+        uint8_t size, bool in)
+{
+    bool rep = (qualification & 0x20) != 0;
+    uint64_t info = read_vmcs(VMCS_RO_VMX_INSTR_INFO);
+    uint64_t address_mask = 0xffffULL;
+    switch ((info >> 7) & 0x7) {
+    case 1:
+        address_mask = 0xffffffffULL;
+        break;
+    case 2:
+        address_mask = ~0ULL;
+        break;
+    }
+
+    if (read_vmcs(VMCS_GUEST_CR0) & CPU_CR0_PG) {
+        LOG_WARN("CPU: String I/O with paging is not supported\n");
+        advance_rip();
+        return;
+    }
+
+    // INS always stores to ES:DI; OUTS loads from a segment that may be
+    // overridden
+    hv_x86_reg_t index_reg = in ? HV_X86_RDI : HV_X86_RSI;
+    int segment = in ? 0 : (info >> 15) & 0x7;
+    uint64_t base = read_vmcs(segment_base_fields[segment < 6 ? segment : 3]);
+    uint64_t index = read_register(index_reg);
+    uint64_t rcx = read_register(HV_X86_RCX);
+    uint64_t count = rep ? rcx & address_mask : 1;
+    bool backward = (read_register(HV_X86_RFLAGS) & CPU_RFLAGS_DF) != 0;
+
+    if (count == 0) {
+        advance_rip();
+        return;
+    }
+
+    uint8_t *p = NULL;
+    if (!backward) {
+        p = (uint8_t*)memory->get_pointer(base + (index & address_mask),
+                count * size);
+    }
+
+    if (p != NULL) {
+        // Whole transfer is in RAM; let the device take it at once
+        if (in) {
+            io_bus->read_block(port, p, size, count);
+            memory->mark_dirty(base + (index & address_mask), count * size);
+        } else {
+            io_bus->write_block(port, p, size, count);
+        }
+    } else {
+        for (uint64_t i = 0; i < count; i++) {
+            uint64_t offset = backward ? index - i * size : index + i * size;
+            uint8_t *element = (uint8_t*)memory->get_pointer(
+                    base + (offset & address_mask), size);
+            uint32_t value = 0;
+            if (in) {
+                io_bus->read(port, &value, size);
+                if (element != NULL) {
+                    memcpy(element, &value, size);
+                    memory->mark_dirty(base + (offset & address_mask), size);
+                }
+            } else {
+                if (element != NULL) {
+                    memcpy(&value, element, size);
+                }
+                io_bus->write(port, &value, size);
+            }
+        }
+    }
+
+    uint64_t delta = count * size;
+    index = backward ? index - delta : index + delta;
+    write_register(index_reg, (read_register(index_reg) & ~address_mask)
+            | (index & address_mask));
+    if (rep) {
+        write_register(HV_X86_RCX, rcx & ~address_mask);
+    }
+
+    advance_rip();
+}
+
+void CPU::handle_cpuid()
+{
+    uint32_t eax = read_register(HV_X86_RAX);
+    uint32_t ecx = read_register(HV_X86_RCX);
+    uint32_t ebx, edx;
+
+    __asm__ __volatile__("cpuid"
+            : "+a"(eax), "=b"(ebx), "+c"(ecx), "=d"(edx));
+
+    uint32_t leaf = read_register(HV_X86_RAX);
+    if (leaf == 1) {
+        // Hide VMX and the local APIC, and tell the guest it runs on a
+        // hypervisor
+        ecx &= ~(1U << 5);
+        ecx &= ~(CPU_CPUID_ECX_X2APIC | CPU_CPUID_ECX_TSC_DEADLINE);
+        edx &= ~CPU_CPUID_EDX_APIC;
+        ecx |= 1U << 31;
+    } else if (leaf >= CPU_CPUID_HYPERVISOR_BASE
+            && leaf <= CPU_CPUID_HYPERVISOR_LAST) {
+        // The host's hypervisor leaves describe Hypervisor.framework, not us
+        if (pvclock == NULL || !pvclock->cpuid(leaf, &eax, &ebx, &ecx, &edx)) {
+            eax = ebx = ecx = edx = 0;
+        }
+    }
+
+    write_register(HV_X86_RAX, eax);
+    write_register(HV_X86_RBX, ebx);
+    write_register(HV_X86_RCX, ecx);
+    write_register(HV_X86_RDX, edx);
+    advance_rip();
+}
+
+void CPU::handle_rdmsr()
+{
+    uint32_t msr = read_register(HV_X86_RCX);
+    uint64_t value = 0;
+
+    if (pvclock == NULL || !pvclock->read_msr(msr, &value)) {
+        LOG_DEBUG("CPU: RDMSR 0x%08x\n", msr);
+    }
+    write_register(HV_X86_RAX, value & 0xffffffff);
+    write_register(HV_X86_RDX, value >> 32);
+    advance_rip();
+}
+
+void CPU::handle_wrmsr()
+{
+    uint32_t msr = read_register(HV_X86_RCX);
+    uint64_t value = (read_register(HV_X86_RDX) << 32)
+        | (read_register(HV_X86_RAX) & 0xffffffff);
+
+    if (pvclock == NULL || !pvclock->write_msr(msr, value)) {
+        LOG_DEBUG("CPU: WRMSR 0x%08x\n", msr);
+    }
+    advance_rip();
+}
+
+bool CPU::handle_mmio(uint64_t address)
+{
+    uint8_t code[MMIO_DECODE_MAX_LENGTH];
+    int length = fetch_code(code, sizeof(code));
+    mmio_instruction insn;
+
+    if (!mmio_decode(code, length, get_code_bits(), &insn)) {
+        printf("CPU: Unhandled MMIO instruction at 0x%llx:",
+                (unsigned long long)address);
+        for (int i = 0; i < length; i++) {
+            printf(" %02x", code[i]);
+        }
+        printf("\n");
+        return false;
+    }
+
+    hv_x86_reg_t reg = gpr_map[insn.reg];
+    if (insn.op == MMIO_OP_STORE) {
+        uint64_t value = mmio_store_value(&insn,
+                insn.has_immediate ? 0 : read_register(reg));
+        memory->mmio_write(address, &value, insn.size);
+    } else {
+        // Reads of nothing float high, like on the bus
+        uint64_t value = ~0ULL;
+        memory->mmio_read(address, &value, insn.size);
+        write_register(reg, mmio_load_result(&insn, read_register(reg),
+                    value));
+    }
+
+    // The exit instruction length is undefined for EPT violations
+    write_register(HV_X86_RIP, read_register(HV_X86_RIP) + insn.length);
+
+    return true;
+}
+
+int CPU::fetch_code(uint8_t *code, int length)
+{
+    uint64_t linear = read_vmcs(VMCS_GUEST_CS_BASE)
+        + read_register(HV_X86_RIP);
+    uint64_t cr0 = read_vmcs(VMCS_GUEST_CR0);
+    bool paging = (cr0 & CPU_CR0_PG) != 0;
+    bool user = ((read_vmcs(VMCS_GUEST_SS_AR) >> CPU_SEGMENT_DPL_SHIFT)
+            & 0x3) == 3;
+
+    if (paging) {
+        mmu->set_cr0(cr0);
+        mmu->set_cr4(read_vmcs(VMCS_GUEST_CR4));
+        mmu->set_efer(read_vmcs(VMCS_GUEST_IA32_EFER));
+        mmu->set_cr3(read_vmcs(VMCS_GUEST_CR3));
+    }
+
+    // Page by page, since consecutive linear pages needn't be physically
+    // contiguous
+    int done = 0;
+    while (done < length) {
+        uint64_t physical = linear + done;
+        if (paging && !mmu->translate(linear + done, SOFT_MMU_EXEC, user,
+                    &physical)) {
+            break;
+        }
+        int chunk = MEMORY_PAGE_SIZE - (physical & (MEMORY_PAGE_SIZE - 1));
+        if (chunk > length - done) {
+            chunk = length - done;
+        }
+        const uint8_t *p = (const uint8_t*)memory->get_pointer(physical,
+                chunk);
+        if (p == NULL) {
+            break;
+        }
+        memcpy(code + done, p, chunk);
+        done += chunk;
+    }
+
+    return done;
+}
+
+int CPU::get_code_bits()
+{
+    if (!(read_vmcs(VMCS_GUEST_CR0) & CPU_CR0_PE)) {
+        return 16;
+    }
+
+    uint64_t access_rights = read_vmcs(VMCS_GUEST_CS_AR);
+    if ((read_vmcs(VMCS_GUEST_IA32_EFER) & CPU_EFER_LMA)
+            && (access_rights & CPU_SEGMENT_L)) {
+        return 64;
+    }
+
+    return access_rights & CPU_SEGMENT_DB ? 32 : 16;
+}
+
+void CPU::handle_hlt()
+{
+    if (interrupt_pending()) {
+        halted = false;
+        return;
+    }
+    // Nothing happens until the next timer fires, so go straight there
+    if (scheduler != NULL && scheduler->skip_to_next_deadline()) {
+        return;
+    }
+    // Time is replayed too, so there's nothing to wait for
+    if (replay_mode == REPLAY_PLAY) {
+        return;
+    }
+
+    // Host time, not recorded for replay since halt timing doesn't affect
+    // the guest
+    uint64_t start = host_clock_ns();
+
+    // Polling takes time samples that replay doesn't repeat, so just wait
+    if (replay_mode == REPLAY_RECORD) {
+        wait_for_kick(halt_timeout(start));
+        return;
+    }
+
+    // Spin first; wakeups inside the window are cheaper to catch this way
+    // than by sleeping. Same order as the run loop, so a timer firing here
+    // is handled the same way.
+    while (host_clock_ns() - start < halt_poll_ns) {
+        if (scheduler != NULL) {
+            scheduler->run_expired();
+        }
+        if (aio != NULL && aio->get_inflight() > 0) {
+            aio->poll_completions();
+        }
+        if (interrupt_pending()) {
+            halted = false;
+            halt_polls++;
+            return;
+        }
+        __builtin_ia32_pause();
+    }
+
+    // Devices with host input kick us, so sleep until the next timer
+    wait_for_kick(halt_timeout(host_clock_ns()));
+    halt_sleeps++;
+
+    // Widen the window when the wakeup came soon enough to have been
+    // caught by polling, and narrow it when polling would have been wasted
+    uint64_t waited = host_clock_ns() - start;
+    if (waited <= CPU_HALT_POLL_MAX) {
+        halt_poll_ns = halt_poll_ns < CPU_HALT_POLL_MIN ? CPU_HALT_POLL_MIN
+            : halt_poll_ns * 2;
+        if (halt_poll_ns > CPU_HALT_POLL_MAX) {
+            halt_poll_ns = CPU_HALT_POLL_MAX;
+        }
+    } else {
+        halt_poll_ns /= 2;
+        if (halt_poll_ns < CPU_HALT_POLL_MIN) {
+            halt_poll_ns = 0;
+        }
+    }
+}
+
+uint64_t CPU::halt_timeout(uint64_t now)
+{
+    uint64_t deadline = scheduler != NULL ? scheduler->next_deadline()
+        : EVENT_SCHEDULER_NO_DEADLINE;
+    if (deadline == EVENT_SCHEDULER_NO_DEADLINE) {
+        return CPU_HALT_NO_TIMEOUT;
+    }
+
+    // Host time: virtual time deadlines were skipped to before halting
+    return deadline > now ? deadline - now : 0;
+}
+
+void CPU::wait_for_kick(uint64_t timeout)
+{
+    if (timeout == 0) {
+        return;
+    }
+
+    uint64_t until = host_clock_os_ns();
+    until = timeout < CPU_HALT_NO_TIMEOUT - until ? until + timeout
+        : CPU_HALT_NO_TIMEOUT;
+
+    pthread_mutex_lock(&halt_lock);
+    while (!kicked) {
+        if (until == CPU_HALT_NO_TIMEOUT) {
+            pthread_cond_wait(&halt_cond, &halt_lock);
+            continue;
+        }
+        uint64_t now = host_clock_os_ns();
+        if (now >= until) {
+            break;
+        }
+#ifdef __APPLE__
+        struct timespec ts;
+        ts.tv_sec = (until - now) / HOST_CLOCK_S_IN_NS;
+        ts.tv_nsec = (until - now) % HOST_CLOCK_S_IN_NS;
+        pthread_cond_timedwait_relative_np(&halt_cond, &halt_lock, &ts);
+#else
+        struct timespec ts;
+        ts.tv_sec = until / HOST_CLOCK_S_IN_NS;
+        ts.tv_nsec = until % HOST_CLOCK_S_IN_NS;
+        pthread_cond_timedwait(&halt_cond, &halt_lock, &ts);
+#endif
+    }
+    kicked = false;
+    pthread_mutex_unlock(&halt_lock);
+}
+
+bool CPU::interrupt_pending()
+{
+    if (replay_interrupt_due()) {
+        return true;
+    }
+    for (int i = 0; i < 4; i++) {
+        if (__atomic_load_n(&pending_vectors[i], __ATOMIC_ACQUIRE) != 0) {
+            return true;
+        }
+    }
+
+    return pic != NULL && pic->irq_pending();
+}
+
+void CPU::inject_interrupt()
+{
+    // Something is already being (re)delivered
+    if (read_vmcs(VMCS_CTRL_VMENTRY_IRQ_INFO) & IRQ_INFO_VALID) {
+        return;
+    }
+
+    uint64_t procbased = read_vmcs(VMCS_CTRL_CPU_BASED);
+    bool interruptible = (read_register(HV_X86_RFLAGS) & CPU_RFLAGS_IF)
+        && !(read_vmcs(VMCS_GUEST_INTERRUPTIBILITY)
+                & (CPU_BLOCKING_STI | CPU_BLOCKING_MOV_SS));
+
+    if (!interruptible) {
+        // Exit as soon as the guest can take the interrupt
+        if (interrupt_pending()) {
+            write_vmcs(VMCS_CTRL_CPU_BASED, procbased | CPU_BASED_IRQ_WND);
+        }
+        return;
+    }
+
+    if (procbased & CPU_BASED_IRQ_WND) {
+        write_vmcs(VMCS_CTRL_CPU_BASED, procbased & ~CPU_BASED_IRQ_WND);
+    }
+
+    int vector = -1;
+    for (int i = 0; i < 4 && vector < 0; i++) {
+        uint64_t pending = __atomic_load_n(&pending_vectors[i],
+                __ATOMIC_ACQUIRE);
+        if (pending != 0) {
+            int bit = __builtin_ctzll(pending);
+            __atomic_and_fetch(&pending_vectors[i], ~(1ULL << bit),
+                    __ATOMIC_ACQ_REL);
+            vector = i * 64 + bit;
+            replay_record_interrupt(vector);
+        }
+    }
+    if (vector < 0) {
+        vector = replay_next_interrupt();
+    }
+    // PIC acknowledges the interrupt here, so only ask when it can be
+    // delivered
+    if (vector < 0 && pic != NULL && pic->poll_irq()) {
+        vector = pic->get_vector();
+    }
+
+    if (vector >= 0) {
+        write_vmcs(VMCS_CTRL_VMENTRY_IRQ_INFO,
+                vector | IRQ_INFO_EXT_IRQ | IRQ_INFO_VALID);
+    }
+}
+
+void CPU::debug_status()
+{
+    printf("------------------------------\n");
+    printf("CPU:\n");
+    printf("CS:IP: %04llx:%04llx, RFLAGS: 0x%08llx, %s\n",
+            (unsigned long long)read_vmcs(VMCS_GUEST_CS),
+            (unsigned long long)read_register(HV_X86_RIP),
+            (unsigned long long)read_register(HV_X86_RFLAGS),
+            halted ? "halted" : "running");
+    printf("RAX: 0x%016llx, RBX: 0x%016llx\n",
+            (unsigned long long)read_register(HV_X86_RAX),
+            (unsigned long long)read_register(HV_X86_RBX));
+    printf("RCX: 0x%016llx, RDX: 0x%016llx\n",
+            (unsigned long long)read_register(HV_X86_RCX),
+            (unsigned long long)read_register(HV_X86_RDX));
+    printf("CR0: 0x%08llx, exits: %llu\n",
+            (unsigned long long)read_vmcs(VMCS_GUEST_CR0),
+            (unsigned long long)exit_count);
+    printf("Halt poll window: %llu ns, woken polling: %llu, sleeping: %llu\n",
+            (unsigned long long)halt_poll_ns,
+            (unsigned long long)halt_polls,
+            (unsigned long long)halt_sleeps);
+    printf("------------------------------\n");
+}
@@ -1,15 +1,176 @@
 #ifndef __CPU_H__
 #define __CPU_H__
 
+#include <pthread.h>
+#include <stdint.h>
+#include <Hypervisor/hv.h>
+
+#include "aio.h"
+#include "event_scheduler.h"
+#include "io_bus.h"
+#include "io_device.h"
+#include "memory.h"
+#include "pic.h"
+#include "pvclock.h"
+#include "soft_mmu.h"
+#include "stats.h"
+
+// RFLAGS
+#define CPU_RFLAGS_IF           (1 << 9)
+#define CPU_RFLAGS_DF           (1 << 10)
+// CR0
+#define CPU_CR0_PE              (1 << 0)
+#define CPU_CR0_NE              (1 << 5)
+#define CPU_CR0_PG              (1U << 31)
+// CR4
+#define CPU_CR4_VMXE            (1 << 13)
+// EFER
+#define CPU_EFER_LMA            (1 << 10)
+// Segment access rights
+#define CPU_SEGMENT_DPL_SHIFT   (5)
+#define CPU_SEGMENT_L           (1 << 13)
+#define CPU_SEGMENT_DB          (1 << 14)
+
+// CPUID leaf 1 features of a local APIC, which isn't emulated
+#define CPU_CPUID_EDX_APIC      (1 << 9)
+#define CPU_CPUID_ECX_X2APIC    (1 << 21)
+#define CPU_CPUID_ECX_TSC_DEADLINE  (1 << 24)
+// Hypervisor leaves
+#define CPU_CPUID_HYPERVISOR_BASE   (0x40000000)
+#define CPU_CPUID_HYPERVISOR_LAST   (0x400000ff)
+
+// Halt polling window [ns]; adapts between 0 and max, starting at min
+#define CPU_HALT_POLL_MIN       (10000)
+#define CPU_HALT_POLL_MAX       (200000)
+// Sleep while halted until kicked, with no timer due
+#define CPU_HALT_NO_TIMEOUT     (UINT64_MAX)
+
+// Interruptibility state that blocks injection (STI and MOV SS shadows)
+#define CPU_BLOCKING_STI        (0x1)
+#define CPU_BLOCKING_MOV_SS     (0x2)
+
+// Event types in interruption information; software events need an
+// instruction length on reinjection
+#define CPU_IRQ_INFO_TYPE(info) (((info) >> 8) & 0x7)
+#define CPU_IRQ_TYPE_SOFT_INT   (4)
+#define CPU_IRQ_TYPE_PRIV_SOFT_EXC  (5)
+#define CPU_IRQ_TYPE_SOFT_EXC   (6)
+
+// EPT violation qualification: the access was a data write
+#define CPU_EPT_WRITE           (1 << 1)
+
+// Told of a reset the guest asked for, to put the rest of the machine back
+// to its power-on state
+class ResetHandler {
+public:
+    virtual ~ResetHandler() {}
+    // Called on the vCPU thread, right before the vCPU itself is reset
+    virtual void handle_reset() = 0;
+};
+
 class CPU {
 public:
-    void init();
-    void connect_io_device(IODevice *device);
+    CPU();
+    ~CPU();
+    // Create the vCPU. Hypervisor.framework binds it to the calling
+    // thread, so init and run must be called from the same thread.
+    bool init();
+    // Destroy the vCPU, from the thread that created it
+    void destroy();
+    void connect_io_bus(IOBus *io_bus);
     void connect_memory(Memory *memory);
+    void connect_pic(PIC *pic);
+    void connect_stats(Stats *stats);
+    // Fire timers from the run loop, and advance virtual time
+    void connect_scheduler(EventScheduler *scheduler);
+    // kvmclock MSRs and CPUID leaves
+    void connect_pvclock(PVClock *pvclock);
+    // Collect block request completions from the run loop, for devices
+    // that the PIC doesn't poll, such as virtio-blk
+    void connect_aio(AsyncIO *aio);
+    void connect_reset_handler(ResetHandler *reset_handler);
 
+    // Run guest until stop() is called or the guest can't continue
+    void run();
+    // Callable from any thread
+    void stop();
+    // Queue interrupt for injection, e.g. from MSI. Callable from any
+    // thread.
     void external_interrupt(uint8_t vector_number);
+    // Wake the vCPU if it is halted, e.g. after host input that may raise
+    // an interrupt. Callable from any thread.
+    void kick();
+    // Reset the machine before the vCPU next enters the guest, e.g. when
+    // a device pulses the reset line. Callable from any thread.
+    void request_reset();
+
+    uint64_t get_exit_count();
+    void debug_status();
 private:
-    hv_vcpuid_t *vcpu;
+    // Power-on state, with CS:IP at the BIOS reset vector
+    void reset();
+    uint64_t read_vmcs(uint32_t field);
+    void write_vmcs(uint32_t field, uint64_t value);
+    uint64_t read_register(hv_x86_reg_t reg);
+    void write_register(hv_x86_reg_t reg, uint64_t value);
+    void advance_rip();
+
+    // Return false to stop the run loop
+    bool handle_exit(uint64_t reason);
+    void handle_io(uint64_t qualification);
+    void handle_string_io(uint64_t qualification, uint16_t port,
+            uint8_t size, bool in);
+    void handle_cpuid();
+    void handle_rdmsr();
+    void handle_wrmsr();
+    // Emulate the MOV that hit MMIO at physical address. Return false if
+    // the instruction can't be decoded.
+    bool handle_mmio(uint64_t address);
+    // Read up to length bytes of code at CS:RIP; return how many were read
+    int fetch_code(uint8_t *code, int length);
+    // Default operand size of the code segment: 16, 32 or 64
+    int get_code_bits();
+    void handle_hlt();
+    // Time until the next timer is due [ns] from host time now, or
+    // CPU_HALT_NO_TIMEOUT
+    uint64_t halt_timeout(uint64_t now);
+    // Sleep until kick() or timeout [ns] on the monotonic clock
+    void wait_for_kick(uint64_t timeout);
+    // Inject a pending interrupt, or ask for an exit once the guest can
+    // take one
+    void inject_interrupt();
+    bool interrupt_pending();
+
+    hv_vcpuid_t vcpu;
+    bool created;
+    Memory *memory;
+    IOBus *io_bus;
+    PIC *pic;
+    Stats *stats;
+    EventScheduler *scheduler;
+    PVClock *pvclock;
+    AsyncIO *aio;
+    ResetHandler *reset_handler;
+    // Page walks for MMIO instruction fetch, with the guest's paging state
+    SoftMMU *mmu;
+
+    // Set by stop(), possibly before run() has started
+    bool stopping;
+    bool reset_requested;
+    bool halted;
+    // Last exit was caused by the host rather than the guest
+    bool async_exit;
+    // Vectors queued by external_interrupt, one bit each
+    uint64_t pending_vectors[4];
+    uint64_t exit_count;
+
+    pthread_mutex_t halt_lock;
+    pthread_cond_t halt_cond;
+    bool kicked;
+    uint64_t halt_poll_ns;
+    // Halts that ended while polling, and by sleeping
+    uint64_t halt_polls;
+    uint64_t halt_sleeps;
 };
 
 #endif
@@ -2,6 +2,8 @@
 
 #include <stdio.h>
 
+#include "log.h"
+
 DebugOutput::DebugOutput()
 {
 }
@@ -13,16 +15,29 @@ DebugOutput::~DebugOutput()
 void DebugOutput::write(uint32_t port, const uint32_t *value, uint8_t size)
 {
     if (size != 1) {
-        printf("DebugOutput: DebugOutput only supports single-byte R/W\n");
+        LOG_WARN("DebugOutput: DebugOutput only supports single-byte R/W\n");
+    }
+
+    if (port == DEBUG_OUTPUT_BASE_PORT) {
+        putchar(*value & 0xff);
+    }
+}
+
+void DebugOutput::write_block(uint32_t port, const uint8_t *data, uint8_t size,
+        uint32_t count)
+{
+    if (size != 1) {
+        LOG_WARN("DebugOutput: DebugOutput only supports single-byte R/W\n");
+        return;
     }
 
     if (port == DEBUG_OUTPUT_BASE_PORT) {
-        putchar(value & 0xff);
+        fwrite(data, 1, count, stdout);
     }
 }
 
 void DebugOutput::read(uint32_t port, uint32_t *value, uint8_t size)
 {
-    printf("DebugOutput: This device is write only\n");
+    LOG_WARN("DebugOutput: This device is write only\n");
 }
 
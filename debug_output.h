@@ -3,15 +3,18 @@
 
 #include <stdint.h>
 
+#include "io_device.h"
+
 #define DEBUG_OUTPUT_BASE_PORT   (0x402)
 
-class DebugOutput {
+class DebugOutput : public IODevice {
 public:
     DebugOutput();
     ~DebugOutput();
     void write(uint32_t port, const uint32_t *value, uint8_t size);
     void read(uint32_t port, uint32_t *value, uint8_t size);
+    void write_block(uint32_t port, const uint8_t *data, uint8_t size,
+            uint32_t count);
 };
 
 #endif
-
@@ -0,0 +1,159 @@
+#include "event_loop.h"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <unistd.h>
+
+EventLoop::EventLoop()
+{
+    running = false;
+    pthread_mutex_init(&lock, NULL);
+    pthread_mutex_init(&dispatch_lock, NULL);
+
+    if (pipe(wake_pipe) != 0) {
+        printf("EventLoop: Failed to create pipe\n");
+        wake_pipe[0] = -1;
+        wake_pipe[1] = -1;
+        return;
+    }
+    fcntl(wake_pipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(wake_pipe[1], F_SETFL, O_NONBLOCK);
+}
+
+EventLoop::~EventLoop()
+{
+    stop();
+
+    if (wake_pipe[0] >= 0) {
+        close(wake_pipe[0]);
+        close(wake_pipe[1]);
+    }
+    pthread_mutex_destroy(&dispatch_lock);
+    pthread_mutex_destroy(&lock);
+}
+
+bool EventLoop::start()
+{
+    if (running || wake_pipe[0] < 0) {
+        return false;
+    }
+
+    running = true;
+    if (pthread_create(&thread, NULL, thread_main, this) != 0) {
+        printf("EventLoop: Failed to create thread\n");
+        running = false;
+        return false;
+    }
+
+    return true;
+}
+
+void EventLoop::stop()
+{
+    if (!running) {
+        return;
+    }
+
+    __atomic_store_n(&running, false, __ATOMIC_RELAXED);
+    wake();
+    pthread_join(thread, NULL);
+}
+
+void EventLoop::add_fd(int fd, EventLoopHandler *handler)
+{
+    watch w = {fd, handler};
+
+    pthread_mutex_lock(&lock);
+    watches.push_back(w);
+    pthread_mutex_unlock(&lock);
+
+    wake();
+}
+
+void EventLoop::remove_fd(int fd)
+{
+    pthread_mutex_lock(&lock);
+    for (std::vector<watch>::iterator it = watches.begin();
+            it != watches.end(); it++) {
+        if (it->fd == fd) {
+            watches.erase(it);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&lock);
+
+    wake();
+
+    // Wait out a handler that may be running, unless we are that handler
+    if (running && !pthread_equal(pthread_self(), thread)) {
+        pthread_mutex_lock(&dispatch_lock);
+        pthread_mutex_unlock(&dispatch_lock);
+    }
+}
+
+void EventLoop::wake()
+{
+    char c = 0;
+    if (write(wake_pipe[1], &c, 1) < 0) {
+        // Pipe is full, so a wakeup is already pending
+    }
+}
+
+void *EventLoop::thread_main(void *arg)
+{
+    ((EventLoop*)arg)->run();
+
+    return NULL;
+}
+
+void EventLoop::run()
+{
+    std::vector<struct pollfd> fds;
+
+    while (__atomic_load_n(&running, __ATOMIC_RELAXED)) {
+        fds.clear();
+        struct pollfd wake_fd = {wake_pipe[0], POLLIN, 0};
+        fds.push_back(wake_fd);
+
+        pthread_mutex_lock(&lock);
+        for (size_t i = 0; i < watches.size(); i++) {
+            struct pollfd pfd = {watches[i].fd, POLLIN, 0};
+            fds.push_back(pfd);
+        }
+        pthread_mutex_unlock(&lock);
+
+        if (poll(fds.data(), fds.size(), -1) < 0) {
+            continue;
+        }
+
+        if (fds[0].revents & POLLIN) {
+            char buf[64];
+            while (read(wake_pipe[0], buf, sizeof(buf)) > 0) {
+            }
+        }
+
+        pthread_mutex_lock(&dispatch_lock);
+        for (size_t i = 1; i < fds.size(); i++) {
+            if (!(fds[i].revents & (POLLIN | POLLHUP | POLLERR))) {
+                continue;
+            }
+
+            // Handler may have been removed since poll started
+            EventLoopHandler *handler = NULL;
+            pthread_mutex_lock(&lock);
+            for (size_t j = 0; j < watches.size(); j++) {
+                if (watches[j].fd == fds[i].fd) {
+                    handler = watches[j].handler;
+                    break;
+                }
+            }
+            pthread_mutex_unlock(&lock);
+
+            if (handler != NULL) {
+                handler->handle_readable(fds[i].fd);
+            }
+        }
+        pthread_mutex_unlock(&dispatch_lock);
+    }
+}
@@ -0,0 +1,48 @@
+#ifndef __EVENT_LOOP_H__
+#define __EVENT_LOOP_H__
+
+#include <pthread.h>
+#include <vector>
+
+class EventLoopHandler {
+public:
+    virtual ~EventLoopHandler() {}
+    // Called on the loop thread when fd is readable or has hung up
+    virtual void handle_readable(int fd) = 0;
+};
+
+// One thread waiting on host file descriptors for all device backends in
+// the process, however many VMs there are
+class EventLoop {
+public:
+    EventLoop();
+    ~EventLoop();
+    bool start();
+    void stop();
+    // Callable from any thread
+    void add_fd(int fd, EventLoopHandler *handler);
+    // Callable from any thread. Once it returns, handler won't be called
+    // for fd again.
+    void remove_fd(int fd);
+private:
+    struct watch {
+        int fd;
+        EventLoopHandler *handler;
+    };
+
+    static void *thread_main(void *arg);
+    void run();
+    // Make the loop pick up changes to watches
+    void wake();
+
+    pthread_t thread;
+    bool running;
+    // Protects watches
+    pthread_mutex_t lock;
+    // Held while handlers run
+    pthread_mutex_t dispatch_lock;
+    std::vector<watch> watches;
+    int wake_pipe[2];
+};
+
+#endif
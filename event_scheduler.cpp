@@ -0,0 +1,110 @@
+#include "event_scheduler.h"
+
+#include "host_clock.h"
+#include "replay.h"
+#include "trace.h"
+
+EventScheduler::EventScheduler()
+{
+    host_clock_init();
+    clock_mode = EVENT_CLOCK_HOST;
+    virtual_time = 0;
+}
+
+EventScheduler::~EventScheduler()
+{
+}
+
+void EventScheduler::schedule(EventHandler *handler, uint64_t deadline)
+{
+    cancel(handler);
+
+    std::vector<event>::iterator it = events.begin();
+    while (it != events.end() && it->deadline <= deadline) {
+        it++;
+    }
+
+    event e = {deadline, handler};
+    events.insert(it, e);
+}
+
+void EventScheduler::cancel(EventHandler *handler)
+{
+    for (std::vector<event>::iterator it = events.begin();
+            it != events.end(); it++) {
+        if (it->handler == handler) {
+            events.erase(it);
+            return;
+        }
+    }
+}
+
+void EventScheduler::run_expired()
+{
+    uint64_t now = get_time();
+
+    while (!events.empty() && events.front().deadline <= now) {
+        EventHandler *handler = events.front().handler;
+        uint64_t lateness = now - events.front().deadline;
+        events.erase(events.begin());
+        TRACE(TRACE_CAT_TIMER, TRACE_TIMER_FIRE, 0, 0,
+                lateness > UINT32_MAX ? UINT32_MAX : lateness);
+        // Handler may schedule itself again
+        handler->handle_event(now);
+    }
+}
+
+uint64_t EventScheduler::next_deadline()
+{
+    if (events.empty()) {
+        return EVENT_SCHEDULER_NO_DEADLINE;
+    }
+
+    return events.front().deadline;
+}
+
+uint64_t EventScheduler::get_time()
+{
+    if (clock_mode == EVENT_CLOCK_VIRTUAL) {
+        return virtual_time;
+    }
+
+    return get_host_time();
+}
+
+uint64_t EventScheduler::get_host_time()
+{
+    return replay_time(REPLAY_CLOCK_SCHEDULER, host_clock_ns());
+}
+
+void EventScheduler::set_clock_mode(event_clock_mode_t mode)
+{
+    // Carry on from the current time so deadlines stay meaningful
+    if (mode == EVENT_CLOCK_VIRTUAL && clock_mode == EVENT_CLOCK_HOST) {
+        virtual_time = get_host_time();
+    }
+    clock_mode = mode;
+}
+
+event_clock_mode_t EventScheduler::get_clock_mode()
+{
+    return clock_mode;
+}
+
+void EventScheduler::advance(uint64_t ns)
+{
+    virtual_time += ns;
+}
+
+bool EventScheduler::skip_to_next_deadline()
+{
+    if (clock_mode != EVENT_CLOCK_VIRTUAL || events.empty()) {
+        return false;
+    }
+
+    if (events.front().deadline > virtual_time) {
+        virtual_time = events.front().deadline;
+    }
+
+    return true;
+}
@@ -0,0 +1,59 @@
+#ifndef __EVENT_SCHEDULER_H__
+#define __EVENT_SCHEDULER_H__
+
+#include <stdint.h>
+#include <vector>
+
+#define EVENT_SCHEDULER_NO_DEADLINE (UINT64_MAX)
+
+typedef enum {
+    // Guest time follows the host monotonic clock
+    EVENT_CLOCK_HOST,
+    // Guest time only advances while the guest runs, and skips ahead to
+    // the next deadline when it idles
+    EVENT_CLOCK_VIRTUAL,
+} event_clock_mode_t;
+
+class EventHandler {
+public:
+    virtual ~EventHandler() {}
+    // Called once when the scheduled deadline [ns] has passed
+    virtual void handle_event(uint64_t now) = 0;
+};
+
+class EventScheduler {
+public:
+    EventScheduler();
+    ~EventScheduler();
+    // Schedule handler at deadline [ns], replacing its previous deadline
+    void schedule(EventHandler *handler, uint64_t deadline);
+    void cancel(EventHandler *handler);
+    // Fire all events whose deadline has passed
+    void run_expired();
+    // Earliest pending deadline [ns]
+    uint64_t next_deadline();
+    // Get current guest time in nanosec
+    uint64_t get_time();
+    // Get host monotonic time in nanosec, whatever the clock mode
+    uint64_t get_host_time();
+
+    void set_clock_mode(event_clock_mode_t mode);
+    event_clock_mode_t get_clock_mode();
+    // Move virtual time forward by time spent running the guest [ns]
+    void advance(uint64_t ns);
+    // Move virtual time to the earliest deadline. Returns false in host
+    // mode or when nothing is scheduled.
+    bool skip_to_next_deadline();
+private:
+    struct event {
+        uint64_t deadline;
+        EventHandler *handler;
+    };
+
+    // Pending events sorted by deadline (few timers, so a vector is enough)
+    std::vector<event> events;
+    event_clock_mode_t clock_mode;
+    uint64_t virtual_time;
+};
+
+#endif
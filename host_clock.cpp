@@ -0,0 +1,98 @@
+#include "host_clock.h"
+
+#include <errno.h>
+#include <pthread.h>
+
+host_clock_tsc host_clock_tsc_state;
+
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+
+static bool tsc_is_invariant()
+{
+    uint32_t eax = 0x80000000, ebx, ecx = 0, edx;
+    __asm__ __volatile__("cpuid"
+            : "+a"(eax), "=b"(ebx), "+c"(ecx), "=d"(edx));
+    if (eax < 0x80000007) {
+        return false;
+    }
+
+    eax = 0x80000007;
+    ecx = 0;
+    __asm__ __volatile__("cpuid"
+            : "+a"(eax), "=b"(ebx), "+c"(ecx), "=d"(edx));
+
+    return (edx & (1 << 8)) != 0;
+}
+
+uint64_t host_clock_os_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * HOST_CLOCK_S_IN_NS + ts.tv_nsec;
+}
+
+static void calibrate()
+{
+    if (!tsc_is_invariant()) {
+        return;
+    }
+
+    uint64_t start_ns = host_clock_os_ns();
+    uint64_t start_tsc = host_clock_read_tsc();
+    uint64_t end_ns;
+    do {
+        end_ns = host_clock_os_ns();
+    } while (end_ns - start_ns < HOST_CLOCK_CALIBRATION);
+    uint64_t end_tsc = host_clock_read_tsc();
+
+    if (end_tsc <= start_tsc) {
+        return;
+    }
+
+    host_clock_tsc_state.base_tsc = end_tsc;
+    host_clock_tsc_state.base_ns = end_ns;
+    host_clock_tsc_state.mult = (uint64_t)(((unsigned __int128)
+                (end_ns - start_ns) << 32) / (end_tsc - start_tsc));
+    __atomic_store_n(&host_clock_tsc_state.enabled, true, __ATOMIC_RELEASE);
+}
+
+void host_clock_init()
+{
+    pthread_once(&init_once, calibrate);
+}
+
+uint64_t host_clock_realtime_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+
+    return (uint64_t)ts.tv_sec * HOST_CLOCK_S_IN_NS + ts.tv_nsec;
+}
+
+void host_clock_sleep_until(uint64_t deadline)
+{
+    uint64_t now = host_clock_ns();
+    if (deadline <= now) {
+        return;
+    }
+
+#ifdef __linux__
+    // Absolute sleep on the OS clock isn't cut short by early wakeups
+    uint64_t os_deadline = host_clock_os_ns() + (deadline - now);
+    struct timespec ts;
+    ts.tv_sec = os_deadline / HOST_CLOCK_S_IN_NS;
+    ts.tv_nsec = os_deadline % HOST_CLOCK_S_IN_NS;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL)
+            == EINTR) {
+    }
+#else
+    while (now < deadline) {
+        struct timespec ts;
+        ts.tv_sec = (deadline - now) / HOST_CLOCK_S_IN_NS;
+        ts.tv_nsec = (deadline - now) % HOST_CLOCK_S_IN_NS;
+        nanosleep(&ts, NULL);
+        now = host_clock_ns();
+    }
+#endif
+}
@@ -0,0 +1,54 @@
+#ifndef __HOST_CLOCK_H__
+#define __HOST_CLOCK_H__
+
+#include <stdint.h>
+#include <time.h>
+
+#define HOST_CLOCK_S_IN_NS      (1000000000ULL)
+// How long to compare TSC against the OS clock [ns]
+#define HOST_CLOCK_CALIBRATION  (10000000)
+
+// TSC to nanosec conversion, set up by host_clock_init(). Only used when
+// the TSC is invariant, i.e. ticks at a constant rate in all P/C-states.
+struct host_clock_tsc {
+    bool enabled;
+    uint64_t base_tsc;
+    uint64_t base_ns;
+    // ns = base_ns + ((tsc - base_tsc) * mult) >> 32
+    uint64_t mult;
+};
+
+extern host_clock_tsc host_clock_tsc_state;
+
+// Calibrate, once. Called by the schedulers; until then host_clock_ns
+// uses the OS clock.
+void host_clock_init();
+uint64_t host_clock_os_ns();
+
+static inline uint64_t host_clock_read_tsc()
+{
+    uint32_t lo, hi;
+    __asm__ __volatile__("rdtsc" : "=a"(lo), "=d"(hi));
+
+    return (uint64_t)hi << 32 | lo;
+}
+
+// Monotonic time [ns]: a TSC read when possible, the OS clock (vDSO on
+// Linux, commpage on macOS) otherwise
+static inline uint64_t host_clock_ns()
+{
+    if (__builtin_expect(host_clock_tsc_state.enabled, 1)) {
+        uint64_t delta = host_clock_read_tsc() - host_clock_tsc_state.base_tsc;
+        return host_clock_tsc_state.base_ns + (uint64_t)(((unsigned __int128)
+                    delta * host_clock_tsc_state.mult) >> 32);
+    }
+
+    return host_clock_os_ns();
+}
+
+// Wall clock time [ns since the epoch]
+uint64_t host_clock_realtime_ns();
+// Sleep until monotonic time deadline [ns], as returned by host_clock_ns
+void host_clock_sleep_until(uint64_t deadline);
+
+#endif
@@ -0,0 +1,328 @@
+#include "hpet.h"
+
+#include <stdio.h>
+
+#include "log.h"
+
+void HPETTimer::handle_event(uint64_t)
+{
+    hpet->fire_timer(index);
+}
+
+HPET::HPET(EventScheduler *scheduler)
+{
+    this->scheduler = scheduler;
+    pic = NULL;
+
+    for (int i = 0; i < HPET_TIMER_COUNT; i++) {
+        timers[i].hpet = this;
+        timers[i].index = i;
+    }
+
+    reset();
+}
+
+HPET::~HPET()
+{
+    for (int i = 0; i < HPET_TIMER_COUNT; i++) {
+        scheduler->cancel(&timers[i]);
+    }
+}
+
+void HPET::reset()
+{
+    config = 0;
+    int_status = 0;
+    counter_base = 0;
+    counter_base_time = scheduler->get_time();
+
+    for (int i = 0; i < HPET_TIMER_COUNT; i++) {
+        scheduler->cancel(&timers[i]);
+        timers[i].config = 0;
+        timers[i].comparator = UINT64_MAX;
+        timers[i].period = 0;
+    }
+}
+
+void HPET::connect_pic(PIC *pic)
+{
+    this->pic = pic;
+}
+
+void HPET::mmio_write(uint64_t address, const uint64_t *value, uint8_t size)
+{
+    if (size != 4 && size != 8) {
+        LOG_WARN("HPET: HPET only supports 32-bit or 64-bit R/W\n");
+        return;
+    }
+
+    uint64_t offset = address - HPET_BASE_ADDRESS;
+    // 32-bit accesses hit either half of a 64-bit register
+    int shift = size == 4 ? (offset & 0x4) * 8 : 0;
+    uint64_t mask = size == 4 ? 0xffffffffULL << shift : UINT64_MAX;
+
+    write_register(offset & ~0x7ULL, (*value << shift) & mask, mask);
+}
+
+void HPET::mmio_read(uint64_t address, uint64_t *value, uint8_t size)
+{
+    if (size != 4 && size != 8) {
+        LOG_WARN("HPET: HPET only supports 32-bit or 64-bit R/W\n");
+        return;
+    }
+
+    uint64_t offset = address - HPET_BASE_ADDRESS;
+    uint64_t reg = read_register(offset & ~0x7ULL);
+
+    if (size == 4) {
+        *value = (reg >> ((offset & 0x4) * 8)) & 0xffffffff;
+    } else {
+        *value = reg;
+    }
+}
+
+uint64_t HPET::read_register(uint64_t offset)
+{
+    switch (offset) {
+    case HPET_REG_CAPABILITIES:
+        return (uint64_t)HPET_CLOCK_PERIOD << 32
+            // Vendor ID
+            | 0x8086 << 16
+            // Legacy replacement route capable
+            | 1 << 15
+            // 64-bit main counter
+            | 1 << 13
+            | (HPET_TIMER_COUNT - 1) << 8
+            // Revision
+            | 0x01;
+    case HPET_REG_CONFIG:
+        return config;
+    case HPET_REG_INT_STATUS:
+        return int_status;
+    case HPET_REG_MAIN_COUNTER:
+        return get_counter();
+    }
+
+    if (offset < HPET_REG_TIMER_BASE
+            || offset >= HPET_REG_TIMER_BASE
+                + HPET_TIMER_COUNT * HPET_REG_TIMER_SIZE) {
+        return 0;
+    }
+
+    int timer = (offset - HPET_REG_TIMER_BASE) / HPET_REG_TIMER_SIZE;
+    switch ((offset - HPET_REG_TIMER_BASE) % HPET_REG_TIMER_SIZE) {
+    case HPET_REG_TIMER_CONFIG:
+        return timers[timer].config
+            | HPET_TN_PERIODIC_CAP
+            | HPET_TN_SIZE_CAP
+            // Interrupt route capability: any IRQ on the PIC
+            | (uint64_t)((1 << PIC_IRQ_COUNT) - 1) << 32;
+    case HPET_REG_TIMER_CMP:
+        return timers[timer].comparator;
+    case HPET_REG_TIMER_FSB:
+        return 0;
+    }
+
+    return 0;
+}
+
+void HPET::write_register(uint64_t offset, uint64_t value, uint64_t mask)
+{
+    switch (offset) {
+    case HPET_REG_CAPABILITIES:
+        LOG_WARN("HPET: Capabilities register is read only\n");
+        return;
+    case HPET_REG_CONFIG:
+        write_config((config & ~mask) | value);
+        return;
+    case HPET_REG_INT_STATUS:
+        // Write 1 to clear
+        int_status &= ~value;
+        return;
+    case HPET_REG_MAIN_COUNTER:
+        if (config & HPET_CFG_ENABLE) {
+            LOG_WARN("HPET: Main counter written while running\n");
+            return;
+        }
+        counter_base = (counter_base & ~mask) | value;
+        return;
+    }
+
+    if (offset < HPET_REG_TIMER_BASE
+            || offset >= HPET_REG_TIMER_BASE
+                + HPET_TIMER_COUNT * HPET_REG_TIMER_SIZE) {
+        return;
+    }
+
+    int timer = (offset - HPET_REG_TIMER_BASE) / HPET_REG_TIMER_SIZE;
+    switch ((offset - HPET_REG_TIMER_BASE) % HPET_REG_TIMER_SIZE) {
+    case HPET_REG_TIMER_CONFIG:
+        write_timer_config(timer, (timers[timer].config & ~mask) | value);
+        break;
+    case HPET_REG_TIMER_CMP:
+        write_timer_comparator(timer,
+                (timers[timer].comparator & ~mask) | value);
+        break;
+    case HPET_REG_TIMER_FSB:
+        LOG_WARN("HPET: FSB interrupt delivery is not supported\n");
+        break;
+    }
+}
+
+void HPET::write_config(uint64_t value)
+{
+    uint64_t old_config = config;
+
+    if ((old_config & HPET_CFG_ENABLE) && !(value & HPET_CFG_ENABLE)) {
+        // Freeze main counter
+        counter_base = get_counter();
+    } else if (!(old_config & HPET_CFG_ENABLE) && (value & HPET_CFG_ENABLE)) {
+        // Start counting from the frozen value
+        counter_base_time = scheduler->get_time();
+    }
+
+    config = value & (HPET_CFG_ENABLE | HPET_CFG_LEGACY);
+
+    for (int i = 0; i < HPET_TIMER_COUNT; i++) {
+        update_timer(i);
+    }
+}
+
+void HPET::write_timer_config(int timer, uint64_t value)
+{
+    HPETTimer *t = &timers[timer];
+
+    t->config = value & HPET_TN_CFG_WRITE_MASK;
+
+    if (!(t->config & HPET_TN_LEVEL)) {
+        int_status &= ~(1ULL << timer);
+    }
+    if (t->config & HPET_TN_32BIT) {
+        t->comparator &= 0xffffffff;
+        t->period &= 0xffffffff;
+    }
+
+    update_timer(timer);
+}
+
+void HPET::write_timer_comparator(int timer, uint64_t value)
+{
+    HPETTimer *t = &timers[timer];
+
+    if (t->config & HPET_TN_32BIT) {
+        value &= 0xffffffff;
+    }
+
+    // In periodic mode, comparator is only set when VAL_SET is written
+    // first. Otherwise only the period is updated.
+    if (!(t->config & HPET_TN_PERIODIC) || (t->config & HPET_TN_SETVAL)) {
+        t->comparator = value;
+    }
+    t->period = value;
+    t->config &= ~HPET_TN_SETVAL;
+
+    update_timer(timer);
+}
+
+uint64_t HPET::get_counter()
+{
+    if (!(config & HPET_CFG_ENABLE)) {
+        return counter_base;
+    }
+
+    uint64_t elapsed_time = scheduler->get_time() - counter_base_time;
+
+    return counter_base + elapsed_time / HPET_TICK_IN_NS;
+}
+
+void HPET::update_timer(int timer)
+{
+    HPETTimer *t = &timers[timer];
+
+    scheduler->cancel(t);
+
+    if (!(config & HPET_CFG_ENABLE) || !(t->config & HPET_TN_ENABLE)) {
+        return;
+    }
+
+    // Ticks until the comparator matches, with wrap-around
+    uint64_t ticks = t->comparator - get_counter();
+    if (t->config & HPET_TN_32BIT) {
+        ticks &= 0xffffffff;
+    }
+
+    // A comparator left at its reset value is never reached
+    uint64_t now = scheduler->get_time();
+    if (ticks > (UINT64_MAX - now) / HPET_TICK_IN_NS) {
+        return;
+    }
+    scheduler->schedule(t, now + ticks * HPET_TICK_IN_NS);
+}
+
+void HPET::fire_timer(int timer)
+{
+    HPETTimer *t = &timers[timer];
+
+    if (t->config & HPET_TN_LEVEL) {
+        int_status |= 1ULL << timer;
+    }
+
+    uint8_t irq_number = get_irq_number(timer);
+    if (irq_number >= PIC_IRQ_COUNT) {
+        LOG_WARN("HPET: IRQ %d cannot be routed to PIC\n", irq_number);
+    } else if (pic != NULL) {
+        pic->push_irq(irq_number);
+    }
+
+    if (!(t->config & HPET_TN_PERIODIC) || t->period == 0) {
+        // One-shot timers fire only once
+        return;
+    }
+
+    // Skip missed periods so that a stalled guest doesn't get an IRQ storm
+    uint64_t counter = get_counter();
+    do {
+        t->comparator += t->period;
+        if (t->config & HPET_TN_32BIT) {
+            t->comparator &= 0xffffffff;
+        }
+    } while ((int64_t)(t->comparator - counter) <= 0
+            && !(t->config & HPET_TN_32BIT));
+
+    update_timer(timer);
+}
+
+uint8_t HPET::get_irq_number(int timer)
+{
+    if (config & HPET_CFG_LEGACY) {
+        // Legacy replacement route takes over IRQ0 (PIT) and IRQ8 (RTC)
+        if (timer == 0) {
+            return 0;
+        } else if (timer == 1) {
+            return 8;
+        }
+    }
+
+    return (timers[timer].config >> HPET_TN_ROUTE_SHIFT) & HPET_TN_ROUTE_MASK;
+}
+
+void HPET::debug_status()
+{
+    printf("------------------------------\n");
+    printf("HPET:\n");
+    printf("Counter: 0x%016llx, %s %s\n",
+            (unsigned long long)get_counter(),
+            config & HPET_CFG_ENABLE ? "enabled" : "disabled",
+            config & HPET_CFG_LEGACY ? "legacy route" : "");
+    printf("Interrupt status: 0x%08llx\n", (unsigned long long)int_status);
+    for (int i = 0; i < HPET_TIMER_COUNT; i++) {
+        printf("Timer %d: config: 0x%04llx, comparator: 0x%016llx, "
+                "period: 0x%016llx, IRQ: %d\n",
+                i,
+                (unsigned long long)timers[i].config,
+                (unsigned long long)timers[i].comparator,
+                (unsigned long long)timers[i].period,
+                get_irq_number(i));
+    }
+    printf("------------------------------\n");
+}
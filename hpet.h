@@ -0,0 +1,98 @@
+#ifndef __HPET_H__
+#define __HPET_H__
+
+#include <stdint.h>
+
+#include "event_scheduler.h"
+#include "io_device.h"
+#include "pic.h"
+
+#define HPET_BASE_ADDRESS       (0xfed00000)
+#define HPET_MMIO_SIZE          (0x400)
+#define HPET_TIMER_COUNT        (3)
+// Counter tick period in femtosec (10MHz)
+#define HPET_CLOCK_PERIOD       (100000000)
+#define HPET_TICK_IN_NS         (HPET_CLOCK_PERIOD / 1000000)
+
+// Register offsets
+#define HPET_REG_CAPABILITIES   (0x000)
+#define HPET_REG_CONFIG         (0x010)
+#define HPET_REG_INT_STATUS     (0x020)
+#define HPET_REG_MAIN_COUNTER   (0x0f0)
+#define HPET_REG_TIMER_BASE     (0x100)
+#define HPET_REG_TIMER_SIZE     (0x20)
+#define HPET_REG_TIMER_CONFIG   (0x00)
+#define HPET_REG_TIMER_CMP      (0x08)
+#define HPET_REG_TIMER_FSB      (0x10)
+
+#define HPET_CFG_ENABLE         (0x1)
+#define HPET_CFG_LEGACY         (0x2)
+
+#define HPET_TN_LEVEL           (0x002)
+#define HPET_TN_ENABLE          (0x004)
+#define HPET_TN_PERIODIC        (0x008)
+#define HPET_TN_PERIODIC_CAP    (0x010)
+#define HPET_TN_SIZE_CAP        (0x020)
+#define HPET_TN_SETVAL          (0x040)
+#define HPET_TN_32BIT           (0x100)
+#define HPET_TN_ROUTE_SHIFT     (9)
+#define HPET_TN_ROUTE_MASK      (0x1f)
+// Writable bits of timer N configuration register
+#define HPET_TN_CFG_WRITE_MASK  (0x3f4e)
+
+class HPET;
+
+class HPETTimer : public EventHandler {
+public:
+    void handle_event(uint64_t now);
+
+    HPET *hpet;
+    int index;
+    uint64_t config;
+    uint64_t comparator;
+    // Period for periodic mode, in counter ticks
+    uint64_t period;
+};
+
+class HPET : public MMIODevice {
+public:
+    HPET(EventScheduler *scheduler);
+    ~HPET();
+    void mmio_write(uint64_t address, const uint64_t *value, uint8_t size);
+    void mmio_read(uint64_t address, uint64_t *value, uint8_t size);
+    void connect_pic(PIC *pic);
+    // Counter and timers stopped and cleared
+    void reset();
+    void debug_status();
+private:
+    friend class HPETTimer;
+
+    uint64_t read_register(uint64_t offset);
+    // Only bits set in mask are written
+    void write_register(uint64_t offset, uint64_t value, uint64_t mask);
+    void write_timer_config(int timer, uint64_t value);
+    void write_timer_comparator(int timer, uint64_t value);
+    void write_config(uint64_t value);
+    // Current main counter computed from monotonic time
+    uint64_t get_counter();
+    // Arm event for comparator of timer (or disarm if not needed)
+    void update_timer(int timer);
+    // Called when comparator of timer matched the main counter
+    void fire_timer(int timer);
+    uint8_t get_irq_number(int timer);
+
+    EventScheduler *scheduler;
+    PIC *pic;
+    HPETTimer timers[HPET_TIMER_COUNT];
+
+    // General configuration register
+    uint64_t config;
+    // General interrupt status register (level-triggered timers)
+    uint64_t int_status;
+    // Main counter value at counter_base_time
+    uint64_t counter_base;
+    // Time [ns] when main counter was counter_base
+    uint64_t counter_base_time;
+};
+
+#endif
@@ -0,0 +1,555 @@
+#include "i8042.h"
+
+#include <stdio.h>
+
+#include "cpu.h"
+#include "log.h"
+
+// Marks replies from the auxiliary port
+#define I8042_REPLY_AUX         (0x100)
+
+// Keyboard replies
+#define KBD_ACK                 (0xfa)
+#define KBD_RESEND              (0xfe)
+#define KBD_SELF_TEST_OK        (0xaa)
+#define KBD_ECHO                (0xee)
+
+// Set 1 scancodes
+#define KEY_EXTENDED            (0xe0)
+#define KEY_RELEASE             (0x80)
+#define KEY_ESCAPE              (0x01)
+#define KEY_BACKSPACE           (0x0e)
+#define KEY_TAB                 (0x0f)
+#define KEY_ENTER               (0x1c)
+#define KEY_CTRL                (0x1d)
+#define KEY_SHIFT               (0x2a)
+
+// Set 2 code of each set 1 code. Extended keys use the same mapping.
+static const uint8_t set2_codes[0x59] = {
+    0x00, 0x76, 0x16, 0x1e, 0x26, 0x25, 0x2e, 0x36,
+    0x3d, 0x3e, 0x46, 0x45, 0x4e, 0x55, 0x66, 0x0d,
+    0x15, 0x1d, 0x24, 0x2d, 0x2c, 0x35, 0x3c, 0x43,
+    0x44, 0x4d, 0x54, 0x5b, 0x5a, 0x14, 0x1c, 0x1b,
+    0x23, 0x2b, 0x34, 0x33, 0x3b, 0x42, 0x4b, 0x4c,
+    0x52, 0x0e, 0x12, 0x5d, 0x1a, 0x22, 0x21, 0x2a,
+    0x32, 0x31, 0x3a, 0x41, 0x49, 0x4a, 0x59, 0x7c,
+    0x11, 0x29, 0x58, 0x05, 0x06, 0x04, 0x0c, 0x03,
+    0x0b, 0x83, 0x0a, 0x01, 0x09, 0x77, 0x7e, 0x6c,
+    0x75, 0x7d, 0x7b, 0x6b, 0x73, 0x74, 0x79, 0x69,
+    0x72, 0x7a, 0x70, 0x71, 0x7f, 0x60, 0x61, 0x78,
+    0x07,
+};
+
+// Characters on the US layout from set 1 code first, without and with
+// shift
+struct key_row {
+    uint8_t first;
+    const char *plain;
+    const char *shifted;
+};
+
+static const key_row key_rows[] = {
+    { 0x02, "1234567890-=", "!@#$%^&*()_+" },
+    { 0x10, "qwertyuiop[]", "QWERTYUIOP{}" },
+    { 0x1e, "asdfghjkl;'`", "ASDFGHJKL:\"~" },
+    { 0x2b, "\\zxcvbnm,./", "|ZXCVBNM<>?" },
+    { 0x39, " ", " " },
+};
+
+// Set 1 code of a character, and whether it needs shift
+static bool find_key(uint8_t c, uint8_t *code, bool *shift)
+{
+    for (size_t i = 0; i < sizeof(key_rows) / sizeof(key_rows[0]); i++) {
+        for (int j = 0; key_rows[i].plain[j] != '\0'; j++) {
+            if (key_rows[i].plain[j] == c) {
+                *code = key_rows[i].first + j;
+                *shift = false;
+                return true;
+            }
+            if (key_rows[i].shifted[j] == c) {
+                *code = key_rows[i].first + j;
+                *shift = true;
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+I8042::I8042()
+{
+    pic = NULL;
+    cpu = NULL;
+
+    input_head = 0;
+    input_tail = 0;
+    keys_dropped = 0;
+
+    bytes_sent = 0;
+    irqs = 0;
+    resets = 0;
+
+    reset();
+}
+
+void I8042::reset()
+{
+    status = I8042_STATUS_UNLOCKED;
+    command_byte = I8042_CCB_KBD_IRQ | I8042_CCB_TRANSLATE
+        | I8042_CCB_AUX_DISABLE;
+    pending_command = 0;
+    output = 0;
+    irq_raised = false;
+    a20 = true;
+    port_a = I8042_OUT_A20;
+
+    scanning = true;
+    scancode_set = 2;
+    pending_keyboard_command = 0;
+    pending_scancode = 0;
+    replies.clear();
+}
+
+void I8042::connect_pic(PIC *pic)
+{
+    this->pic = pic;
+}
+
+void I8042::connect_cpu(CPU *cpu)
+{
+    this->cpu = cpu;
+}
+
+void I8042::write(uint32_t port, const uint32_t *value, uint8_t size)
+{
+    if (size != 1) {
+        LOG_WARN("I8042: I8042 only supports single-byte R/W\n");
+        return;
+    }
+
+    switch (port) {
+    case I8042_DATA_PORT:
+        status &= ~I8042_STATUS_COMMAND;
+        write_data(*value);
+        break;
+    case I8042_COMMAND_PORT:
+        status |= I8042_STATUS_COMMAND;
+        write_command(*value);
+        break;
+    case I8042_PORT_A:
+        a20 = (*value & I8042_OUT_A20) != 0;
+        // Reset on a rising edge of bit 0
+        if ((*value & I8042_OUT_RESET) && !(port_a & I8042_OUT_RESET)) {
+            reset_cpu();
+        }
+        port_a = *value & (I8042_OUT_RESET | I8042_OUT_A20);
+        break;
+    }
+}
+
+void I8042::read(uint32_t port, uint32_t *value, uint8_t size)
+{
+    if (size != 1) {
+        LOG_WARN("I8042: I8042 only supports single-byte R/W\n");
+        return;
+    }
+
+    switch (port) {
+    case I8042_DATA_PORT:
+        *value = output;
+        status &= ~(I8042_STATUS_OBF | I8042_STATUS_AUX_OBF);
+        break;
+    case I8042_COMMAND_PORT:
+        // Guests poll here with interrupts off
+        fill_output();
+        *value = status;
+        break;
+    case I8042_PORT_A:
+        *value = (port_a & I8042_OUT_RESET) | (a20 ? I8042_OUT_A20 : 0);
+        break;
+    }
+}
+
+void I8042::write_command(uint8_t value)
+{
+    pending_command = 0;
+
+    // Pulse output port bits low; bit 0 is the reset line
+    if ((value & 0xf0) == 0xf0) {
+        if (!(value & I8042_OUT_RESET)) {
+            reset_cpu();
+        }
+        return;
+    }
+
+    switch (value) {
+    case 0x20:
+        reply(command_byte);
+        break;
+    case 0x60:
+    case 0xd1:
+    case 0xd2:
+    case 0xd3:
+    case 0xd4:
+        // Data byte follows
+        pending_command = value;
+        break;
+    case 0xa7:
+        command_byte |= I8042_CCB_AUX_DISABLE;
+        break;
+    case 0xa8:
+        command_byte &= ~I8042_CCB_AUX_DISABLE;
+        break;
+    case 0xa9:
+    case 0xab:
+        // Interface test passed
+        reply(0x00);
+        break;
+    case 0xaa:
+        status |= I8042_STATUS_SYS;
+        reply(0x55);
+        break;
+    case 0xad:
+        command_byte |= I8042_CCB_KBD_DISABLE;
+        break;
+    case 0xae:
+        command_byte &= ~I8042_CCB_KBD_DISABLE;
+        break;
+    case 0xc0:
+        // Input port: keyboard not inhibited
+        reply(0x80);
+        break;
+    case 0xd0: {
+        uint8_t port = I8042_OUT_RESET | (a20 ? I8042_OUT_A20 : 0);
+        if (status & I8042_STATUS_OBF) {
+            port |= status & I8042_STATUS_AUX_OBF ? 0x20 : 0x10;
+        }
+        reply(port);
+    }
+        break;
+    case 0xdd:
+        a20 = false;
+        break;
+    case 0xdf:
+        a20 = true;
+        break;
+    default:
+        LOG_WARN("I8042: Unknown command 0x%02x\n", value);
+        break;
+    }
+}
+
+void I8042::write_data(uint8_t value)
+{
+    uint8_t command = pending_command;
+    pending_command = 0;
+
+    switch (command) {
+    case 0x60:
+        command_byte = value;
+        status = (status & ~I8042_STATUS_SYS) | (value & I8042_CCB_SYS);
+        break;
+    case 0xd1:
+        write_output_port(value);
+        break;
+    case 0xd2:
+        reply(value);
+        break;
+    case 0xd3:
+        reply(value, true);
+        break;
+    case 0xd4:
+        // No mouse: commands to it time out
+        reply(KBD_RESEND, true);
+        break;
+    default:
+        // Writing to the keyboard enables it
+        command_byte &= ~I8042_CCB_KBD_DISABLE;
+        keyboard_command(value);
+        break;
+    }
+}
+
+void I8042::write_output_port(uint8_t value)
+{
+    a20 = (value & I8042_OUT_A20) != 0;
+    if (!(value & I8042_OUT_RESET)) {
+        reset_cpu();
+    }
+}
+
+void I8042::keyboard_command(uint8_t value)
+{
+    uint8_t command = pending_keyboard_command;
+    pending_keyboard_command = 0;
+
+    // Argument of the previous command
+    if (command != 0) {
+        if (command == 0xf0 && value == 0) {
+            reply(KBD_ACK);
+            reply(scancode_set);
+            return;
+        }
+        if (command == 0xf0 && (value == 1 || value == 2)) {
+            scancode_set = value;
+        }
+        reply(KBD_ACK);
+        return;
+    }
+
+    switch (value) {
+    case 0xed:
+    case 0xf0:
+    case 0xf3:
+        // LEDs, scancode set and typematic rate take an argument
+        pending_keyboard_command = value;
+        reply(KBD_ACK);
+        break;
+    case 0xee:
+        reply(KBD_ECHO);
+        break;
+    case 0xf2:
+        // MF2 keyboard
+        reply(KBD_ACK);
+        reply(0xab);
+        reply(0x83);
+        break;
+    case 0xf4:
+        scanning = true;
+        reply(KBD_ACK);
+        break;
+    case 0xf5:
+        scanning = false;
+        reply(KBD_ACK);
+        break;
+    case 0xf6:
+        scanning = true;
+        scancode_set = 2;
+        reply(KBD_ACK);
+        break;
+    case 0xf7:
+    case 0xf8:
+    case 0xf9:
+    case 0xfa:
+    case 0xfb:
+    case 0xfc:
+    case 0xfd:
+        reply(KBD_ACK);
+        break;
+    case 0xff:
+        scanning = true;
+        scancode_set = 2;
+        pending_scancode = 0;
+        reply(KBD_ACK);
+        reply(KBD_SELF_TEST_OK);
+        break;
+    default:
+        reply(KBD_RESEND);
+        break;
+    }
+}
+
+void I8042::reply(uint8_t value, bool aux)
+{
+    replies.push_back(value | (aux ? I8042_REPLY_AUX : 0));
+    fill_output();
+}
+
+void I8042::fill_output()
+{
+    if (status & I8042_STATUS_OBF) {
+        return;
+    }
+
+    bool aux = false;
+    if (!replies.empty()) {
+        aux = (replies.front() & I8042_REPLY_AUX) != 0;
+        output = replies.front();
+        replies.pop_front();
+    } else if (pending_scancode != 0) {
+        output = pending_scancode;
+        pending_scancode = 0;
+    } else {
+        uint8_t code;
+        if (!scanning || (command_byte & I8042_CCB_KBD_DISABLE)
+                || !pop_input(&code)) {
+            return;
+        }
+
+        // Set 1 goes out as queued; set 2 marks releases with a prefix
+        if ((command_byte & I8042_CCB_TRANSLATE) || scancode_set == 1
+                || code == KEY_EXTENDED) {
+            output = code;
+        } else {
+            uint8_t set2 = (code & ~KEY_RELEASE) < sizeof(set2_codes)
+                ? set2_codes[code & ~KEY_RELEASE] : 0;
+            if (code & KEY_RELEASE) {
+                output = 0xf0;
+                pending_scancode = set2;
+            } else {
+                output = set2;
+            }
+        }
+    }
+
+    status |= I8042_STATUS_OBF;
+    if (aux) {
+        status |= I8042_STATUS_AUX_OBF;
+    } else if (command_byte & I8042_CCB_KBD_IRQ) {
+        irq_raised = true;
+    }
+    bytes_sent++;
+}
+
+bool I8042::poll_irq()
+{
+    fill_output();
+    if (!irq_raised) {
+        return false;
+    }
+
+    irq_raised = false;
+    irqs++;
+    if (pic != NULL) {
+        pic->push_irq(I8042_IRQ);
+    }
+
+    return true;
+}
+
+void I8042::reset_cpu()
+{
+    resets++;
+    if (cpu != NULL) {
+        cpu->request_reset();
+    }
+}
+
+bool I8042::queue_input(const uint8_t *data, uint32_t length)
+{
+    uint32_t head = __atomic_load_n(&input_head, __ATOMIC_RELAXED);
+    uint32_t tail = __atomic_load_n(&input_tail, __ATOMIC_ACQUIRE);
+    if (head - tail + length > I8042_QUEUE_SIZE) {
+        return false;
+    }
+
+    for (uint32_t i = 0; i < length; i++) {
+        input[(head + i) % I8042_QUEUE_SIZE] = data[i];
+    }
+    __atomic_store_n(&input_head, head + length, __ATOMIC_RELEASE);
+
+    return true;
+}
+
+bool I8042::pop_input(uint8_t *value)
+{
+    uint32_t tail = __atomic_load_n(&input_tail, __ATOMIC_RELAXED);
+    if (tail == __atomic_load_n(&input_head, __ATOMIC_ACQUIRE)) {
+        return false;
+    }
+
+    *value = input[tail % I8042_QUEUE_SIZE];
+    __atomic_store_n(&input_tail, tail + 1, __ATOMIC_RELEASE);
+
+    return true;
+}
+
+bool I8042::send_input(const uint8_t *data, uint32_t length)
+{
+    // Under record/replay, input reaches the guest at a logged point
+    if (replay_mode != REPLAY_OFF) {
+        replay_queue_input(this, data, length);
+        return true;
+    }
+
+    if (!queue_input(data, length)) {
+        return false;
+    }
+    if (cpu != NULL) {
+        cpu->kick();
+    }
+
+    return true;
+}
+
+bool I8042::queue_key(uint8_t code, bool extended, bool release)
+{
+    uint8_t data[2];
+    uint32_t length = 0;
+    if (extended) {
+        data[length++] = KEY_EXTENDED;
+    }
+    data[length++] = (code & ~KEY_RELEASE) | (release ? KEY_RELEASE : 0);
+
+    return send_input(data, length);
+}
+
+void I8042::receive(const uint8_t *data, uint32_t length)
+{
+    for (uint32_t i = 0; i < length; i++) {
+        uint8_t c = data[i];
+        uint8_t code = 0;
+        bool shift = false;
+        bool ctrl = false;
+
+        if (c == '\r' || c == '\n') {
+            code = KEY_ENTER;
+        } else if (c == '\t') {
+            code = KEY_TAB;
+        } else if (c == '\b' || c == 0x7f) {
+            code = KEY_BACKSPACE;
+        } else if (c == 0x1b) {
+            code = KEY_ESCAPE;
+        } else if (c >= 0x01 && c <= 0x1a) {
+            // Control-letter
+            ctrl = find_key('a' + c - 1, &code, &shift);
+        } else if (!find_key(c, &code, &shift)) {
+            code = 0;
+        }
+        if (code == 0) {
+            continue;
+        }
+
+        // Whole keystroke at once, so a full queue doesn't leave a
+        // modifier held down
+        uint8_t keys[6];
+        uint32_t count = 0;
+        if (ctrl) {
+            keys[count++] = KEY_CTRL;
+        }
+        if (shift) {
+            keys[count++] = KEY_SHIFT;
+        }
+        keys[count++] = code;
+        keys[count++] = code | KEY_RELEASE;
+        if (shift) {
+            keys[count++] = KEY_SHIFT | KEY_RELEASE;
+        }
+        if (ctrl) {
+            keys[count++] = KEY_CTRL | KEY_RELEASE;
+        }
+        if (!send_input(keys, count)) {
+            __atomic_fetch_add(&keys_dropped, 1, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+void I8042::replay_input(const uint8_t *data, uint32_t length)
+{
+    queue_input(data, length);
+}
+
+bool I8042::get_a20()
+{
+    return a20;
+}
+
+void I8042::debug_status()
+{
+    printf("I8042: A20 %s, command byte 0x%02x, %llu bytes sent, %llu IRQs, "
+            "%llu resets, %u typed keys dropped\n", a20 ? "on" : "off",
+            command_byte, (unsigned long long)bytes_sent,
+            (unsigned long long)irqs, (unsigned long long)resets,
+            __atomic_load_n(&keys_dropped, __ATOMIC_RELAXED));
+}
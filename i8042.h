@@ -0,0 +1,123 @@
+#ifndef __I8042_H__
+#define __I8042_H__
+
+#include <stdint.h>
+#include <deque>
+
+#include "io_device.h"
+#include "pic.h"
+#include "replay.h"
+
+class CPU;
+
+#define I8042_DATA_PORT         (0x60)
+#define I8042_COMMAND_PORT      (0x64)
+// System control port A: fast A20 gate and fast reset
+#define I8042_PORT_A            (0x92)
+#define I8042_IRQ               (1)
+// Host input not yet taken by the keyboard [bytes], a power of two
+#define I8042_QUEUE_SIZE        (256)
+
+// Status register
+#define I8042_STATUS_OBF        (0x01)
+#define I8042_STATUS_SYS        (0x04)
+#define I8042_STATUS_COMMAND    (0x08)
+#define I8042_STATUS_UNLOCKED   (0x10)
+#define I8042_STATUS_AUX_OBF    (0x20)
+
+// Controller command byte
+#define I8042_CCB_KBD_IRQ       (0x01)
+#define I8042_CCB_SYS           (0x04)
+#define I8042_CCB_KBD_DISABLE   (0x10)
+#define I8042_CCB_AUX_DISABLE   (0x20)
+#define I8042_CCB_TRANSLATE     (0x40)
+
+// Output port and port A bits
+#define I8042_OUT_RESET         (0x01)
+#define I8042_OUT_A20           (0x02)
+
+// Keyboard controller with a PS/2 keyboard on its first port and nothing
+// on the auxiliary one.
+//
+// Host input is queued as scancode set 1 bytes (0xe0 prefix, bit 7 for
+// release) in a ring with one producer and the vCPU thread as consumer,
+// so that a terminal or test script can type without taking locks on the
+// guest's path. The keyboard sends them on in set 2 unless the command
+// byte asks the controller to translate to set 1, as BIOSes do.
+//
+// The A20 gate is tracked for the guest to read back, but memory above
+// 1 MB is never wrapped; guest RAM is mapped flat.
+class I8042 : public IODevice, public ReplayInput {
+public:
+    I8042();
+    void write(uint32_t port, const uint32_t *value, uint8_t size);
+    void read(uint32_t port, uint32_t *value, uint8_t size);
+    bool poll_irq();
+    // Controller and keyboard back to power-on, port A reset bit clear.
+    // Host input already queued is kept.
+    void reset();
+    void connect_pic(PIC *pic);
+    // CPU to reset, and to wake when input arrives
+    void connect_cpu(CPU *cpu);
+
+    // Queue a key press or release in set 1 terms. Return false if the
+    // queue is full. Only one host thread may queue input at a time.
+    bool queue_key(uint8_t code, bool extended, bool release);
+    // Type characters from a terminal or script on a US layout, with
+    // shift and control pressed as needed. Other bytes are dropped.
+    void receive(const uint8_t *data, uint32_t length);
+    void replay_input(const uint8_t *data, uint32_t length);
+
+    bool get_a20();
+    void debug_status();
+private:
+    // Queue set 1 bytes from the host, all or none, or hand them to the
+    // replay log
+    bool send_input(const uint8_t *data, uint32_t length);
+    bool queue_input(const uint8_t *data, uint32_t length);
+    bool pop_input(uint8_t *value);
+    void write_command(uint8_t value);
+    void write_data(uint8_t value);
+    void keyboard_command(uint8_t value);
+    void write_output_port(uint8_t value);
+    // Controller or keyboard reply, ahead of any scancodes
+    void reply(uint8_t value, bool aux = false);
+    // Load the next byte into the output buffer if it's empty
+    void fill_output();
+    void reset_cpu();
+
+    PIC *pic;
+    CPU *cpu;
+
+    uint8_t status;
+    uint8_t command_byte;
+    // Controller command waiting for its data byte, 0 if none
+    uint8_t pending_command;
+    uint8_t output;
+    bool irq_raised;
+    bool a20;
+    uint8_t port_a;
+    // Replies with I8042_REPLY_AUX for the auxiliary port
+    std::deque<uint16_t> replies;
+
+    // Keyboard
+    bool scanning;
+    uint8_t scancode_set;
+    // Keyboard command waiting for its argument, 0 if none
+    uint8_t pending_keyboard_command;
+    // Set 2 byte to send after a release prefix, 0 if none
+    uint8_t pending_scancode;
+
+    // Written by the host thread (head) and the vCPU thread (tail)
+    uint8_t input[I8042_QUEUE_SIZE];
+    uint32_t input_head;
+    uint32_t input_tail;
+    // Keystrokes from receive() that didn't fit
+    uint32_t keys_dropped;
+
+    uint64_t bytes_sent;
+    uint64_t irqs;
+    uint64_t resets;
+};
+
+#endif
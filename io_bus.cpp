@@ -0,0 +1,195 @@
+#include "io_bus.h"
+
+#include <stdio.h>
+
+#include "trace.h"
+
+IOBus::IOBus()
+{
+    for (int i = 0; i < IO_BUS_PORT_COUNT; i++) {
+        devices[i] = NULL;
+        stats_ids[i] = STATS_NO_DEVICE;
+    }
+    stats = NULL;
+}
+
+IOBus::~IOBus()
+{
+}
+
+void IOBus::connect_io_device(uint32_t base_port, uint32_t count,
+        IODevice *device)
+{
+    if (base_port + count > IO_BUS_PORT_COUNT) {
+        printf("IOBus: Invalid port range 0x%04x-0x%04x\n",
+                base_port, base_port + count - 1);
+        return;
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        devices[base_port + i] = device;
+    }
+    update_stats_ids(base_port, count);
+}
+
+void IOBus::disconnect_io_device(uint32_t base_port, uint32_t count)
+{
+    connect_io_device(base_port, count, NULL);
+}
+
+IODevice *IOBus::get_device(uint32_t port)
+{
+    return devices[port & (IO_BUS_PORT_COUNT - 1)];
+}
+
+void IOBus::connect_stats(Stats *stats)
+{
+    this->stats = stats;
+    update_stats_ids(0, IO_BUS_PORT_COUNT);
+}
+
+void IOBus::update_stats_ids(uint32_t base_port, uint32_t count)
+{
+    for (uint32_t i = base_port; i < base_port + count; i++) {
+        stats_ids[i] = stats != NULL && devices[i] != NULL
+            ? stats->get_device_id(devices[i], i) : STATS_NO_DEVICE;
+    }
+}
+
+void IOBus::write(uint32_t port, const uint32_t *value, uint8_t size)
+{
+    IODevice *device = get_device(port);
+    TRACE(TRACE_CAT_IO, TRACE_IO_WRITE, size, port, *value);
+    if (device == NULL) {
+        return;
+    }
+
+    if (stats == NULL) {
+        dispatch_write(device, port, value, size);
+        return;
+    }
+
+    uint64_t start = Stats::read_tsc();
+    dispatch_write(device, port, value, size);
+    port &= IO_BUS_PORT_COUNT - 1;
+    stats->record_io(port, true, stats_ids[port], 1,
+            Stats::read_tsc() - start);
+}
+
+void IOBus::read(uint32_t port, uint32_t *value, uint8_t size)
+{
+    IODevice *device = get_device(port);
+    // Reads from unconnected ports float high
+    *value = 0xffffffff >> ((4 - size) * 8);
+
+    if (device == NULL) {
+        TRACE(TRACE_CAT_IO, TRACE_IO_READ, size, port, *value);
+        return;
+    }
+
+    if (stats == NULL) {
+        dispatch_read(device, port, value, size);
+        TRACE(TRACE_CAT_IO, TRACE_IO_READ, size, port, *value);
+        return;
+    }
+
+    uint64_t start = Stats::read_tsc();
+    dispatch_read(device, port, value, size);
+    port &= IO_BUS_PORT_COUNT - 1;
+    stats->record_io(port, false, stats_ids[port], 1,
+            Stats::read_tsc() - start);
+    TRACE(TRACE_CAT_IO, TRACE_IO_READ, size, port, *value);
+}
+
+void IOBus::dispatch_write(IODevice *device, uint32_t port,
+        const uint32_t *value, uint8_t size)
+{
+    uint8_t width = device->access_width(port);
+    if (size <= width) {
+        device->write(port, value, size);
+        return;
+    }
+
+    // Narrow device on a wide access: each chunk goes to the next port
+    for (int i = 0; i < size; i += width) {
+        uint32_t chunk = (*value >> (i * 8)) & ((1ULL << (width * 8)) - 1);
+        device = get_device(port + i);
+        if (device != NULL) {
+            device->write(port + i, &chunk, width);
+        }
+    }
+}
+
+void IOBus::dispatch_read(IODevice *device, uint32_t port, uint32_t *value,
+        uint8_t size)
+{
+    uint8_t width = device->access_width(port);
+    if (size <= width) {
+        device->read(port, value, size);
+        return;
+    }
+
+    uint32_t result = 0;
+    for (int i = 0; i < size; i += width) {
+        uint32_t chunk = 0xffffffff >> ((4 - width) * 8);
+        device = get_device(port + i);
+        if (device != NULL) {
+            device->read(port + i, &chunk, width);
+        }
+        result |= (chunk & ((1ULL << (width * 8)) - 1)) << (i * 8);
+    }
+    *value = result;
+}
+
+void IOBus::write_block(uint32_t port, const uint8_t *data, uint8_t size,
+        uint32_t count)
+{
+    IODevice *device = get_device(port);
+    if (device == NULL) {
+        return;
+    }
+
+    if (size <= device->access_width(port)) {
+        uint64_t start = stats != NULL ? Stats::read_tsc() : 0;
+        device->write_block(port, data, size, count);
+        if (stats != NULL) {
+            port &= IO_BUS_PORT_COUNT - 1;
+            stats->record_io(port, true, stats_ids[port], count,
+                    Stats::read_tsc() - start);
+        }
+        return;
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t value = 0;
+        for (int j = 0; j < size; j++) {
+            value |= (uint32_t)data[i * size + j] << (j * 8);
+        }
+        write(port, &value, size);
+    }
+}
+
+void IOBus::read_block(uint32_t port, uint8_t *data, uint8_t size,
+        uint32_t count)
+{
+    IODevice *device = get_device(port);
+
+    if (device != NULL && size <= device->access_width(port)) {
+        uint64_t start = stats != NULL ? Stats::read_tsc() : 0;
+        device->read_block(port, data, size, count);
+        if (stats != NULL) {
+            port &= IO_BUS_PORT_COUNT - 1;
+            stats->record_io(port, false, stats_ids[port], count,
+                    Stats::read_tsc() - start);
+        }
+        return;
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t value;
+        read(port, &value, size);
+        for (int j = 0; j < size; j++) {
+            data[i * size + j] = (value >> (j * 8)) & 0xff;
+        }
+    }
+}
@@ -0,0 +1,43 @@
+#ifndef __IO_BUS_H__
+#define __IO_BUS_H__
+
+#include <stdint.h>
+
+#include "io_device.h"
+#include "stats.h"
+
+#define IO_BUS_PORT_COUNT   (0x10000)
+
+// Dispatches port I/O from the CPU to connected devices
+class IOBus {
+public:
+    IOBus();
+    ~IOBus();
+    void connect_io_device(uint32_t base_port, uint32_t count,
+            IODevice *device);
+    void disconnect_io_device(uint32_t base_port, uint32_t count);
+    IODevice *get_device(uint32_t port);
+    // Count accesses and time device handlers
+    void connect_stats(Stats *stats);
+
+    void write(uint32_t port, const uint32_t *value, uint8_t size);
+    void read(uint32_t port, uint32_t *value, uint8_t size);
+    // String I/O. data points into guest memory.
+    void write_block(uint32_t port, const uint8_t *data, uint8_t size,
+            uint32_t count);
+    void read_block(uint32_t port, uint8_t *data, uint8_t size,
+            uint32_t count);
+private:
+    void dispatch_write(IODevice *device, uint32_t port,
+            const uint32_t *value, uint8_t size);
+    void dispatch_read(IODevice *device, uint32_t port, uint32_t *value,
+            uint8_t size);
+    void update_stats_ids(uint32_t base_port, uint32_t count);
+
+    // One entry per port, so that dispatch is a single table lookup
+    IODevice *devices[IO_BUS_PORT_COUNT];
+    Stats *stats;
+    uint8_t stats_ids[IO_BUS_PORT_COUNT];
+};
+
+#endif
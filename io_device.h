@@ -1,13 +1,55 @@
 #ifndef __IO_DEVICE_H__
 #define __IO_DEVICE_H__
 
+#include <stdint.h>
+
 class IODevice {
 public:
     virtual ~IODevice() {}
     virtual void write(uint32_t port, const uint32_t *value, uint8_t size) = 0;
     virtual void read(uint32_t port, uint32_t *value, uint8_t size) = 0;
-    virtual bool poll_irq() {};
+    // Return true if the device has raised an IRQ
+    virtual bool poll_irq() { return false; };
+    // Widest access the device handles in one call at port. Wider accesses
+    // are split into consecutive ports by IOBus.
+    virtual uint8_t access_width(uint32_t) { return 1; };
+
+    // String I/O (REP OUTS/INS). data points to count elements of size
+    // bytes in guest memory. Devices override these to handle the whole
+    // string in one call.
+    virtual void write_block(uint32_t port, const uint8_t *data, uint8_t size,
+            uint32_t count)
+    {
+        for (uint32_t i = 0; i < count; i++) {
+            uint32_t value = 0;
+            for (int j = 0; j < size; j++) {
+                value |= (uint32_t)data[i * size + j] << (j * 8);
+            }
+            write(port, &value, size);
+        }
+    };
+    virtual void read_block(uint32_t port, uint8_t *data, uint8_t size,
+            uint32_t count)
+    {
+        for (uint32_t i = 0; i < count; i++) {
+            uint32_t value = 0;
+            read(port, &value, size);
+            for (int j = 0; j < size; j++) {
+                data[i * size + j] = (value >> (j * 8)) & 0xff;
+            }
+        }
+    };
 };
 
-#endif
+// Memory-mapped device. address is the guest physical address and size is
+// 1, 2, 4 or 8 bytes.
+class MMIODevice {
+public:
+    virtual ~MMIODevice() {}
+    virtual void mmio_write(uint64_t address, const uint64_t *value,
+            uint8_t size) = 0;
+    virtual void mmio_read(uint64_t address, uint64_t *value,
+            uint8_t size) = 0;
+};
 
+#endif
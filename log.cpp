@@ -0,0 +1,176 @@
+#include "log.h"
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+
+#include "host_clock.h"
+
+int log_level = LOG_LEVEL_INFO;
+
+static const char *level_names[] = {
+    "error",
+    "warn",
+    "info",
+    "debug",
+};
+
+// Formatted messages waiting for the flush thread
+static char queue[LOG_QUEUE_SIZE][LOG_MESSAGE_SIZE];
+static uint32_t queue_head = 0;
+static uint32_t queue_tail = 0;
+// Messages dropped because the queue was full
+static uint32_t queue_dropped = 0;
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+
+static FILE *output = NULL;
+static pthread_t flush_thread;
+static bool running = false;
+
+static void *flush_main(void *)
+{
+    char message[LOG_MESSAGE_SIZE];
+
+    pthread_mutex_lock(&queue_lock);
+    while (true) {
+        while (running && queue_head == queue_tail && queue_dropped == 0) {
+            pthread_cond_wait(&queue_cond, &queue_lock);
+        }
+        if (queue_head == queue_tail && queue_dropped == 0) {
+            break;
+        }
+
+        uint32_t dropped = queue_dropped;
+        queue_dropped = 0;
+        bool has_message = queue_head != queue_tail;
+        if (has_message) {
+            memcpy(message, queue[queue_tail % LOG_QUEUE_SIZE],
+                    LOG_MESSAGE_SIZE);
+            queue_tail++;
+        }
+
+        // Writing may block; don't hold up the vCPUs meanwhile
+        pthread_mutex_unlock(&queue_lock);
+        if (has_message) {
+            fputs(message, output);
+        }
+        if (dropped != 0) {
+            fprintf(output, "[warn] Log: %u messages dropped\n", dropped);
+        }
+        fflush(output);
+        pthread_mutex_lock(&queue_lock);
+    }
+    pthread_mutex_unlock(&queue_lock);
+
+    return NULL;
+}
+
+void log_init(FILE *file)
+{
+    pthread_mutex_lock(&queue_lock);
+    if (running) {
+        pthread_mutex_unlock(&queue_lock);
+        return;
+    }
+    output = file;
+    running = true;
+    pthread_mutex_unlock(&queue_lock);
+
+    if (pthread_create(&flush_thread, NULL, flush_main, NULL) != 0) {
+        printf("Log: Failed to create flush thread\n");
+        pthread_mutex_lock(&queue_lock);
+        running = false;
+        pthread_mutex_unlock(&queue_lock);
+    }
+}
+
+void log_shutdown()
+{
+    pthread_mutex_lock(&queue_lock);
+    if (!running) {
+        pthread_mutex_unlock(&queue_lock);
+        return;
+    }
+    running = false;
+    pthread_cond_signal(&queue_cond);
+    pthread_mutex_unlock(&queue_lock);
+
+    // Flush thread drains the queue before exiting
+    pthread_join(flush_thread, NULL);
+}
+
+void log_set_level(int level)
+{
+    log_level = level;
+}
+
+bool log_allow(log_site *site, uint32_t *suppressed)
+{
+    uint64_t now = host_clock_ns();
+    uint64_t start = __atomic_load_n(&site->window_start, __ATOMIC_RELAXED);
+
+    *suppressed = 0;
+
+    if (now - start >= LOG_RATE_INTERVAL) {
+        // New window; report what the previous one swallowed
+        __atomic_store_n(&site->window_start, now, __ATOMIC_RELAXED);
+        __atomic_store_n(&site->count, 1, __ATOMIC_RELAXED);
+        *suppressed = __atomic_exchange_n(&site->suppressed, 0,
+                __ATOMIC_RELAXED);
+        return true;
+    }
+
+    if (__atomic_fetch_add(&site->count, 1, __ATOMIC_RELAXED)
+            < LOG_RATE_BURST) {
+        return true;
+    }
+
+    __atomic_fetch_add(&site->suppressed, 1, __ATOMIC_RELAXED);
+    return false;
+}
+
+void log_write(int level, uint32_t suppressed, const char *format, ...)
+{
+    char message[LOG_MESSAGE_SIZE];
+    int length = snprintf(message, sizeof(message), "[%s] ",
+            level_names[level]);
+
+    va_list args;
+    va_start(args, format);
+    vsnprintf(message + length, sizeof(message) - length, format, args);
+    va_end(args);
+
+    // Messages carry their own newline, as printf callers did
+    length = strlen(message);
+    if (length > 0 && message[length - 1] == '\n') {
+        message[--length] = '\0';
+    }
+    if (suppressed != 0) {
+        snprintf(message + length, sizeof(message) - length,
+                " (%u similar messages suppressed)", suppressed);
+        length = strlen(message);
+    }
+    if (length == (int)sizeof(message) - 1) {
+        length--;
+    }
+    message[length] = '\n';
+    message[length + 1] = '\0';
+
+    pthread_mutex_lock(&queue_lock);
+    if (!running) {
+        pthread_mutex_unlock(&queue_lock);
+        fputs(message, stdout);
+        return;
+    }
+
+    if (queue_head - queue_tail < LOG_QUEUE_SIZE) {
+        memcpy(queue[queue_head % LOG_QUEUE_SIZE], message, length + 2);
+        queue_head++;
+    } else {
+        queue_dropped++;
+    }
+    pthread_cond_signal(&queue_cond);
+    pthread_mutex_unlock(&queue_lock);
+}
@@ -0,0 +1,60 @@
+#ifndef __LOG_H__
+#define __LOG_H__
+
+#include <stdint.h>
+#include <stdio.h>
+
+#define LOG_LEVEL_ERROR         (0)
+#define LOG_LEVEL_WARN          (1)
+#define LOG_LEVEL_INFO          (2)
+#define LOG_LEVEL_DEBUG         (3)
+
+// Levels above this are compiled out, arguments included
+#ifndef LOG_COMPILED_LEVEL
+#define LOG_COMPILED_LEVEL      LOG_LEVEL_INFO
+#endif
+
+// Each call site may emit LOG_RATE_BURST messages per LOG_RATE_INTERVAL
+#define LOG_RATE_BURST          (10)
+#define LOG_RATE_INTERVAL       (1000000000ULL)
+#define LOG_QUEUE_SIZE          (256)
+#define LOG_MESSAGE_SIZE        (160)
+
+// Rate limiting state, one per call site
+struct log_site {
+    uint64_t window_start;
+    uint32_t count;
+    uint32_t suppressed;
+};
+
+extern int log_level;
+
+#define LOG(level, ...) \
+    do { \
+        if ((level) <= LOG_COMPILED_LEVEL && (level) <= log_level) { \
+            static log_site site_; \
+            uint32_t suppressed_; \
+            if (log_allow(&site_, &suppressed_)) { \
+                log_write((level), suppressed_, __VA_ARGS__); \
+            } \
+        } \
+    } while (0)
+
+#define LOG_ERROR(...)  LOG(LOG_LEVEL_ERROR, __VA_ARGS__)
+#define LOG_WARN(...)   LOG(LOG_LEVEL_WARN, __VA_ARGS__)
+#define LOG_INFO(...)   LOG(LOG_LEVEL_INFO, __VA_ARGS__)
+#define LOG_DEBUG(...)  LOG(LOG_LEVEL_DEBUG, __VA_ARGS__)
+
+// Start the flush thread. Until then, messages are written synchronously.
+void log_init(FILE *file);
+// Flush queued messages and stop the flush thread
+void log_shutdown();
+void log_set_level(int level);
+
+// Return false if the site is over its rate. suppressed receives the
+// number of messages dropped since the last one that got through.
+bool log_allow(log_site *site, uint32_t *suppressed);
+void log_write(int level, uint32_t suppressed, const char *format, ...)
+    __attribute__((format(printf, 3, 4)));
+
+#endif
@@ -0,0 +1,313 @@
+#include "machine.h"
+
+#include <Hypervisor/hv.h>
+#include <stdio.h>
+
+#include "cow_image.h"
+#include "log.h"
+#include "trace.h"
+
+// Hypervisor.framework VMs belong to the process
+static bool vm_in_use = false;
+
+void HVFDirtyLog::write_protect(uint64_t address, uint64_t length)
+{
+    if (hv_vm_protect(address, length, HV_MEMORY_READ | HV_MEMORY_EXEC)
+            != HV_SUCCESS) {
+        LOG_ERROR("Machine: Failed to write-protect 0x%llx\n",
+                (unsigned long long)address);
+    }
+}
+
+void HVFDirtyLog::write_unprotect(uint64_t address, uint64_t length)
+{
+    if (hv_vm_protect(address, length,
+                HV_MEMORY_READ | HV_MEMORY_WRITE | HV_MEMORY_EXEC)
+            != HV_SUCCESS) {
+        LOG_ERROR("Machine: Failed to unprotect 0x%llx\n",
+                (unsigned long long)address);
+    }
+}
+
+Machine::Machine() : pic_slave(PIC_SLAVE_BASE_PORT)
+{
+    vm_created = false;
+    started = false;
+    memory = NULL;
+    pci_bus = NULL;
+    ata = NULL;
+    pci_ide = NULL;
+    disk = NULL;
+    zero_scanner = NULL;
+    vga = NULL;
+    hpet = NULL;
+    pvclock = NULL;
+    virtio_disk = NULL;
+    virtio_blk = NULL;
+    balloon = NULL;
+    serial = NULL;
+}
+
+Machine::~Machine()
+{
+    stop();
+
+    delete serial;
+    delete balloon;
+    delete virtio_blk;
+    delete virtio_disk;
+    delete pvclock;
+    delete hpet;
+    delete vga;
+    delete zero_scanner;
+    delete pci_ide;
+    delete ata;
+    delete pci_bus;
+    delete disk;
+
+    if (vm_created) {
+        hv_vm_destroy();
+        __atomic_store_n(&vm_in_use, false, __ATOMIC_RELEASE);
+    }
+    delete memory;
+}
+
+bool Machine::init(const machine_config *config)
+{
+    if (__atomic_exchange_n(&vm_in_use, true, __ATOMIC_ACQ_REL)) {
+        printf("Machine: Only one VM per process is supported\n");
+        return false;
+    }
+    if (hv_vm_create(HV_VM_DEFAULT) != HV_SUCCESS) {
+        printf("Machine: Failed to create VM\n");
+        __atomic_store_n(&vm_in_use, false, __ATOMIC_RELEASE);
+        return false;
+    }
+    vm_created = true;
+
+    memory = new Memory(config->ram_size);
+    memory->load_bios(config->bios_path);
+    if (config->vga_bios_path != NULL) {
+        memory->load_vga_bios(config->vga_bios_path);
+    }
+    if (hv_vm_map(memory->get_pointer(0, config->ram_size), 0,
+                config->ram_size,
+                HV_MEMORY_READ | HV_MEMORY_WRITE | HV_MEMORY_EXEC)
+            != HV_SUCCESS) {
+        printf("Machine: Failed to map guest memory\n");
+        return false;
+    }
+    memory->connect_dirty_log(&dirty_log);
+
+    if (config->virtual_time) {
+        scheduler.set_clock_mode(EVENT_CLOCK_VIRTUAL);
+    }
+    pit.connect_scheduler(&scheduler);
+    pit.connect_pic(&pic);
+    cmos.connect_scheduler(&scheduler);
+
+    pic.connect_slave(&pic_slave);
+    pic.connect_io_device(PIT_IRQ_CH, &pit);
+    i8042.connect_pic(&pic);
+    i8042.connect_cpu(&cpu);
+    aio.connect_cpu(&cpu);
+    pic.connect_io_device(I8042_IRQ, &i8042);
+
+    io_bus.connect_io_device(PIC_BASE_PORT, 2, &pic);
+    io_bus.connect_io_device(PIC_SLAVE_BASE_PORT, 2, &pic_slave);
+    io_bus.connect_io_device(PIT_BASE_PORT, 4, &pit);
+    io_bus.connect_io_device(CMOS_BASE_PORT, 2, &cmos);
+    io_bus.connect_io_device(UART_BASE_PORT, 8, &uart);
+    io_bus.connect_io_device(DEBUG_OUTPUT_BASE_PORT, 1, &debug_output);
+    io_bus.connect_io_device(I8042_DATA_PORT, 1, &i8042);
+    io_bus.connect_io_device(I8042_COMMAND_PORT, 1, &i8042);
+    io_bus.connect_io_device(I8042_PORT_A, 1, &i8042);
+
+    vga = new VGA(memory, &scheduler);
+    io_bus.connect_io_device(VGA_BASE_PORT, VGA_PORT_COUNT, vga);
+
+    pci_bus = new PCIBus(&io_bus, memory);
+    io_bus.connect_io_device(PCI_CONFIG_ADDRESS_PORT, 8, pci_bus);
+    pci_bus->connect_cpu(&cpu);
+
+    if (config->disk_path != NULL) {
+        disk = open_block_image(config->disk_path, config->disk_read_only);
+        if (disk == NULL) {
+            return false;
+        }
+        ata = new ATA(memory, &aio);
+        pci_ide = new PCIIDE(ata);
+        ata->attach_disk(disk);
+        ata->connect_pic(&pic_slave);
+        pic_slave.connect_io_device(ATA_IRQ - PIC_IRQ_COUNT, ata);
+        io_bus.connect_io_device(ATA_BASE_PORT, 8, ata);
+        io_bus.connect_io_device(ATA_CONTROL_PORT, 1, ata);
+        pci_bus->connect_pci_device(pci_ide);
+    }
+
+    hpet = new HPET(&scheduler);
+    hpet->connect_pic(&pic);
+    memory->map_mmio(HPET_BASE_ADDRESS, HPET_MMIO_SIZE, hpet);
+
+    pvclock = new PVClock(memory, &scheduler);
+    cpu.connect_pvclock(pvclock);
+
+    if (config->virtio_disk_path != NULL) {
+        virtio_disk = open_block_image(config->virtio_disk_path,
+                config->disk_read_only);
+        if (virtio_disk == NULL) {
+            return false;
+        }
+        virtio_blk = new VirtioBlk(memory, MACHINE_VIRTIO_BLK_BASE, &aio,
+                virtio_disk, config->disk_read_only, 1);
+        virtio_blk->connect_pic(&pic_slave,
+                MACHINE_VIRTIO_BLK_IRQ - PIC_IRQ_COUNT);
+        memory->map_mmio(MACHINE_VIRTIO_BLK_BASE, VIRTIO_MMIO_SIZE,
+                virtio_blk);
+    }
+    if (config->balloon) {
+        balloon = new VirtioBalloon(memory, MACHINE_VIRTIO_BALLOON_BASE);
+        balloon->connect_pic(&pic_slave,
+                MACHINE_VIRTIO_BALLOON_IRQ - PIC_IRQ_COUNT);
+        memory->map_mmio(MACHINE_VIRTIO_BALLOON_BASE, VIRTIO_MMIO_SIZE,
+                balloon);
+    }
+
+    if (config->serial_fd >= 0) {
+        if (config->event_loop == NULL) {
+            printf("Machine: Serial fd needs an event loop\n");
+            return false;
+        }
+        serial = new FdCharBackend(config->serial_fd, config->event_loop);
+        serial->connect_uart(&uart);
+        serial->connect_cpu(&cpu);
+        uart.connect_backend(serial);
+    }
+
+    if (config->reclaim_memory) {
+        memory->set_mergeable(true);
+        zero_scanner = new ZeroPageScanner(memory, &scheduler, &aio);
+        zero_scanner->start();
+    }
+
+    io_bus.connect_stats(&stats);
+    cpu.connect_memory(memory);
+    cpu.connect_io_bus(&io_bus);
+    cpu.connect_pic(&pic);
+    cpu.connect_stats(&stats);
+    cpu.connect_scheduler(&scheduler);
+    cpu.connect_aio(&aio);
+    cpu.connect_reset_handler(this);
+
+    return true;
+}
+
+void Machine::connect_serial(CharBackend *backend)
+{
+    uart.connect_backend(backend);
+}
+
+void Machine::connect_display(TextDisplay *display)
+{
+    vga->connect_display(display);
+}
+
+void Machine::handle_reset()
+{
+    pit.reset();
+    uart.reset();
+    i8042.reset();
+    hpet->reset();
+    pvclock->reset();
+    if (ata != NULL) {
+        ata->reset();
+    }
+    if (virtio_blk != NULL) {
+        virtio_blk->reset_device();
+    }
+    if (balloon != NULL) {
+        balloon->reset_device();
+    }
+    // Last, so that nothing raised before the reset is left pending
+    pic.reset();
+    pic_slave.reset();
+}
+
+void *Machine::vcpu_main(void *arg)
+{
+    Machine *machine = (Machine*)arg;
+
+    trace_register_vcpu(0);
+    if (machine->cpu.init()) {
+        machine->cpu.run();
+    }
+    machine->cpu.destroy();
+
+    return NULL;
+}
+
+bool Machine::start()
+{
+    if (!vm_created || started) {
+        return false;
+    }
+
+    if (pthread_create(&vcpu_thread, NULL, vcpu_main, this) != 0) {
+        printf("Machine: Failed to create vCPU thread\n");
+        return false;
+    }
+    started = true;
+
+    return true;
+}
+
+void Machine::stop()
+{
+    if (!started) {
+        return;
+    }
+
+    cpu.stop();
+    pthread_join(vcpu_thread, NULL);
+    started = false;
+}
+
+CPU *Machine::get_cpu()
+{
+    return &cpu;
+}
+
+Memory *Machine::get_memory()
+{
+    return memory;
+}
+
+UART *Machine::get_uart()
+{
+    return &uart;
+}
+
+I8042 *Machine::get_keyboard()
+{
+    return &i8042;
+}
+
+VGA *Machine::get_vga()
+{
+    return vga;
+}
+
+VirtioBalloon *Machine::get_balloon()
+{
+    return balloon;
+}
+
+Stats *Machine::get_stats()
+{
+    return &stats;
+}
+
+EventScheduler *Machine::get_scheduler()
+{
+    return &scheduler;
+}
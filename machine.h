@@ -0,0 +1,138 @@
+#ifndef __MACHINE_H__
+#define __MACHINE_H__
+
+#include <pthread.h>
+#include <stddef.h>
+
+#include "aio.h"
+#include "ata.h"
+#include "block.h"
+#include "char_backend.h"
+#include "cmos.h"
+#include "cpu.h"
+#include "debug_output.h"
+#include "event_loop.h"
+#include "event_scheduler.h"
+#include "hpet.h"
+#include "i8042.h"
+#include "io_bus.h"
+#include "memory.h"
+#include "pci.h"
+#include "pci_ide.h"
+#include "pic.h"
+#include "pit.h"
+#include "pvclock.h"
+#include "stats.h"
+#include "text_display.h"
+#include "uart.h"
+#include "vga.h"
+#include "virtio_balloon.h"
+#include "virtio_blk.h"
+#include "zero_page_scanner.h"
+
+// virtio-mmio devices, for the guest's kernel command line
+// (virtio_mmio.device=512@0xd0000000:10)
+#define MACHINE_VIRTIO_BLK_BASE     (0xd0000000)
+#define MACHINE_VIRTIO_BLK_IRQ      (10)
+#define MACHINE_VIRTIO_BALLOON_BASE (0xd0001000)
+#define MACHINE_VIRTIO_BALLOON_IRQ  (11)
+
+struct machine_config {
+    // Guest RAM [bytes]
+    size_t ram_size;
+    const char *bios_path;
+    // Option ROM loaded at 0xc0000 for video BIOS services, or NULL
+    const char *vga_bios_path;
+    // Disk image for the primary master, or NULL
+    const char *disk_path;
+    // Disk image for virtio-blk, or NULL
+    const char *virtio_disk_path;
+    // Open disk images read-only, and tell the guest so where the device
+    // can (virtio-blk)
+    bool disk_read_only;
+    bool virtual_time;
+    // Give zero pages back to the host, and let it merge identical ones
+    bool reclaim_memory;
+    // Add a virtio balloon
+    bool balloon;
+    // Serial line on this host fd (a socket or pty), read on event_loop,
+    // or -1. The machine takes ownership of it.
+    int serial_fd;
+    // Shared by all machines in the process; only needed for serial_fd
+    EventLoop *event_loop;
+};
+
+// Dirty log through EPT write protection
+class HVFDirtyLog : public DirtyLogBackend {
+public:
+    void write_protect(uint64_t address, uint64_t length);
+    void write_unprotect(uint64_t address, uint64_t length);
+};
+
+// One guest: its memory, devices and vCPU thread. Nothing in here is
+// global, so a process can hold several, but Hypervisor.framework only
+// allows one VM per process, so only one of them can be initialized at a
+// time.
+class Machine : public ResetHandler {
+public:
+    Machine();
+    ~Machine();
+    bool init(const machine_config *config);
+    // Serial output goes to the terminal unless connected
+    void connect_serial(CharBackend *backend);
+    // Draw the VGA text screen on display. Call between init() and
+    // start().
+    void connect_display(TextDisplay *display);
+    // Run the vCPU on its own thread
+    bool start();
+    // Stop the vCPU and wait for its thread
+    void stop();
+    // Devices back to power-on when the guest resets. CMOS and VGA keep
+    // their state, as they do on a PC.
+    void handle_reset();
+
+    CPU *get_cpu();
+    Memory *get_memory();
+    UART *get_uart();
+    I8042 *get_keyboard();
+    VGA *get_vga();
+    // NULL unless configured
+    VirtioBalloon *get_balloon();
+    Stats *get_stats();
+    EventScheduler *get_scheduler();
+private:
+    static void *vcpu_main(void *arg);
+
+    bool vm_created;
+    bool started;
+    pthread_t vcpu_thread;
+
+    Memory *memory;
+    HVFDirtyLog dirty_log;
+    Stats stats;
+    EventScheduler scheduler;
+    IOBus io_bus;
+    PIC pic;
+    PIC pic_slave;
+    PIT pit;
+    CMOS cmos;
+    UART uart;
+    I8042 i8042;
+    DebugOutput debug_output;
+    AsyncIO aio;
+    PCIBus *pci_bus;
+    ATA *ata;
+    PCIIDE *pci_ide;
+    BlockBackend *disk;
+    ZeroPageScanner *zero_scanner;
+    VGA *vga;
+    HPET *hpet;
+    PVClock *pvclock;
+    BlockBackend *virtio_disk;
+    VirtioBlk *virtio_blk;
+    VirtioBalloon *balloon;
+    FdCharBackend *serial;
+    CPU cpu;
+};
+
+#endif
@@ -1,42 +1,443 @@
 #include <stdio.h>
-#include <malloc.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
+#include "log.h"
 #include "memory.h"
 
+// Drop pages and their accounting. Linux zero-fills them on the next
+// access; macOS may keep the contents until it needs the memory.
+#ifdef MADV_FREE_REUSABLE
+#define MEMORY_MADV_DISCARD     (MADV_FREE_REUSABLE)
+#else
+#define MEMORY_MADV_DISCARD     (MADV_DONTNEED)
+#endif
+
+#ifdef __APPLE__
+typedef char mincore_vec_t;
+#else
+typedef unsigned char mincore_vec_t;
+#endif
+
 Memory::Memory(size_t size)
 {
-    memory = valloc(size);
+    memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON,
+            -1, 0);
+    if (memory == MAP_FAILED) {
+        printf("Memory: Failed to allocate %zu bytes\n", size);
+        memory = NULL;
+        size = 0;
+    }
+    this->size = size;
+    mmio_last_hit = 0;
+
+    size_t pages = (size + MEMORY_PAGE_SIZE - 1) >> MEMORY_PAGE_SHIFT;
+    dirty_bitmap.resize((pages + MEMORY_DIRTY_WORD_PAGES - 1)
+            / MEMORY_DIRTY_WORD_PAGES);
+    dirty_tracking = false;
+    dirty_log = NULL;
 }
 
 Memory::~Memory()
 {
-    free(memory);
+    if (memory != NULL) {
+        munmap(memory, size);
+    }
 }
 
-void Memory::load_file(const char *filename)
+bool Memory::load_file(const char *filename, uint64_t address,
+        bool align_end)
 {
     FILE *fp = fopen(filename, "rb");
     if (fp == NULL)
     {
         printf("Memory: Failed to load file '%s'\n", filename);
-        return;
+        return false;
     }
 
     fseek(fp, 0, SEEK_END);
     size_t size = ftell(fp);
 
+    void *p = NULL;
+    if (!align_end || size <= address) {
+        p = get_pointer(align_end ? address - size : address, size);
+    }
+    if (p == NULL) {
+        printf("Memory: File '%s' doesn't fit in RAM\n", filename);
+        fclose(fp);
+        return false;
+    }
+
+    // Map whole pages of the file copy-on-write, so that every VM booting
+    // the same image shares them through the page cache
+    long page_size = sysconf(_SC_PAGESIZE);
+    if ((uintptr_t)p % page_size == 0 && size % page_size == 0
+            && mmap(p, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED,
+                fileno(fp), 0) != MAP_FAILED) {
+        fclose(fp);
+        return true;
+    }
+
     fseek(fp, 0, SEEK_SET);
-    fread(memory, size, 1, fp);
+    bool ok = fread(p, size, 1, fp) == 1;
 
     fclose(fp);
+
+    return ok;
 }
 
 void Memory::load_bios(const char *filename)
 {
-    load_file(filename, )
+    load_file(filename, MEMORY_BIOS_END, true);
 }
 
 void Memory::load_vga_bios(const char *filename)
 {
+    load_file(filename, MEMORY_VGA_BIOS_BASE, false);
+}
+
+size_t Memory::get_size()
+{
+    return size;
+}
+
+void *Memory::get_pointer(uint64_t address, size_t length)
+{
+    if (address >= size || length > size - address) {
+        return NULL;
+    }
+
+    return (uint8_t*)memory + address;
+}
+
+uint64_t Memory::get_address(const void *pointer)
+{
+    return (const uint8_t*)pointer - (const uint8_t*)memory;
+}
+
+
+bool Memory::map_mmio(uint64_t base, uint64_t size, MMIODevice *device)
+{
+    std::vector<mmio_region>::iterator it = mmio_regions.begin();
+    while (it != mmio_regions.end() && it->base < base) {
+        it++;
+    }
+
+    // Reject overlap with neighbouring regions
+    if ((it != mmio_regions.end() && base + size > it->base)
+            || (it != mmio_regions.begin()
+                && (it - 1)->base + (it - 1)->size > base)) {
+        printf("Memory: MMIO region 0x%llx overlaps with another region\n",
+                (unsigned long long)base);
+        return false;
+    }
+
+    mmio_region region = {base, size, device};
+    mmio_regions.insert(it, region);
+    mmio_last_hit = 0;
+
+    return true;
+}
+
+void Memory::unmap_mmio(uint64_t base)
+{
+    for (std::vector<mmio_region>::iterator it = mmio_regions.begin();
+            it != mmio_regions.end(); it++) {
+        if (it->base == base) {
+            mmio_regions.erase(it);
+            mmio_last_hit = 0;
+            return;
+        }
+    }
+}
+
+mmio_region *Memory::find_mmio(uint64_t address)
+{
+    if (mmio_last_hit < mmio_regions.size()) {
+        mmio_region *region = &mmio_regions[mmio_last_hit];
+        if (address - region->base < region->size) {
+            return region;
+        }
+    }
+
+    // Binary search for the last region whose base <= address
+    size_t lo = 0;
+    size_t hi = mmio_regions.size();
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (mmio_regions[mid].base <= address) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    if (lo == 0) {
+        return NULL;
+    }
+
+    mmio_region *region = &mmio_regions[lo - 1];
+    if (address - region->base >= region->size) {
+        return NULL;
+    }
+
+    mmio_last_hit = lo - 1;
+    return region;
 }
 
+bool Memory::mmio_write(uint64_t address, const uint64_t *value, uint8_t size)
+{
+    mmio_region *region = find_mmio(address);
+    if (region == NULL) {
+        return false;
+    }
+
+    region->device->mmio_write(address, value, size);
+    return true;
+}
+
+bool Memory::mmio_read(uint64_t address, uint64_t *value, uint8_t size)
+{
+    mmio_region *region = find_mmio(address);
+    if (region == NULL) {
+        return false;
+    }
+
+    region->device->mmio_read(address, value, size);
+    return true;
+}
+
+void Memory::connect_dirty_log(DirtyLogBackend *backend)
+{
+    dirty_log = backend;
+}
+
+void Memory::start_dirty_tracking()
+{
+    size_t pages = (size + MEMORY_PAGE_SIZE - 1) >> MEMORY_PAGE_SHIFT;
+    for (size_t i = 0; i < dirty_bitmap.size(); i++) {
+        uint64_t bits = ~(uint64_t)0;
+        if (pages - i * MEMORY_DIRTY_WORD_PAGES < MEMORY_DIRTY_WORD_PAGES) {
+            bits = ((uint64_t)1 << (pages % MEMORY_DIRTY_WORD_PAGES)) - 1;
+        }
+        __atomic_store_n(&dirty_bitmap[i], bits, __ATOMIC_RELAXED);
+    }
+    // Nothing to protect yet: pages are write-protected as they are fetched
+    __atomic_store_n(&dirty_tracking, true, __ATOMIC_RELEASE);
+}
+
+void Memory::stop_dirty_tracking()
+{
+    if (!__atomic_exchange_n(&dirty_tracking, false, __ATOMIC_ACQ_REL)) {
+        return;
+    }
+    if (dirty_log != NULL) {
+        dirty_log->write_unprotect(0, size);
+    }
+}
+
+bool Memory::is_dirty_tracking()
+{
+    return __atomic_load_n(&dirty_tracking, __ATOMIC_ACQUIRE);
+}
+
+void Memory::mark_dirty_pages(uint64_t address, uint64_t length)
+{
+    if (length == 0 || address >= size) {
+        return;
+    }
+    if (length > size - address) {
+        length = size - address;
+    }
+
+    uint64_t first = address >> MEMORY_PAGE_SHIFT;
+    uint64_t last = (address + length - 1) >> MEMORY_PAGE_SHIFT;
+    for (uint64_t page = first; page <= last; page++) {
+        uint64_t *word = &dirty_bitmap[page / MEMORY_DIRTY_WORD_PAGES];
+        uint64_t bit = (uint64_t)1 << (page % MEMORY_DIRTY_WORD_PAGES);
+        // Plain load first, so that hot pages don't bounce the cache line
+        if (!(__atomic_load_n(word, __ATOMIC_RELAXED) & bit)) {
+            __atomic_fetch_or(word, bit, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+void Memory::mark_dirty_iov(const struct iovec *iov, int iovcnt)
+{
+    if (!__atomic_load_n(&dirty_tracking, __ATOMIC_RELAXED)) {
+        return;
+    }
+
+    for (int i = 0; i < iovcnt; i++) {
+        mark_dirty(get_address(iov[i].iov_base), iov[i].iov_len);
+    }
+}
+
+bool Memory::handle_write_fault(uint64_t address)
+{
+    if (!__atomic_load_n(&dirty_tracking, __ATOMIC_ACQUIRE)
+            || dirty_log == NULL || address >= size) {
+        return false;
+    }
+
+    // Unprotect before marking: a fetch in between then either sees the bit
+    // or protects the page again after it
+    uint64_t page = address & ~(uint64_t)(MEMORY_PAGE_SIZE - 1);
+    dirty_log->write_unprotect(page, MEMORY_PAGE_SIZE);
+    mark_dirty(page, MEMORY_PAGE_SIZE);
+
+    return true;
+}
+
+size_t Memory::get_dirty_word_count()
+{
+    return dirty_bitmap.size();
+}
+
+uint64_t Memory::fetch_dirty_word(size_t index)
+{
+    if (index >= dirty_bitmap.size()
+            || __atomic_load_n(&dirty_bitmap[index], __ATOMIC_RELAXED) == 0) {
+        return 0;
+    }
+
+    uint64_t bits = __atomic_exchange_n(&dirty_bitmap[index], 0,
+            __ATOMIC_ACQ_REL);
+    if (dirty_log == NULL) {
+        return bits;
+    }
+
+    // Protect each run of dirty pages with one call
+    uint64_t rest = bits;
+    while (rest != 0) {
+        int first = __builtin_ctzll(rest);
+        uint64_t shifted = ~(rest >> first);
+        int count = shifted == 0 ? 64 - first : __builtin_ctzll(shifted);
+        uint64_t page = index * MEMORY_DIRTY_WORD_PAGES + first;
+        dirty_log->write_protect(page << MEMORY_PAGE_SHIFT,
+                (uint64_t)count << MEMORY_PAGE_SHIFT);
+        rest &= count == 64 ? 0 : ~((((uint64_t)1 << count) - 1) << first);
+    }
+
+    return bits;
+}
+
+uint64_t Memory::count_dirty_pages()
+{
+    uint64_t count = 0;
+    for (size_t i = 0; i < dirty_bitmap.size(); i++) {
+        count += __builtin_popcountll(
+                __atomic_load_n(&dirty_bitmap[i], __ATOMIC_RELAXED));
+    }
+
+    return count;
+}
+
+void Memory::discard(uint64_t address, uint64_t length)
+{
+    void *p = get_pointer(address, length);
+    if (p == NULL || length == 0) {
+        return;
+    }
+
+    if (madvise(p, length, MEMORY_MADV_DISCARD) != 0) {
+        LOG_WARN("Memory: Failed to discard 0x%llx\n",
+                (unsigned long long)address);
+    }
+    // Contents may have changed to zero
+    mark_dirty(address, length);
+}
+
+uint64_t Memory::discard_zero_pages(uint64_t first_page, uint64_t count)
+{
+    uint64_t pages = get_page_count();
+    if (first_page >= pages) {
+        return 0;
+    }
+    if (count > pages - first_page) {
+        count = pages - first_page;
+    }
+
+    uint8_t *base = (uint8_t*)memory + (first_page << MEMORY_PAGE_SHIFT);
+    std::vector<mincore_vec_t> resident(count);
+    if (mincore(base, count << MEMORY_PAGE_SHIFT, resident.data()) != 0) {
+        return 0;
+    }
+
+    // Pages never touched cost nothing, and reading them would map them.
+    // Runs of zero pages go in one call.
+    uint64_t discarded = 0;
+    uint64_t run_start = 0;
+    uint64_t run_length = 0;
+    for (uint64_t i = 0; i <= count; i++) {
+        bool zero = i < count && (resident[i] & 1)
+            && is_zero_page(base + (i << MEMORY_PAGE_SHIFT));
+        if (zero) {
+            if (run_length == 0) {
+                run_start = i;
+            }
+            run_length++;
+            continue;
+        }
+        if (run_length > 0 && madvise(base + (run_start << MEMORY_PAGE_SHIFT),
+                    run_length << MEMORY_PAGE_SHIFT, MEMORY_MADV_DISCARD)
+                == 0) {
+            discarded += run_length;
+        }
+        run_length = 0;
+    }
+
+    return discarded;
+}
+
+bool Memory::set_mergeable(bool mergeable)
+{
+#ifdef MADV_MERGEABLE
+    if (memory != NULL && madvise(memory, size,
+                mergeable ? MADV_MERGEABLE : MADV_UNMERGEABLE) == 0) {
+        return true;
+    }
+#endif
+    printf("Memory: Page merging is unavailable\n");
+
+    return false;
+}
+
+uint64_t Memory::get_page_count()
+{
+    return size >> MEMORY_PAGE_SHIFT;
+}
+
+uint64_t Memory::count_resident_pages()
+{
+    std::vector<mincore_vec_t> resident(get_page_count());
+    if (memory == NULL || mincore(memory,
+                resident.size() << MEMORY_PAGE_SHIFT, resident.data()) != 0) {
+        return 0;
+    }
+
+    uint64_t count = 0;
+    for (size_t i = 0; i < resident.size(); i++) {
+        count += resident[i] & 1;
+    }
+
+    return count;
+}
+
+bool Memory::is_zero_page(const void *page)
+{
+    // OR a cache line at a time, so that the compiler can vectorize it
+    const uint64_t *words = (const uint64_t*)page;
+    for (int i = 0; i < MEMORY_PAGE_SIZE / 8; i += 8) {
+        uint64_t bits = 0;
+        for (int j = 0; j < 8; j++) {
+            bits |= words[i + j];
+        }
+        if (bits != 0) {
+            return false;
+        }
+    }
+
+    return true;
+}
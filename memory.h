@@ -1,14 +1,114 @@
 #ifndef __MEMORY_H__
 #define __MEMORY_H__
 
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+#include <vector>
+
+#include "io_device.h"
+
+// System BIOS ends at 1MB, and VGA BIOS starts at 0xc0000
+#define MEMORY_BIOS_END         (0x100000)
+#define MEMORY_VGA_BIOS_BASE    (0xc0000)
+// Granularity of dirty tracking
+#define MEMORY_PAGE_SHIFT       (12)
+#define MEMORY_PAGE_SIZE        (1 << MEMORY_PAGE_SHIFT)
+// Pages per dirty bitmap word
+#define MEMORY_DIRTY_WORD_PAGES (64)
+
+struct mmio_region {
+    uint64_t base;
+    uint64_t size;
+    MMIODevice *device;
+};
+
+// Write protection behind a hardware dirty log, e.g. EPT. Guest writes to
+// protected pages must fault into Memory::handle_write_fault.
+class DirtyLogBackend {
+public:
+    virtual ~DirtyLogBackend() {}
+    virtual void write_protect(uint64_t address, uint64_t length) = 0;
+    virtual void write_unprotect(uint64_t address, uint64_t length) = 0;
+};
+
 class Memory {
 public:
     Memory(size_t size);
     ~Memory();
     void load_bios(const char *filename);
     void load_vga_bios(const char *filename);
+    size_t get_size();
+    // Host pointer to guest physical range, or NULL if out of RAM
+    void *get_pointer(uint64_t address, size_t length);
+    // Guest physical address of a pointer from get_pointer
+    uint64_t get_address(const void *pointer);
+
+    // Route accesses to [base, base + size) to device
+    bool map_mmio(uint64_t base, uint64_t size, MMIODevice *device);
+    void unmap_mmio(uint64_t base);
+    // Region containing address, or NULL if it's not memory-mapped I/O
+    mmio_region *find_mmio(uint64_t address);
+    // Dispatch access to the device. Return false if address is not mapped.
+    bool mmio_write(uint64_t address, const uint64_t *value, uint8_t size);
+    bool mmio_read(uint64_t address, uint64_t *value, uint8_t size);
+
+    // Dirty page tracking, one bit per page. Guest writes are caught by the
+    // dirty log backend if connected, or reported through mark_dirty by a
+    // software CPU. Devices report their DMA writes through mark_dirty.
+    void connect_dirty_log(DirtyLogBackend *backend);
+    // Start tracking with every page dirty, so the first fetch sees all RAM
+    void start_dirty_tracking();
+    void stop_dirty_tracking();
+    bool is_dirty_tracking();
+    // Callable from any thread; no-op unless tracking
+    void mark_dirty(uint64_t address, uint64_t length)
+    {
+        if (__builtin_expect(__atomic_load_n(&dirty_tracking,
+                        __ATOMIC_RELAXED), 0)) {
+            mark_dirty_pages(address, length);
+        }
+    }
+    void mark_dirty_iov(const struct iovec *iov, int iovcnt);
+    // Guest write to a write-protected page. Return false if address is not
+    // tracked RAM.
+    bool handle_write_fault(uint64_t address);
+    size_t get_dirty_word_count();
+    // Atomically fetch and clear the dirty bits of pages [index * 64,
+    // index * 64 + 64), write-protecting them again so that the next write
+    // is seen. Read the pages only after this returns.
+    uint64_t fetch_dirty_word(size_t index);
+    uint64_t count_dirty_pages();
+
+    // Give a page-aligned range back to the host. Reads return zeros or the
+    // old contents afterwards, so only for pages that are zero or unused.
+    void discard(uint64_t address, uint64_t length);
+    // Discard the resident zero pages of [first_page, first_page + count).
+    // Nothing may write to them meanwhile. Return number of pages dropped.
+    uint64_t discard_zero_pages(uint64_t first_page, uint64_t count);
+    // Let the host merge identical pages between guests (Linux KSM).
+    // Return false where that's unsupported.
+    bool set_mergeable(bool mergeable);
+    uint64_t get_page_count();
+    // Pages backed by host memory
+    uint64_t count_resident_pages();
+    static bool is_zero_page(const void *page);
 private:
+    void mark_dirty_pages(uint64_t address, uint64_t length);
+    // Load file at address, or so that it ends at address if align_end
+    bool load_file(const char *filename, uint64_t address, bool align_end);
+
     void *memory;
-}
+    size_t size;
+
+    // MMIO regions sorted by base address
+    std::vector<mmio_region> mmio_regions;
+    // Index of last region found, since accesses tend to hit the same device
+    size_t mmio_last_hit;
+
+    bool dirty_tracking;
+    std::vector<uint64_t> dirty_bitmap;
+    DirtyLogBackend *dirty_log;
+};
 
 #endif
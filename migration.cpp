@@ -0,0 +1,193 @@
+#include "migration.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+static bool make_address(const char *path, struct sockaddr_un *address)
+{
+    if (strlen(path) >= sizeof(address->sun_path)) {
+        printf("Migration: Socket path %s is too long\n", path);
+        return false;
+    }
+
+    memset(address, 0, sizeof(*address));
+    address->sun_family = AF_UNIX;
+    strcpy(address->sun_path, path);
+
+    return true;
+}
+
+MigrationSender::MigrationSender(Memory *memory)
+{
+    this->memory = memory;
+    fd = -1;
+    rounds = 0;
+    last_round_pages = 0;
+    memset(&stats, 0, sizeof(stats));
+}
+
+MigrationSender::~MigrationSender()
+{
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+bool MigrationSender::connect(const char *path)
+{
+    struct sockaddr_un address;
+    if (!make_address(path, &address)) {
+        return false;
+    }
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || ::connect(fd, (struct sockaddr*)&address,
+                sizeof(address)) != 0) {
+        printf("Migration: Failed to connect to %s\n", path);
+        return false;
+    }
+#ifdef SO_NOSIGPIPE
+    // A receiver going away is an error, not a reason to die. Without
+    // SO_NOSIGPIPE (Linux) the writes pass MSG_NOSIGNAL instead.
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#endif
+
+    if (!snapshot_write_header(memory, fd)) {
+        printf("Migration: Failed to send header\n");
+        return false;
+    }
+
+    return true;
+}
+
+bool MigrationSender::precopy()
+{
+    if (fd < 0) {
+        return false;
+    }
+
+    // The first round starts dirty tracking and sends everything
+    while (rounds < MIGRATION_MAX_ROUNDS) {
+        uint64_t pages = stats.pages;
+        if (!snapshot_write_dirty(memory, fd, &stats)) {
+            printf("Migration: Failed to send round %d\n", rounds);
+            return false;
+        }
+        rounds++;
+        last_round_pages = stats.pages - pages;
+
+        // Stop once the rest is small, or when the guest dirties pages as
+        // fast as we send them and more rounds won't help
+        if (rounds > 1 && (last_round_pages < MIGRATION_MIN_DIRTY
+                    || memory->count_dirty_pages() >= last_round_pages)) {
+            break;
+        }
+    }
+
+    return true;
+}
+
+bool MigrationSender::complete()
+{
+    if (fd < 0) {
+        return false;
+    }
+
+    uint64_t pages = stats.pages;
+    uint8_t ack = 0;
+    bool ok = snapshot_write_dirty(memory, fd, &stats)
+        && snapshot_write_end(fd)
+        && read(fd, &ack, 1) == 1 && ack == MIGRATION_ACK;
+    last_round_pages = stats.pages - pages;
+    rounds++;
+
+    memory->stop_dirty_tracking();
+    close(fd);
+    fd = -1;
+
+    if (!ok) {
+        printf("Migration: Receiver didn't confirm\n");
+    }
+
+    return ok;
+}
+
+int MigrationSender::get_rounds()
+{
+    return rounds;
+}
+
+void MigrationSender::debug_status()
+{
+    printf("Migration: %d rounds, %llu pages (%llu zero), %llu bytes, "
+            "last round %llu pages\n", rounds,
+            (unsigned long long)stats.pages,
+            (unsigned long long)stats.zero_pages,
+            (unsigned long long)stats.bytes,
+            (unsigned long long)last_round_pages);
+}
+
+MigrationReceiver::MigrationReceiver(Memory *memory)
+{
+    this->memory = memory;
+    listen_fd = -1;
+}
+
+MigrationReceiver::~MigrationReceiver()
+{
+    if (listen_fd >= 0) {
+        close(listen_fd);
+        unlink(path.c_str());
+    }
+}
+
+bool MigrationReceiver::listen(const char *path)
+{
+    struct sockaddr_un address;
+    if (!make_address(path, &address)) {
+        return false;
+    }
+
+    listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(path);
+    if (listen_fd < 0 || bind(listen_fd, (struct sockaddr*)&address,
+                sizeof(address)) != 0 || ::listen(listen_fd, 1) != 0) {
+        printf("Migration: Failed to listen on %s\n", path);
+        if (listen_fd >= 0) {
+            close(listen_fd);
+            listen_fd = -1;
+        }
+        return false;
+    }
+    this->path = path;
+
+    return true;
+}
+
+bool MigrationReceiver::receive()
+{
+    if (listen_fd < 0) {
+        return false;
+    }
+
+    int fd = accept(listen_fd, NULL, NULL);
+    if (fd < 0) {
+        printf("Migration: Failed to accept on %s\n", path.c_str());
+        return false;
+    }
+
+    uint8_t ack = MIGRATION_ACK;
+#ifdef MSG_NOSIGNAL
+    bool ok = snapshot_read(memory, fd)
+        && send(fd, &ack, 1, MSG_NOSIGNAL) == 1;
+#else
+    bool ok = snapshot_read(memory, fd) && write(fd, &ack, 1) == 1;
+#endif
+    close(fd);
+
+    return ok;
+}
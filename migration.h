@@ -0,0 +1,55 @@
+#ifndef __MIGRATION_H__
+#define __MIGRATION_H__
+
+#include <stdint.h>
+#include <string>
+
+#include "memory.h"
+#include "snapshot.h"
+
+// Pre-copy rounds before giving up on convergence
+#define MIGRATION_MAX_ROUNDS    (30)
+// A round this small is cheap enough to send with the guest stopped
+#define MIGRATION_MIN_DIRTY     (256)
+// Receiver's reply once all of RAM arrived
+#define MIGRATION_ACK           (0x4b)
+
+// Sends guest RAM to a MigrationReceiver in another process on this host.
+// Device and vCPU state aren't covered; RAM is what takes the time.
+class MigrationSender {
+public:
+    MigrationSender(Memory *memory);
+    ~MigrationSender();
+    bool connect(const char *path);
+    // With the guest running: send all of RAM, then what the guest dirtied
+    // meanwhile, round after round until a round is small enough or
+    // MIGRATION_MAX_ROUNDS have gone by
+    bool precopy();
+    // With the guest stopped: send the remaining dirty pages and wait for
+    // the receiver to have them
+    bool complete();
+    int get_rounds();
+    void debug_status();
+private:
+    Memory *memory;
+    int fd;
+    int rounds;
+    uint64_t last_round_pages;
+    snapshot_stats stats;
+};
+
+class MigrationReceiver {
+public:
+    MigrationReceiver(Memory *memory);
+    ~MigrationReceiver();
+    // Bind path, so that a sender can connect from then on
+    bool listen(const char *path);
+    // Wait for a sender and write its pages to memory until it completes
+    bool receive();
+private:
+    Memory *memory;
+    int listen_fd;
+    std::string path;
+};
+
+#endif
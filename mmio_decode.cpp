@@ -0,0 +1,233 @@
+#include "mmio_decode.h"
+
+#include <string.h>
+
+#define REX_W                   (0x8)
+#define REX_R                   (0x4)
+
+// Skip a ModRM memory operand and whatever follows it up to the
+// immediate. Return false if it's a register operand or code ends early.
+static bool skip_modrm(const uint8_t *code, int length, int *pos,
+        int address_bits, uint8_t *reg)
+{
+    if (*pos >= length) {
+        return false;
+    }
+    uint8_t modrm = code[(*pos)++];
+    uint8_t mod = modrm >> 6;
+    uint8_t rm = modrm & 0x7;
+    *reg = (modrm >> 3) & 0x7;
+
+    // A register can't be MMIO
+    if (mod == 3) {
+        return false;
+    }
+
+    int displacement = 0;
+    if (address_bits == 16) {
+        if (mod == 1) {
+            displacement = 1;
+        } else if (mod == 2 || (mod == 0 && rm == 6)) {
+            displacement = 2;
+        }
+    } else {
+        if (rm == 4) {
+            if (*pos >= length) {
+                return false;
+            }
+            // No base register with mod 0 means a 32-bit displacement
+            uint8_t sib = code[(*pos)++];
+            if (mod == 0 && (sib & 0x7) == 5) {
+                displacement = 4;
+            }
+        }
+        if (mod == 1) {
+            displacement = 1;
+        } else if (mod == 2 || (mod == 0 && rm == 5)) {
+            displacement = 4;
+        }
+    }
+
+    *pos += displacement;
+    return *pos <= length;
+}
+
+// Little-endian immediate of size bytes, sign-extended to 64 bits
+static bool read_immediate(const uint8_t *code, int length, int *pos,
+        int size, uint64_t *value)
+{
+    if (*pos + size > length) {
+        return false;
+    }
+
+    uint64_t result = 0;
+    for (int i = 0; i < size; i++) {
+        result |= (uint64_t)code[*pos + i] << (i * 8);
+    }
+    if (size < 8 && (result >> (size * 8 - 1)) & 1) {
+        result |= ~0ULL << (size * 8);
+    }
+    *pos += size;
+    *value = result;
+
+    return true;
+}
+
+bool mmio_decode(const uint8_t *code, int length, int mode_bits,
+        mmio_instruction *insn)
+{
+    bool operand_override = false;
+    bool address_override = false;
+    uint8_t rex = 0;
+    int pos = 0;
+
+    memset(insn, 0, sizeof(*insn));
+    if (length > MMIO_DECODE_MAX_LENGTH) {
+        length = MMIO_DECODE_MAX_LENGTH;
+    }
+
+    // Segment overrides don't matter, the address is already known
+    for (; pos < length; pos++) {
+        uint8_t prefix = code[pos];
+        if (prefix == 0x66) {
+            operand_override = true;
+        } else if (prefix == 0x67) {
+            address_override = true;
+        } else if (prefix != 0x26 && prefix != 0x2e && prefix != 0x36
+                && prefix != 0x3e && prefix != 0x64 && prefix != 0x65) {
+            break;
+        }
+    }
+    // REX counts only right before the opcode
+    if (mode_bits == 64 && pos < length && (code[pos] & 0xf0) == 0x40) {
+        rex = code[pos++];
+    }
+    if (pos >= length) {
+        return false;
+    }
+
+    int operand_size;
+    int address_bits;
+    if (mode_bits == 16) {
+        operand_size = operand_override ? 4 : 2;
+        address_bits = address_override ? 32 : 16;
+    } else {
+        operand_size = operand_override ? 2 : 4;
+        address_bits = address_override ? mode_bits / 2 : mode_bits;
+    }
+    if (rex & REX_W) {
+        operand_size = 8;
+    }
+
+    uint8_t opcode = code[pos++];
+    uint8_t reg = 0;
+    switch (opcode) {
+    case 0x88:
+    case 0x89:
+    case 0x8a:
+    case 0x8b:
+        if (!skip_modrm(code, length, &pos, address_bits, &reg)) {
+            return false;
+        }
+        insn->op = opcode & 0x2 ? MMIO_OP_LOAD : MMIO_OP_STORE;
+        insn->size = opcode & 0x1 ? operand_size : 1;
+        insn->operand_size = insn->size;
+        insn->reg = reg | (rex & REX_R ? 8 : 0);
+        // Without REX, byte registers 4-7 are AH, CH, DH and BH
+        insn->high_byte = insn->size == 1 && rex == 0 && reg >= 4;
+        if (insn->high_byte) {
+            insn->reg -= 4;
+        }
+        break;
+    case 0xc6:
+    case 0xc7:
+        if (!skip_modrm(code, length, &pos, address_bits, &reg)
+                || reg != 0) {
+            return false;
+        }
+        insn->op = MMIO_OP_STORE;
+        insn->size = opcode == 0xc6 ? 1 : operand_size;
+        insn->operand_size = insn->size;
+        insn->has_immediate = true;
+        // 64-bit stores take a sign-extended 32-bit immediate
+        if (!read_immediate(code, length, &pos,
+                    insn->size == 8 ? 4 : insn->size, &insn->immediate)) {
+            return false;
+        }
+        break;
+    case 0xa0:
+    case 0xa1:
+    case 0xa2:
+    case 0xa3:
+        // Accumulator and an absolute address of the address size
+        insn->op = opcode & 0x2 ? MMIO_OP_STORE : MMIO_OP_LOAD;
+        insn->size = opcode & 0x1 ? operand_size : 1;
+        insn->operand_size = insn->size;
+        insn->reg = 0;
+        pos += address_bits / 8;
+        if (pos > length) {
+            return false;
+        }
+        break;
+    case 0x0f:
+        if (pos >= length) {
+            return false;
+        }
+        opcode = code[pos++];
+        if (opcode != 0xb6 && opcode != 0xb7 && opcode != 0xbe
+                && opcode != 0xbf) {
+            return false;
+        }
+        if (!skip_modrm(code, length, &pos, address_bits, &reg)) {
+            return false;
+        }
+        insn->op = MMIO_OP_LOAD;
+        insn->size = opcode & 0x1 ? 2 : 1;
+        insn->operand_size = operand_size;
+        insn->sign_extend = opcode >= 0xbe;
+        insn->reg = reg | (rex & REX_R ? 8 : 0);
+        break;
+    default:
+        return false;
+    }
+
+    insn->length = pos;
+
+    return true;
+}
+
+uint64_t mmio_store_value(const mmio_instruction *insn, uint64_t reg)
+{
+    uint64_t value = insn->has_immediate ? insn->immediate
+        : insn->high_byte ? reg >> 8 : reg;
+
+    return insn->size == 8 ? value : value & ((1ULL << (insn->size * 8)) - 1);
+}
+
+uint64_t mmio_load_result(const mmio_instruction *insn, uint64_t reg,
+        uint64_t value)
+{
+    int bits = insn->size * 8;
+    if (bits < 64) {
+        value &= (1ULL << bits) - 1;
+        if (insn->sign_extend && (value >> (bits - 1)) & 1) {
+            value |= ~0ULL << bits;
+        }
+    }
+
+    if (insn->high_byte) {
+        return (reg & ~0xff00ULL) | (value & 0xff) << 8;
+    }
+
+    switch (insn->operand_size) {
+    case 1:
+        return (reg & ~0xffULL) | (value & 0xff);
+    case 2:
+        return (reg & ~0xffffULL) | (value & 0xffff);
+    case 4:
+        // 32-bit results clear the upper half, as any 32-bit operation
+        return value & 0xffffffff;
+    }
+
+    return value;
+}
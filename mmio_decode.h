@@ -0,0 +1,48 @@
+#ifndef __MMIO_DECODE_H__
+#define __MMIO_DECODE_H__
+
+#include <stdint.h>
+
+// Longest x86 instruction [bytes]
+#define MMIO_DECODE_MAX_LENGTH  (15)
+
+typedef enum {
+    // Register or immediate to memory
+    MMIO_OP_STORE,
+    // Memory to register
+    MMIO_OP_LOAD,
+} mmio_op_t;
+
+// A MOV-family instruction whose memory operand hit MMIO. The address is
+// not decoded; the hardware reports it with the exit.
+struct mmio_instruction {
+    mmio_op_t op;
+    // Bytes accessed in memory
+    uint8_t size;
+    // Size of the register operand, wider than size for MOVZX and MOVSX
+    uint8_t operand_size;
+    bool sign_extend;
+    // General purpose register in the REX/ModRM numbering (0 = RAX), and
+    // whether it names AH, CH, DH or BH instead
+    uint8_t reg;
+    bool high_byte;
+    // Stored instead of a register
+    bool has_immediate;
+    uint64_t immediate;
+    // Instruction length, for advancing RIP
+    uint8_t length;
+};
+
+// Decode length bytes of code at RIP. mode_bits is 16, 32 or 64: the
+// default operand and address size of the code segment. Handles MOV to and
+// from memory (88, 89, 8a, 8b, c6, c7, a0-a3) and MOVZX/MOVSX loads.
+// Return false for anything else, or if code is cut short.
+bool mmio_decode(const uint8_t *code, int length, int mode_bits,
+        mmio_instruction *insn);
+// Value to store, given the register operand's current value
+uint64_t mmio_store_value(const mmio_instruction *insn, uint64_t reg);
+// Register operand after a load of value, given its current value
+uint64_t mmio_load_result(const mmio_instruction *insn, uint64_t reg,
+        uint64_t value);
+
+#endif
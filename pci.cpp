@@ -0,0 +1,377 @@
+#include "pci.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "log.h"
+
+PCIDevice::PCIDevice(uint16_t vendor_id, uint16_t device_id,
+        uint32_t class_code)
+{
+    bus = NULL;
+    has_msi = false;
+
+    memset(config, 0, sizeof(config));
+    memcpy(config + PCI_VENDOR_ID, &vendor_id, 2);
+    memcpy(config + PCI_DEVICE_ID, &device_id, 2);
+    // Class code is class, subclass and programming interface
+    config[PCI_CLASS_PROG] = class_code & 0xff;
+    config[PCI_CLASS_DEVICE] = (class_code >> 8) & 0xff;
+    config[PCI_CLASS_DEVICE + 1] = (class_code >> 16) & 0xff;
+
+    for (int i = 0; i < PCI_BAR_COUNT; i++) {
+        bars[i].type = PCI_BAR_NONE;
+        bars[i].size = 0;
+        bars[i].mapped_address = 0;
+        bars[i].io_device = NULL;
+        bars[i].mmio_device = NULL;
+    }
+}
+
+PCIDevice::~PCIDevice()
+{
+}
+
+void PCIDevice::add_io_bar(int bar, uint32_t size, IODevice *device)
+{
+    bars[bar].type = PCI_BAR_TYPE_IO;
+    bars[bar].size = size;
+    bars[bar].io_device = device;
+    config[PCI_BAR_0 + bar * 4] = PCI_BAR_IO;
+}
+
+void PCIDevice::add_mmio_bar(int bar, uint32_t size, MMIODevice *device)
+{
+    bars[bar].type = PCI_BAR_TYPE_MEM;
+    bars[bar].size = size;
+    bars[bar].mmio_device = device;
+}
+
+void PCIDevice::add_msi_capability()
+{
+    has_msi = true;
+
+    config[PCI_STATUS] |= PCI_STATUS_CAP_LIST;
+    config[PCI_CAPABILITY_LIST] = PCI_MSI_OFFSET;
+    config[PCI_MSI_OFFSET] = PCI_CAP_ID_MSI;
+    // No next capability; 32-bit address, single vector
+    config[PCI_MSI_OFFSET + 1] = 0;
+    config[PCI_MSI_OFFSET + 2] = 0;
+}
+
+void PCIDevice::set_interrupt_pin(uint8_t pin)
+{
+    config[PCI_INTERRUPT_PIN] = pin;
+}
+
+void PCIDevice::config_write(uint8_t offset, uint32_t value, uint8_t size)
+{
+    if (offset >= PCI_BAR_0 && offset < PCI_BAR_0 + PCI_BAR_COUNT * 4) {
+        int bar = (offset - PCI_BAR_0) / 4;
+        int shift = (offset & 0x3) * 8;
+        uint32_t mask = size == 4
+            ? 0xffffffff : ((1 << (size * 8)) - 1) << shift;
+        uint32_t current;
+        memcpy(&current, config + PCI_BAR_0 + bar * 4, 4);
+
+        write_bar(bar, (current & ~mask) | ((value << shift) & mask));
+        return;
+    }
+
+    // Only a few registers are writable; the rest describe the device
+    for (int i = 0; i < size && offset + i < PCI_CONFIG_SIZE; i++) {
+        uint8_t reg = offset + i;
+        uint8_t byte = (value >> (i * 8)) & 0xff;
+
+        switch (reg) {
+        case PCI_COMMAND:
+        case PCI_COMMAND + 1:
+        // Cache line size and latency timer
+        case 0x0c:
+        case 0x0d:
+        case PCI_INTERRUPT_LINE:
+            config[reg] = byte;
+            break;
+        default:
+            if (has_msi && reg == PCI_MSI_OFFSET + 2) {
+                config[reg] = byte & PCI_MSI_FLAGS_ENABLE;
+            } else if (has_msi && reg >= PCI_MSI_OFFSET + 4
+                    && reg < PCI_MSI_OFFSET + 0xa) {
+                // Message address and data
+                config[reg] = byte;
+            }
+            break;
+        }
+    }
+
+    if (offset <= PCI_COMMAND + 1 && offset + size > PCI_COMMAND) {
+        update_mappings();
+    }
+}
+
+uint32_t PCIDevice::config_read(uint8_t offset, uint8_t size)
+{
+    uint32_t value = 0;
+
+    if (offset + size > PCI_CONFIG_SIZE) {
+        return 0xffffffff;
+    }
+
+    memcpy(&value, config + offset, size);
+
+    return value;
+}
+
+bool PCIDevice::msi_enabled()
+{
+    return has_msi && (config[PCI_MSI_OFFSET + 2] & PCI_MSI_FLAGS_ENABLE);
+}
+
+bool PCIDevice::send_msi()
+{
+    if (!msi_enabled() || bus == NULL) {
+        return false;
+    }
+
+    // MSI is a memory write, so bus mastering must be enabled
+    if (!(config[PCI_COMMAND] & PCI_COMMAND_MASTER)) {
+        return true;
+    }
+
+    uint32_t address;
+    uint16_t data;
+    memcpy(&address, config + PCI_MSI_OFFSET + 4, 4);
+    memcpy(&data, config + PCI_MSI_OFFSET + 8, 2);
+
+    bus->deliver_msi(address, data);
+
+    return true;
+}
+
+void PCIDevice::write_bar(int bar, uint32_t value)
+{
+    uint32_t *reg = (uint32_t*)(config + PCI_BAR_0 + bar * 4);
+
+    switch (bars[bar].type) {
+    case PCI_BAR_NONE:
+        // Unimplemented BARs read as 0, which also tells their size
+        *reg = 0;
+        return;
+    case PCI_BAR_TYPE_IO:
+        *reg = (value & ~(bars[bar].size - 1)) | PCI_BAR_IO;
+        break;
+    case PCI_BAR_TYPE_MEM:
+        *reg = value & ~(bars[bar].size - 1) & ~0xf;
+        break;
+    }
+
+    update_mappings();
+}
+
+void PCIDevice::update_mappings()
+{
+    uint16_t command;
+    memcpy(&command, config + PCI_COMMAND, 2);
+
+    for (int i = 0; i < PCI_BAR_COUNT; i++) {
+        pci_bar *bar = &bars[i];
+        if (bar->type == PCI_BAR_NONE || bus == NULL) {
+            continue;
+        }
+
+        uint32_t reg;
+        memcpy(&reg, config + PCI_BAR_0 + i * 4, 4);
+
+        // While the guest is sizing the BAR, all address bits are set
+        uint64_t address = 0;
+        if (bar->type == PCI_BAR_TYPE_IO) {
+            address = reg & ~0x3;
+            if (!(command & PCI_COMMAND_IO) || address > 0xffff
+                    || address + bar->size > 0x10000) {
+                address = 0;
+            }
+        } else {
+            address = reg & ~0xf;
+            if (!(command & PCI_COMMAND_MEMORY)
+                    || address == (~(bar->size - 1) & ~0xfULL & 0xffffffff)) {
+                address = 0;
+            }
+        }
+
+        if (address == bar->mapped_address) {
+            continue;
+        }
+
+        if (bar->mapped_address != 0) {
+            if (bar->type == PCI_BAR_TYPE_IO) {
+                bus->unmap_io(bar->mapped_address, bar->size);
+            } else {
+                bus->unmap_mmio(bar->mapped_address);
+            }
+        }
+
+        if (address != 0) {
+            if (bar->type == PCI_BAR_TYPE_IO) {
+                bus->map_io(address, bar->size, bar->io_device);
+            } else {
+                bus->map_mmio(address, bar->size, bar->mmio_device);
+            }
+        }
+
+        bar->mapped_address = address;
+        bar_remapped(i, address);
+    }
+}
+
+PCIBus::PCIBus(IOBus *io_bus, Memory *memory)
+    // Intel 440FX
+    : host_bridge(0x8086, 0x1237, 0x060000)
+{
+    this->io_bus = io_bus;
+    this->memory = memory;
+    cpu = NULL;
+    config_address = 0;
+
+    for (int i = 0; i < PCI_SLOT_COUNT; i++) {
+        devices[i] = NULL;
+    }
+
+    host_bridge.bus = this;
+    devices[0] = &host_bridge;
+}
+
+PCIBus::~PCIBus()
+{
+}
+
+void PCIBus::write(uint32_t port, const uint32_t *value, uint8_t size)
+{
+    if (port == PCI_CONFIG_ADDRESS_PORT) {
+        if (size == 4) {
+            config_address = *value;
+        }
+        return;
+    }
+
+    if (port < PCI_CONFIG_DATA_PORT || !(config_address & 0x80000000)) {
+        return;
+    }
+
+    uint8_t bus_number = (config_address >> 16) & 0xff;
+    uint8_t slot = (config_address >> 11) & 0x1f;
+    uint8_t function = (config_address >> 8) & 0x7;
+    uint8_t offset = (config_address & 0xfc) + (port - PCI_CONFIG_DATA_PORT);
+
+    if (bus_number != 0 || function != 0 || devices[slot] == NULL) {
+        return;
+    }
+
+    devices[slot]->config_write(offset, *value, size);
+}
+
+void PCIBus::read(uint32_t port, uint32_t *value, uint8_t size)
+{
+    if (port == PCI_CONFIG_ADDRESS_PORT) {
+        *value = size == 4 ? config_address : 0xffffffff;
+        return;
+    }
+
+    // Missing devices read as all ones
+    *value = 0xffffffff >> ((4 - size) * 8);
+
+    if (port < PCI_CONFIG_DATA_PORT || !(config_address & 0x80000000)) {
+        return;
+    }
+
+    uint8_t bus_number = (config_address >> 16) & 0xff;
+    uint8_t slot = (config_address >> 11) & 0x1f;
+    uint8_t function = (config_address >> 8) & 0x7;
+    uint8_t offset = (config_address & 0xfc) + (port - PCI_CONFIG_DATA_PORT);
+
+    if (bus_number != 0 || function != 0 || devices[slot] == NULL) {
+        return;
+    }
+
+    *value = devices[slot]->config_read(offset, size);
+}
+
+int PCIBus::connect_pci_device(PCIDevice *device)
+{
+    for (int i = 1; i < PCI_SLOT_COUNT; i++) {
+        if (devices[i] == NULL) {
+            devices[i] = device;
+            device->bus = this;
+            return i;
+        }
+    }
+
+    printf("PCIBus: No free slot\n");
+    return -1;
+}
+
+void PCIBus::connect_cpu(CPU *cpu)
+{
+    this->cpu = cpu;
+}
+
+void PCIBus::map_io(uint32_t port, uint32_t size, IODevice *device)
+{
+    io_bus->connect_io_device(port, size, device);
+}
+
+void PCIBus::unmap_io(uint32_t port, uint32_t size)
+{
+    io_bus->disconnect_io_device(port, size);
+}
+
+void PCIBus::map_mmio(uint64_t address, uint32_t size, MMIODevice *device)
+{
+    memory->map_mmio(address, size, device);
+}
+
+void PCIBus::unmap_mmio(uint64_t address)
+{
+    memory->unmap_mmio(address);
+}
+
+void PCIBus::deliver_msi(uint64_t address, uint32_t data)
+{
+    if ((address & 0xfff00000) != PCI_MSI_ADDRESS_BASE) {
+        LOG_WARN("PCIBus: Invalid MSI address 0x%08llx\n",
+                (unsigned long long)address);
+        return;
+    }
+
+    // Fixed delivery to the only CPU; vector is the low byte of data
+    if (cpu != NULL) {
+        cpu->external_interrupt(data & 0xff);
+    }
+}
+
+void PCIBus::debug_status()
+{
+    printf("------------------------------\n");
+    printf("PCIBus:\n");
+    printf("Config address: 0x%08x\n", config_address);
+    for (int i = 0; i < PCI_SLOT_COUNT; i++) {
+        if (devices[i] == NULL) {
+            continue;
+        }
+        printf("%02x.0: %04x:%04x, class 0x%06x, command 0x%04x%s\n", i,
+                devices[i]->config_read(PCI_VENDOR_ID, 2),
+                devices[i]->config_read(PCI_DEVICE_ID, 2),
+                devices[i]->config_read(PCI_REVISION_ID, 4) >> 8,
+                devices[i]->config_read(PCI_COMMAND, 2),
+                devices[i]->msi_enabled() ? ", MSI" : "");
+        for (int j = 0; j < PCI_BAR_COUNT; j++) {
+            if (devices[i]->bars[j].type != PCI_BAR_NONE) {
+                printf("  BAR%d: %s 0x%08llx size 0x%x\n", j,
+                        devices[i]->bars[j].type == PCI_BAR_TYPE_IO
+                            ? "I/O" : "memory",
+                        (unsigned long long)devices[i]->bars[j].mapped_address,
+                        devices[i]->bars[j].size);
+            }
+        }
+    }
+    printf("------------------------------\n");
+}
@@ -0,0 +1,129 @@
+#ifndef __PCI_H__
+#define __PCI_H__
+
+#include <stdint.h>
+
+#include "cpu.h"
+#include "io_bus.h"
+#include "io_device.h"
+#include "memory.h"
+
+#define PCI_CONFIG_ADDRESS_PORT (0xcf8)
+#define PCI_CONFIG_DATA_PORT    (0xcfc)
+#define PCI_SLOT_COUNT          (32)
+#define PCI_CONFIG_SIZE         (256)
+#define PCI_BAR_COUNT           (6)
+
+// Configuration header offsets
+#define PCI_VENDOR_ID           (0x00)
+#define PCI_DEVICE_ID           (0x02)
+#define PCI_COMMAND             (0x04)
+#define PCI_STATUS              (0x06)
+#define PCI_REVISION_ID         (0x08)
+#define PCI_CLASS_PROG          (0x09)
+#define PCI_CLASS_DEVICE        (0x0a)
+#define PCI_HEADER_TYPE         (0x0e)
+#define PCI_BAR_0               (0x10)
+#define PCI_SUBSYSTEM_VENDOR_ID (0x2c)
+#define PCI_SUBSYSTEM_ID        (0x2e)
+#define PCI_CAPABILITY_LIST     (0x34)
+#define PCI_INTERRUPT_LINE      (0x3c)
+#define PCI_INTERRUPT_PIN       (0x3d)
+
+#define PCI_COMMAND_IO          (0x1)
+#define PCI_COMMAND_MEMORY      (0x2)
+#define PCI_COMMAND_MASTER      (0x4)
+#define PCI_STATUS_CAP_LIST     (0x10)
+
+#define PCI_BAR_IO              (0x1)
+#define PCI_BAR_MEM_64          (0x4)
+
+#define PCI_CAP_ID_MSI          (0x05)
+#define PCI_MSI_OFFSET          (0x50)
+#define PCI_MSI_FLAGS_ENABLE    (0x1)
+#define PCI_MSI_ADDRESS_BASE    (0xfee00000)
+
+class PCIBus;
+
+typedef enum {
+    PCI_BAR_NONE,
+    PCI_BAR_TYPE_IO,
+    PCI_BAR_TYPE_MEM,
+} pci_bar_type_t;
+
+struct pci_bar {
+    pci_bar_type_t type;
+    uint32_t size;
+    // Address currently routed to the device, 0 if unmapped
+    uint64_t mapped_address;
+    IODevice *io_device;
+    MMIODevice *mmio_device;
+};
+
+// Function 0 of a PCI device with a type 0 configuration header
+class PCIDevice {
+public:
+    PCIDevice(uint16_t vendor_id, uint16_t device_id, uint32_t class_code);
+    virtual ~PCIDevice();
+    // size must be a power of two
+    void add_io_bar(int bar, uint32_t size, IODevice *device);
+    void add_mmio_bar(int bar, uint32_t size, MMIODevice *device);
+    // No device in the machine adds one: MSI needs a local APIC, which
+    // isn't emulated, so guests never enable it
+    void add_msi_capability();
+    void set_interrupt_pin(uint8_t pin);
+
+    virtual void config_write(uint8_t offset, uint32_t value, uint8_t size);
+    virtual uint32_t config_read(uint8_t offset, uint8_t size);
+
+    bool msi_enabled();
+    // Signal interrupt through MSI. Return false if MSI is disabled.
+    bool send_msi();
+protected:
+    // Called after a BAR has been routed to a new address (0 if unmapped),
+    // for devices that decode absolute addresses
+    virtual void bar_remapped(int, uint64_t) {}
+
+    uint8_t config[PCI_CONFIG_SIZE];
+private:
+    friend class PCIBus;
+
+    void write_bar(int bar, uint32_t value);
+    // Route BARs according to their address and the command register
+    void update_mappings();
+
+    PCIBus *bus;
+    pci_bar bars[PCI_BAR_COUNT];
+    bool has_msi;
+};
+
+// Host bridge with configuration mechanism #1
+class PCIBus : public IODevice {
+public:
+    PCIBus(IOBus *io_bus, Memory *memory);
+    ~PCIBus();
+    void write(uint32_t port, const uint32_t *value, uint8_t size);
+    void read(uint32_t port, uint32_t *value, uint8_t size);
+    uint8_t access_width(uint32_t) { return 4; };
+    // Return slot number, or -1 if the bus is full
+    int connect_pci_device(PCIDevice *device);
+    void connect_cpu(CPU *cpu);
+    void debug_status();
+private:
+    friend class PCIDevice;
+
+    void map_io(uint32_t port, uint32_t size, IODevice *device);
+    void unmap_io(uint32_t port, uint32_t size);
+    void map_mmio(uint64_t address, uint32_t size, MMIODevice *device);
+    void unmap_mmio(uint64_t address);
+    void deliver_msi(uint64_t address, uint32_t data);
+
+    IOBus *io_bus;
+    Memory *memory;
+    CPU *cpu;
+    PCIDevice host_bridge;
+    PCIDevice *devices[PCI_SLOT_COUNT];
+    uint32_t config_address;
+};
+
+#endif
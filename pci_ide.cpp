@@ -0,0 +1,21 @@
+#include "pci_ide.h"
+
+PCIIDE::PCIIDE(ATA *ata)
+    // Intel 82371SB, mass storage IDE with bus mastering
+    : PCIDevice(0x8086, 0x7010, 0x010180)
+{
+    this->ata = ata;
+
+    add_io_bar(PCI_IDE_BMIDE_BAR, PCI_IDE_BMIDE_SIZE, ata);
+}
+
+PCIIDE::~PCIIDE()
+{
+}
+
+void PCIIDE::bar_remapped(int bar, uint64_t address)
+{
+    if (bar == PCI_IDE_BMIDE_BAR && address != 0) {
+        ata->set_bus_master_base(address);
+    }
+}
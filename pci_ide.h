@@ -0,0 +1,24 @@
+#ifndef __PCI_IDE_H__
+#define __PCI_IDE_H__
+
+#include <stdint.h>
+
+#include "ata.h"
+#include "pci.h"
+
+// PIIX3 IDE function. Legacy ports stay fixed; the bus master registers
+// follow BAR4.
+#define PCI_IDE_BMIDE_BAR       (4)
+#define PCI_IDE_BMIDE_SIZE      (16)
+
+class PCIIDE : public PCIDevice {
+public:
+    PCIIDE(ATA *ata);
+    ~PCIIDE();
+protected:
+    void bar_remapped(int bar, uint64_t address);
+private:
+    ATA *ata;
+};
+
+#endif
@@ -1,21 +1,36 @@
 #include "pic.h"
 
-PIC::PIC()
+#include <stdio.h>
+
+#include "log.h"
+#include "trace.h"
+
+PIC::PIC(uint32_t base_port)
+{
+    this->base_port = base_port;
+    slave = NULL;
+    for (int i = 0; i < PIC_IRQ_COUNT; i++) {
+        devices[i] = NULL;
+    }
+
+    reset();
+}
+
+void PIC::reset()
 {
     icw3_enabled = false;
     icw4_enabled = false;
+    aeoi_enabled = false;
+    rotation_enabled = false;
     data_is_irr = true;
     interrupt_vector_address = 0;
     status = PIC_STATUS_IDLE;
-    iir = imr = isr = 0;
+    irr = imr = isr = 0;
     top_priority_irq = 0;
-
-    for (int i = 0; i < PIC_IRQ_COUNT; i++) {
-        devices[i] = NULL;
-    }
+    last_irq = 0;
 }
 
-void connect_io_device(uint8_t irq_number, IODevice *device)
+void PIC::connect_io_device(uint8_t irq_number, IODevice *device)
 {
     if (irq_number >= PIC_IRQ_COUNT) {
         printf("PIC: Invalid IRQ number\n");
@@ -25,14 +40,19 @@ void connect_io_device(uint8_t irq_number, IODevice *device)
     devices[irq_number] = device;
 }
 
+void PIC::connect_slave(PIC *slave)
+{
+    this->slave = slave;
+}
+
 void PIC::write(uint32_t port, const uint32_t *value, uint8_t size)
 {
     if (size != 1) {
-        printf("PIC: PIC only supports single-byte R/W\n");
+        LOG_WARN("PIC: PIC only supports single-byte R/W\n");
         return;
     }
 
-    switch (port - PIC_BASE_PORT) {
+    switch (port - base_port) {
     case 0:
         write_command(*((uint8_t*)value));
         break;
@@ -45,11 +65,11 @@ void PIC::write(uint32_t port, const uint32_t *value, uint8_t size)
 void PIC::read(uint32_t port, uint32_t *value, uint8_t size)
 {
     if (size != 1) {
-        printf("PIC: PIC only supports single-byte R/W\n");
+        LOG_WARN("PIC: PIC only supports single-byte R/W\n");
         return;
     }
 
-    switch (port - PIC_BASE_PORT) {
+    switch (port - base_port) {
     case 0:
         *value = read_command();
         break;
@@ -71,27 +91,28 @@ uint8_t PIC::read_command()
 void PIC::write_command(uint8_t value)
 {
     // ICW1
-    if (value & 0x8 == 0x8) {
-        icw4_enabled = value & 0x1 != 0;
-        cascading_enabled = value & 0x2 == 0;
+    if ((value & 0x10) == 0x10) {
+        icw4_enabled = (value & 0x1) != 0;
+        icw3_enabled = (value & 0x2) == 0;
+        imr = isr = irr = 0;
         status = PIC_STATUS_ICW2;
     // OCW2
-    } else if (value & 0xc == 0x0) {
+    } else if ((value & 0x18) == 0x0) {
         uint8_t irq_number = value & 0x7;
         uint8_t command = value >> 5;
         ocw2(irq_number, command);
     // OCW3
-    } else if (value & 0xc == 0x4) {
-        if (value & 0x3 == 0x2) {
+    } else if ((value & 0x18) == 0x8) {
+        if ((value & 0x3) == 0x2) {
             data_is_irr = true;
-        } else if (value & 0x3 == 0x3) {
+        } else if ((value & 0x3) == 0x3) {
             data_is_irr = false;
         }
-        if (value & 0x60 == 0x60) {
-            printf("PIC: Special mask mode is not supported\n");
+        if ((value & 0x60) == 0x60) {
+            LOG_WARN("PIC: Special mask mode is not supported\n");
         }
     } else {
-        printf("PIC: Unknown command 0x%02x written\n", value);
+        LOG_WARN("PIC: Unknown command 0x%02x written\n", value);
     }
 }
 
@@ -123,6 +144,7 @@ void PIC::write_data(uint8_t value)
         break;
     // ICW4
     case PIC_STATUS_ICW4:
+        aeoi_enabled = (value & 0x2) != 0;
         status = PIC_STATUS_IDLE;
         break;
     }
@@ -133,7 +155,7 @@ uint8_t PIC::read_data()
     return imr;
 }
 
-void PIC::poll_irq()
+bool PIC::irq_pending()
 {
     // Update irq status of all connected devices
     // Each device will PIC::push_irq if needed
@@ -143,23 +165,79 @@ void PIC::poll_irq()
         }
     }
 
-    // Select which
-    uint8_t selected_irq = top_priority_irq;
+    // The slave's output is a level: it drops once the slave has nothing
+    // it would deliver
+    if (slave != NULL) {
+        if (slave->irq_pending()) {
+            push_irq(PIC_CASCADE_IRQ);
+        } else {
+            irr &= ~(1 << PIC_CASCADE_IRQ);
+        }
+    }
+
+    return select_irq() >= 0;
+}
+
+int PIC::select_irq()
+{
+    // Requests at or below the priority of one in service wait for its EOI
+    uint8_t irq = top_priority_irq;
     for (int i = 0; i < PIC_IRQ_COUNT; i++) {
-        if (irr & (1 << selected_irq)) {
-            break;
+        if (isr & (1 << irq)) {
+            return -1;
+        }
+        if (irr & (1 << irq)) {
+            return irq;
         }
 
-        selected_irq = (selected_irq + 1) % PIC_IRQ_COUNT;
+        irq = (irq + 1) % PIC_IRQ_COUNT;
     }
 
-    isr != 1 << selected_irq;
+    return -1;
+}
+
+bool PIC::poll_irq()
+{
+    if (!irq_pending()) {
+        return false;
+    }
+
+    uint8_t selected_irq = select_irq();
     irr &= ~(1 << selected_irq);
+    // Automatic EOI at the end of the acknowledge cycle
+    if (aeoi_enabled) {
+        if (rotation_enabled) {
+            top_priority_irq = (selected_irq + 1) % PIC_IRQ_COUNT;
+        }
+    } else {
+        isr |= 1 << selected_irq;
+    }
+    last_irq = selected_irq;
+    TRACE(TRACE_CAT_IRQ, TRACE_IRQ_ACK, 0, selected_irq, base_port);
+
+    // Slave acknowledges its own interrupt on the cascade cycle
+    if (selected_irq == PIC_CASCADE_IRQ && slave != NULL) {
+        slave->poll_irq();
+    }
+
+    return true;
 }
 
 void PIC::push_irq(uint8_t irq_number)
 {
     irr |= ~imr & (1 << irq_number);
+    TRACE(TRACE_CAT_IRQ, TRACE_IRQ_ASSERT, (imr >> irq_number) & 1,
+            irq_number, base_port);
+}
+
+uint8_t PIC::get_vector()
+{
+    // Slave supplies the vector of interrupts it cascades
+    if (slave != NULL && last_irq == PIC_CASCADE_IRQ) {
+        return slave->get_vector();
+    }
+
+    return (interrupt_vector_address & 0xf8) | last_irq;
 }
 
 void PIC::ocw2(uint8_t irq_number, uint8_t command)
@@ -171,18 +249,14 @@ void PIC::ocw2(uint8_t irq_number, uint8_t command)
         }
         break;
     case 1:
-        uint8_t selected_irq = top_priority_irq;
-        for (int i = 0; i < PIC_IRQ_COUNT; i++) {
-            if (isr & (1 << selected_irq)) {
-                isr &= ~(1 << selected_irq);
-            }
-        }
+        non_specific_eoi();
         rotation_enabled = false;
         break;
     case 2:
         break;
     case 3:
         isr &= ~(1 << irq_number);
+        TRACE(TRACE_CAT_IRQ, TRACE_IRQ_EOI, 0, irq_number, base_port);
         rotation_enabled = false;
         break;
     case 4:
@@ -191,12 +265,7 @@ void PIC::ocw2(uint8_t irq_number, uint8_t command)
         }
         break;
     case 5:
-        uint8_t selected_irq = top_priority_irq;
-        for (int i = 0; i < PIC_IRQ_COUNT; i++) {
-            if (isr & (1 << selected_irq)) {
-                isr &= ~(1 << selected_irq);
-            }
-        }
+        non_specific_eoi();
         rotation_enabled = true;
         break;
     case 6:
@@ -204,8 +273,25 @@ void PIC::ocw2(uint8_t irq_number, uint8_t command)
         break;
     case 7:
         isr &= ~(1 << irq_number);
+        TRACE(TRACE_CAT_IRQ, TRACE_IRQ_EOI, 0, irq_number, base_port);
         rotation_enabled = true;
         break;
     }
 }
 
+void PIC::non_specific_eoi()
+{
+    uint8_t selected_irq = top_priority_irq;
+    for (int i = 0; i < PIC_IRQ_COUNT; i++) {
+        if (isr & (1 << selected_irq)) {
+            isr &= ~(1 << selected_irq);
+            TRACE(TRACE_CAT_IRQ, TRACE_IRQ_EOI, 0, selected_irq, base_port);
+            if (rotation_enabled) {
+                top_priority_irq = (selected_irq + 1) % PIC_IRQ_COUNT;
+            }
+            return;
+        }
+
+        selected_irq = (selected_irq + 1) % PIC_IRQ_COUNT;
+    }
+}
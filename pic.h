@@ -1,10 +1,15 @@
 #ifndef __PIC_H__
 #define __PIC_H__
 
+#include <stdint.h>
+
 #include "io_device.h"
 
-#define PIC_BASE_PORT   (0x20)
-#define PIC_IRQ_COUNT   (8)
+#define PIC_BASE_PORT       (0x20)
+#define PIC_SLAVE_BASE_PORT (0xa0)
+#define PIC_IRQ_COUNT       (8)
+// IRQ line of the master that the slave is wired to
+#define PIC_CASCADE_IRQ     (2)
 
 typedef enum {
     PIC_STATUS_IDLE,
@@ -13,21 +18,39 @@ typedef enum {
     PIC_STATUS_ICW4,
 } pic_status_t;
 
-class PIC : IODevice {
+class PIC : public IODevice {
 public:
+    PIC(uint32_t base_port = PIC_BASE_PORT);
     void write(uint32_t port, const uint32_t *value, uint8_t size);
     void read(uint32_t port, uint32_t *value, uint8_t size);
-    void poll_irq();
+    // Back to the uninitialized state; connected devices stay
+    void reset();
+    // Acknowledge highest priority interrupt. Return false if none.
+    bool poll_irq();
+    // Poll devices without acknowledging anything. Return true if an
+    // interrupt could be acknowledged.
+    bool irq_pending();
 
     void push_irq(uint8_t irq_number);
+    // Vector of the interrupt last acknowledged by poll_irq
+    uint8_t get_vector();
     void connect_io_device(uint8_t irq_number, IODevice *device);
+    // Wire slave PIC to PIC_CASCADE_IRQ of this PIC
+    void connect_slave(PIC *slave);
 private:
     uint8_t read_command();
     uint8_t read_data();
     void write_command(uint8_t value);
     void write_data(uint8_t value);
+    void ocw2(uint8_t irq_number, uint8_t command);
+    // Clear highest priority bit in ISR
+    void non_specific_eoi();
+    // Highest priority IRR bit not blocked by ISR, or -1 if none
+    int select_irq();
 
+    uint32_t base_port;
     IODevice *devices[PIC_IRQ_COUNT];
+    PIC *slave;
     // Cascaded
     bool icw3_enabled;
     bool icw4_enabled;
@@ -38,9 +61,10 @@ private:
     uint8_t interrupt_vector_address;
     pic_status_t status;
     uint8_t top_priority_irq;
+    uint8_t last_irq;
 
     // Internal registers
-    uint8_t iir;
+    uint8_t irr;
     uint8_t imr;
     uint8_t isr;
 };
@@ -1,10 +1,26 @@
 #include "pit.h"
 
-#include <mach/clock.h>
-#include <mach/mach.h>
 #include <stdio.h>
 
+#include "host_clock.h"
+#include "log.h"
+#include "replay.h"
+
 PIT::PIT()
+{
+    scheduler = NULL;
+    pic = NULL;
+    reset();
+}
+
+PIT::~PIT()
+{
+    if (scheduler != NULL) {
+        scheduler->cancel(this);
+    }
+}
+
+void PIT::reset()
 {
     for (int i = 0; i < PIT_CH_COUNT; i++) {
         reload_values[i] = 0;
@@ -17,19 +33,33 @@ PIT::PIT()
         access_bytes[i] = 0;
     }
 
-    host_get_clock_service(mach_host_self(), CALENDAR_CLOCK, &clock_service);
     next_clock_time = get_real_time();
+    schedule_irq();
 }
 
-PIT::~PIT()
+void PIT::connect_scheduler(EventScheduler *scheduler)
 {
-    mach_port_deallocate(mach_task_self(), clock_service);
+    this->scheduler = scheduler;
+    next_clock_time = get_real_time();
+    schedule_irq();
+}
+
+void PIT::connect_pic(PIC *pic)
+{
+    this->pic = pic;
+    schedule_irq();
+}
+
+void PIT::handle_event(uint64_t)
+{
+    tick();
+    schedule_irq();
 }
 
 void PIT::write(uint32_t port, const uint32_t *value, uint8_t size)
 {
     if (size != 1) {
-        printf("PIT: PIT only supports single-byte R/W\n");
+        LOG_WARN("PIT: PIT only supports single-byte R/W\n");
         return;
     }
 
@@ -52,7 +82,7 @@ void PIT::write(uint32_t port, const uint32_t *value, uint8_t size)
 void PIT::read(uint32_t port, uint32_t *value, uint8_t size)
 {
     if (size != 1) {
-        printf("PIT: PIT only supports single-byte R/W\n");
+        LOG_WARN("PIT: PIT only supports single-byte R/W\n");
         return;
     }
 
@@ -67,7 +97,7 @@ void PIT::read(uint32_t port, uint32_t *value, uint8_t size)
         read_data(2, (uint8_t*)value);
         break;
     case 3:
-        printf("PIT: Control register is write only\n");
+        LOG_WARN("PIT: Control register is write only\n");
         break;
     }
 }
@@ -75,80 +105,101 @@ void PIT::read(uint32_t port, uint32_t *value, uint8_t size)
 bool PIT::poll_irq()
 {
     tick();
+
+    return false;
 }
 
 void PIT::tick()
 {
     uint64_t current_time = get_real_time();
-    // Elapsed time [ns] since the time event should have been occured
-    uint64_t elapsed_time = current_time - next_clock_time;
-    // Elapsed time counverted to clock counts
-    uint64_t clocks = elapsed_time * PIT_CLOCK_FREQ / PIT_S_IN_NS;
+    if (current_time <= next_clock_time) {
+        return;
+    }
 
-    if (current_time <= next_clock_time)
-    {
+    // Whole clocks only; the rest of the elapsed time carries over
+    uint64_t clocks = (current_time - next_clock_time) * PIT_CLOCK_FREQ
+        / PIT_S_IN_NS;
+    if (clocks == 0) {
         return;
     }
+    next_clock_time += clocks * PIT_S_IN_NS / PIT_CLOCK_FREQ;
 
+    bool irq = false;
     for (int i = 0; i < PIT_CH_COUNT; i++) {
         if (!is_running[i]) {
             continue;
         }
-        tick_counter(i, clocks);
+        if (tick_counter(i, clocks) && i == PIT_IRQ_CH) {
+            irq = true;
+        }
     }
 
-    next_clock_time = current_time + elapsed_time;
+    if (irq) {
+        // Expirations since the last tick collapse into one edge
+        if (pic != NULL) {
+            pic->push_irq(PIT_IRQ_CH);
+        }
+        schedule_irq();
+    }
 }
 
-void PIT::tick_counter(int ch, uint64_t clocks)
+bool PIT::tick_counter(int ch, uint64_t clocks)
 {
-    uint16_t steps = clocks % reload_values[ch];
-
-    if (current_values[ch] <= steps) {
-        // Reload counter value
-        current_values[ch] = reload_values[ch] + (current_values[ch] - steps)
-            % reload_values[ch];
+    uint32_t period = reload_values[ch] != 0 ? reload_values[ch]
+        : PIT_MAX_COUNT;
 
-        if (ch == PIT_IRQ_CH) {
-            // TODO do IRQ
+    if (clocks < current_values[ch]) {
+        current_values[ch] -= clocks;
+        if (operating_modes[ch] == PIT_OPERATING_MODE_3) {
+            output[ch] = current_values[ch] > period / 2;
         }
+        return false;
+    }
 
-        switch (operating_modes[ch]) {
-        case PIT_OPERATING_MODE_0:
-            output[ch] = true;
-            // Counter should continue counting, but we ignore it
-            is_running[ch] = false;
-            break;
-        case PIT_OPERATING_MODE_2:
-            // Output should go LOW for 1 CLK, but we just ignore it
-            break;
-        case PIT_OPERATING_MODE_3:
-            output[ch] = !output[ch];
-            break;
-        }
-    } else {
-        switch (operating_modes[ch]) {
-        case PIT_OPERATING_MODE_0:
-            break;
-        case PIT_OPERATING_MODE_2:
-            break;
-        case PIT_OPERATING_MODE_3:
-            if (current_values[ch] > reload_values[ch] / 2
-                    && current_values[ch] - steps <= reload_values[ch] / 2) {
-                output[ch] = !output[ch];
-            }
-            break;
-        }
-        current_values[ch] -= steps;
+    switch (operating_modes[ch]) {
+    case PIT_OPERATING_MODE_0:
+        output[ch] = true;
+        // Counter should continue counting, but we ignore it
+        current_values[ch] = 0;
+        is_running[ch] = false;
+        break;
+    case PIT_OPERATING_MODE_2:
+        // Output should go LOW for 1 CLK, but we just ignore it
+        current_values[ch] = period - (clocks - current_values[ch]) % period;
+        break;
+    case PIT_OPERATING_MODE_3:
+        current_values[ch] = period - (clocks - current_values[ch]) % period;
+        output[ch] = current_values[ch] > period / 2;
+        break;
     }
+
+    return true;
+}
+
+void PIT::schedule_irq()
+{
+    if (scheduler == NULL || pic == NULL) {
+        return;
+    }
+
+    if (!is_running[PIT_IRQ_CH]) {
+        scheduler->cancel(this);
+        return;
+    }
+
+    // Round up, so that tick() finds the count expired when it fires
+    uint64_t clocks = current_values[PIT_IRQ_CH];
+    scheduler->schedule(this, next_clock_time
+            + (clocks * PIT_S_IN_NS + PIT_CLOCK_FREQ - 1) / PIT_CLOCK_FREQ);
 }
 
 uint64_t PIT::get_real_time()
 {
-    mach_timespec_t ts;
-    clock_get_time(clock_service, &ts);
+    if (scheduler != NULL) {
+        return scheduler->get_time();
+    }
 
-    return (uint64_t)ts.tv_sec * PIT_S_IN_NS + (uint64_t)ts.tv_nsec;
+    return replay_time(REPLAY_CLOCK_PIT, host_clock_ns());
 }
 
 void PIT::write_control(uint8_t value)
@@ -160,15 +211,15 @@ void PIT::write_control(uint8_t value)
 
     if (bcd_binary_mode != 0 || channel >= PIT_CH_COUNT || operating_mode == 1
         || operating_mode > 3) {
-        printf("PIT: Unsopported feature\n");
+        LOG_WARN("PIT: Unsopported feature\n");
         return;
     }
 
+    tick();
     access_modes[channel] = (pit_access_mode_t)access_mode;
 
     /* if access mode is latch count */
     if (access_mode == PIT_ACCESS_MODE_LATCH) {
-        tick();
         latched_values[channel] = current_values[channel];
         return;
     } else {
@@ -183,11 +234,15 @@ void PIT::write_control(uint8_t value)
     current_values[channel] = 0;
     output[channel] = true;
     is_running[channel] = false;
+    if (channel == PIT_IRQ_CH) {
+        schedule_irq();
+    }
 }
 
 void PIT::read_data(uint8_t channel, uint8_t *value)
 {
     tick();
+    // A full count of 0x10000 reads as 0
     uint16_t counter = current_values[channel];
 
     switch (access_modes[channel]) {
@@ -253,7 +308,10 @@ void PIT::start_counter(int channel)
         return;
     }
 
-    current_values[channel] = reload_values[channel];
+    // Count from now, not from whenever the PIT was last looked at
+    tick();
+    current_values[channel] = reload_values[channel] != 0
+        ? reload_values[channel] : PIT_MAX_COUNT;
     is_running[channel] = true;
 
     switch (operating_modes[channel]) {
@@ -267,6 +325,9 @@ void PIT::start_counter(int channel)
         output[channel] = true;
         break;
     }
+    if (channel == PIT_IRQ_CH) {
+        schedule_irq();
+    }
 }
 
 void PIT::debug_status()
@@ -2,16 +2,18 @@
 #define __PIT_H__
 
 #include <stdint.h>
-#include <mach/clock.h>
-#include <mach/mach.h>
 
+#include "event_scheduler.h"
 #include "io_device.h"
+#include "pic.h"
 
 #define PIT_BASE_PORT   (0x40)
 #define PIT_CLOCK_FREQ  (1193182)
 #define PIT_CH_COUNT    (3)
 #define PIT_S_IN_NS     (1000000000)
 #define PIT_IRQ_CH      (0)
+// Count loaded by a reload value of 0
+#define PIT_MAX_COUNT   (0x10000)
 
 typedef enum {
     PIT_ACCESS_MODE_LATCH = 0,
@@ -26,13 +28,22 @@ typedef enum {
     PIT_OPERATING_MODE_3,
 } pit_operating_mode_t;
 
-class PIT : IODevice {
+class PIT : public IODevice, public EventHandler {
 public:
     PIT();
     ~PIT();
     void write(uint32_t port, const uint32_t *value, uint8_t size);
     void read(uint32_t port, uint32_t *value, uint8_t size);
     bool poll_irq();
+    // Stop all counters
+    void reset();
+    // Count guest time from scheduler instead of the host calendar clock,
+    // and schedule channel 0 terminal counts on it so that a halted guest
+    // is woken (and virtual time skips ahead) for the timer interrupt
+    void connect_scheduler(EventScheduler *scheduler);
+    // Raise IRQ0 at channel 0 terminal counts
+    void connect_pic(PIC *pic);
+    void handle_event(uint64_t now);
     void debug_status();
     // Output pin
     bool output[PIT_CH_COUNT];
@@ -42,17 +53,20 @@ private:
     void write_control(uint8_t value);
     // Update internal state
     void tick();
-    // Update counter internal state
-    void tick_counter(int channel, uint64_t clocks);
+    // Update counter internal state. Return true if it reached terminal
+    // count.
+    bool tick_counter(int channel, uint64_t clocks);
     // Start counter
     void start_counter(int channel);
+    // Schedule the next channel 0 terminal count, or cancel it
+    void schedule_irq();
     // Get current real time in nanosec
     uint64_t get_real_time();
 
     // Counter starts from this value when reloaded
     uint16_t reload_values[PIT_CH_COUNT];
-    // Current value for each counters
-    uint16_t current_values[PIT_CH_COUNT];
+    // Current value for each counters, 1 to PIT_MAX_COUNT while running
+    uint32_t current_values[PIT_CH_COUNT];
     // Operating mode for each counter
     pit_operating_mode_t operating_modes[PIT_CH_COUNT];
     // Access mode for each counter
@@ -64,9 +78,10 @@ private:
     // Byte index to access in next access (0: LOW byte, 1: HI byte)
     uint8_t access_bytes[PIT_CH_COUNT];
 
-    // Time when the next clock will happen
+    // Time [ns] up to which clocks have been counted
     uint64_t next_clock_time;
-    clock_serv_t clock_service;
+    EventScheduler *scheduler;
+    PIC *pic;
 };
 
 #endif
@@ -0,0 +1,208 @@
+#include "pvclock.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "host_clock.h"
+#include "log.h"
+
+PVClock::PVClock(Memory *memory, EventScheduler *scheduler)
+{
+    this->memory = memory;
+    this->scheduler = scheduler;
+
+    system_time_msr = 0;
+    wall_clock_msr = 0;
+    version = 0;
+
+    calibrate_tsc();
+    base_time = scheduler->get_time();
+}
+
+PVClock::~PVClock()
+{
+}
+
+void PVClock::reset()
+{
+    system_time_msr = 0;
+    wall_clock_msr = 0;
+}
+
+bool PVClock::write_msr(uint32_t msr, uint64_t value)
+{
+    switch (msr) {
+    case PVCLOCK_MSR_SYSTEM_TIME:
+        system_time_msr = value;
+        update();
+        return true;
+    case PVCLOCK_MSR_WALL_CLOCK:
+        wall_clock_msr = value;
+        write_wall_clock(value);
+        return true;
+    }
+
+    return false;
+}
+
+bool PVClock::read_msr(uint32_t msr, uint64_t *value)
+{
+    switch (msr) {
+    case PVCLOCK_MSR_SYSTEM_TIME:
+        *value = system_time_msr;
+        return true;
+    case PVCLOCK_MSR_WALL_CLOCK:
+        *value = wall_clock_msr;
+        return true;
+    }
+
+    return false;
+}
+
+bool PVClock::cpuid(uint32_t leaf, uint32_t *eax, uint32_t *ebx,
+        uint32_t *ecx, uint32_t *edx)
+{
+    // kvmclock runs off the host TSC and can't follow virtual time as it
+    // skips ahead over halts. Hidden, guests use the HPET or PIT instead.
+    if (scheduler->get_clock_mode() == EVENT_CLOCK_VIRTUAL) {
+        return false;
+    }
+
+    switch (leaf) {
+    case PVCLOCK_CPUID_SIGNATURE:
+        *eax = PVCLOCK_CPUID_FEATURES;
+        // "KVMKVMKVM\0\0\0"
+        memcpy(ebx, "KVMK", 4);
+        memcpy(ecx, "VMKV", 4);
+        memcpy(edx, "M\0\0\0", 4);
+        return true;
+    case PVCLOCK_CPUID_FEATURES:
+        *eax = PVCLOCK_FEATURE_CLOCKSOURCE2 | PVCLOCK_FEATURE_STABLE_BIT;
+        *ebx = *ecx = *edx = 0;
+        return true;
+    }
+
+    return false;
+}
+
+void PVClock::update()
+{
+    if (!(system_time_msr & PVCLOCK_MSR_ENABLE)) {
+        return;
+    }
+
+    uint64_t address = system_time_msr & ~(uint64_t)PVCLOCK_MSR_ENABLE;
+    volatile pvclock_vcpu_time_info *info = (pvclock_vcpu_time_info*)
+        memory->get_pointer(address, sizeof(pvclock_vcpu_time_info));
+    if (info == NULL) {
+        LOG_WARN("PVClock: Time info page 0x%llx is outside of RAM\n",
+                (unsigned long long)address);
+        return;
+    }
+
+    // Sample TSC and monotonic time as close together as possible
+    uint64_t tsc = read_tsc();
+    uint64_t system_time = scheduler->get_time() - base_time;
+
+    // Seqlock: guest retries while version is odd or has changed
+    version += 2;
+    info->version = version - 1;
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    info->tsc_timestamp = tsc;
+    info->system_time = system_time;
+    info->tsc_to_system_mul = tsc_to_system_mul;
+    info->tsc_shift = tsc_shift;
+    info->flags = PVCLOCK_FLAG_TSC_STABLE;
+
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    info->version = version;
+    memory->mark_dirty(address, sizeof(pvclock_vcpu_time_info));
+}
+
+void PVClock::write_wall_clock(uint64_t address)
+{
+    volatile pvclock_wall_clock *wall = (pvclock_wall_clock*)
+        memory->get_pointer(address, sizeof(pvclock_wall_clock));
+    if (wall == NULL) {
+        LOG_WARN("PVClock: Wall clock 0x%llx is outside of RAM\n",
+                (unsigned long long)address);
+        return;
+    }
+
+    // Wall clock time when guest system time was 0
+    uint64_t now = host_clock_realtime_ns();
+    uint64_t boot = now - (scheduler->get_time() - base_time);
+
+    uint32_t wall_version = wall->version | 1;
+    wall->version = wall_version;
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    wall->sec = boot / 1000000000;
+    wall->nsec = boot % 1000000000;
+
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    wall->version = wall_version + 1;
+    memory->mark_dirty(address, sizeof(pvclock_wall_clock));
+}
+
+void PVClock::calibrate_tsc()
+{
+    // The TSC runs with the host, and virtual time doesn't move while we
+    // wait here
+    uint64_t start_time = scheduler->get_host_time();
+    uint64_t start_tsc = read_tsc();
+    uint64_t end_time;
+
+    do {
+        end_time = scheduler->get_host_time();
+    } while (end_time - start_time < PVCLOCK_CALIBRATION_TIME);
+
+    uint64_t end_tsc = read_tsc();
+    tsc_freq = (end_tsc - start_tsc) * 1000000000 / (end_time - start_time);
+
+    // Find mul and shift such that
+    // ns = ((tsc << shift) * mul) >> 32 (shift is right shift if negative)
+    uint64_t scaled = 1000000000;
+    uint64_t base = tsc_freq;
+    int shift = 0;
+
+    while (base > scaled * 2 || (base & 0xffffffff00000000ULL)) {
+        base >>= 1;
+        shift--;
+    }
+
+    uint32_t base32 = (uint32_t)base;
+    while (base32 <= scaled || (scaled & 0xffffffff00000000ULL)) {
+        if ((scaled & 0xffffffff00000000ULL) || (base32 & 0x80000000)) {
+            scaled >>= 1;
+        } else {
+            base32 <<= 1;
+        }
+        shift++;
+    }
+
+    tsc_shift = shift;
+    tsc_to_system_mul = (uint32_t)((scaled << 32) / base32);
+}
+
+uint64_t PVClock::read_tsc()
+{
+    uint32_t lo, hi;
+    __asm__ __volatile__("rdtsc" : "=a"(lo), "=d"(hi));
+
+    return (uint64_t)hi << 32 | lo;
+}
+
+void PVClock::debug_status()
+{
+    printf("------------------------------\n");
+    printf("PVClock:\n");
+    printf("System time MSR: 0x%016llx, wall clock MSR: 0x%016llx\n",
+            (unsigned long long)system_time_msr,
+            (unsigned long long)wall_clock_msr);
+    printf("TSC frequency: %lluHz, mul: 0x%08x, shift: %d\n",
+            (unsigned long long)tsc_freq, tsc_to_system_mul, tsc_shift);
+    printf("Version: %u\n", version);
+    printf("------------------------------\n");
+}
@@ -0,0 +1,79 @@
+#ifndef __PVCLOCK_H__
+#define __PVCLOCK_H__
+
+#include <stdint.h>
+
+#include "event_scheduler.h"
+#include "memory.h"
+
+// kvmclock compatible MSRs, so that unmodified guest drivers work
+#define PVCLOCK_MSR_WALL_CLOCK      (0x4b564d00)
+#define PVCLOCK_MSR_SYSTEM_TIME     (0x4b564d01)
+#define PVCLOCK_MSR_ENABLE          (0x1)
+
+#define PVCLOCK_CPUID_SIGNATURE     (0x40000000)
+#define PVCLOCK_CPUID_FEATURES      (0x40000001)
+#define PVCLOCK_FEATURE_CLOCKSOURCE2    (1 << 3)
+#define PVCLOCK_FEATURE_STABLE_BIT      (1 << 24)
+
+#define PVCLOCK_FLAG_TSC_STABLE     (0x1)
+// Time to spend on TSC calibration [ns]
+#define PVCLOCK_CALIBRATION_TIME    (10000000)
+
+// Shared with the guest; layout is fixed by the kvmclock ABI
+struct pvclock_vcpu_time_info {
+    // Odd while the host is updating (seqlock)
+    uint32_t version;
+    uint32_t pad0;
+    uint64_t tsc_timestamp;
+    uint64_t system_time;
+    uint32_t tsc_to_system_mul;
+    int8_t tsc_shift;
+    uint8_t flags;
+    uint8_t pad[2];
+} __attribute__((packed));
+
+struct pvclock_wall_clock {
+    uint32_t version;
+    uint32_t sec;
+    uint32_t nsec;
+} __attribute__((packed));
+
+class PVClock {
+public:
+    PVClock(Memory *memory, EventScheduler *scheduler);
+    ~PVClock();
+    // Return false if msr is not handled by this device
+    bool write_msr(uint32_t msr, uint64_t value);
+    bool read_msr(uint32_t msr, uint64_t *value);
+    // Return false if leaf is not handled by this device. kvmclock isn't
+    // offered under virtual time.
+    bool cpuid(uint32_t leaf, uint32_t *eax, uint32_t *ebx, uint32_t *ecx,
+            uint32_t *edx);
+    // Publish current TSC scale and offset to the guest page
+    void update();
+    // Stop writing to guest pages the guest registered before a reset
+    void reset();
+    void debug_status();
+private:
+    void calibrate_tsc();
+    void write_wall_clock(uint64_t address);
+    // Get current TSC value
+    uint64_t read_tsc();
+
+    Memory *memory;
+    EventScheduler *scheduler;
+
+    // MSR values written by the guest
+    uint64_t system_time_msr;
+    uint64_t wall_clock_msr;
+    // Monotonic time [ns] that corresponds to guest system time 0
+    uint64_t base_time;
+    // TSC frequency [Hz] and scale to convert TSC delta to nanosec
+    uint64_t tsc_freq;
+    uint32_t tsc_to_system_mul;
+    int8_t tsc_shift;
+    uint32_t version;
+};
+
+#endif
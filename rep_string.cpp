@@ -0,0 +1,246 @@
+#include "rep_string.h"
+
+#include <string.h>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+void rep_fill(uint8_t *dst, uint64_t value, uint8_t size, uint64_t count)
+{
+    uint64_t bytes = count * size;
+    if (size == 1) {
+        memset(dst, value & 0xff, bytes);
+        return;
+    }
+
+    // Element repeated over 8 bytes. Every store below starts at a
+    // multiple of 8 from dst, so the pattern stays in phase.
+    uint64_t pattern = value;
+    if (size == 2) {
+        pattern = (value & 0xffff) * 0x0001000100010001ULL;
+    } else if (size == 4) {
+        pattern = (value & 0xffffffff) * 0x0000000100000001ULL;
+    }
+
+    uint64_t i = 0;
+#if defined(__AVX2__)
+    __m256i v = _mm256_set1_epi64x(pattern);
+    for (; i + 32 <= bytes; i += 32) {
+        _mm256_storeu_si256((__m256i*)(dst + i), v);
+    }
+#elif defined(__SSE2__)
+    __m128i v = _mm_set1_epi64x(pattern);
+    for (; i + 16 <= bytes; i += 16) {
+        _mm_storeu_si128((__m128i*)(dst + i), v);
+    }
+#endif
+    for (; i + 8 <= bytes; i += 8) {
+        memcpy(dst + i, &pattern, 8);
+    }
+    memcpy(dst + i, &pattern, bytes - i);
+}
+
+// Copy [src, src + bytes) to dst as elements from the lowest address up
+// would. Where dst overlaps the source ahead of it, that repeats the first
+// distance bytes, which is built by doubling the copied part.
+static void copy_forward(uint8_t *dst, const uint8_t *src, uint64_t bytes,
+        uint8_t size)
+{
+    if (dst <= src || dst >= src + bytes) {
+        memmove(dst, src, bytes);
+        return;
+    }
+
+    uint64_t distance = dst - src;
+    if (distance < size) {
+        // Each element reads part of the one before; no shortcut
+        for (uint64_t i = 0; i < bytes; i += size) {
+            uint64_t element;
+            memcpy(&element, src + i, size);
+            memcpy(dst + i, &element, size);
+        }
+        return;
+    }
+
+    memcpy(dst, src, distance < bytes ? distance : bytes);
+    uint64_t copied = distance;
+    while (copied < bytes) {
+        uint64_t n = bytes - copied < copied ? bytes - copied : copied;
+        memcpy(dst + copied, dst, n);
+        copied += n;
+    }
+}
+
+// Same for elements from the highest address down, with dst and src
+// pointing at the lowest byte
+static void copy_backward(uint8_t *dst, const uint8_t *src, uint64_t bytes,
+        uint8_t size)
+{
+    if (dst >= src || dst + bytes <= src) {
+        memmove(dst, src, bytes);
+        return;
+    }
+
+    uint64_t distance = src - dst;
+    uint8_t *dst_end = dst + bytes;
+    const uint8_t *src_end = src + bytes;
+    if (distance < size) {
+        for (uint64_t i = size; i <= bytes; i += size) {
+            uint64_t element;
+            memcpy(&element, src_end - i, size);
+            memcpy(dst_end - i, &element, size);
+        }
+        return;
+    }
+
+    uint64_t first = distance < bytes ? distance : bytes;
+    memcpy(dst_end - first, src_end - first, first);
+    uint64_t copied = distance;
+    while (copied < bytes) {
+        uint64_t n = bytes - copied < copied ? bytes - copied : copied;
+        memcpy(dst_end - copied - n, dst_end - n, n);
+        copied += n;
+    }
+}
+
+// Elements from index on that lie in the page of address and don't wrap
+// the index. 0 if the first element already crosses either.
+static uint64_t span(uint64_t address, uint64_t index,
+        const rep_string_state *state)
+{
+    uint64_t offset = address & SOFT_MMU_PAGE_MASK;
+    uint64_t mask = state->address_mask;
+    uint8_t size = state->size;
+    index &= mask;
+
+    if (offset + size > MEMORY_PAGE_SIZE || mask - index < size - 1u) {
+        return 0;
+    }
+
+    uint64_t in_page;
+    uint64_t in_index;
+    if (state->backward) {
+        in_page = offset / size + 1;
+        in_index = index / size + 1;
+    } else {
+        in_page = (MEMORY_PAGE_SIZE - offset) / size;
+        in_index = (mask - index - (size - 1)) / size + 1;
+    }
+
+    return in_page < in_index ? in_page : in_index;
+}
+
+static void advance(rep_string_state *state, uint64_t count, bool source)
+{
+    uint64_t mask = state->address_mask;
+    uint64_t delta = count * state->size;
+    if (state->backward) {
+        delta = -delta;
+    }
+
+    if (source) {
+        state->rsi = (state->rsi & ~mask) | ((state->rsi + delta) & mask);
+    }
+    state->rdi = (state->rdi & ~mask) | ((state->rdi + delta) & mask);
+    state->rcx = (state->rcx & ~mask) | ((state->rcx - count) & mask);
+}
+
+bool rep_movs(SoftMMU *mmu, Memory *memory, rep_string_state *state)
+{
+    uint64_t mask = state->address_mask;
+    uint8_t size = state->size;
+
+    while ((state->rcx & mask) != 0) {
+        uint64_t src = state->src_base + (state->rsi & mask);
+        uint64_t dst = state->dst_base + (state->rdi & mask);
+        uint64_t count = state->rcx & mask;
+        uint64_t n = span(src, state->rsi, state);
+        uint64_t dst_n = span(dst, state->rdi, state);
+        n = n < dst_n ? n : dst_n;
+        n = n < count ? n : count;
+
+        uint8_t *src_host = NULL;
+        uint8_t *dst_host = NULL;
+        if (n > 0) {
+            bool faulted;
+            src_host = mmu->get_host_pointer(src, SOFT_MMU_READ,
+                    state->user, &faulted);
+            if (faulted) {
+                return false;
+            }
+            dst_host = mmu->get_host_pointer(dst, SOFT_MMU_WRITE,
+                    state->user, &faulted);
+            if (faulted) {
+                return false;
+            }
+        }
+
+        if (src_host == NULL || dst_host == NULL) {
+            // MMIO, or an element crossing a page or wrapping the index
+            uint64_t element;
+            if (!mmu->read(src, &element, size, state->user)
+                    || !mmu->write(dst, &element, size, state->user)) {
+                return false;
+            }
+            n = 1;
+        } else {
+            uint64_t bytes = n * size;
+            if (state->backward) {
+                dst_host -= bytes - size;
+                src_host -= bytes - size;
+                copy_backward(dst_host, src_host, bytes, size);
+            } else {
+                copy_forward(dst_host, src_host, bytes, size);
+            }
+            memory->mark_dirty(memory->get_address(dst_host), bytes);
+        }
+
+        advance(state, n, true);
+    }
+
+    return true;
+}
+
+bool rep_stos(SoftMMU *mmu, Memory *memory, rep_string_state *state,
+        uint64_t value)
+{
+    uint64_t mask = state->address_mask;
+    uint8_t size = state->size;
+
+    while ((state->rcx & mask) != 0) {
+        uint64_t dst = state->dst_base + (state->rdi & mask);
+        uint64_t count = state->rcx & mask;
+        uint64_t n = span(dst, state->rdi, state);
+        n = n < count ? n : count;
+
+        uint8_t *dst_host = NULL;
+        if (n > 0) {
+            bool faulted;
+            dst_host = mmu->get_host_pointer(dst, SOFT_MMU_WRITE,
+                    state->user, &faulted);
+            if (faulted) {
+                return false;
+            }
+        }
+
+        if (dst_host == NULL) {
+            if (!mmu->write(dst, &value, size, state->user)) {
+                return false;
+            }
+            n = 1;
+        } else {
+            // Every element gets the same value, so direction only decides
+            // which end the range starts from
+            if (state->backward) {
+                dst_host -= (n - 1) * size;
+            }
+            rep_fill(dst_host, value, size, n);
+            memory->mark_dirty(memory->get_address(dst_host), n * size);
+        }
+
+        advance(state, n, false);
+    }
+
+    return true;
+}
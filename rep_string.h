@@ -0,0 +1,38 @@
+#ifndef __REP_STRING_H__
+#define __REP_STRING_H__
+
+#include <stdint.h>
+
+#include "memory.h"
+#include "soft_mmu.h"
+
+// Registers of a REP MOVS/STOS in progress. Indexes and count wrap within
+// address_mask (0xffff, 0xffffffff or all ones for the address size).
+struct rep_string_state {
+    // Linear base of the source segment (DS or override) and of ES
+    uint64_t src_base;
+    uint64_t dst_base;
+    uint64_t rsi;
+    uint64_t rdi;
+    uint64_t rcx;
+    uint64_t address_mask;
+    // Element size: 1, 2, 4 or 8
+    uint8_t size;
+    // EFLAGS.DF
+    bool backward;
+    bool user;
+};
+
+// Run the instruction to completion. Spans of plain RAM go as bulk copies
+// and fills with the semantics of one element at a time, including
+// overlap; MMIO and page-crossing elements go one at a time. On a page
+// fault return false with the registers after the last element done, as
+// the CPU leaves them.
+bool rep_movs(SoftMMU *mmu, Memory *memory, rep_string_state *state);
+bool rep_stos(SoftMMU *mmu, Memory *memory, rep_string_state *state,
+        uint64_t value);
+
+// Store count elements of size bytes, all value, starting at dst
+void rep_fill(uint8_t *dst, uint64_t value, uint8_t size, uint64_t count);
+
+#endif
@@ -0,0 +1,338 @@
+#include "replay.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+#include "log.h"
+
+#define REPLAY_BUFFER_SIZE      (1 << 16)
+
+replay_mode_t replay_mode = REPLAY_OFF;
+uint64_t replay_position = 0;
+
+struct queued_input {
+    uint8_t channel;
+    std::vector<uint8_t> data;
+};
+
+static FILE *log_file = NULL;
+// Position and clock samples of the previous event, for delta encoding
+static uint64_t last_position = 0;
+static uint64_t last_samples[REPLAY_CLOCK_COUNT];
+
+static ReplayInput *inputs[REPLAY_MAX_INPUTS];
+static int input_count = 0;
+static std::vector<queued_input> input_queue;
+static pthread_mutex_t input_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Next event when replaying, decoded ahead of time
+static struct {
+    uint8_t type;
+    uint64_t position;
+    uint8_t arg;
+    uint64_t value;
+    std::vector<uint8_t> data;
+} next;
+
+static void write_varint(uint64_t value)
+{
+    uint8_t buf[10];
+    int length = 0;
+    while (value >= 0x80) {
+        buf[length++] = (value & 0x7f) | 0x80;
+        value >>= 7;
+    }
+    buf[length++] = value;
+    fwrite(buf, 1, length, log_file);
+}
+
+static bool read_varint(uint64_t *value)
+{
+    *value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        int c = getc(log_file);
+        if (c == EOF) {
+            return false;
+        }
+        *value |= (uint64_t)(c & 0x7f) << shift;
+        if (!(c & 0x80)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void write_event(uint8_t type)
+{
+    putc(type, log_file);
+    write_varint(replay_position - last_position);
+    last_position = replay_position;
+}
+
+static void close_log()
+{
+    if (log_file != NULL) {
+        fclose(log_file);
+        log_file = NULL;
+    }
+    replay_mode = REPLAY_OFF;
+}
+
+// Decode the following event into next; a truncated log ends the replay
+static void read_next()
+{
+    uint64_t delta = 0;
+    int type = getc(log_file);
+    if (type == EOF || type >= REPLAY_EVENT_END || !read_varint(&delta)) {
+        next.type = REPLAY_EVENT_END;
+        return;
+    }
+    next.type = type;
+    next.position += delta;
+
+    bool ok = true;
+    switch (type) {
+    case REPLAY_EVENT_TIME: {
+        uint64_t zigzag;
+        next.arg = getc(log_file);
+        ok = next.arg < REPLAY_CLOCK_COUNT && read_varint(&zigzag);
+        if (ok) {
+            int64_t diff = (int64_t)(zigzag >> 1) ^ -(int64_t)(zigzag & 1);
+            last_samples[next.arg] += diff;
+            next.value = last_samples[next.arg];
+        }
+    }
+        break;
+    case REPLAY_EVENT_INPUT: {
+        uint64_t length;
+        next.arg = getc(log_file);
+        ok = next.arg < REPLAY_MAX_INPUTS && read_varint(&length);
+        if (ok) {
+            next.data.resize(length);
+            ok = fread(next.data.data(), 1, length, log_file) == length;
+        }
+    }
+        break;
+    case REPLAY_EVENT_INTERRUPT:
+        next.arg = getc(log_file);
+        break;
+    }
+
+    if (!ok) {
+        printf("Replay: Truncated log\n");
+        next.type = REPLAY_EVENT_END;
+    }
+}
+
+// Check that the guest asked for what the log has next. If not, the run
+// has diverged and continues live.
+static bool expect(uint8_t type, uint8_t arg)
+{
+    if (next.type == REPLAY_EVENT_END) {
+        LOG_INFO("Replay: End of log at position %llu\n",
+                (unsigned long long)replay_position);
+        close_log();
+        return false;
+    }
+    if (next.type != type || next.arg != arg) {
+        LOG_ERROR("Replay: Diverged at position %llu\n",
+                (unsigned long long)replay_position);
+        close_log();
+        return false;
+    }
+    if (next.position != replay_position) {
+        LOG_WARN("Replay: Event logged at position %llu seen at %llu\n",
+                (unsigned long long)next.position,
+                (unsigned long long)replay_position);
+    }
+
+    return true;
+}
+
+static bool open_log(const char *filename, const char *mode)
+{
+    if (log_file != NULL) {
+        printf("Replay: Already active\n");
+        return false;
+    }
+
+    log_file = fopen(filename, mode);
+    if (log_file == NULL) {
+        printf("Replay: Failed to open %s\n", filename);
+        return false;
+    }
+    setvbuf(log_file, NULL, _IOFBF, REPLAY_BUFFER_SIZE);
+
+    replay_position = 0;
+    last_position = 0;
+    memset(last_samples, 0, sizeof(last_samples));
+
+    return true;
+}
+
+bool replay_start_record(const char *filename)
+{
+    if (!open_log(filename, "wb")) {
+        return false;
+    }
+
+    replay_file_header header;
+    header.magic = REPLAY_MAGIC;
+    header.version = REPLAY_VERSION;
+    fwrite(&header, sizeof(header), 1, log_file);
+
+    replay_mode = REPLAY_RECORD;
+
+    return true;
+}
+
+bool replay_start_play(const char *filename)
+{
+    if (!open_log(filename, "rb")) {
+        return false;
+    }
+
+    replay_file_header header;
+    if (fread(&header, sizeof(header), 1, log_file) != 1
+            || header.magic != REPLAY_MAGIC
+            || header.version != REPLAY_VERSION) {
+        printf("Replay: %s is not a replay log\n", filename);
+        close_log();
+        return false;
+    }
+
+    next.position = 0;
+    read_next();
+    replay_mode = REPLAY_PLAY;
+
+    return true;
+}
+
+void replay_stop()
+{
+    if (replay_mode == REPLAY_RECORD) {
+        write_event(REPLAY_EVENT_END);
+    }
+    close_log();
+}
+
+uint64_t replay_time_slow(replay_clock_t clock, uint64_t value)
+{
+    if (replay_mode == REPLAY_RECORD) {
+        int64_t diff = value - last_samples[clock];
+        last_samples[clock] = value;
+
+        write_event(REPLAY_EVENT_TIME);
+        putc(clock, log_file);
+        write_varint(((uint64_t)diff << 1) ^ (uint64_t)(diff >> 63));
+        return value;
+    }
+
+    if (!expect(REPLAY_EVENT_TIME, clock)) {
+        return value;
+    }
+    value = next.value;
+    read_next();
+
+    return value;
+}
+
+bool replay_connect_input(ReplayInput *input)
+{
+    if (input_count >= REPLAY_MAX_INPUTS) {
+        printf("Replay: Too many inputs\n");
+        return false;
+    }
+
+    inputs[input_count++] = input;
+
+    return true;
+}
+
+void replay_queue_input(ReplayInput *input, const uint8_t *data,
+        uint32_t length)
+{
+    if (replay_mode != REPLAY_RECORD) {
+        return;
+    }
+
+    for (int i = 0; i < input_count; i++) {
+        if (inputs[i] == input) {
+            queued_input entry;
+            entry.channel = i;
+            entry.data.assign(data, data + length);
+
+            pthread_mutex_lock(&input_lock);
+            input_queue.push_back(entry);
+            pthread_mutex_unlock(&input_lock);
+            return;
+        }
+    }
+
+    LOG_WARN("Replay: Input from unregistered device dropped\n");
+}
+
+void replay_advance()
+{
+    replay_position++;
+}
+
+void replay_poll()
+{
+    if (replay_mode == REPLAY_RECORD) {
+        pthread_mutex_lock(&input_lock);
+        std::vector<queued_input> queue;
+        queue.swap(input_queue);
+        pthread_mutex_unlock(&input_lock);
+
+        for (size_t i = 0; i < queue.size(); i++) {
+            write_event(REPLAY_EVENT_INPUT);
+            putc(queue[i].channel, log_file);
+            write_varint(queue[i].data.size());
+            fwrite(queue[i].data.data(), 1, queue[i].data.size(), log_file);
+
+            inputs[queue[i].channel]->replay_input(queue[i].data.data(),
+                    queue[i].data.size());
+        }
+        return;
+    }
+
+    while (replay_mode == REPLAY_PLAY && next.type == REPLAY_EVENT_INPUT
+            && next.position <= replay_position) {
+        if (inputs[next.arg] != NULL) {
+            inputs[next.arg]->replay_input(next.data.data(),
+                    next.data.size());
+        }
+        read_next();
+    }
+}
+
+void replay_record_interrupt(uint8_t vector)
+{
+    if (replay_mode != REPLAY_RECORD) {
+        return;
+    }
+
+    write_event(REPLAY_EVENT_INTERRUPT);
+    putc(vector, log_file);
+}
+
+bool replay_interrupt_due()
+{
+    return replay_mode == REPLAY_PLAY && next.type == REPLAY_EVENT_INTERRUPT
+        && next.position <= replay_position;
+}
+
+int replay_next_interrupt()
+{
+    if (!replay_interrupt_due()) {
+        return -1;
+    }
+
+    int vector = next.arg;
+    read_next();
+
+    return vector;
+}
@@ -0,0 +1,85 @@
+#ifndef __REPLAY_H__
+#define __REPLAY_H__
+
+#include <stdint.h>
+
+#define REPLAY_MAGIC            (0x50525648)
+#define REPLAY_VERSION          (1)
+#define REPLAY_MAX_INPUTS       (4)
+
+typedef enum {
+    REPLAY_OFF,
+    REPLAY_RECORD,
+    REPLAY_PLAY,
+} replay_mode_t;
+
+// Host clocks whose samples are logged
+typedef enum {
+    REPLAY_CLOCK_PIT,
+    REPLAY_CLOCK_CMOS,
+    REPLAY_CLOCK_SCHEDULER,
+    REPLAY_CLOCK_COUNT,
+} replay_clock_t;
+
+// Log: header, then a stream of events. Each event is a type byte, the
+// position delta as a varint and a type-specific payload.
+typedef enum {
+    // clock byte, zigzag varint delta from the clock's previous sample
+    REPLAY_EVENT_TIME,
+    // input channel byte, varint length, data
+    REPLAY_EVENT_INPUT,
+    // vector byte
+    REPLAY_EVENT_INTERRUPT,
+    REPLAY_EVENT_END,
+} replay_event_t;
+
+struct replay_file_header {
+    uint32_t magic;
+    uint32_t version;
+};
+
+// Device that takes host input, e.g. a serial line
+class ReplayInput {
+public:
+    virtual ~ReplayInput() {}
+    // Called from the vCPU thread at the point the input is logged
+    virtual void replay_input(const uint8_t *data, uint32_t length) = 0;
+};
+
+extern replay_mode_t replay_mode;
+// Guest-synchronous VM exits so far; identifies where events happen
+extern uint64_t replay_position;
+
+bool replay_start_record(const char *filename);
+bool replay_start_play(const char *filename);
+void replay_stop();
+
+// Returns value when recording or off, and the logged sample when
+// replaying
+uint64_t replay_time_slow(replay_clock_t clock, uint64_t value);
+static inline uint64_t replay_time(replay_clock_t clock, uint64_t value)
+{
+    if (__builtin_expect(replay_mode == REPLAY_OFF, 1)) {
+        return value;
+    }
+    return replay_time_slow(clock, value);
+}
+
+// Register device for input events; returns false if there are too many
+bool replay_connect_input(ReplayInput *input);
+// Callable from any thread. Input is queued until the next replay_poll
+// when recording, and dropped when replaying since the log supplies it.
+void replay_queue_input(ReplayInput *input, const uint8_t *data,
+        uint32_t length);
+// Called by the vCPU thread after each guest-synchronous exit
+void replay_advance();
+// Deliver input due at the current position
+void replay_poll();
+
+// Log an interrupt that came from outside the device model (e.g. MSI)
+void replay_record_interrupt(uint8_t vector);
+// Next logged interrupt due at the current position, or -1
+int replay_next_interrupt();
+bool replay_interrupt_due();
+
+#endif
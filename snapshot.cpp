@@ -0,0 +1,260 @@
+#include "snapshot.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// Pages of the run being built, written out once it can't grow any more
+struct run_writer {
+    Memory *memory;
+    int fd;
+    snapshot_run run;
+    snapshot_stats *stats;
+};
+
+static bool write_all(int fd, const void *data, size_t length)
+{
+    const uint8_t *p = (const uint8_t*)data;
+    while (length > 0) {
+#ifdef MSG_NOSIGNAL
+        // A migration peer going away is an error, not a reason to die.
+        // Snapshot files aren't sockets and take a plain write.
+        ssize_t ret = send(fd, p, length, MSG_NOSIGNAL);
+        if (ret < 0 && errno == ENOTSOCK) {
+            ret = write(fd, p, length);
+        }
+#else
+        ssize_t ret = write(fd, p, length);
+#endif
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ret <= 0) {
+            return false;
+        }
+        p += ret;
+        length -= ret;
+    }
+
+    return true;
+}
+
+static bool read_all(int fd, void *data, size_t length)
+{
+    uint8_t *p = (uint8_t*)data;
+    while (length > 0) {
+        ssize_t ret = read(fd, p, length);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ret <= 0) {
+            return false;
+        }
+        p += ret;
+        length -= ret;
+    }
+
+    return true;
+}
+
+static bool flush_run(run_writer *w)
+{
+    if (w->run.count == 0) {
+        return true;
+    }
+
+    if (!write_all(w->fd, &w->run, sizeof(w->run))) {
+        return false;
+    }
+    w->stats->bytes += sizeof(w->run);
+
+    if (!(w->run.flags & SNAPSHOT_RUN_ZERO)) {
+        // Straight from guest memory; a page the guest changes meanwhile
+        // is dirty again and goes out in the next round
+        uint64_t length = (uint64_t)w->run.count << MEMORY_PAGE_SHIFT;
+        void *p = w->memory->get_pointer(
+                w->run.first_page << MEMORY_PAGE_SHIFT, length);
+        if (!write_all(w->fd, p, length)) {
+            return false;
+        }
+        w->stats->bytes += length;
+    }
+    w->run.count = 0;
+
+    return true;
+}
+
+static bool add_page(run_writer *w, uint64_t page)
+{
+    void *p = w->memory->get_pointer(page << MEMORY_PAGE_SHIFT,
+            MEMORY_PAGE_SIZE);
+    if (p == NULL) {
+        return true;
+    }
+
+    uint32_t flags = Memory::is_zero_page(p) ? SNAPSHOT_RUN_ZERO : 0;
+    if (w->run.count > 0 && (w->run.first_page + w->run.count != page
+                || w->run.flags != flags)) {
+        if (!flush_run(w)) {
+            return false;
+        }
+    }
+    if (w->run.count == 0) {
+        w->run.first_page = page;
+        w->run.flags = flags;
+    }
+    w->run.count++;
+
+    w->stats->pages++;
+    if (flags & SNAPSHOT_RUN_ZERO) {
+        w->stats->zero_pages++;
+    }
+
+    return true;
+}
+
+bool snapshot_write_header(Memory *memory, int fd)
+{
+    snapshot_header header;
+    header.magic = SNAPSHOT_MAGIC;
+    header.version = SNAPSHOT_VERSION;
+    header.ram_size = memory->get_size();
+
+    return write_all(fd, &header, sizeof(header));
+}
+
+bool snapshot_write_dirty(Memory *memory, int fd, snapshot_stats *stats)
+{
+    if (!memory->is_dirty_tracking()) {
+        memory->start_dirty_tracking();
+    }
+
+    run_writer w;
+    w.memory = memory;
+    w.fd = fd;
+    w.run.count = 0;
+    w.stats = stats;
+
+    size_t words = memory->get_dirty_word_count();
+    bool ok = true;
+    for (size_t i = 0; ok && i < words; i++) {
+        uint64_t bits = memory->fetch_dirty_word(i);
+        while (ok && bits != 0) {
+            int bit = __builtin_ctzll(bits);
+            bits &= bits - 1;
+            ok = add_page(&w, i * MEMORY_DIRTY_WORD_PAGES + bit);
+        }
+    }
+
+    if (!ok || !flush_run(&w)) {
+        // Bits fetched so far are lost; make the next call write all of RAM
+        memory->start_dirty_tracking();
+        return false;
+    }
+
+    return true;
+}
+
+bool snapshot_write_end(int fd)
+{
+    snapshot_run run;
+    memset(&run, 0, sizeof(run));
+
+    return write_all(fd, &run, sizeof(run));
+}
+
+bool snapshot_read(Memory *memory, int fd)
+{
+    snapshot_header header;
+    if (!read_all(fd, &header, sizeof(header))
+            || header.magic != SNAPSHOT_MAGIC
+            || header.version != SNAPSHOT_VERSION) {
+        printf("Snapshot: Not a snapshot stream\n");
+        return false;
+    }
+    if (header.ram_size != memory->get_size()) {
+        printf("Snapshot: RAM size %llu doesn't match %zu\n",
+                (unsigned long long)header.ram_size, memory->get_size());
+        return false;
+    }
+
+    while (true) {
+        snapshot_run run;
+        if (!read_all(fd, &run, sizeof(run))) {
+            printf("Snapshot: Truncated stream\n");
+            return false;
+        }
+        if (run.count == 0) {
+            return true;
+        }
+
+        uint64_t length = (uint64_t)run.count << MEMORY_PAGE_SHIFT;
+        uint8_t *p = (uint8_t*)memory->get_pointer(
+                run.first_page << MEMORY_PAGE_SHIFT, length);
+        if (p == NULL) {
+            printf("Snapshot: Page %llu is outside of RAM\n",
+                    (unsigned long long)run.first_page);
+            return false;
+        }
+
+        if (!(run.flags & SNAPSHOT_RUN_ZERO)) {
+            if (!read_all(fd, p, length)) {
+                printf("Snapshot: Truncated stream\n");
+                return false;
+            }
+            continue;
+        }
+
+        // Only write pages that aren't zero already, so that untouched
+        // memory stays unallocated
+        for (uint32_t i = 0; i < run.count; i++) {
+            uint8_t *page = p + ((uint64_t)i << MEMORY_PAGE_SHIFT);
+            if (!Memory::is_zero_page(page)) {
+                memset(page, 0, MEMORY_PAGE_SIZE);
+            }
+        }
+    }
+}
+
+bool snapshot_save(Memory *memory, const char *filename,
+        snapshot_stats *stats)
+{
+    snapshot_stats local;
+    if (stats == NULL) {
+        stats = &local;
+    }
+    memset(stats, 0, sizeof(*stats));
+
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        printf("Snapshot: Failed to create %s\n", filename);
+        return false;
+    }
+
+    bool ok = snapshot_write_header(memory, fd)
+        && snapshot_write_dirty(memory, fd, stats)
+        && snapshot_write_end(fd);
+    if (close(fd) != 0 || !ok) {
+        printf("Snapshot: Failed to write %s\n", filename);
+        return false;
+    }
+
+    return true;
+}
+
+bool snapshot_load(Memory *memory, const char *filename)
+{
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        printf("Snapshot: Failed to open %s\n", filename);
+        return false;
+    }
+
+    bool ok = snapshot_read(memory, fd);
+    close(fd);
+
+    return ok;
+}
@@ -0,0 +1,49 @@
+#ifndef __SNAPSHOT_H__
+#define __SNAPSHOT_H__
+
+#include <stdint.h>
+
+#include "memory.h"
+
+#define SNAPSHOT_MAGIC          (0x53525648) // "HVRS"
+#define SNAPSHOT_VERSION        (1)
+// Run of pages that are all zero; no data follows
+#define SNAPSHOT_RUN_ZERO       (0x1)
+
+// Stream: header, then runs of pages each followed by their data, ended by
+// a run of 0 pages. Used by snapshot files and migration alike.
+struct snapshot_header {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t ram_size;
+};
+
+struct snapshot_run {
+    uint64_t first_page;
+    uint32_t count;
+    uint32_t flags;
+};
+
+struct snapshot_stats {
+    uint64_t pages;
+    uint64_t zero_pages;
+    uint64_t bytes;
+};
+
+bool snapshot_write_header(Memory *memory, int fd);
+// Write the pages dirtied since the previous call, starting dirty tracking
+// (and so writing all of RAM) on the first. Only one writer may consume
+// the dirty bitmap.
+bool snapshot_write_dirty(Memory *memory, int fd, snapshot_stats *stats);
+bool snapshot_write_end(int fd);
+// Read header and runs into memory until the end of the stream
+bool snapshot_read(Memory *memory, int fd);
+
+// Save RAM to filename: all of it the first time, only what changed since
+// the previous save afterwards. Loading the first file and then each later
+// one in order restores the latest state. stats may be NULL.
+bool snapshot_save(Memory *memory, const char *filename,
+        snapshot_stats *stats);
+bool snapshot_load(Memory *memory, const char *filename);
+
+#endif
@@ -0,0 +1,368 @@
+#include "soft_mmu.h"
+
+#include <stdio.h>
+
+#define SOFT_MMU_ADDRESS_MASK   (0x000ffffffffff000ULL)
+
+SoftMMU::SoftMMU(Memory *memory)
+{
+    this->memory = memory;
+    cr0 = 0;
+    cr3 = 0;
+    cr4 = 0;
+    efer = 0;
+    memset(&fault, 0, sizeof(fault));
+    misses = 0;
+    walks = 0;
+    flushes = 0;
+
+    flush(true);
+}
+
+void SoftMMU::set_cr0(uint64_t value)
+{
+    if ((value ^ cr0) & (SOFT_MMU_CR0_PG | SOFT_MMU_CR0_WP)) {
+        flush(true);
+    }
+    cr0 = value;
+}
+
+void SoftMMU::set_cr3(uint64_t value)
+{
+    // Loading CR3 drops non-global translations even if it's unchanged
+    cr3 = value;
+    flush(false);
+}
+
+void SoftMMU::set_cr4(uint64_t value)
+{
+    if ((value ^ cr4)
+            & (SOFT_MMU_CR4_PSE | SOFT_MMU_CR4_PAE | SOFT_MMU_CR4_PGE)) {
+        flush(true);
+    }
+    cr4 = value;
+}
+
+void SoftMMU::set_efer(uint64_t value)
+{
+    if ((value ^ efer) & (SOFT_MMU_EFER_LMA | SOFT_MMU_EFER_NXE)) {
+        flush(true);
+    }
+    efer = value;
+}
+
+void SoftMMU::invlpg(uint64_t address)
+{
+    uint64_t page = address & ~SOFT_MMU_PAGE_MASK;
+    int index = (address >> MEMORY_PAGE_SHIFT) & (SOFT_TLB_SIZE - 1);
+
+    for (int user = 0; user < 2; user++) {
+        for (int access = 0; access < SOFT_MMU_ACCESS_COUNT; access++) {
+            soft_tlb_entry *entry = &tlb[user][access][index];
+            if ((entry->tag & ~(uint64_t)SOFT_TLB_MMIO) == page) {
+                entry->tag = SOFT_TLB_EMPTY;
+            }
+        }
+    }
+}
+
+void SoftMMU::flush(bool global)
+{
+    for (int user = 0; user < 2; user++) {
+        for (int access = 0; access < SOFT_MMU_ACCESS_COUNT; access++) {
+            for (int i = 0; i < SOFT_TLB_SIZE; i++) {
+                soft_tlb_entry *entry = &tlb[user][access][i];
+                if (global || !entry->global) {
+                    entry->tag = SOFT_TLB_EMPTY;
+                    entry->global = false;
+                }
+            }
+        }
+    }
+    flushes++;
+}
+
+const soft_mmu_fault *SoftMMU::get_fault()
+{
+    return &fault;
+}
+
+void SoftMMU::raise_fault(uint64_t address, soft_mmu_access_t access,
+        bool user, bool present)
+{
+    fault.address = address;
+    fault.error_code = (present ? SOFT_MMU_PF_P : 0)
+        | (access == SOFT_MMU_WRITE ? SOFT_MMU_PF_W : 0)
+        | (user ? SOFT_MMU_PF_U : 0)
+        | (access == SOFT_MMU_EXEC && (efer & SOFT_MMU_EFER_NXE)
+                ? SOFT_MMU_PF_I : 0);
+}
+
+bool SoftMMU::read_entry(uint64_t table, uint64_t index, bool wide,
+        uint64_t *entry)
+{
+    uint32_t size = wide ? 8 : 4;
+    void *p = memory->get_pointer(table + index * size, size);
+    if (p == NULL) {
+        return false;
+    }
+
+    // Another vCPU may be setting accessed bits
+    if (wide) {
+        *entry = __atomic_load_n((uint64_t*)p, __ATOMIC_RELAXED);
+    } else {
+        *entry = __atomic_load_n((uint32_t*)p, __ATOMIC_RELAXED);
+    }
+
+    return true;
+}
+
+void SoftMMU::set_entry_bits(uint64_t table, uint64_t index, bool wide,
+        uint64_t bits)
+{
+    uint32_t size = wide ? 8 : 4;
+    void *p = memory->get_pointer(table + index * size, size);
+
+    if (wide) {
+        __atomic_fetch_or((uint64_t*)p, bits, __ATOMIC_RELAXED);
+    } else {
+        __atomic_fetch_or((uint32_t*)p, (uint32_t)bits, __ATOMIC_RELAXED);
+    }
+    memory->mark_dirty(table + index * size, size);
+}
+
+bool SoftMMU::walk(uint64_t address, soft_mmu_access_t access, bool user,
+        bool update, uint64_t *physical, bool *global)
+{
+    walks++;
+    *global = false;
+
+    if (!(cr0 & SOFT_MMU_CR0_PG)) {
+        *physical = address & 0xffffffff;
+        return true;
+    }
+
+    // 4-level long mode, 3-level PAE or 2-level legacy paging
+    int levels = 2;
+    bool wide = false;
+    uint64_t table = cr3 & 0xfffff000;
+    if (efer & SOFT_MMU_EFER_LMA) {
+        levels = 4;
+        wide = true;
+        table = cr3 & SOFT_MMU_ADDRESS_MASK;
+    } else if (cr4 & SOFT_MMU_CR4_PAE) {
+        levels = 3;
+        wide = true;
+        table = cr3 & 0xffffffe0;
+    }
+    int index_bits = wide ? 9 : 10;
+    bool nx_enabled = wide && (efer & SOFT_MMU_EFER_NXE);
+
+    uint64_t tables[4];
+    uint64_t indices[4];
+    uint64_t entries[4];
+    int used = 0;
+    bool writable = true;
+    bool user_ok = true;
+    bool nx = false;
+    int shift = 0;
+    uint64_t entry = 0;
+
+    for (int level = levels - 1; level >= 0; level--) {
+        shift = MEMORY_PAGE_SHIFT + level * index_bits;
+        // PAE page directory pointers: 4 entries, without access rights
+        bool pdpte = levels == 3 && level == 2;
+        uint64_t index = (address >> shift)
+            & (pdpte ? 0x3 : (1 << index_bits) - 1);
+
+        if (!read_entry(table, index, wide, &entry)
+                || !(entry & SOFT_MMU_PTE_P)) {
+            raise_fault(address, access, user, false);
+            return false;
+        }
+        tables[used] = table;
+        indices[used] = index;
+        entries[used] = entry;
+        used++;
+
+        if (!pdpte) {
+            writable = writable && (entry & SOFT_MMU_PTE_RW);
+            user_ok = user_ok && (entry & SOFT_MMU_PTE_US);
+            nx = nx || (nx_enabled && (entry & SOFT_MMU_PTE_NX));
+        }
+
+        // 4 MB (PSE), 2 MB or 1 GB pages end the walk early
+        bool large = level > 0 && (entry & SOFT_MMU_PTE_PS)
+            && (levels == 2 ? (cr4 & SOFT_MMU_CR4_PSE) != 0
+                    : level == 1 || (levels == 4 && level == 2));
+        if (large || level == 0) {
+            break;
+        }
+        table = entry & (wide ? SOFT_MMU_ADDRESS_MASK : 0xfffff000);
+    }
+
+    if ((user && !user_ok)
+            || (access == SOFT_MMU_WRITE && !writable
+                && (user || (cr0 & SOFT_MMU_CR0_WP)))
+            || (access == SOFT_MMU_EXEC && nx)) {
+        raise_fault(address, access, user, true);
+        return false;
+    }
+
+    uint64_t page_mask = ((uint64_t)1 << shift) - 1;
+    uint64_t base = entry & (wide ? SOFT_MMU_ADDRESS_MASK : 0xfffff000);
+    *physical = (base & ~page_mask) | (address & page_mask);
+    *global = (cr4 & SOFT_MMU_CR4_PGE) && (entry & SOFT_MMU_PTE_G);
+
+    if (update) {
+        for (int i = 0; i < used; i++) {
+            uint64_t bits = SOFT_MMU_PTE_A;
+            if (i == used - 1 && access == SOFT_MMU_WRITE) {
+                bits |= SOFT_MMU_PTE_D;
+            }
+            // PAE PDPTEs have no accessed bit
+            if ((entries[i] & bits) != bits && !(levels == 3 && i == 0)) {
+                set_entry_bits(tables[i], indices[i], wide, bits);
+            }
+        }
+    }
+
+    return true;
+}
+
+bool SoftMMU::translate(uint64_t address, soft_mmu_access_t access,
+        bool user, uint64_t *physical)
+{
+    bool global;
+    soft_mmu_fault saved = fault;
+    bool ok = walk(address, access, user, false, physical, &global);
+    fault = saved;
+
+    return ok;
+}
+
+soft_tlb_entry *SoftMMU::lookup(uint64_t address, soft_mmu_access_t access,
+        bool user)
+{
+    soft_tlb_entry *entry = &tlb[user][access]
+        [(address >> MEMORY_PAGE_SHIFT) & (SOFT_TLB_SIZE - 1)];
+    if ((entry->tag & ~(uint64_t)SOFT_TLB_MMIO)
+            == (address & ~SOFT_MMU_PAGE_MASK)) {
+        return entry;
+    }
+
+    return fill(address, access, user);
+}
+
+soft_tlb_entry *SoftMMU::fill(uint64_t address, soft_mmu_access_t access,
+        bool user)
+{
+    misses++;
+
+    uint64_t physical;
+    bool global;
+    if (!walk(address, access, user, true, &physical, &global)) {
+        return NULL;
+    }
+
+    uint64_t page = address & ~SOFT_MMU_PAGE_MASK;
+    uint64_t physical_page = physical & ~SOFT_MMU_PAGE_MASK;
+    uint8_t *host = (uint8_t*)memory->get_pointer(physical_page,
+            MEMORY_PAGE_SIZE);
+
+    soft_tlb_entry *entry = &tlb[user][access]
+        [(address >> MEMORY_PAGE_SHIFT) & (SOFT_TLB_SIZE - 1)];
+    entry->tag = host != NULL ? page : page | SOFT_TLB_MMIO;
+    entry->addend = host != NULL ? (uintptr_t)host - page : 0;
+    entry->physical = physical_page;
+    entry->global = global;
+
+    return entry;
+}
+
+void SoftMMU::access_page(soft_tlb_entry *entry, uint64_t address,
+        void *data, uint32_t size, soft_mmu_access_t access)
+{
+    uint64_t physical = entry->physical | (address & SOFT_MMU_PAGE_MASK);
+    uint8_t *p = (uint8_t*)data;
+
+    if (!(entry->tag & SOFT_TLB_MMIO)) {
+        uint8_t *host = (uint8_t*)(entry->addend + address);
+        if (access == SOFT_MMU_WRITE) {
+            memcpy(host, p, size);
+            memory->mark_dirty(physical, size);
+        } else {
+            memcpy(p, host, size);
+        }
+        return;
+    }
+
+    // Devices take 1, 2, 4 or 8 bytes at a time. Reads from addresses
+    // nothing decodes return all ones.
+    while (size > 0) {
+        uint8_t chunk = size >= 8 ? 8 : size >= 4 ? 4 : size >= 2 ? 2 : 1;
+        uint64_t value = 0;
+        if (access == SOFT_MMU_WRITE) {
+            memcpy(&value, p, chunk);
+            memory->mmio_write(physical, &value, chunk);
+        } else {
+            if (!memory->mmio_read(physical, &value, chunk)) {
+                value = ~(uint64_t)0;
+            }
+            memcpy(p, &value, chunk);
+        }
+        physical += chunk;
+        p += chunk;
+        size -= chunk;
+    }
+}
+
+bool SoftMMU::access_slow(uint64_t address, void *data, uint32_t size,
+        soft_mmu_access_t access, bool user)
+{
+    uint32_t first = size;
+    if ((address & SOFT_MMU_PAGE_MASK) + size > MEMORY_PAGE_SIZE) {
+        first = MEMORY_PAGE_SIZE - (address & SOFT_MMU_PAGE_MASK);
+    }
+
+    // Translate both pages of a split access before touching either, so
+    // that a fault on the second leaves memory as it was
+    soft_tlb_entry *entry = lookup(address, access, user);
+    if (entry == NULL) {
+        return false;
+    }
+    soft_tlb_entry *next = NULL;
+    if (first < size) {
+        next = lookup(address + first, access, user);
+        if (next == NULL) {
+            return false;
+        }
+    }
+
+    access_page(entry, address, data, first, access);
+    if (next != NULL) {
+        access_page(next, address + first, (uint8_t*)data + first,
+                size - first, access);
+    }
+
+    return true;
+}
+
+uint8_t *SoftMMU::get_host_pointer(uint64_t address,
+        soft_mmu_access_t access, bool user, bool *faulted)
+{
+    soft_tlb_entry *entry = lookup(address, access, user);
+    *faulted = entry == NULL;
+    if (entry == NULL || (entry->tag & SOFT_TLB_MMIO)) {
+        return NULL;
+    }
+
+    return (uint8_t*)(entry->addend + address);
+}
+
+void SoftMMU::debug_status()
+{
+    printf("SoftMMU: %llu misses, %llu walks, %llu flushes\n",
+            (unsigned long long)misses, (unsigned long long)walks,
+            (unsigned long long)flushes);
+}
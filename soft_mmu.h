@@ -0,0 +1,180 @@
+#ifndef __SOFT_MMU_H__
+#define __SOFT_MMU_H__
+
+#include <stdint.h>
+#include <string.h>
+
+#include "memory.h"
+
+#define SOFT_TLB_BITS           (8)
+#define SOFT_TLB_SIZE           (1 << SOFT_TLB_BITS)
+#define SOFT_MMU_PAGE_MASK      ((uint64_t)MEMORY_PAGE_SIZE - 1)
+// Tag bit of pages that aren't RAM, so that the fast path misses and the
+// access goes to MMIO dispatch
+#define SOFT_TLB_MMIO           (0x1)
+// Never matches a page address
+#define SOFT_TLB_EMPTY          (~(uint64_t)0)
+
+#define SOFT_MMU_CR0_PG         (1U << 31)
+#define SOFT_MMU_CR0_WP         (1 << 16)
+#define SOFT_MMU_CR4_PSE        (1 << 4)
+#define SOFT_MMU_CR4_PAE        (1 << 5)
+#define SOFT_MMU_CR4_PGE        (1 << 7)
+#define SOFT_MMU_EFER_LMA       (1 << 10)
+#define SOFT_MMU_EFER_NXE       (1 << 11)
+
+// Page table entry bits
+#define SOFT_MMU_PTE_P          (1 << 0)
+#define SOFT_MMU_PTE_RW         (1 << 1)
+#define SOFT_MMU_PTE_US         (1 << 2)
+#define SOFT_MMU_PTE_A          (1 << 5)
+#define SOFT_MMU_PTE_D          (1 << 6)
+#define SOFT_MMU_PTE_PS         (1 << 7)
+#define SOFT_MMU_PTE_G          (1 << 8)
+#define SOFT_MMU_PTE_NX         (1ULL << 63)
+
+// Page fault error code
+#define SOFT_MMU_PF_P           (0x1)
+#define SOFT_MMU_PF_W           (0x2)
+#define SOFT_MMU_PF_U           (0x4)
+#define SOFT_MMU_PF_I           (0x10)
+
+typedef enum {
+    SOFT_MMU_READ,
+    SOFT_MMU_WRITE,
+    SOFT_MMU_EXEC,
+    SOFT_MMU_ACCESS_COUNT,
+} soft_mmu_access_t;
+
+struct soft_mmu_fault {
+    // Linear address for CR2
+    uint64_t address;
+    uint32_t error_code;
+};
+
+struct soft_tlb_entry {
+    // Linear page address, SOFT_TLB_MMIO for pages that aren't RAM, or
+    // SOFT_TLB_EMPTY
+    uint64_t tag;
+    // Host address minus linear address, for RAM pages
+    uintptr_t addend;
+    uint64_t physical;
+    bool global;
+};
+
+// Linear to physical translation for a software CPU. Translations are
+// cached per privilege level and access type in direct-mapped TLBs that
+// map straight to host pointers into Memory, so hits don't walk page
+// tables or look up RAM.
+class SoftMMU {
+public:
+    SoftMMU(Memory *memory);
+    // Control register writes; each flushes what it invalidates
+    void set_cr0(uint64_t value);
+    void set_cr3(uint64_t value);
+    void set_cr4(uint64_t value);
+    void set_efer(uint64_t value);
+    void invlpg(uint64_t address);
+    // Drop all translations, e.g. after MMIO regions have changed
+    void flush(bool global);
+
+    // Access size bytes at linear address. On a page fault return false
+    // and leave the details in get_fault(); nothing has been written then.
+    bool read(uint64_t address, void *data, uint32_t size, bool user);
+    bool write(uint64_t address, const void *data, uint32_t size, bool user);
+    bool fetch(uint64_t address, void *data, uint32_t size, bool user);
+    // Host pointer for access to address, valid up to the end of its page,
+    // or NULL if the page isn't RAM or faults. Callers writing through it
+    // report the write with Memory::mark_dirty afterwards.
+    uint8_t *get_host_pointer(uint64_t address, soft_mmu_access_t access,
+            bool user, bool *faulted);
+    // Walk the page tables without touching TLB or accessed bits
+    bool translate(uint64_t address, soft_mmu_access_t access, bool user,
+            uint64_t *physical);
+
+    const soft_mmu_fault *get_fault();
+    void debug_status();
+private:
+    soft_tlb_entry *lookup(uint64_t address, soft_mmu_access_t access,
+            bool user);
+    // Entry for address, walking the page tables on a miss. NULL on fault.
+    soft_tlb_entry *fill(uint64_t address, soft_mmu_access_t access,
+            bool user);
+    bool walk(uint64_t address, soft_mmu_access_t access, bool user,
+            bool update, uint64_t *physical, bool *global);
+    // Entry index of page table at physical address; false if not in RAM
+    bool read_entry(uint64_t table, uint64_t index, bool wide,
+            uint64_t *entry);
+    void set_entry_bits(uint64_t table, uint64_t index, bool wide,
+            uint64_t bits);
+    bool access_slow(uint64_t address, void *data, uint32_t size,
+            soft_mmu_access_t access, bool user);
+    void access_page(soft_tlb_entry *entry, uint64_t address, void *data,
+            uint32_t size, soft_mmu_access_t access);
+    void raise_fault(uint64_t address, soft_mmu_access_t access, bool user,
+            bool present);
+
+    Memory *memory;
+    uint64_t cr0;
+    uint64_t cr3;
+    uint64_t cr4;
+    uint64_t efer;
+    soft_mmu_fault fault;
+
+    // Indexed by user, access type and linear page number
+    soft_tlb_entry tlb[2][SOFT_MMU_ACCESS_COUNT][SOFT_TLB_SIZE];
+
+    uint64_t misses;
+    uint64_t walks;
+    uint64_t flushes;
+};
+
+// Hits in one page are inline; everything else goes through access_slow
+inline bool SoftMMU::read(uint64_t address, void *data, uint32_t size,
+        bool user)
+{
+    soft_tlb_entry *entry = &tlb[user][SOFT_MMU_READ]
+        [(address >> MEMORY_PAGE_SHIFT) & (SOFT_TLB_SIZE - 1)];
+    if (__builtin_expect(entry->tag == (address & ~SOFT_MMU_PAGE_MASK)
+                && (address & SOFT_MMU_PAGE_MASK) + size <= MEMORY_PAGE_SIZE,
+                1)) {
+        memcpy(data, (const void*)(entry->addend + address), size);
+        return true;
+    }
+
+    return access_slow(address, data, size, SOFT_MMU_READ, user);
+}
+
+inline bool SoftMMU::write(uint64_t address, const void *data, uint32_t size,
+        bool user)
+{
+    soft_tlb_entry *entry = &tlb[user][SOFT_MMU_WRITE]
+        [(address >> MEMORY_PAGE_SHIFT) & (SOFT_TLB_SIZE - 1)];
+    if (__builtin_expect(entry->tag == (address & ~SOFT_MMU_PAGE_MASK)
+                && (address & SOFT_MMU_PAGE_MASK) + size <= MEMORY_PAGE_SIZE,
+                1)) {
+        memcpy((void*)(entry->addend + address), data, size);
+        memory->mark_dirty(entry->physical | (address & SOFT_MMU_PAGE_MASK),
+                size);
+        return true;
+    }
+
+    return access_slow(address, (void*)data, size, SOFT_MMU_WRITE, user);
+}
+
+inline bool SoftMMU::fetch(uint64_t address, void *data, uint32_t size,
+        bool user)
+{
+    soft_tlb_entry *entry = &tlb[user][SOFT_MMU_EXEC]
+        [(address >> MEMORY_PAGE_SHIFT) & (SOFT_TLB_SIZE - 1)];
+    if (__builtin_expect(entry->tag == (address & ~SOFT_MMU_PAGE_MASK)
+                && (address & SOFT_MMU_PAGE_MASK) + size <= MEMORY_PAGE_SIZE,
+                1)) {
+        memcpy(data, (const void*)(entry->addend + address), size);
+        return true;
+    }
+
+    return access_slow(address, data, size, SOFT_MMU_EXEC, user);
+}
+
+#endif
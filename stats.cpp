@@ -0,0 +1,349 @@
+#include "stats.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+thread_local int Stats::current_vcpu = 0;
+
+static const char *exit_names[STATS_EXIT_COUNT] = {
+    "io",
+    "mmio",
+    "hlt",
+    "irq_window",
+    "external_irq",
+    "cpuid",
+    "msr",
+    "ept_violation",
+    "other",
+};
+
+Stats::Stats()
+{
+    for (int i = 0; i < STATS_MAX_VCPUS; i++) {
+        vcpus[i] = NULL;
+    }
+
+    pthread_mutex_init(&lock, NULL);
+    device_count = 0;
+
+    pthread_cond_init(&dump_cond, NULL);
+    dump_path[0] = '\0';
+    dump_interval_ms = 0;
+    dumping = false;
+
+    // Boot CPU, and anything driving devices outside a vCPU thread
+    register_vcpu(0);
+}
+
+Stats::~Stats()
+{
+    stop_dump();
+
+    for (int i = 0; i < STATS_MAX_VCPUS; i++) {
+        free(vcpus[i]);
+    }
+
+    pthread_cond_destroy(&dump_cond);
+    pthread_mutex_destroy(&lock);
+}
+
+void Stats::register_vcpu(int vcpu)
+{
+    if (vcpu < 0 || vcpu >= STATS_MAX_VCPUS) {
+        printf("Stats: Invalid vCPU %d\n", vcpu);
+        return;
+    }
+
+    pthread_mutex_lock(&lock);
+    if (vcpus[vcpu] == NULL) {
+        void *p;
+        if (posix_memalign(&p, STATS_CACHE_LINE_SIZE,
+                    sizeof(vcpu_stats)) == 0) {
+            memset(p, 0, sizeof(vcpu_stats));
+            // Publish only after the counters are zeroed
+            __atomic_store_n(&vcpus[vcpu], (vcpu_stats*)p, __ATOMIC_RELEASE);
+        }
+    }
+    pthread_mutex_unlock(&lock);
+
+    current_vcpu = vcpu;
+}
+
+uint8_t Stats::get_device_id(IODevice *device, uint32_t base_port)
+{
+    uint8_t id = STATS_NO_DEVICE;
+
+    pthread_mutex_lock(&lock);
+    for (int i = 0; i < device_count; i++) {
+        if (devices[i] == device) {
+            id = i;
+            break;
+        }
+    }
+    if (id == STATS_NO_DEVICE && device_count < STATS_MAX_DEVICES) {
+        id = device_count;
+        devices[id] = device;
+        device_ports[id] = base_port;
+        device_count++;
+    }
+    pthread_mutex_unlock(&lock);
+
+    return id;
+}
+
+uint64_t Stats::get_exit_count(stats_exit_t reason)
+{
+    uint64_t count = 0;
+
+    for (int i = 0; i < STATS_MAX_VCPUS; i++) {
+        vcpu_stats *s = __atomic_load_n(&vcpus[i], __ATOMIC_ACQUIRE);
+        if (s != NULL) {
+            count += load(&s->exits[reason]);
+        }
+    }
+
+    return count;
+}
+
+uint64_t Stats::get_port_count(uint32_t port, bool is_write)
+{
+    uint64_t count = 0;
+
+    port &= STATS_PORT_COUNT - 1;
+    for (int i = 0; i < STATS_MAX_VCPUS; i++) {
+        vcpu_stats *s = __atomic_load_n(&vcpus[i], __ATOMIC_ACQUIRE);
+        if (s != NULL) {
+            count += load(is_write ? &s->port_writes[port]
+                    : &s->port_reads[port]);
+        }
+    }
+
+    return count;
+}
+
+void Stats::get_histogram(uint8_t device, uint64_t *buckets)
+{
+    memset(buckets, 0, sizeof(uint64_t) * STATS_HISTOGRAM_BUCKETS);
+
+    if (device >= STATS_MAX_DEVICES) {
+        return;
+    }
+
+    for (int i = 0; i < STATS_MAX_VCPUS; i++) {
+        vcpu_stats *s = __atomic_load_n(&vcpus[i], __ATOMIC_ACQUIRE);
+        if (s == NULL) {
+            continue;
+        }
+        for (int j = 0; j < STATS_HISTOGRAM_BUCKETS; j++) {
+            buckets[j] += load(&s->device_cycles[device][j]);
+        }
+    }
+}
+
+void Stats::write_json(FILE *fp)
+{
+    fprintf(fp, "{\"vcpus\":[");
+    bool first = true;
+    for (int i = 0; i < STATS_MAX_VCPUS; i++) {
+        vcpu_stats *s = __atomic_load_n(&vcpus[i], __ATOMIC_ACQUIRE);
+        if (s == NULL) {
+            continue;
+        }
+        fprintf(fp, "%s{\"id\":%d,\"exits\":{", first ? "" : ",", i);
+        for (int j = 0; j < STATS_EXIT_COUNT; j++) {
+            fprintf(fp, "%s\"%s\":%llu", j == 0 ? "" : ",", exit_names[j],
+                    (unsigned long long)load(&s->exits[j]));
+        }
+        fprintf(fp, "}}");
+        first = false;
+    }
+
+    // Only ports that have seen traffic
+    fprintf(fp, "],\"ports\":[");
+    first = true;
+    for (uint32_t port = 0; port < STATS_PORT_COUNT; port++) {
+        uint64_t reads = get_port_count(port, false);
+        uint64_t writes = get_port_count(port, true);
+        if (reads == 0 && writes == 0) {
+            continue;
+        }
+        fprintf(fp, "%s{\"port\":%u,\"reads\":%llu,\"writes\":%llu}",
+                first ? "" : ",", port, (unsigned long long)reads,
+                (unsigned long long)writes);
+        first = false;
+    }
+
+    fprintf(fp, "],\"devices\":[");
+    pthread_mutex_lock(&lock);
+    int count = device_count;
+    pthread_mutex_unlock(&lock);
+    for (int i = 0; i < count; i++) {
+        uint64_t buckets[STATS_HISTOGRAM_BUCKETS];
+        get_histogram(i, buckets);
+        fprintf(fp, "%s{\"base_port\":%u,\"cycles_log2\":[",
+                i == 0 ? "" : ",", device_ports[i]);
+        for (int j = 0; j < STATS_HISTOGRAM_BUCKETS; j++) {
+            fprintf(fp, "%s%llu", j == 0 ? "" : ",",
+                    (unsigned long long)buckets[j]);
+        }
+        fprintf(fp, "]}");
+    }
+    fprintf(fp, "]}\n");
+}
+
+bool Stats::start_dump(const char *path, uint32_t interval_ms)
+{
+    if (dumping) {
+        printf("Stats: Dump already running\n");
+        return false;
+    }
+    if (strlen(path) >= sizeof(dump_path) || interval_ms == 0) {
+        printf("Stats: Invalid dump target\n");
+        return false;
+    }
+
+    strcpy(dump_path, path);
+    dump_interval_ms = interval_ms;
+    dumping = true;
+
+    if (pthread_create(&dump_thread, NULL, dump_main, this) != 0) {
+        printf("Stats: Failed to create dump thread\n");
+        dumping = false;
+        return false;
+    }
+
+    return true;
+}
+
+void Stats::stop_dump()
+{
+    pthread_mutex_lock(&lock);
+    if (!dumping) {
+        pthread_mutex_unlock(&lock);
+        return;
+    }
+    dumping = false;
+    pthread_cond_signal(&dump_cond);
+    pthread_mutex_unlock(&lock);
+
+    pthread_join(dump_thread, NULL);
+    // Final snapshot
+    dump_once();
+}
+
+void *Stats::dump_main(void *arg)
+{
+    Stats *stats = (Stats*)arg;
+
+    pthread_mutex_lock(&stats->lock);
+    while (stats->dumping) {
+        struct timeval now;
+        struct timespec deadline;
+        gettimeofday(&now, NULL);
+        uint64_t ns = (uint64_t)now.tv_usec * 1000
+            + (uint64_t)stats->dump_interval_ms * 1000000;
+        deadline.tv_sec = now.tv_sec + ns / 1000000000;
+        deadline.tv_nsec = ns % 1000000000;
+
+        pthread_cond_timedwait(&stats->dump_cond, &stats->lock, &deadline);
+        if (!stats->dumping) {
+            break;
+        }
+
+        pthread_mutex_unlock(&stats->lock);
+        stats->dump_once();
+        pthread_mutex_lock(&stats->lock);
+    }
+    pthread_mutex_unlock(&stats->lock);
+
+    return NULL;
+}
+
+bool Stats::dump_once()
+{
+    if (strncmp(dump_path, "unix:", 5) == 0) {
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, dump_path + 5, sizeof(addr.sun_path) - 1);
+
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0) {
+            return false;
+        }
+        // Nobody listening is not an error; try again next interval
+        if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+            close(fd);
+            return false;
+        }
+
+        FILE *fp = fdopen(fd, "w");
+        if (fp == NULL) {
+            close(fd);
+            return false;
+        }
+        write_json(fp);
+        fclose(fp);
+
+        return true;
+    }
+
+    // Write a temporary file and rename it, so readers never see a
+    // partial snapshot
+    char tmp_path[sizeof(dump_path) + 4];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", dump_path);
+
+    FILE *fp = fopen(tmp_path, "w");
+    if (fp == NULL) {
+        printf("Stats: Failed to open %s: %s\n", tmp_path, strerror(errno));
+        return false;
+    }
+    write_json(fp);
+    fclose(fp);
+
+    if (rename(tmp_path, dump_path) < 0) {
+        printf("Stats: Failed to rename %s: %s\n", tmp_path, strerror(errno));
+        return false;
+    }
+
+    return true;
+}
+
+const char *Stats::exit_name(stats_exit_t reason)
+{
+    return reason < STATS_EXIT_COUNT ? exit_names[reason] : "invalid";
+}
+
+void Stats::debug_status()
+{
+    printf("------------------------------\n");
+    printf("Stats:\n");
+    for (int i = 0; i < STATS_EXIT_COUNT; i++) {
+        printf("Exit %s: %llu\n", exit_names[i],
+                (unsigned long long)get_exit_count((stats_exit_t)i));
+    }
+    for (int i = 0; i < device_count; i++) {
+        uint64_t buckets[STATS_HISTOGRAM_BUCKETS];
+        uint64_t total = 0;
+        int median = 0;
+        get_histogram(i, buckets);
+        for (int j = 0; j < STATS_HISTOGRAM_BUCKETS; j++) {
+            total += buckets[j];
+        }
+        for (uint64_t seen = 0; median < STATS_HISTOGRAM_BUCKETS; median++) {
+            seen += buckets[median];
+            if (seen * 2 >= total) {
+                break;
+            }
+        }
+        printf("Device at 0x%04x: %llu accesses, median < %llu cycles\n",
+                device_ports[i], (unsigned long long)total,
+                1ULL << (median + 1));
+    }
+    printf("------------------------------\n");
+}
@@ -0,0 +1,132 @@
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "io_device.h"
+
+#define STATS_MAX_VCPUS         (16)
+#define STATS_MAX_DEVICES       (32)
+#define STATS_PORT_COUNT        (0x10000)
+// Bucket n counts handler latencies of [2^n, 2^(n+1)) cycles
+#define STATS_HISTOGRAM_BUCKETS (32)
+#define STATS_CACHE_LINE_SIZE   (64)
+#define STATS_NO_DEVICE         (0xff)
+
+typedef enum {
+    STATS_EXIT_IO,
+    STATS_EXIT_MMIO,
+    STATS_EXIT_HLT,
+    STATS_EXIT_IRQ_WINDOW,
+    STATS_EXIT_EXTERNAL_IRQ,
+    STATS_EXIT_CPUID,
+    STATS_EXIT_MSR,
+    STATS_EXIT_EPT_VIOLATION,
+    STATS_EXIT_OTHER,
+    STATS_EXIT_COUNT,
+} stats_exit_t;
+
+// Counters of one vCPU. Only the owning vCPU thread writes them, so
+// updates are relaxed stores and readers never stall the vCPU. Each
+// vCPU has its own cache-line-aligned allocation.
+struct vcpu_stats {
+    uint64_t exits[STATS_EXIT_COUNT];
+    uint64_t port_reads[STATS_PORT_COUNT];
+    uint64_t port_writes[STATS_PORT_COUNT];
+    uint64_t device_cycles[STATS_MAX_DEVICES][STATS_HISTOGRAM_BUCKETS];
+};
+
+class Stats {
+public:
+    Stats();
+    ~Stats();
+    // Call from the thread running the vCPU before it enters the guest.
+    // Threads that never register count as vCPU 0.
+    void register_vcpu(int vcpu);
+    // Return device index used by histograms, registering it on first use
+    uint8_t get_device_id(IODevice *device, uint32_t base_port);
+
+    // Hot path, called from vCPU threads
+    void record_exit(stats_exit_t reason)
+    {
+        vcpu_stats *s = vcpus[current_vcpu];
+        if (s != NULL) {
+            increment(&s->exits[reason], 1);
+        }
+    }
+    void record_io(uint32_t port, bool is_write, uint8_t device,
+            uint32_t count, uint64_t cycles)
+    {
+        vcpu_stats *s = vcpus[current_vcpu];
+        if (s == NULL) {
+            return;
+        }
+        port &= STATS_PORT_COUNT - 1;
+        increment(is_write ? &s->port_writes[port] : &s->port_reads[port],
+                count);
+        if (device < STATS_MAX_DEVICES) {
+            increment(&s->device_cycles[device][histogram_bucket(cycles)], 1);
+        }
+    }
+
+    // Snapshots summed over all vCPUs; safe to call from any thread
+    uint64_t get_exit_count(stats_exit_t reason);
+    uint64_t get_port_count(uint32_t port, bool is_write);
+    void get_histogram(uint8_t device, uint64_t *buckets);
+    void write_json(FILE *fp);
+
+    // Periodically write JSON to path, or to a UNIX socket if path is
+    // "unix:<socket path>"
+    bool start_dump(const char *path, uint32_t interval_ms);
+    void stop_dump();
+
+    static uint64_t read_tsc()
+    {
+        uint32_t lo, hi;
+        __asm__ __volatile__("rdtsc" : "=a"(lo), "=d"(hi));
+
+        return (uint64_t)hi << 32 | lo;
+    }
+    static const char *exit_name(stats_exit_t reason);
+    void debug_status();
+private:
+    static void increment(uint64_t *counter, uint64_t count)
+    {
+        __atomic_store_n(counter,
+                __atomic_load_n(counter, __ATOMIC_RELAXED) + count,
+                __ATOMIC_RELAXED);
+    }
+    static int histogram_bucket(uint64_t cycles)
+    {
+        int bucket = 63 - __builtin_clzll(cycles | 1);
+        return bucket < STATS_HISTOGRAM_BUCKETS
+            ? bucket : STATS_HISTOGRAM_BUCKETS - 1;
+    }
+    static uint64_t load(const uint64_t *counter)
+    {
+        return __atomic_load_n(counter, __ATOMIC_RELAXED);
+    }
+
+    static void *dump_main(void *arg);
+    bool dump_once();
+
+    static thread_local int current_vcpu;
+
+    vcpu_stats *vcpus[STATS_MAX_VCPUS];
+
+    pthread_mutex_t lock;
+    IODevice *devices[STATS_MAX_DEVICES];
+    uint32_t device_ports[STATS_MAX_DEVICES];
+    int device_count;
+
+    // Periodic dump
+    pthread_t dump_thread;
+    pthread_cond_t dump_cond;
+    char dump_path[256];
+    uint32_t dump_interval_ms;
+    bool dumping;
+};
+
+#endif
@@ -0,0 +1,120 @@
+#include "ata.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+Memory memory(1024 * 1024);
+AsyncIO aio;
+ATA ata(&memory, &aio);
+
+void out_byte(uint32_t port, uint32_t value)
+{
+    ata.write(port, &value, 1);
+}
+
+uint32_t in_byte(uint32_t port)
+{
+    uint32_t value = 0;
+    ata.read(port, &value, 1);
+
+    return value;
+}
+
+void wait_for_drq()
+{
+    while ((in_byte(ATA_BASE_PORT + 7) & (ATA_SR_BSY | ATA_SR_DRQ))
+            != ATA_SR_DRQ) {
+        ata.poll_irq();
+    }
+}
+
+void wait_for_ready()
+{
+    while (in_byte(ATA_BASE_PORT + 7) & ATA_SR_BSY) {
+        ata.poll_irq();
+    }
+}
+
+int main()
+{
+    char filename[] = "/tmp/test_ata_XXXXXX";
+    int fd = mkstemp(filename);
+    ftruncate(fd, 1024 * 1024);
+    close(fd);
+
+    RawImage image;
+    image.open(filename, false);
+    ata.attach_disk(&image);
+
+    uint8_t sector[BLOCK_SECTOR_SIZE];
+
+    // IDENTIFY
+    out_byte(ATA_BASE_PORT + 6, 0xa0);
+    out_byte(ATA_BASE_PORT + 7, ATA_CMD_IDENTIFY);
+    wait_for_drq();
+    ata.read_block(ATA_BASE_PORT, sector, 2, BLOCK_SECTOR_SIZE / 2);
+    printf("sectors: %d\n", sector[120] | sector[121] << 8
+            | sector[122] << 16 | sector[123] << 24);
+
+    // Write 2 sectors at LBA 10 with PIO
+    for (int i = 0; i < BLOCK_SECTOR_SIZE; i++) {
+        sector[i] = i & 0xff;
+    }
+    out_byte(ATA_BASE_PORT + 2, 2);
+    out_byte(ATA_BASE_PORT + 3, 10);
+    out_byte(ATA_BASE_PORT + 4, 0);
+    out_byte(ATA_BASE_PORT + 5, 0);
+    out_byte(ATA_BASE_PORT + 6, 0xe0);
+    out_byte(ATA_BASE_PORT + 7, ATA_CMD_WRITE_SECTORS);
+    for (int i = 0; i < 2; i++) {
+        wait_for_drq();
+        ata.write_block(ATA_BASE_PORT, sector, 2, BLOCK_SECTOR_SIZE / 2);
+    }
+    wait_for_ready();
+
+    // Read them back with DMA into 0x10000 using a single PRD at 0x1000
+    uint32_t *prd = (uint32_t*)memory.get_pointer(0x1000, 8);
+    prd[0] = 0x10000;
+    prd[1] = ATA_PRD_EOT | (2 * BLOCK_SECTOR_SIZE);
+    uint32_t value = 0x1000;
+    ata.write(ATA_BMIDE_BASE_PORT + 4, &value, 4);
+    out_byte(ATA_BASE_PORT + 2, 2);
+    out_byte(ATA_BASE_PORT + 3, 10);
+    out_byte(ATA_BASE_PORT + 7, ATA_CMD_READ_DMA);
+    out_byte(ATA_BMIDE_BASE_PORT, ATA_BM_CMD_START | ATA_BM_CMD_READ);
+    wait_for_ready();
+
+    uint8_t *data = (uint8_t*)memory.get_pointer(0x10000, 1024);
+    for (int i = 0; i < 1024; i += 128) {
+        printf("%d: %d\n", i, data[i + 1]);
+    }
+    printf("bus master status: 0x%02x\n", in_byte(ATA_BMIDE_BASE_PORT + 2));
+
+    // Reset while a DMA read is in flight: busy until the read is done,
+    // then the next command runs normally
+    out_byte(ATA_BMIDE_BASE_PORT + 2, ATA_BM_ST_IRQ | ATA_BM_ST_DMA0_CAP);
+    out_byte(ATA_BMIDE_BASE_PORT, 0);
+    out_byte(ATA_BASE_PORT + 2, 2);
+    out_byte(ATA_BASE_PORT + 3, 10);
+    out_byte(ATA_BASE_PORT + 6, 0xe0);
+    out_byte(ATA_BASE_PORT + 7, ATA_CMD_READ_DMA);
+    out_byte(ATA_BMIDE_BASE_PORT, ATA_BM_CMD_START | ATA_BM_CMD_READ);
+    out_byte(ATA_CONTROL_PORT, ATA_DC_SRST);
+    out_byte(ATA_CONTROL_PORT, 0);
+    printf("status after reset: 0x%02x\n", in_byte(ATA_BASE_PORT + 7));
+    wait_for_ready();
+    printf("reset done: status 0x%02x, error 0x%02x, bus master 0x%02x\n",
+            in_byte(ATA_BASE_PORT + 7), in_byte(ATA_BASE_PORT + 1),
+            in_byte(ATA_BMIDE_BASE_PORT + 2));
+    out_byte(ATA_BASE_PORT + 6, 0xa0);
+    out_byte(ATA_BASE_PORT + 7, ATA_CMD_IDENTIFY);
+    wait_for_drq();
+    ata.read_block(ATA_BASE_PORT, sector, 2, BLOCK_SECTOR_SIZE / 2);
+    printf("identify after reset: %d sectors\n", sector[120]
+            | sector[121] << 8 | sector[122] << 16 | sector[123] << 24);
+
+    ata.debug_status();
+    unlink(filename);
+
+    return 0;
+}
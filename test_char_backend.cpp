@@ -0,0 +1,92 @@
+#include "char_backend.h"
+#include "event_loop.h"
+#include "uart.h"
+#include <stdio.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+// Read what the guest would see on the UART, waiting up to a second for
+// the event loop to hand it over
+static int guest_read(UART *uart, char *data, int length)
+{
+    int count = 0;
+    for (int i = 0; i < 1000 && count < length; i++) {
+        uint32_t lsr = 0;
+        uart->poll_irq();
+        uart->read(UART_BASE_PORT + 5, &lsr, 1);
+        if (!(lsr & UART_LSR_RX)) {
+            struct timespec ts = { 0, 1000000 };
+            nanosleep(&ts, NULL);
+            continue;
+        }
+        uint32_t value = 0;
+        uart->read(UART_BASE_PORT, &value, 1);
+        data[count++] = value;
+    }
+
+    return count;
+}
+
+int main()
+{
+    EventLoop loop;
+    loop.start();
+
+    // Two machines' serial lines on one loop
+    UART uarts[2];
+    FdCharBackend *backends[2];
+    int peers[2];
+    for (int i = 0; i < 2; i++) {
+        int sv[2];
+        socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+        peers[i] = sv[1];
+        backends[i] = new FdCharBackend(sv[0], &loop);
+        backends[i]->connect_uart(&uarts[i]);
+        uarts[i].connect_backend(backends[i]);
+    }
+
+    // Host to guest
+    if (write(peers[1], "two", 3) != 3 || write(peers[0], "one", 3) != 3) {
+        printf("write failed\n");
+        return 1;
+    }
+    for (int i = 0; i < 2; i++) {
+        char data[8] = {0};
+        int count = guest_read(&uarts[i], data, 3);
+        printf("uart %d received %d bytes: %s\n", i, count, data);
+    }
+
+    // Guest to host
+    uint32_t value = 'X';
+    uarts[0].write(UART_BASE_PORT, &value, 1);
+    char c = 0;
+    ssize_t n = read(peers[0], &c, 1);
+    printf("peer 0 read %zd byte: %c\n", n, c);
+
+    // A hung up peer is dropped from the loop; the other keeps working
+    close(peers[0]);
+    struct timespec ts = { 0, 10000000 };
+    nanosleep(&ts, NULL);
+    if (write(peers[1], "!", 1) != 1) {
+        printf("write failed\n");
+        return 1;
+    }
+    char data[2] = {0};
+    int count = guest_read(&uarts[1], data, 1);
+    printf("after hangup, uart 1 received %d byte: %s\n", count, data);
+
+    // Guest output to the hung up peer is dropped, without SIGPIPE
+    for (int i = 0; i < 2; i++) {
+        uarts[0].write(UART_BASE_PORT, &value, 1);
+    }
+    printf("uart 0 still writing after hangup\n");
+
+    for (int i = 0; i < 2; i++) {
+        delete backends[i];
+    }
+    close(peers[1]);
+    loop.stop();
+
+    return 0;
+}
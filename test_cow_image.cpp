@@ -0,0 +1,46 @@
+#include "cow_image.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+int main()
+{
+    const char *base_filename = "/tmp/test_cow_base.img";
+    const char *overlay_filename = "/tmp/test_cow_overlay.img";
+    uint8_t buffer[4096];
+
+    // Base image where every byte is its sector number
+    FILE *fp = fopen(base_filename, "wb");
+    for (int i = 0; i < 2048; i++) {
+        memset(buffer, i & 0xff, BLOCK_SECTOR_SIZE);
+        fwrite(buffer, BLOCK_SECTOR_SIZE, 1, fp);
+    }
+    fclose(fp);
+
+    CowImage::create(overlay_filename, 0, base_filename);
+    CowImage image;
+    image.open(overlay_filename, false);
+
+    // Partial write into an unallocated cluster
+    memset(buffer, 0xaa, sizeof(buffer));
+    struct iovec iov = {buffer, BLOCK_SECTOR_SIZE};
+    image.pwritev(&iov, 1, 3 * BLOCK_SECTOR_SIZE);
+
+    // Read across the written sector and untouched clusters
+    for (int sector = 0; sector < 2048; sector += 100) {
+        iov.iov_len = BLOCK_SECTOR_SIZE;
+        image.preadv(&iov, 1, (uint64_t)sector * BLOCK_SECTOR_SIZE);
+        printf("sector %d: 0x%02x\n", sector, buffer[0]);
+    }
+    iov.iov_len = 4 * BLOCK_SECTOR_SIZE;
+    image.preadv(&iov, 1, 0);
+    printf("sector 2: 0x%02x, sector 3: 0x%02x\n",
+            buffer[2 * BLOCK_SECTOR_SIZE], buffer[3 * BLOCK_SECTOR_SIZE]);
+
+    image.debug_status();
+    unlink(overlay_filename);
+    unlink(base_filename);
+
+    return 0;
+}
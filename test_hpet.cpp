@@ -0,0 +1,58 @@
+#include "hpet.h"
+#include <stdio.h>
+
+int main()
+{
+    EventScheduler scheduler;
+    HPET hpet(&scheduler);
+    uint64_t rax = 0;
+
+    // Enable main counter
+    rax = HPET_CFG_ENABLE;
+    hpet.mmio_write(HPET_BASE_ADDRESS + HPET_REG_CONFIG, &rax, 8);
+
+    // One-shot comparator on timer 2, 1ms from now
+    hpet.mmio_read(HPET_BASE_ADDRESS + HPET_REG_MAIN_COUNTER, &rax, 8);
+    uint64_t cmp = rax + 10000;
+    rax = HPET_TN_ENABLE | 2 << HPET_TN_ROUTE_SHIFT;
+    hpet.mmio_write(HPET_BASE_ADDRESS + HPET_REG_TIMER_BASE
+            + 2 * HPET_REG_TIMER_SIZE + HPET_REG_TIMER_CONFIG, &rax, 8);
+    hpet.mmio_write(HPET_BASE_ADDRESS + HPET_REG_TIMER_BASE
+            + 2 * HPET_REG_TIMER_SIZE + HPET_REG_TIMER_CMP, &cmp, 8);
+
+    for (int i = 0; i < 10000; i++) {
+        // A single 32-bit read per timestamp
+        hpet.mmio_read(HPET_BASE_ADDRESS + HPET_REG_MAIN_COUNTER, &rax, 4);
+        scheduler.run_expired();
+
+        printf("%llu\n", (unsigned long long)rax);
+    }
+
+    hpet.debug_status();
+
+    // Virtual time: a timer a minute away fires without waiting for it
+    scheduler.set_clock_mode(EVENT_CLOCK_VIRTUAL);
+    hpet.mmio_read(HPET_BASE_ADDRESS + HPET_REG_MAIN_COUNTER, &rax, 8);
+    cmp = rax + 60ULL * 1000000000ULL / HPET_TICK_IN_NS;
+    hpet.mmio_write(HPET_BASE_ADDRESS + HPET_REG_TIMER_BASE
+            + 2 * HPET_REG_TIMER_SIZE + HPET_REG_TIMER_CMP, &cmp, 8);
+    scheduler.skip_to_next_deadline();
+    scheduler.run_expired();
+    hpet.mmio_read(HPET_BASE_ADDRESS + HPET_REG_MAIN_COUNTER, &rax, 8);
+    printf("Counter after skip: %llu (comparator %llu)\n",
+            (unsigned long long)rax, (unsigned long long)cmp);
+
+    // Enabling a timer with the reset comparator schedules nothing
+    rax = HPET_TN_ENABLE;
+    hpet.mmio_write(HPET_BASE_ADDRESS + HPET_REG_TIMER_BASE
+            + HPET_REG_TIMER_CONFIG, &rax, 8);
+    bool skipped = scheduler.skip_to_next_deadline();
+    scheduler.run_expired();
+    hpet.mmio_read(HPET_BASE_ADDRESS + HPET_REG_INT_STATUS, &rax, 8);
+    printf("Reset comparator: skipped %d, interrupt status 0x%llx\n",
+            skipped, (unsigned long long)rax);
+
+    hpet.debug_status();
+
+    return 0;
+}
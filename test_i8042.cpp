@@ -0,0 +1,146 @@
+#include "i8042.h"
+#include "pic.h"
+#include <pthread.h>
+#include <stdio.h>
+
+#define THREAD_KEYS             (100000)
+
+static void out(I8042 *i8042, uint32_t port, uint32_t value)
+{
+    i8042->write(port, &value, 1);
+}
+
+static uint32_t in(I8042 *i8042, uint32_t port)
+{
+    uint32_t value = 0;
+    i8042->read(port, &value, 1);
+    return value;
+}
+
+// Print everything in the output buffer as the guest's IRQ handler would
+// read it
+static void drain(const char *label, I8042 *i8042, PIC *pic)
+{
+    int irqs = 0;
+    printf("%s:", label);
+    for (;;) {
+        if (pic->poll_irq()) {
+            irqs++;
+            // EOI
+            uint32_t eoi = 0x20;
+            pic->write(PIC_BASE_PORT, &eoi, 1);
+        }
+        if (!(in(i8042, I8042_COMMAND_PORT) & I8042_STATUS_OBF)) {
+            break;
+        }
+        printf(" %02x", in(i8042, I8042_DATA_PORT));
+    }
+    printf(" (%d IRQs)\n", irqs);
+}
+
+static void *type_keys(void *arg)
+{
+    I8042 *i8042 = (I8042*)arg;
+    for (int i = 0; i < THREAD_KEYS; i++) {
+        // Keys 1-9 in turn; retry while the queue is full
+        while (!i8042->queue_key(0x02 + i % 9, false, false)) {
+        }
+    }
+    return NULL;
+}
+
+int main()
+{
+    PIC pic;
+    I8042 i8042;
+    i8042.connect_pic(&pic);
+    pic.connect_io_device(I8042_IRQ, &i8042);
+
+    // Controller self test with interrupts off, then keyboard reset
+    out(&i8042, I8042_COMMAND_PORT, 0xaa);
+    printf("self test: status 0x%02x,", in(&i8042, I8042_COMMAND_PORT));
+    printf(" 0x%02x\n", in(&i8042, I8042_DATA_PORT));
+    out(&i8042, I8042_DATA_PORT, 0xff);
+    drain("keyboard reset", &i8042, &pic);
+    out(&i8042, I8042_DATA_PORT, 0xf2);
+    drain("identify", &i8042, &pic);
+
+    // Typed text comes out translated to set 1
+    i8042.receive((const uint8_t*)"Hi\n", 3);
+    drain("'Hi\\n' set 1", &i8042, &pic);
+
+    // Without translation the keyboard's own set 2
+    out(&i8042, I8042_COMMAND_PORT, 0x60);
+    out(&i8042, I8042_DATA_PORT, I8042_CCB_KBD_IRQ | I8042_CCB_SYS);
+    i8042.receive((const uint8_t*)"a", 1);
+    i8042.queue_key(0x48, true, false);
+    i8042.queue_key(0x48, true, true);
+    drain("'a', up set 2", &i8042, &pic);
+
+    // Scanning off holds keys back until it's on again
+    out(&i8042, I8042_DATA_PORT, 0xf5);
+    drain("scanning off", &i8042, &pic);
+    i8042.queue_key(0x1c, false, false);
+    drain("held", &i8042, &pic);
+    out(&i8042, I8042_DATA_PORT, 0xf4);
+    drain("scanning on", &i8042, &pic);
+    out(&i8042, I8042_COMMAND_PORT, 0x60);
+    out(&i8042, I8042_DATA_PORT, I8042_CCB_KBD_IRQ | I8042_CCB_TRANSLATE);
+
+    // A20 through port 0x92 and the output port
+    printf("port a: 0x%02x, a20 %d\n", in(&i8042, I8042_PORT_A),
+            i8042.get_a20());
+    out(&i8042, I8042_PORT_A, 0x00);
+    printf("fast a20 off: a20 %d\n", i8042.get_a20());
+    out(&i8042, I8042_COMMAND_PORT, 0xd1);
+    out(&i8042, I8042_DATA_PORT, I8042_OUT_RESET | I8042_OUT_A20);
+    out(&i8042, I8042_COMMAND_PORT, 0xd0);
+    printf("output port a20 on: a20 %d, output port 0x%02x\n",
+            i8042.get_a20(), in(&i8042, I8042_DATA_PORT));
+
+    // Both reset paths. Port A resets on a rising edge of bit 0 only, and
+    // the machine reset clears it, so that the usual read-modify-write
+    // resets every time. Expect 3 resets in the status below.
+    out(&i8042, I8042_COMMAND_PORT, 0xfe);
+    for (int i = 0; i < 2; i++) {
+        out(&i8042, I8042_PORT_A, in(&i8042, I8042_PORT_A) | I8042_OUT_RESET);
+        // Still high: no edge
+        out(&i8042, I8042_PORT_A, in(&i8042, I8042_PORT_A) | I8042_OUT_RESET);
+        printf("fast reset %d: port a 0x%02x", i, in(&i8042, I8042_PORT_A));
+        // As Machine::handle_reset does
+        i8042.reset();
+        printf(", after machine reset 0x%02x\n", in(&i8042, I8042_PORT_A));
+    }
+
+    // A full queue drops whole keystrokes
+    int accepted = 0;
+    for (int i = 0; i < 300; i++) {
+        accepted += i8042.queue_key(0x1e, false, false);
+    }
+    printf("accepted %d of 300 keys\n", accepted);
+    for (int i = 0; i < accepted; i++) {
+        in(&i8042, I8042_COMMAND_PORT);
+        in(&i8042, I8042_DATA_PORT);
+    }
+
+    // Another thread typing while the guest reads
+    pthread_t thread;
+    pthread_create(&thread, NULL, type_keys, &i8042);
+    int received = 0;
+    int out_of_order = 0;
+    while (received < THREAD_KEYS) {
+        if (!(in(&i8042, I8042_COMMAND_PORT) & I8042_STATUS_OBF)) {
+            continue;
+        }
+        if (in(&i8042, I8042_DATA_PORT) != 0x02u + received % 9) {
+            out_of_order++;
+        }
+        received++;
+    }
+    pthread_join(thread, NULL);
+    printf("threaded: %d keys, %d out of order\n", received, out_of_order);
+
+    i8042.debug_status();
+
+    return 0;
+}
@@ -0,0 +1,72 @@
+#include "mmio_decode.h"
+#include <stdio.h>
+
+#define REGISTER                (0x1122334455667788ULL)
+#define LOADED                  (0xfedcba9876543281ULL)
+
+static void decode(const char *label, const uint8_t *code, int length,
+        int mode_bits)
+{
+    mmio_instruction insn;
+    if (!mmio_decode(code, length, mode_bits, &insn)) {
+        printf("%s: not decoded\n", label);
+        return;
+    }
+
+    printf("%s: %s size %d reg %d%s length %d", label,
+            insn.op == MMIO_OP_STORE ? "store" : "load", insn.size,
+            insn.reg, insn.high_byte ? " (high byte)" : "", insn.length);
+    if (insn.op == MMIO_OP_STORE) {
+        printf(", value 0x%llx\n",
+                (unsigned long long)mmio_store_value(&insn, REGISTER));
+    } else {
+        printf(", result 0x%llx\n", (unsigned long long)mmio_load_result(
+                    &insn, REGISTER, LOADED));
+    }
+}
+
+int main()
+{
+    // mov [ebx], eax
+    const uint8_t store32[] = { 0x89, 0x03 };
+    decode("mov [ebx], eax", store32, sizeof(store32), 32);
+    // mov [bx+si+0x10], ax
+    const uint8_t store16[] = { 0x89, 0x40, 0x10 };
+    decode("mov [bx+si+0x10], ax", store16, sizeof(store16), 16);
+    // mov [ebx+ecx*4+0x12345678], bh
+    const uint8_t store_high[] = { 0x88, 0xbc, 0x8b, 0x78, 0x56, 0x34, 0x12 };
+    decode("mov [ebx+ecx*4+disp32], bh", store_high, sizeof(store_high), 32);
+    // mov r9, [rip+0x100]
+    const uint8_t load64[] = { 0x4c, 0x8b, 0x0d, 0x00, 0x01, 0x00, 0x00 };
+    decode("mov r9, [rip+0x100]", load64, sizeof(load64), 64);
+    // mov eax, [rdi] clears the upper half
+    const uint8_t load32[] = { 0x8b, 0x07 };
+    decode("mov eax, [rdi]", load32, sizeof(load32), 64);
+    // mov ah, [esi]
+    const uint8_t load_high[] = { 0x8a, 0x26 };
+    decode("mov ah, [esi]", load_high, sizeof(load_high), 32);
+    // mov word fs:[eax], 0x1234
+    const uint8_t store_imm16[] = { 0x64, 0x66, 0xc7, 0x00, 0x34, 0x12 };
+    decode("mov word fs:[eax], imm", store_imm16, sizeof(store_imm16), 32);
+    // mov qword [rax], -2
+    const uint8_t store_imm64[] = { 0x48, 0xc7, 0x00, 0xfe, 0xff, 0xff, 0xff };
+    decode("mov qword [rax], imm32", store_imm64, sizeof(store_imm64), 64);
+    // mov eax, [0xfee000f0]
+    const uint8_t moffs[] = { 0xa1, 0xf0, 0x00, 0xe0, 0xfe };
+    decode("mov eax, [moffs]", moffs, sizeof(moffs), 32);
+    // movzx ecx, word [rdx]
+    const uint8_t movzx[] = { 0x0f, 0xb7, 0x0a };
+    decode("movzx ecx, word [rdx]", movzx, sizeof(movzx), 64);
+    // movsx rdx, byte [rbx]
+    const uint8_t movsx[] = { 0x48, 0x0f, 0xbe, 0x13 };
+    decode("movsx rdx, byte [rbx]", movsx, sizeof(movsx), 64);
+
+    // Register operands, other instructions and code cut short
+    const uint8_t register_operand[] = { 0x89, 0xc3 };
+    decode("mov ebx, eax", register_operand, sizeof(register_operand), 32);
+    const uint8_t add[] = { 0x01, 0x03 };
+    decode("add [ebx], eax", add, sizeof(add), 32);
+    decode("truncated", store_high, 4, 32);
+
+    return 0;
+}
@@ -0,0 +1,126 @@
+#include "pci.h"
+#include <stdio.h>
+
+#define SLOT_CONFIG             (0x80000000 | (1 << 11))
+
+Memory memory(1024 * 1024);
+IOBus io_bus;
+
+// One port and one memory BAR, reporting the address of each access
+class TestDevice : public PCIDevice, public IODevice, public MMIODevice {
+public:
+    TestDevice() : PCIDevice(0x1234, 0x5678, 0xff0000)
+    {
+        add_io_bar(0, 0x20, this);
+        add_mmio_bar(1, 0x1000, this);
+        add_msi_capability();
+    }
+    void write(uint32_t, const uint32_t *, uint8_t) {}
+    void read(uint32_t port, uint32_t *value, uint8_t)
+    {
+        *value = port;
+    }
+    void mmio_write(uint64_t, const uint64_t *, uint8_t) {}
+    void mmio_read(uint64_t address, uint64_t *value, uint8_t)
+    {
+        *value = address;
+    }
+protected:
+    void bar_remapped(int bar, uint64_t address)
+    {
+        printf("  bar %d remapped to 0x%llx\n", bar,
+                (unsigned long long)address);
+    }
+};
+
+void config_write(uint8_t offset, uint32_t value, uint8_t size)
+{
+    uint32_t address = SLOT_CONFIG | offset;
+    io_bus.write(PCI_CONFIG_ADDRESS_PORT, &address, 4);
+    io_bus.write(PCI_CONFIG_DATA_PORT + (offset & 0x3), &value, size);
+}
+
+uint32_t config_read(uint8_t offset, uint8_t size)
+{
+    uint32_t address = SLOT_CONFIG | offset;
+    uint32_t value = 0;
+    io_bus.write(PCI_CONFIG_ADDRESS_PORT, &address, 4);
+    io_bus.read(PCI_CONFIG_DATA_PORT + (offset & 0x3), &value, size);
+
+    return value;
+}
+
+// Size a BAR the way firmware does: all ones, read back, restore
+uint32_t bar_size(int bar)
+{
+    uint8_t offset = PCI_BAR_0 + bar * 4;
+    uint32_t saved = config_read(offset, 4);
+    config_write(offset, 0xffffffff, 4);
+    uint32_t value = config_read(offset, 4);
+    config_write(offset, saved, 4);
+
+    uint32_t mask = value & PCI_BAR_IO ? ~0x3U : ~0xfU;
+    return value == 0 ? 0 : ~(value & mask) + 1;
+}
+
+void print_access(uint32_t port, uint64_t address)
+{
+    uint32_t port_value = 0;
+    uint64_t mmio_value = 0;
+    io_bus.read(port, &port_value, 1);
+    printf("  port 0x%x reads 0x%x, memory 0x%llx %s\n", port, port_value,
+            (unsigned long long)address,
+            memory.mmio_read(address, &mmio_value, 4)
+            && mmio_value == address ? "mapped" : "unmapped");
+}
+
+int main()
+{
+    PCIBus bus(&io_bus, &memory);
+    io_bus.connect_io_device(PCI_CONFIG_ADDRESS_PORT, 8, &bus);
+    TestDevice device;
+    printf("slot %d\n", bus.connect_pci_device(&device));
+
+    printf("id 0x%08x, BAR sizes 0x%x 0x%x 0x%x\n", config_read(0, 4),
+            bar_size(0), bar_size(1), bar_size(2));
+
+    // Assigned addresses only decode once the command register allows
+    config_write(PCI_BAR_0, 0xc000, 4);
+    config_write(PCI_BAR_0 + 4, 0xe0000000, 4);
+    printf("assigned, decoding off:\n");
+    print_access(0xc004, 0xe0000010);
+    config_write(PCI_COMMAND, PCI_COMMAND_IO | PCI_COMMAND_MEMORY, 2);
+    printf("decoding on:\n");
+    print_access(0xc004, 0xe0000010);
+
+    // Moving a BAR leaves nothing behind at the old address, and sizing it
+    // unmaps it meanwhile
+    printf("moved:\n");
+    config_write(PCI_BAR_0, 0xd000, 4);
+    config_write(PCI_BAR_0 + 4, 0xe0100000, 4);
+    print_access(0xc004, 0xe0000010);
+    print_access(0xd004, 0xe0100010);
+    printf("sized again:\n");
+    bar_size(1);
+    config_write(PCI_COMMAND, 0, 2);
+    printf("decoding off:\n");
+    print_access(0xd004, 0xe0100010);
+
+    // MSI capability: only the enable bit of the flags is writable, and
+    // messages need bus mastering
+    uint8_t cap = config_read(PCI_CAPABILITY_LIST, 1);
+    printf("status 0x%04x, capability 0x%02x id 0x%02x\n",
+            config_read(PCI_STATUS, 2), cap, config_read(cap, 1));
+    printf("msi disabled: send %d\n", device.send_msi());
+    config_write(cap + 4, PCI_MSI_ADDRESS_BASE, 4);
+    config_write(cap + 8, 0x41, 2);
+    config_write(cap + 2, 0xffff, 2);
+    printf("msi flags 0x%04x, address 0x%08x, data 0x%04x, enabled %d\n",
+            config_read(cap + 2, 2), config_read(cap + 4, 4),
+            config_read(cap + 8, 2), device.msi_enabled());
+    printf("msi enabled: send %d\n", device.send_msi());
+
+    bus.debug_status();
+
+    return 0;
+}
@@ -0,0 +1,86 @@
+#include "pic.h"
+#include <stdio.h>
+
+static void out(PIC *pic, uint32_t port, uint32_t value)
+{
+    pic->write(port, &value, 1);
+}
+
+static uint32_t in(PIC *pic, uint32_t port)
+{
+    uint32_t value = 0;
+    pic->read(port, &value, 1);
+    return value;
+}
+
+// ICW1-4 as a BIOS does, all IRQs unmasked
+static void init(PIC *pic, uint32_t port, uint8_t vector, uint8_t icw3,
+        uint8_t icw4)
+{
+    out(pic, port, 0x11);
+    out(pic, port + 1, vector);
+    out(pic, port + 1, icw3);
+    out(pic, port + 1, icw4);
+    out(pic, port + 1, 0x00);
+}
+
+static uint8_t read_isr(PIC *pic, uint32_t port)
+{
+    out(pic, port, 0x0b);
+    uint8_t isr = in(pic, port);
+    out(pic, port, 0x0a);
+    return isr;
+}
+
+static void ack(const char *label, PIC *pic)
+{
+    printf("%s: ", label);
+    if (pic->poll_irq()) {
+        printf("vector 0x%02x", pic->get_vector());
+    } else {
+        printf("none");
+    }
+    printf(", isr 0x%02x\n", read_isr(pic, PIC_BASE_PORT));
+}
+
+int main()
+{
+    PIC pic;
+    PIC slave(PIC_SLAVE_BASE_PORT);
+    init(&pic, PIC_BASE_PORT, 0x08, 1 << PIC_CASCADE_IRQ, 0x01);
+
+    // Lower priority requests wait for the EOI of the one in service,
+    // higher priority ones nest
+    pic.push_irq(3);
+    ack("irq 3", &pic);
+    pic.push_irq(5);
+    ack("irq 5 behind 3", &pic);
+    pic.push_irq(1);
+    ack("irq 1 over 3", &pic);
+    out(&pic, PIC_BASE_PORT, 0x20);
+    ack("eoi 1", &pic);
+    out(&pic, PIC_BASE_PORT, 0x20);
+    ack("eoi 3", &pic);
+    out(&pic, PIC_BASE_PORT, 0x20);
+
+    // Nothing goes in service with automatic EOI
+    init(&pic, PIC_BASE_PORT, 0x08, 1 << PIC_CASCADE_IRQ, 0x03);
+    pic.push_irq(3);
+    ack("aeoi irq 3", &pic);
+    pic.push_irq(5);
+    ack("aeoi irq 5", &pic);
+
+    // A slave interrupt waits behind a higher priority one on the master
+    init(&pic, PIC_BASE_PORT, 0x08, 1 << PIC_CASCADE_IRQ, 0x01);
+    init(&slave, PIC_SLAVE_BASE_PORT, 0x70, PIC_CASCADE_IRQ, 0x01);
+    pic.connect_slave(&slave);
+    pic.push_irq(1);
+    ack("irq 1", &pic);
+    slave.push_irq(4);
+    printf("irq 12 behind 1: pending %d\n", pic.irq_pending());
+    out(&pic, PIC_BASE_PORT, 0x20);
+    ack("eoi 1", &pic);
+    printf("slave isr 0x%02x\n", read_isr(&slave, PIC_SLAVE_BASE_PORT));
+
+    return 0;
+}
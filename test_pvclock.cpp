@@ -0,0 +1,100 @@
+#include "pvclock.h"
+#include "host_clock.h"
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define TIME_INFO_ADDRESS       (0x1000)
+#define WALL_CLOCK_ADDRESS      (0x2000)
+
+static uint64_t rdtsc()
+{
+    uint32_t lo, hi;
+    __asm__ __volatile__("rdtsc" : "=a"(lo), "=d"(hi));
+
+    return (uint64_t)hi << 32 | lo;
+}
+
+// Guest system time [ns] the way a kvmclock driver reads it, retrying
+// while the host is updating
+static uint64_t guest_time(volatile pvclock_vcpu_time_info *info)
+{
+    uint32_t version;
+    uint64_t ns;
+    do {
+        version = info->version;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        uint64_t delta = rdtsc() - info->tsc_timestamp;
+        if (info->tsc_shift < 0) {
+            delta >>= -info->tsc_shift;
+        } else {
+            delta <<= info->tsc_shift;
+        }
+        ns = info->system_time
+            + (uint64_t)(((unsigned __int128)delta * info->tsc_to_system_mul)
+                    >> 32);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while ((version & 1) || version != info->version);
+
+    return ns;
+}
+
+int main()
+{
+    Memory memory(1024 * 1024);
+    EventScheduler scheduler;
+    PVClock pvclock(&memory, &scheduler);
+
+    uint32_t eax, ebx, ecx, edx;
+    char signature[13] = {0};
+    pvclock.cpuid(PVCLOCK_CPUID_SIGNATURE, &eax, &ebx, &ecx, &edx);
+    memcpy(signature, &ebx, 4);
+    memcpy(signature + 4, &ecx, 4);
+    memcpy(signature + 8, &edx, 4);
+    printf("signature: %s, max leaf 0x%08x\n", signature, eax);
+
+    // Enabling the page publishes an even version
+    volatile pvclock_vcpu_time_info *info = (pvclock_vcpu_time_info*)
+        memory.get_pointer(TIME_INFO_ADDRESS, sizeof(*info));
+    pvclock.write_msr(PVCLOCK_MSR_SYSTEM_TIME,
+            TIME_INFO_ADDRESS | PVCLOCK_MSR_ENABLE);
+    printf("version %u, flags 0x%x\n", info->version, info->flags);
+    pvclock.write_msr(PVCLOCK_MSR_SYSTEM_TIME,
+            TIME_INFO_ADDRESS | PVCLOCK_MSR_ENABLE);
+    printf("version after update %u\n", info->version);
+
+    // mul and shift scale the TSC to guest time: 100 ms of host time
+    // reads as 100 ms in the guest
+    uint64_t host_start = host_clock_ns();
+    uint64_t guest_start = guest_time(info);
+    struct timespec ts = { 0, 100000000 };
+    nanosleep(&ts, NULL);
+    uint64_t host_elapsed = host_clock_ns() - host_start;
+    uint64_t guest_elapsed = guest_time(info) - guest_start;
+    double error = (double)guest_elapsed / host_elapsed - 1;
+    printf("guest time within 0.5%% of host time: %d\n",
+            error > -0.005 && error < 0.005);
+
+    // Wall clock at guest time 0 plus guest time is now
+    volatile pvclock_wall_clock *wall = (pvclock_wall_clock*)
+        memory.get_pointer(WALL_CLOCK_ADDRESS, sizeof(*wall));
+    pvclock.write_msr(PVCLOCK_MSR_WALL_CLOCK, WALL_CLOCK_ADDRESS);
+    uint64_t wall_now = wall->sec * 1000000000ULL + wall->nsec
+        + guest_time(info);
+    int64_t wall_error = wall_now - host_clock_realtime_ns();
+    printf("wall clock version %u, within 1 ms: %d\n", wall->version,
+            wall_error > -1000000 && wall_error < 1000000);
+
+    // A reset stops updates to the old page
+    pvclock.reset();
+    uint32_t version = info->version;
+    pvclock.update();
+    printf("after reset: version unchanged %d\n", info->version == version);
+
+    // Not offered under virtual time
+    scheduler.set_clock_mode(EVENT_CLOCK_VIRTUAL);
+    printf("virtual time: signature leaf handled %d\n",
+            pvclock.cpuid(PVCLOCK_CPUID_SIGNATURE, &eax, &ebx, &ecx, &edx));
+
+    return 0;
+}
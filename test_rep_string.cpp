@@ -0,0 +1,220 @@
+#include "memory.h"
+#include "rep_string.h"
+#include "soft_mmu.h"
+#include <stdio.h>
+#include <string.h>
+
+#define RAM_SIZE                (8 << 20)
+#define PAGE_DIR                (0x1000)
+#define PAGE_TABLE              (0x2000)
+#define MMIO_BASE               (0xfee00000)
+// Strings land in here; one page of it is MMIO and one not present
+#define REGION_BASE             (0x100000)
+#define REGION_SIZE             (0x80000)
+#define REGION_MMIO             (0x160000)
+#define REGION_MISSING          (0x17f000)
+#define ITERATIONS              (4000)
+
+class TestMMIO : public MMIODevice {
+public:
+    void mmio_write(uint64_t, const uint64_t *, uint8_t)
+    {
+    }
+    void mmio_read(uint64_t address, uint64_t *value, uint8_t)
+    {
+        *value = address * 0x9e3779b97f4a7c15ULL;
+    }
+};
+
+static uint64_t random_state = 1;
+
+static uint64_t next_random()
+{
+    random_state = random_state * 6364136223846793005ULL
+        + 1442695040888963407ULL;
+    return random_state >> 33;
+}
+
+static void map_pages(Memory *memory)
+{
+    uint32_t *table = (uint32_t*)memory->get_pointer(PAGE_TABLE, 0x1000);
+    for (int i = 0; i < 1024; i++) {
+        table[i] = (i << 12) | SOFT_MMU_PTE_P | SOFT_MMU_PTE_RW;
+    }
+    table[REGION_MMIO >> 12] = MMIO_BASE | SOFT_MMU_PTE_P | SOFT_MMU_PTE_RW;
+    table[REGION_MISSING >> 12] = 0;
+    *(uint32_t*)memory->get_pointer(PAGE_DIR, 4) = PAGE_TABLE
+        | SOFT_MMU_PTE_P | SOFT_MMU_PTE_RW;
+}
+
+static void step(rep_string_state *state, bool source)
+{
+    uint64_t mask = state->address_mask;
+    uint64_t delta = state->backward ? -(uint64_t)state->size : state->size;
+    if (source) {
+        state->rsi = (state->rsi & ~mask) | ((state->rsi + delta) & mask);
+    }
+    state->rdi = (state->rdi & ~mask) | ((state->rdi + delta) & mask);
+    state->rcx = (state->rcx & ~mask) | ((state->rcx - 1) & mask);
+}
+
+// One element at a time, as the CPU describes it
+static bool reference_movs(SoftMMU *mmu, rep_string_state *state)
+{
+    uint64_t mask = state->address_mask;
+    while ((state->rcx & mask) != 0) {
+        uint64_t element = 0;
+        if (!mmu->read(state->src_base + (state->rsi & mask), &element,
+                    state->size, state->user)
+                || !mmu->write(state->dst_base + (state->rdi & mask),
+                    &element, state->size, state->user)) {
+            return false;
+        }
+        step(state, true);
+    }
+    return true;
+}
+
+static bool reference_stos(SoftMMU *mmu, rep_string_state *state,
+        uint64_t value)
+{
+    uint64_t mask = state->address_mask;
+    while ((state->rcx & mask) != 0) {
+        if (!mmu->write(state->dst_base + (state->rdi & mask), &value,
+                    state->size, state->user)) {
+            return false;
+        }
+        step(state, false);
+    }
+    return true;
+}
+
+static rep_string_state random_state_for(uint64_t *value)
+{
+    static const uint8_t sizes[] = { 1, 2, 4, 8 };
+    rep_string_state state;
+    memset(&state, 0, sizeof(state));
+    state.size = sizes[next_random() & 3];
+    state.backward = (next_random() & 3) == 0;
+    uint64_t count = next_random() % 3000;
+    state.rcx = count | (next_random() & 0xffff) << 32;
+
+    if ((next_random() & 3) == 0) {
+        // Real mode style: 64 KB segments, indexes about to wrap
+        state.address_mask = 0xffff;
+        state.src_base = REGION_BASE;
+        state.dst_base = REGION_BASE + 0x10000 * (next_random() % 3);
+        state.rsi = next_random() & 0xffff;
+        state.rdi = (next_random() & 1) ? 0xffff - (next_random() & 0xff)
+            : next_random() & 0xffff;
+        state.rcx &= 0xffff;
+    } else {
+        state.address_mask = 0xffffffff;
+        uint64_t span = count * state.size + 16;
+        uint64_t room = REGION_SIZE - 2 * 3000 * 8 - 16;
+        state.rsi = REGION_BASE + 3000 * 8 + next_random() % room;
+        // Often close to the source so the strings overlap
+        if (next_random() & 1) {
+            int64_t distance = (int64_t)(next_random() % (2 * span + 1))
+                - (int64_t)span;
+            state.rdi = state.rsi + distance;
+        } else {
+            state.rdi = REGION_BASE + 3000 * 8 + next_random() % room;
+        }
+    }
+    state.rsi |= (next_random() & 0xffff) << 32 & ~state.address_mask;
+    state.rdi |= (next_random() & 0xffff) << 32 & ~state.address_mask;
+
+    *value = ((uint64_t)next_random() << 32) | next_random();
+    return state;
+}
+
+int main()
+{
+    Memory reference(RAM_SIZE);
+    Memory memory(RAM_SIZE);
+    TestMMIO mmio;
+    reference.map_mmio(MMIO_BASE, 0x1000, &mmio);
+    memory.map_mmio(MMIO_BASE, 0x1000, &mmio);
+    map_pages(&reference);
+    map_pages(&memory);
+    SoftMMU reference_mmu(&reference);
+    SoftMMU mmu(&memory);
+    reference_mmu.set_cr3(PAGE_DIR);
+    reference_mmu.set_cr0(SOFT_MMU_CR0_PG);
+    mmu.set_cr3(PAGE_DIR);
+    mmu.set_cr0(SOFT_MMU_CR0_PG);
+
+    uint8_t *reference_region = (uint8_t*)reference.get_pointer(REGION_BASE,
+            REGION_SIZE);
+    uint8_t *region = (uint8_t*)memory.get_pointer(REGION_BASE,
+            REGION_SIZE);
+    for (int i = 0; i < REGION_SIZE; i++) {
+        reference_region[i] = region[i] = next_random();
+    }
+
+    int mismatches = 0;
+    int faults = 0;
+    int overlapping = 0;
+    for (int i = 0; i < ITERATIONS; i++) {
+        uint64_t value;
+        rep_string_state expected = random_state_for(&value);
+        rep_string_state actual = expected;
+        bool movs = next_random() & 1;
+
+        bool expected_ok;
+        bool actual_ok;
+        if (movs) {
+            uint64_t mask = expected.address_mask;
+            uint64_t distance = expected.dst_base + (expected.rdi & mask)
+                - expected.src_base - (expected.rsi & mask);
+            uint64_t bytes = (expected.rcx & expected.address_mask)
+                * expected.size;
+            if (distance + bytes < 2 * bytes) {
+                overlapping++;
+            }
+            expected_ok = reference_movs(&reference_mmu, &expected);
+            actual_ok = rep_movs(&mmu, &memory, &actual);
+        } else {
+            expected_ok = reference_stos(&reference_mmu, &expected, value);
+            actual_ok = rep_stos(&mmu, &memory, &actual, value);
+        }
+
+        if (!expected_ok) {
+            faults++;
+        }
+        if (expected_ok != actual_ok || expected.rsi != actual.rsi
+                || expected.rdi != actual.rdi || expected.rcx != actual.rcx
+                || memcmp(reference_region, region, REGION_SIZE) != 0) {
+            if (mismatches++ < 5) {
+                printf("mismatch at %d: %s size %d%s, rcx 0x%llx/0x%llx\n",
+                        i, movs ? "movs" : "stos", actual.size,
+                        actual.backward ? " backward" : "",
+                        (unsigned long long)expected.rcx,
+                        (unsigned long long)actual.rcx);
+            }
+            memcpy(region, reference_region, REGION_SIZE);
+        }
+    }
+
+    printf("iterations: %d, overlapping: %d, faulted: %d\n", ITERATIONS,
+            overlapping, faults);
+    printf("mismatches: %d\n", mismatches);
+
+    // Bulk writes show up in the dirty log like element writes do
+    memory.start_dirty_tracking();
+    for (size_t i = 0; i < memory.get_dirty_word_count(); i++) {
+        memory.fetch_dirty_word(i);
+    }
+    rep_string_state state;
+    memset(&state, 0, sizeof(state));
+    state.address_mask = 0xffffffff;
+    state.rdi = REGION_BASE + 0x800;
+    state.rcx = 0x1000;
+    state.size = 4;
+    rep_stos(&mmu, &memory, &state, 0);
+    printf("dirty pages after 16 KB stos: %llu\n",
+            (unsigned long long)memory.count_dirty_pages());
+
+    return mismatches != 0;
+}
@@ -0,0 +1,54 @@
+#include "cmos.h"
+#include "replay.h"
+#include "uart.h"
+#include <stdio.h>
+
+// Read seconds and drain serial input, as a guest would between exits
+static void run_guest(CMOS *cmos, UART *uart)
+{
+    uint32_t value;
+
+    for (int i = 0; i < 3; i++) {
+        replay_advance();
+        replay_poll();
+
+        value = 0x00;
+        cmos->write(0x70, &value, 1);
+        cmos->read(0x71, &value, 1);
+        printf("Seconds: %02x, RX:", value);
+
+        while (true) {
+            uart->read(UART_BASE_PORT + 5, &value, 1);
+            if (!(value & UART_LSR_RX)) {
+                break;
+            }
+            uart->read(UART_BASE_PORT, &value, 1);
+            printf(" %c", value);
+        }
+        printf("\n");
+    }
+}
+
+int main()
+{
+    CMOS cmos;
+    UART uart;
+    const uint8_t input[] = "hv86";
+
+    replay_connect_input(&uart);
+
+    printf("Record:\n");
+    replay_start_record("test_replay.log");
+    uart.receive(input, 4);
+    run_guest(&cmos, &uart);
+    replay_stop();
+
+    // Input arriving during replay is ignored; the log supplies it
+    printf("Replay:\n");
+    replay_start_play("test_replay.log");
+    uart.receive(input, 2);
+    run_guest(&cmos, &uart);
+    replay_stop();
+
+    return 0;
+}
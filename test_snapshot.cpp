@@ -0,0 +1,94 @@
+#include "memory.h"
+#include "migration.h"
+#include "snapshot.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define RAM_SIZE                (16 << 20)
+
+static void *receive_main(void *arg)
+{
+    MigrationReceiver *receiver = (MigrationReceiver*)arg;
+    printf("receive: %d\n", receiver->receive());
+    return NULL;
+}
+
+static void print_stats(const char *name, snapshot_stats *stats)
+{
+    printf("%s: %llu pages, %llu zero, %llu bytes\n", name,
+            (unsigned long long)stats->pages,
+            (unsigned long long)stats->zero_pages,
+            (unsigned long long)stats->bytes);
+}
+
+int main()
+{
+    const char *base_filename = "/tmp/test_snapshot_base.snap";
+    const char *delta_filename = "/tmp/test_snapshot_delta.snap";
+    const char *socket_path = "/tmp/test_snapshot.sock";
+
+    Memory memory(RAM_SIZE);
+    uint8_t *ram = (uint8_t*)memory.get_pointer(0, RAM_SIZE);
+    memset(ram + 0x10000, 0x11, 0x3000);
+
+    // Dirty bits across a bitmap word boundary
+    memory.start_dirty_tracking();
+    for (size_t i = 0; i < memory.get_dirty_word_count(); i++) {
+        memory.fetch_dirty_word(i);
+    }
+    memory.mark_dirty(62 * MEMORY_PAGE_SIZE + 100, 3 * MEMORY_PAGE_SIZE);
+    printf("dirty pages: %llu\n",
+            (unsigned long long)memory.count_dirty_pages());
+    printf("word 0: 0x%016llx\n",
+            (unsigned long long)memory.fetch_dirty_word(0));
+    printf("word 1: 0x%016llx\n",
+            (unsigned long long)memory.fetch_dirty_word(1));
+    printf("word 1 again: 0x%016llx\n",
+            (unsigned long long)memory.fetch_dirty_word(1));
+    memory.stop_dirty_tracking();
+
+    // Full snapshot, then only what changed
+    snapshot_stats stats;
+    snapshot_save(&memory, base_filename, &stats);
+    print_stats("base", &stats);
+    memset(ram + 0x10800, 0x22, 16);
+    memory.mark_dirty(0x10800, 16);
+    memset(ram + 0x200000, 0x33, 0x2000);
+    memory.mark_dirty(0x200000, 0x2000);
+    snapshot_save(&memory, delta_filename, &stats);
+    print_stats("delta", &stats);
+
+    Memory restored(RAM_SIZE);
+    memset(restored.get_pointer(0x300000, 4), 0xff, 4);
+    printf("load base: %d\n", snapshot_load(&restored, base_filename));
+    printf("load delta: %d\n", snapshot_load(&restored, delta_filename));
+    printf("restored matches: %d\n",
+            memcmp(restored.get_pointer(0, RAM_SIZE), ram, RAM_SIZE) == 0);
+
+    // Migration to a receiver on another thread
+    Memory target(RAM_SIZE);
+    MigrationReceiver receiver(&target);
+    receiver.listen(socket_path);
+    pthread_t thread;
+    pthread_create(&thread, NULL, receive_main, &receiver);
+
+    memory.stop_dirty_tracking();
+    MigrationSender sender(&memory);
+    printf("connect: %d\n", sender.connect(socket_path));
+    printf("precopy: %d\n", sender.precopy());
+    // Guest writes while the first rounds were going out
+    memset(ram + 0x400000, 0x44, 0x1000);
+    memory.mark_dirty(0x400000, 0x1000);
+    printf("complete: %d\n", sender.complete());
+    pthread_join(thread, NULL);
+    sender.debug_status();
+    printf("migrated matches: %d\n",
+            memcmp(target.get_pointer(0, RAM_SIZE), ram, RAM_SIZE) == 0);
+
+    unlink(base_filename);
+    unlink(delta_filename);
+
+    return 0;
+}
@@ -0,0 +1,123 @@
+#include "memory.h"
+#include "soft_mmu.h"
+#include <stdio.h>
+#include <string.h>
+
+#define RAM_SIZE                (8 << 20)
+#define PAGE_DIR                (0x1000)
+#define PAGE_TABLE              (0x2000)
+#define MMIO_BASE               (0xfee00000)
+
+class TestMMIO : public MMIODevice {
+public:
+    void mmio_write(uint64_t address, const uint64_t *value, uint8_t size)
+    {
+        printf("mmio write 0x%llx = 0x%llx (%d)\n",
+                (unsigned long long)address, (unsigned long long)*value,
+                size);
+    }
+    void mmio_read(uint64_t, uint64_t *value, uint8_t)
+    {
+        *value = 0x1122334455667788ULL;
+    }
+};
+
+static uint32_t *entry(Memory *memory, uint64_t table, int index)
+{
+    return (uint32_t*)memory->get_pointer(table + index * 4, 4);
+}
+
+int main()
+{
+    Memory memory(RAM_SIZE);
+    TestMMIO mmio;
+    memory.map_mmio(MMIO_BASE, 0x1000, &mmio);
+    SoftMMU mmu(&memory);
+
+    // Paging off: linear is physical
+    uint32_t value = 0xcafef00d;
+    mmu.write(0x5000, &value, 4, false);
+    value = 0;
+    mmu.read(0x5000, &value, 4, false);
+    printf("unpaged: 0x%08x\n", value);
+
+    // First 4 MB through a page table, 0x400000 as a 4 MB page onto the
+    // same memory, and one page onto the MMIO device
+    for (int i = 0; i < 1024; i++) {
+        *entry(&memory, PAGE_TABLE, i) = (i << 12) | SOFT_MMU_PTE_P
+            | SOFT_MMU_PTE_RW | SOFT_MMU_PTE_US;
+    }
+    *entry(&memory, PAGE_TABLE, 0x10) = 0x5000 | SOFT_MMU_PTE_P;
+    *entry(&memory, PAGE_TABLE, 0x11) = MMIO_BASE | SOFT_MMU_PTE_P
+        | SOFT_MMU_PTE_RW;
+    *entry(&memory, PAGE_TABLE, 0x12) = 0;
+    *entry(&memory, PAGE_DIR, 0) = PAGE_TABLE | SOFT_MMU_PTE_P
+        | SOFT_MMU_PTE_RW | SOFT_MMU_PTE_US;
+    *entry(&memory, PAGE_DIR, 1) = 0 | SOFT_MMU_PTE_P | SOFT_MMU_PTE_RW
+        | SOFT_MMU_PTE_PS;
+    mmu.set_cr4(SOFT_MMU_CR4_PSE);
+    mmu.set_cr3(PAGE_DIR);
+    mmu.set_cr0(SOFT_MMU_CR0_PG | SOFT_MMU_CR0_WP);
+
+    value = 0;
+    mmu.read(0x10000, &value, 4, false);
+    printf("0x10000 -> 0x5000: 0x%08x\n", value);
+    mmu.read(0x405000, &value, 4, false);
+    printf("4 MB page: 0x%08x\n", value);
+    printf("accessed/dirty: pde %d, pte %d/%d\n",
+            (*entry(&memory, PAGE_DIR, 0) & SOFT_MMU_PTE_A) != 0,
+            (*entry(&memory, PAGE_TABLE, 0x10) & SOFT_MMU_PTE_A) != 0,
+            (*entry(&memory, PAGE_TABLE, 0x10) & SOFT_MMU_PTE_D) != 0);
+
+    // Read-only page, from kernel with WP set and from user
+    printf("write read-only: %d", mmu.write(0x10000, &value, 4, false));
+    printf(", error 0x%x\n", mmu.get_fault()->error_code);
+    printf("user read of kernel page: %d", mmu.read(0x10000, &value, 4,
+                true));
+    printf(", error 0x%x\n", mmu.get_fault()->error_code);
+    printf("not present: %d", mmu.read(0x12004, &value, 4, false));
+    printf(", cr2 0x%llx, error 0x%x\n",
+            (unsigned long long)mmu.get_fault()->address,
+            mmu.get_fault()->error_code);
+
+    // Write across into a missing page changes nothing
+    uint64_t wide = 0xffffffffffffffffULL;
+    uint32_t *tail = (uint32_t*)memory.get_pointer(0x11ffc, 4);
+    *tail = 0;
+    printf("split write faults: %d, tail 0x%08x\n",
+            mmu.write(0x11ffc, &wide, 8, false), *tail);
+
+    // MMIO through the tagged entry
+    uint64_t mmio_value = 0;
+    mmu.read(0x11000, &mmio_value, 8, false);
+    printf("mmio read: 0x%llx\n", (unsigned long long)mmio_value);
+    value = 0xabcd;
+    mmu.write(0x11010, &value, 2, false);
+
+    // Stale until INVLPG
+    *entry(&memory, PAGE_TABLE, 0x10) = 0x6000 | SOFT_MMU_PTE_P;
+    *(uint32_t*)memory.get_pointer(0x6000, 4) = 0x66666666;
+    mmu.read(0x10000, &value, 4, false);
+    printf("before invlpg: 0x%08x\n", value);
+    mmu.invlpg(0x10000);
+    mmu.read(0x10000, &value, 4, false);
+    printf("after invlpg: 0x%08x\n", value);
+
+    // Global pages survive CR3 loads
+    *entry(&memory, PAGE_TABLE, 0x20) = 0x6000 | SOFT_MMU_PTE_P
+        | SOFT_MMU_PTE_G;
+    mmu.set_cr4(SOFT_MMU_CR4_PSE | SOFT_MMU_CR4_PGE);
+    mmu.read(0x20000, &value, 4, false);
+    *entry(&memory, PAGE_TABLE, 0x20) = 0x5000 | SOFT_MMU_PTE_P
+        | SOFT_MMU_PTE_G;
+    mmu.set_cr3(PAGE_DIR);
+    mmu.read(0x20000, &value, 4, false);
+    printf("global after cr3 load: 0x%08x\n", value);
+    mmu.flush(true);
+    mmu.read(0x20000, &value, 4, false);
+    printf("global after flush: 0x%08x\n", value);
+
+    mmu.debug_status();
+
+    return 0;
+}
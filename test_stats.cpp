@@ -0,0 +1,30 @@
+#include "io_bus.h"
+#include "stats.h"
+#include "uart.h"
+#include <stdio.h>
+
+int main()
+{
+    IOBus io_bus;
+    Stats stats;
+    UART uart;
+    uint32_t value = 0;
+
+    io_bus.connect_io_device(UART_BASE_PORT, 8, &uart);
+    io_bus.connect_stats(&stats);
+
+    // Poll line status as a driver would
+    for (int i = 0; i < 10000; i++) {
+        io_bus.read(UART_BASE_PORT + 5, &value, 1);
+    }
+    stats.record_exit(STATS_EXIT_IO);
+
+    printf("LSR reads: %llu\n",
+            (unsigned long long)stats.get_port_count(UART_BASE_PORT + 5,
+                false));
+
+    stats.write_json(stdout);
+    stats.debug_status();
+
+    return 0;
+}
@@ -0,0 +1,103 @@
+#include "vcpu_scheduler.h"
+#include <stdio.h>
+
+#define TASK_COUNT  (2000)
+
+// Mostly idle guest: spins briefly, then halts on a 1ms timer, and stops
+// after a number of ticks
+class IdleGuest : public VCPUTask {
+public:
+    IdleGuest() : ticks(0) {}
+    vcpu_slice_t run_slice(uint64_t, uint64_t *wake_time)
+    {
+        for (volatile int i = 0; i < 1000; i++) {
+        }
+        if (++ticks >= 20) {
+            __atomic_fetch_add(&finished, 1, __ATOMIC_RELAXED);
+            return VCPU_SLICE_DONE;
+        }
+        *wake_time = VCPUScheduler::get_time() + 1000000;
+        return VCPU_SLICE_HALTED;
+    }
+
+    static int finished;
+private:
+    int ticks;
+};
+
+int IdleGuest::finished = 0;
+
+// Halts on a timer far in the future and is woken by interrupts instead;
+// done after the second wakeup
+class WokenGuest : public VCPUTask {
+public:
+    WokenGuest() : slices(0) {}
+    vcpu_slice_t run_slice(uint64_t, uint64_t *wake_time)
+    {
+        if (++slices >= 3) {
+            __atomic_fetch_add(&finished, 1, __ATOMIC_RELAXED);
+            return VCPU_SLICE_DONE;
+        }
+        *wake_time = VCPUScheduler::get_time() + 10000000000ULL;
+        return VCPU_SLICE_HALTED;
+    }
+
+    static int finished;
+private:
+    int slices;
+};
+
+int WokenGuest::finished = 0;
+
+int main()
+{
+    VCPUScheduler scheduler;
+    IdleGuest *guests = new IdleGuest[TASK_COUNT];
+
+    uint64_t start = VCPUScheduler::get_time();
+    scheduler.start();
+    for (int i = 0; i < TASK_COUNT; i++) {
+        scheduler.add(&guests[i]);
+    }
+    // Interrupts for some guests while they sleep
+    for (int i = 0; i < TASK_COUNT; i += 7) {
+        scheduler.wake(&guests[i]);
+    }
+
+    while (__atomic_load_n(&IdleGuest::finished, __ATOMIC_RELAXED)
+            < TASK_COUNT) {
+        struct timespec ts = { 0, 1000000 };
+        nanosleep(&ts, NULL);
+    }
+    uint64_t elapsed = VCPUScheduler::get_time() - start;
+    scheduler.stop();
+
+    printf("%d guests done in %.1f ms, %llu slices, %llu steals\n",
+            TASK_COUNT, elapsed / 1e6,
+            (unsigned long long)scheduler.get_slice_count(),
+            (unsigned long long)scheduler.get_steal_count());
+    scheduler.debug_status();
+
+    delete[] guests;
+
+    // Timers of guests that were woken early must not outlive them
+    VCPUScheduler woken_scheduler(4);
+    WokenGuest *woken = new WokenGuest[TASK_COUNT];
+    woken_scheduler.start();
+    for (int i = 0; i < TASK_COUNT; i++) {
+        woken_scheduler.add(&woken[i]);
+    }
+    while (__atomic_load_n(&WokenGuest::finished, __ATOMIC_RELAXED)
+            < TASK_COUNT) {
+        for (int i = 0; i < TASK_COUNT; i++) {
+            woken_scheduler.wake(&woken[i]);
+        }
+        struct timespec ts = { 0, 100000 };
+        nanosleep(&ts, NULL);
+    }
+    delete[] woken;
+    printf("%d woken guests done\n", TASK_COUNT);
+    woken_scheduler.debug_status();
+
+    return 0;
+}
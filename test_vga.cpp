@@ -0,0 +1,136 @@
+#include "event_scheduler.h"
+#include "memory.h"
+#include "text_display.h"
+#include "vga.h"
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define RAM_SIZE                (2 << 20)
+
+static void out(VGA *vga, uint32_t port, uint32_t value)
+{
+    vga->write(port, &value, 1);
+}
+
+static void put_text(uint16_t *screen, int offset, const char *text,
+        uint8_t attribute)
+{
+    for (int i = 0; text[i] != '\0'; i++) {
+        screen[offset + i] = (uint8_t)text[i] | (attribute << 8);
+    }
+}
+
+// Run timers for one refresh interval of virtual time
+static void tick(EventScheduler *scheduler)
+{
+    scheduler->skip_to_next_deadline();
+    scheduler->run_expired();
+}
+
+int main()
+{
+    Memory memory(RAM_SIZE);
+    EventScheduler scheduler;
+    scheduler.set_clock_mode(EVENT_CLOCK_VIRTUAL);
+    VGA vga(&memory, &scheduler);
+    MemoryTextDisplay display;
+    uint16_t *screen = (uint16_t*)memory.get_pointer(VGA_TEXT_BASE,
+            VGA_TEXT_WINDOW);
+
+    // Boot-time output lands in RAM; nothing is drawn until the refresh
+    for (int i = 0; i < 80 * 25; i++) {
+        screen[i] = 0x0720;
+    }
+    put_text(screen, 0, "SeaBIOS (version test)", 0x07);
+    put_text(screen, 80 * 2, "Booting from Hard Disk...", 0x1f);
+    vga.connect_display(&display);
+    tick(&scheduler);
+    printf("first frame: %llu cells drawn\n",
+            (unsigned long long)display.get_cells_drawn());
+    printf("row 0: '%s'\n", display.get_row(0).c_str());
+    printf("row 2: '%s', attribute 0x%02x\n", display.get_row(2).c_str(),
+            display.get_attribute(2, 0));
+
+    // A thousand writes to one cell between refreshes draw it once
+    uint64_t drawn = display.get_cells_drawn();
+    for (int i = 0; i < 1000; i++) {
+        screen[80 * 3 + 5] = ('0' + i % 10) | 0x0700;
+    }
+    tick(&scheduler);
+    printf("after 1000 writes: %llu cells drawn, row 3 '%s'\n",
+            (unsigned long long)(display.get_cells_drawn() - drawn),
+            display.get_row(3).c_str());
+
+    // Nothing changed: no frame
+    uint64_t flushes = display.get_flushes();
+    tick(&scheduler);
+    printf("idle refresh flushed: %d\n",
+            (int)(display.get_flushes() - flushes));
+
+    // Cursor through the CRTC index and data registers
+    out(&vga, 0x3d4, 0x0e);
+    out(&vga, 0x3d5, 0x00);
+    out(&vga, 0x3d4, 0x0f);
+    out(&vga, 0x3d5, 80 * 2 + 25);
+    tick(&scheduler);
+    printf("cursor: row %d, column %d\n", display.get_cursor_row(),
+            display.get_cursor_column());
+
+    // Scrolling by start address moves the whole screen
+    drawn = display.get_cells_drawn();
+    out(&vga, 0x3d4, 0x0c);
+    out(&vga, 0x3d5, 0x00);
+    out(&vga, 0x3d4, 0x0d);
+    out(&vga, 0x3d5, 80 * 2);
+    tick(&scheduler);
+    printf("after scroll: row 0 '%s', %llu cells drawn\n",
+            display.get_row(0).c_str(),
+            (unsigned long long)(display.get_cells_drawn() - drawn));
+
+    // 8-line character cells: 80x50
+    out(&vga, 0x3d4, 0x09);
+    out(&vga, 0x3d5, 0x47);
+    tick(&scheduler);
+    vga.debug_status();
+
+    // Graphics mode isn't drawn
+    out(&vga, 0x3ce, 0x06);
+    out(&vga, 0x3cf, 0x05);
+    flushes = display.get_flushes();
+    screen[0] = 0x0741;
+    tick(&scheduler);
+    printf("graphics mode flushed: %d\n",
+            (int)(display.get_flushes() - flushes));
+    out(&vga, 0x3cf, 0x0e);
+
+    // Input status toggles retrace and resets the attribute flip-flop
+    uint32_t status1 = 0;
+    uint32_t status2 = 0;
+    vga.read(0x3da, &status1, 1);
+    vga.read(0x3da, &status2, 1);
+    out(&vga, 0x3c0, 0x10);
+    out(&vga, 0x3c0, 0x0c);
+    uint32_t mode = 0;
+    vga.read(0x3c1, &mode, 1);
+    printf("retrace toggles: 0x%x 0x%x, attribute mode 0x%x\n", status1,
+            status2, mode);
+
+    // Same screen on a terminal, one write per frame
+    int fds[2];
+    if (pipe(fds) != 0) {
+        return 1;
+    }
+    TerminalTextDisplay terminal(fds[1]);
+    vga.connect_display(&terminal);
+    tick(&scheduler);
+    screen[80 * 2 + 5] = 0x0721;
+    tick(&scheduler);
+    printf("terminal bytes: %llu\n",
+            (unsigned long long)terminal.get_bytes_written());
+    vga.connect_display(NULL);
+    close(fds[0]);
+    close(fds[1]);
+
+    return 0;
+}
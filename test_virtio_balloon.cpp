@@ -0,0 +1,138 @@
+#include "virtio_balloon.h"
+#include <stdio.h>
+#include <string.h>
+
+#define BASE                    (0xd0001000)
+#define QUEUE_NUM               (8)
+// Descriptors, available and used ring of each queue, 16 KB apart
+#define RING_ADDRESS(queue)     (0x10000 + (queue) * 0x4000)
+#define PFN_ADDRESS             (0x20000)
+#define RINGS_SIZE              (PFN_ADDRESS + 0x1000 - RING_ADDRESS(0))
+#define INFLATE_ADDRESS         (0x40000)
+#define INFLATE_PAGES           (16)
+#define REPORT_ADDRESS          (0x60000)
+#define REPORT_PAGES            (8)
+
+Memory memory(1024 * 1024);
+
+void out(VirtioBalloon *balloon, uint32_t offset, uint32_t value)
+{
+    uint64_t v = value;
+    balloon->mmio_write(BASE + offset, &v, 4);
+}
+
+uint32_t in(VirtioBalloon *balloon, uint32_t offset)
+{
+    uint64_t value = 0;
+    balloon->mmio_read(BASE + offset, &value, 4);
+
+    return value;
+}
+
+void setup(VirtioBalloon *balloon)
+{
+    // Rings and the page frame list stay resident from here on
+    memset(memory.get_pointer(RING_ADDRESS(0), RINGS_SIZE), 0, RINGS_SIZE);
+    out(balloon, VIRTIO_MMIO_STATUS, 0);
+    out(balloon, VIRTIO_MMIO_STATUS, 0x1 | 0x2);
+    for (int i = 0; i < VIRTIO_BALLOON_QUEUES; i++) {
+        out(balloon, VIRTIO_MMIO_QUEUE_SEL, i);
+        out(balloon, VIRTIO_MMIO_QUEUE_NUM, QUEUE_NUM);
+        out(balloon, VIRTIO_MMIO_QUEUE_DESC_LOW, RING_ADDRESS(i));
+        out(balloon, VIRTIO_MMIO_QUEUE_AVAIL_LOW, RING_ADDRESS(i) + 0x1000);
+        out(balloon, VIRTIO_MMIO_QUEUE_USED_LOW, RING_ADDRESS(i) + 0x2000);
+        out(balloon, VIRTIO_MMIO_QUEUE_READY, 1);
+    }
+    out(balloon, VIRTIO_MMIO_STATUS,
+            0x1 | 0x2 | 0x8 | VIRTIO_STATUS_DRIVER_OK);
+}
+
+// Make a single descriptor chain available on queue and notify
+void send(VirtioBalloon *balloon, int queue, uint64_t address,
+        uint32_t length, uint16_t flags)
+{
+    virtq_desc *desc = (virtq_desc*)memory.get_pointer(RING_ADDRESS(queue),
+            sizeof(virtq_desc) * QUEUE_NUM);
+    virtq_avail *avail = (virtq_avail*)memory.get_pointer(
+            RING_ADDRESS(queue) + 0x1000, 0x100);
+
+    int head = avail->idx % QUEUE_NUM;
+    desc[head].addr = address;
+    desc[head].len = length;
+    desc[head].flags = flags;
+    desc[head].next = 0;
+    avail->ring[head] = head;
+    avail->idx++;
+    out(balloon, VIRTIO_MMIO_QUEUE_NOTIFY, queue);
+}
+
+uint16_t used_idx(int queue)
+{
+    virtq_used *used = (virtq_used*)memory.get_pointer(
+            RING_ADDRESS(queue) + 0x2000, 0x100);
+
+    return used->idx;
+}
+
+// Page frame numbers of count pages from address
+void send_pfns(VirtioBalloon *balloon, int queue, uint64_t address,
+        int count)
+{
+    uint32_t *pfns = (uint32_t*)memory.get_pointer(PFN_ADDRESS, count * 4);
+    for (int i = 0; i < count; i++) {
+        pfns[i] = (address >> VIRTIO_BALLOON_PFN_SHIFT) + i;
+    }
+    send(balloon, queue, PFN_ADDRESS, count * 4, 0);
+}
+
+int main()
+{
+    VirtioBalloon balloon(&memory, BASE);
+    setup(&balloon);
+
+    // The host asks for pages; the config change is signalled, and the
+    // driver reports what it has given up
+    balloon.set_target(INFLATE_PAGES);
+    printf("target: num_pages %u, interrupt status 0x%x\n",
+            in(&balloon, VIRTIO_MMIO_CONFIG),
+            in(&balloon, VIRTIO_MMIO_INTERRUPT_STATUS));
+    out(&balloon, VIRTIO_MMIO_INTERRUPT_ACK, VIRTIO_INT_CONFIG);
+    out(&balloon, VIRTIO_MMIO_CONFIG, 0xffffffff);
+    out(&balloon, VIRTIO_MMIO_CONFIG + 4, INFLATE_PAGES);
+    printf("config: num_pages %u, actual %u\n",
+            in(&balloon, VIRTIO_MMIO_CONFIG), balloon.get_actual());
+
+    // Inflated pages go back to the host
+    uint8_t *pages = (uint8_t*)memory.get_pointer(INFLATE_ADDRESS,
+            INFLATE_PAGES * MEMORY_PAGE_SIZE);
+    memset(pages, 0x55, INFLATE_PAGES * MEMORY_PAGE_SIZE);
+    uint64_t resident = memory.count_resident_pages();
+    send_pfns(&balloon, VIRTIO_BALLOON_Q_INFLATE, INFLATE_ADDRESS,
+            INFLATE_PAGES);
+    printf("inflate: used idx %d, resident pages freed %lld\n",
+            used_idx(VIRTIO_BALLOON_Q_INFLATE),
+            (long long)(resident - memory.count_resident_pages()));
+
+    // Deflating only hands them back to the guest
+    send_pfns(&balloon, VIRTIO_BALLOON_Q_DEFLATE, INFLATE_ADDRESS, 4);
+    printf("deflate: used idx %d\n", used_idx(VIRTIO_BALLOON_Q_DEFLATE));
+
+    // Reported free pages are the buffers themselves
+    memset(memory.get_pointer(REPORT_ADDRESS, REPORT_PAGES * MEMORY_PAGE_SIZE),
+            0xaa, REPORT_PAGES * MEMORY_PAGE_SIZE);
+    resident = memory.count_resident_pages();
+    send(&balloon, VIRTIO_BALLOON_Q_REPORTING, REPORT_ADDRESS,
+            REPORT_PAGES * MEMORY_PAGE_SIZE, VIRTQ_DESC_F_WRITE);
+    printf("report: used idx %d, resident pages freed %lld\n",
+            used_idx(VIRTIO_BALLOON_Q_REPORTING),
+            (long long)(resident - memory.count_resident_pages()));
+
+    // A reset forgets the balloon but not the target
+    setup(&balloon);
+    printf("after reset: num_pages %u, actual %u\n",
+            in(&balloon, VIRTIO_MMIO_CONFIG), balloon.get_actual());
+
+    balloon.debug_status();
+
+    return 0;
+}
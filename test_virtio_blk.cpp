@@ -0,0 +1,181 @@
+#include "virtio_blk.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define BASE                    (0xd0000000)
+#define QUEUE_NUM               (8)
+#define DESC_ADDRESS            (0x1000)
+#define AVAIL_ADDRESS           (0x2000)
+#define USED_ADDRESS            (0x3000)
+#define HEADER_ADDRESS          (0x4000)
+#define STATUS_ADDRESS          (0x5000)
+#define DATA_ADDRESS            (0x10000)
+#define DISK_SIZE               (1024 * 1024)
+
+Memory memory(1024 * 1024);
+AsyncIO aio;
+
+virtq_desc *desc = (virtq_desc*)memory.get_pointer(DESC_ADDRESS,
+        sizeof(virtq_desc) * QUEUE_NUM);
+virtq_avail *avail = (virtq_avail*)memory.get_pointer(AVAIL_ADDRESS, 0x100);
+virtq_used *used = (virtq_used*)memory.get_pointer(USED_ADDRESS, 0x100);
+uint8_t *status = (uint8_t*)memory.get_pointer(STATUS_ADDRESS, QUEUE_NUM);
+
+void out(VirtioBlk *blk, uint32_t offset, uint32_t value)
+{
+    uint64_t v = value;
+    blk->mmio_write(BASE + offset, &v, 4);
+}
+
+uint32_t in(VirtioBlk *blk, uint32_t offset)
+{
+    uint64_t value = 0;
+    blk->mmio_read(BASE + offset, &value, 4);
+
+    return value;
+}
+
+// Driver initialization as Linux does it, with the given queue size
+void setup(VirtioBlk *blk, uint32_t num)
+{
+    memset(avail, 0, 0x100);
+    memset(used, 0, 0x100);
+    out(blk, VIRTIO_MMIO_STATUS, 0);
+    out(blk, VIRTIO_MMIO_STATUS, 0x1 | 0x2);
+    out(blk, VIRTIO_MMIO_QUEUE_SEL, 0);
+    out(blk, VIRTIO_MMIO_QUEUE_NUM, num);
+    out(blk, VIRTIO_MMIO_QUEUE_DESC_LOW, DESC_ADDRESS);
+    out(blk, VIRTIO_MMIO_QUEUE_AVAIL_LOW, AVAIL_ADDRESS);
+    out(blk, VIRTIO_MMIO_QUEUE_USED_LOW, USED_ADDRESS);
+    out(blk, VIRTIO_MMIO_QUEUE_READY, 1);
+    out(blk, VIRTIO_MMIO_STATUS, 0x1 | 0x2 | 0x8 | VIRTIO_STATUS_DRIVER_OK);
+}
+
+void set_desc(int index, uint64_t address, uint32_t length, uint16_t flags,
+        uint16_t next)
+{
+    desc[index].addr = address;
+    desc[index].len = length;
+    desc[index].flags = flags;
+    desc[index].next = next;
+}
+
+// Header, data and status descriptors at head, head + 1 and head + 2
+void request(VirtioBlk *blk, int head, uint32_t type, uint64_t sector,
+        uint64_t data, uint32_t length)
+{
+    virtio_blk_outhdr *header = (virtio_blk_outhdr*)memory.get_pointer(
+            HEADER_ADDRESS + head * 16, sizeof(virtio_blk_outhdr));
+    header->type = type;
+    header->reserved = 0;
+    header->sector = sector;
+    status[head] = 0xff;
+
+    set_desc(head, HEADER_ADDRESS + head * 16, sizeof(*header),
+            VIRTQ_DESC_F_NEXT, head + 1);
+    set_desc(head + 1, data, length, VIRTQ_DESC_F_NEXT
+            | (type != VIRTIO_BLK_T_OUT ? VIRTQ_DESC_F_WRITE : 0), head + 2);
+    set_desc(head + 2, STATUS_ADDRESS + head, 1, VIRTQ_DESC_F_WRITE, 0);
+
+    avail->ring[avail->idx % QUEUE_NUM] = head;
+    avail->idx++;
+    out(blk, VIRTIO_MMIO_QUEUE_NOTIFY, 0);
+}
+
+void wait_for_io()
+{
+    while (aio.get_inflight() > 0) {
+        aio.poll_completions();
+    }
+}
+
+void print_used(const char *label, int head)
+{
+    int last = (used->idx - 1) % QUEUE_NUM;
+    printf("%s: used idx %d, last id %d len %d, status %d\n", label,
+            used->idx, used->ring[last].id, used->ring[last].len,
+            status[head]);
+}
+
+int main()
+{
+    char filename[] = "/tmp/test_virtio_blk_XXXXXX";
+    int fd = mkstemp(filename);
+    ftruncate(fd, DISK_SIZE);
+    close(fd);
+
+    RawImage image;
+    image.open(filename, false);
+    VirtioBlk blk(&memory, BASE, &aio, &image, false, 1);
+    setup(&blk, QUEUE_NUM);
+
+    // Write a sector and read it back elsewhere
+    uint8_t *data = (uint8_t*)memory.get_pointer(DATA_ADDRESS, 0x1000);
+    for (int i = 0; i < BLOCK_SECTOR_SIZE; i++) {
+        data[i] = i & 0xff;
+    }
+    request(&blk, 0, VIRTIO_BLK_T_OUT, 5, DATA_ADDRESS, BLOCK_SECTOR_SIZE);
+    wait_for_io();
+    print_used("write sector 5", 0);
+    request(&blk, 3, VIRTIO_BLK_T_IN, 5, DATA_ADDRESS + 0x800,
+            BLOCK_SECTOR_SIZE);
+    wait_for_io();
+    print_used("read sector 5", 3);
+    printf("read back matches: %d\n",
+            memcmp(data, data + 0x800, BLOCK_SECTOR_SIZE) == 0);
+
+    // Sectors past the end fail without touching the disk
+    request(&blk, 0, VIRTIO_BLK_T_IN, DISK_SIZE / BLOCK_SECTOR_SIZE,
+            DATA_ADDRESS, BLOCK_SECTOR_SIZE);
+    print_used("read past end", 0);
+    request(&blk, 0, VIRTIO_BLK_T_IN, ~0ULL / BLOCK_SECTOR_SIZE,
+            DATA_ADDRESS, BLOCK_SECTOR_SIZE);
+    print_used("read at huge sector", 0);
+
+    // Sizes that aren't a power of two are ignored, so entries keep
+    // landing modulo 8
+    setup(&blk, 3);
+    for (int i = 0; i < 4; i++) {
+        request(&blk, 0, VIRTIO_BLK_T_GET_ID, 0, DATA_ADDRESS, 20);
+    }
+    printf("queue size 3: used idx %d, entry 3 len %d\n", used->idx,
+            used->ring[3].len);
+
+    // A descriptor index out of the ring and a looping chain both need a
+    // reset, and nothing is used
+    setup(&blk, QUEUE_NUM);
+    set_desc(0, HEADER_ADDRESS, 16, VIRTQ_DESC_F_NEXT, 200);
+    avail->ring[0] = 0;
+    avail->idx = 1;
+    out(&blk, VIRTIO_MMIO_QUEUE_NOTIFY, 0);
+    printf("bad index: status 0x%02x, used idx %d\n",
+            in(&blk, VIRTIO_MMIO_STATUS), used->idx);
+    setup(&blk, QUEUE_NUM);
+    set_desc(0, HEADER_ADDRESS, 16, VIRTQ_DESC_F_NEXT, 1);
+    set_desc(1, DATA_ADDRESS, 16, VIRTQ_DESC_F_NEXT, 0);
+    avail->ring[0] = 0;
+    avail->idx = 1;
+    out(&blk, VIRTIO_MMIO_QUEUE_NOTIFY, 0);
+    printf("loop: status 0x%02x, used idx %d\n",
+            in(&blk, VIRTIO_MMIO_STATUS), used->idx);
+
+    // Reset with a read in flight. The queue isn't set up until the read
+    // is done, and the read doesn't complete into the new ring.
+    setup(&blk, QUEUE_NUM);
+    request(&blk, 0, VIRTIO_BLK_T_IN, 5, DATA_ADDRESS, BLOCK_SECTOR_SIZE);
+    setup(&blk, QUEUE_NUM);
+    printf("reset in flight: queue ready %d, in flight %d\n",
+            in(&blk, VIRTIO_MMIO_QUEUE_READY), aio.get_inflight());
+    request(&blk, 0, VIRTIO_BLK_T_GET_ID, 0, DATA_ADDRESS + 0x800, 20);
+    printf("before drain: used idx %d, status %d\n", used->idx, status[0]);
+    wait_for_io();
+    print_used("after drain", 0);
+    printf("id: %s\n", data + 0x800);
+
+    blk.debug_status();
+    unlink(filename);
+
+    return 0;
+}
@@ -0,0 +1,223 @@
+#include "text_display.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <unistd.h>
+
+// Blank cell in light gray on black
+#define TEXT_DISPLAY_BLANK      (0x0720)
+
+// Code points of code page 437 0xb0-0xdf: shades, box drawing and blocks
+static const uint16_t cp437_box[] = {
+    0x2591, 0x2592, 0x2593, 0x2502, 0x2524, 0x2561, 0x2562, 0x2556,
+    0x2555, 0x2563, 0x2551, 0x2557, 0x255d, 0x255c, 0x255b, 0x2510,
+    0x2514, 0x2534, 0x252c, 0x251c, 0x2500, 0x253c, 0x255e, 0x255f,
+    0x255a, 0x2554, 0x2569, 0x2566, 0x2560, 0x2550, 0x256c, 0x2567,
+    0x2568, 0x2564, 0x2565, 0x2559, 0x2558, 0x2552, 0x2553, 0x256b,
+    0x256a, 0x2518, 0x250c, 0x2588, 0x2584, 0x258c, 0x2590, 0x2580,
+};
+
+// VGA color number to ANSI: the two swap red and blue
+static const uint8_t ansi_colors[] = { 0, 4, 2, 6, 1, 5, 3, 7 };
+
+MemoryTextDisplay::MemoryTextDisplay()
+{
+    rows = 0;
+    columns = 0;
+    cursor_row = 0;
+    cursor_column = 0;
+    cursor_visible = false;
+    cells_drawn = 0;
+    flushes = 0;
+}
+
+void MemoryTextDisplay::resize(int rows, int columns)
+{
+    this->rows = rows;
+    this->columns = columns;
+    cells.assign(rows * columns, TEXT_DISPLAY_BLANK);
+}
+
+void MemoryTextDisplay::draw_cell(int row, int column, uint8_t c,
+        uint8_t attribute)
+{
+    cells[row * columns + column] = c | (attribute << 8);
+    cells_drawn++;
+}
+
+void MemoryTextDisplay::move_cursor(int row, int column, bool visible)
+{
+    cursor_row = row;
+    cursor_column = column;
+    cursor_visible = visible;
+}
+
+void MemoryTextDisplay::flush()
+{
+    flushes++;
+}
+
+std::string MemoryTextDisplay::get_row(int row)
+{
+    std::string text;
+    if (row < 0 || row >= rows) {
+        return text;
+    }
+
+    for (int i = 0; i < columns; i++) {
+        uint8_t c = cells[row * columns + i] & 0xff;
+        text += c != 0 ? (char)c : ' ';
+    }
+    size_t end = text.find_last_not_of(' ');
+    text.erase(end == std::string::npos ? 0 : end + 1);
+
+    return text;
+}
+
+std::string MemoryTextDisplay::get_text()
+{
+    std::string text;
+    size_t end = 0;
+    for (int i = 0; i < rows; i++) {
+        std::string row = get_row(i);
+        text += row;
+        text += '\n';
+        if (!row.empty()) {
+            end = text.size();
+        }
+    }
+    text.erase(end);
+
+    return text;
+}
+
+uint8_t MemoryTextDisplay::get_attribute(int row, int column)
+{
+    return cells[row * columns + column] >> 8;
+}
+
+int MemoryTextDisplay::get_cursor_row()
+{
+    return cursor_row;
+}
+
+int MemoryTextDisplay::get_cursor_column()
+{
+    return cursor_column;
+}
+
+uint64_t MemoryTextDisplay::get_cells_drawn()
+{
+    return cells_drawn;
+}
+
+uint64_t MemoryTextDisplay::get_flushes()
+{
+    return flushes;
+}
+
+TerminalTextDisplay::TerminalTextDisplay(int fd)
+{
+    this->fd = fd;
+    columns = 0;
+    output_row = -1;
+    output_column = -1;
+    output_attribute = -1;
+    cursor_row = 0;
+    cursor_column = 0;
+    cursor_visible = false;
+    cursor_moved = false;
+    bytes_written = 0;
+}
+
+void TerminalTextDisplay::resize(int, int columns)
+{
+    this->columns = columns;
+    // Default colors, clear, home
+    output += "\x1b[0m\x1b[2J\x1b[H";
+    output_row = 0;
+    output_column = 0;
+    output_attribute = -1;
+}
+
+void TerminalTextDisplay::draw_cell(int row, int column, uint8_t c,
+        uint8_t attribute)
+{
+    char escape[48];
+    if (row != output_row || column != output_column) {
+        snprintf(escape, sizeof(escape), "\x1b[%d;%dH", row + 1, column + 1);
+        output += escape;
+    }
+    if (attribute != output_attribute) {
+        // Blink bit ignored
+        int foreground = ansi_colors[attribute & 0x7];
+        int background = ansi_colors[(attribute >> 4) & 0x7];
+        snprintf(escape, sizeof(escape), "\x1b[0;%d;%dm",
+                (attribute & 0x8 ? 90 : 30) + foreground, 40 + background);
+        output += escape;
+        output_attribute = attribute;
+    }
+
+    if (c >= 0x20 && c < 0x7f) {
+        output += (char)c;
+    } else if (c >= 0xb0 && c < 0xe0) {
+        // UTF-8 of a code point below 0x10000
+        uint16_t code = cp437_box[c - 0xb0];
+        output += (char)(0xe0 | (code >> 12));
+        output += (char)(0x80 | ((code >> 6) & 0x3f));
+        output += (char)(0x80 | (code & 0x3f));
+    } else if (c == 0 || c == 0xff) {
+        output += ' ';
+    } else {
+        output += '?';
+    }
+
+    output_row = row;
+    output_column = column + 1;
+    // Terminals differ in what they do at the right margin
+    if (output_column >= columns) {
+        output_row = -1;
+    }
+}
+
+void TerminalTextDisplay::move_cursor(int row, int column, bool visible)
+{
+    cursor_row = row;
+    cursor_column = column;
+    cursor_visible = visible;
+    cursor_moved = true;
+}
+
+void TerminalTextDisplay::flush()
+{
+    if (output.empty() && !cursor_moved) {
+        return;
+    }
+
+    char escape[48];
+    snprintf(escape, sizeof(escape), "\x1b[%d;%dH\x1b[?25%c",
+            cursor_row + 1, cursor_column + 1, cursor_visible ? 'h' : 'l');
+    output += escape;
+    output_row = cursor_row;
+    output_column = cursor_column;
+    cursor_moved = false;
+
+    size_t done = 0;
+    while (done < output.size()) {
+        ssize_t n = ::write(fd, output.data() + done, output.size() - done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        done += n;
+    }
+    bytes_written += done;
+    output.clear();
+}
+
+uint64_t TerminalTextDisplay::get_bytes_written()
+{
+    return bytes_written;
+}
@@ -0,0 +1,79 @@
+#ifndef __TEXT_DISPLAY_H__
+#define __TEXT_DISPLAY_H__
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// Host end of a text-mode screen. VGA calls these from its refresh with
+// only the cells that changed since the last one, then flush().
+class TextDisplay {
+public:
+    virtual ~TextDisplay() {};
+    // Screen geometry changed; every cell is drawn again after this
+    virtual void resize(int rows, int columns) = 0;
+    // c is a code page 437 character, attribute the VGA attribute byte
+    virtual void draw_cell(int row, int column, uint8_t c,
+            uint8_t attribute) = 0;
+    virtual void move_cursor(int row, int column, bool visible) = 0;
+    // End of a refresh
+    virtual void flush() {};
+};
+
+// Keeps the screen in memory for headless runs and tests
+class MemoryTextDisplay : public TextDisplay {
+public:
+    MemoryTextDisplay();
+    void resize(int rows, int columns);
+    void draw_cell(int row, int column, uint8_t c, uint8_t attribute);
+    void move_cursor(int row, int column, bool visible);
+    void flush();
+    // Characters of a row without trailing blanks
+    std::string get_row(int row);
+    // All rows, without trailing blank lines
+    std::string get_text();
+    uint8_t get_attribute(int row, int column);
+    int get_cursor_row();
+    int get_cursor_column();
+    uint64_t get_cells_drawn();
+    uint64_t get_flushes();
+private:
+    int rows;
+    int columns;
+    // Character in the low byte, attribute in the high byte, as in VRAM
+    std::vector<uint16_t> cells;
+    int cursor_row;
+    int cursor_column;
+    bool cursor_visible;
+    uint64_t cells_drawn;
+    uint64_t flushes;
+};
+
+// Draws on an ANSI terminal. A refresh is batched into one write of
+// cursor movement, color and text escapes.
+class TerminalTextDisplay : public TextDisplay {
+public:
+    // Doesn't take ownership of fd
+    TerminalTextDisplay(int fd);
+    void resize(int rows, int columns);
+    void draw_cell(int row, int column, uint8_t c, uint8_t attribute);
+    void move_cursor(int row, int column, bool visible);
+    void flush();
+    uint64_t get_bytes_written();
+private:
+    int fd;
+    int columns;
+    std::string output;
+    // Where the terminal cursor will be after output, -1 if unknown
+    int output_row;
+    int output_column;
+    // Attribute of the last color escape, -1 if none yet
+    int output_attribute;
+    int cursor_row;
+    int cursor_column;
+    bool cursor_visible;
+    bool cursor_moved;
+    uint64_t bytes_written;
+};
+
+#endif
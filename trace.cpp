@@ -0,0 +1,173 @@
+#include "trace.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "stats.h"
+
+// Single producer (the vCPU thread) per ring. head only increases; the
+// record at head & (TRACE_RING_SIZE - 1) is written before head is
+// published, so a reader can tell which records may have been
+// overwritten while it was copying them.
+struct trace_ring {
+    trace_record records[TRACE_RING_SIZE];
+    uint64_t head __attribute__((aligned(STATS_CACHE_LINE_SIZE)));
+    // Only touched by trace_save
+    uint64_t tail __attribute__((aligned(STATS_CACHE_LINE_SIZE)));
+    uint64_t lost;
+};
+
+uint32_t trace_categories = 0;
+
+static trace_ring *rings[TRACE_MAX_VCPUS];
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+// Rings have a single producer, so threads that never registered a vCPU
+// don't get to write
+static thread_local int current_vcpu = -1;
+
+static const char *event_names[TRACE_EVENT_COUNT] = {
+    "io_read",
+    "io_write",
+    "irq_assert",
+    "irq_ack",
+    "irq_eoi",
+    "timer_fire",
+};
+
+static void allocate_ring(int vcpu)
+{
+    pthread_mutex_lock(&rings_lock);
+    if (rings[vcpu] == NULL) {
+        void *p;
+        if (posix_memalign(&p, STATS_CACHE_LINE_SIZE,
+                    sizeof(trace_ring)) == 0) {
+            memset(p, 0, sizeof(trace_ring));
+            __atomic_store_n(&rings[vcpu], (trace_ring*)p, __ATOMIC_RELEASE);
+        } else {
+            printf("Trace: Failed to allocate ring for vCPU %d\n", vcpu);
+        }
+    }
+    pthread_mutex_unlock(&rings_lock);
+}
+
+void trace_enable(uint32_t categories)
+{
+    __atomic_or_fetch(&trace_categories, categories, __ATOMIC_RELAXED);
+}
+
+void trace_disable(uint32_t categories)
+{
+    __atomic_and_fetch(&trace_categories, ~categories, __ATOMIC_RELAXED);
+}
+
+void trace_register_vcpu(int vcpu)
+{
+    if (vcpu < 0 || vcpu >= TRACE_MAX_VCPUS) {
+        printf("Trace: Invalid vCPU %d\n", vcpu);
+        return;
+    }
+
+    allocate_ring(vcpu);
+    current_vcpu = vcpu;
+}
+
+void trace_write(uint8_t event, uint8_t size, uint16_t arg0, uint32_t arg1)
+{
+    if (current_vcpu < 0) {
+        return;
+    }
+    trace_ring *ring = __atomic_load_n(&rings[current_vcpu],
+            __ATOMIC_ACQUIRE);
+    if (ring == NULL) {
+        return;
+    }
+
+    uint64_t head = ring->head;
+    trace_record *record = &ring->records[head & (TRACE_RING_SIZE - 1)];
+    record->tsc = Stats::read_tsc();
+    record->event = event;
+    record->size = size;
+    record->arg0 = arg0;
+    record->arg1 = arg1;
+
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+bool trace_save(const char *filename)
+{
+    FILE *fp = fopen(filename, "wb");
+    if (fp == NULL) {
+        printf("Trace: Failed to open %s\n", filename);
+        return false;
+    }
+
+    trace_file_header header;
+    header.magic = TRACE_MAGIC;
+    header.version = TRACE_VERSION;
+    header.vcpu_count = 0;
+    header.record_size = sizeof(trace_record);
+    for (int i = 0; i < TRACE_MAX_VCPUS; i++) {
+        if (__atomic_load_n(&rings[i], __ATOMIC_ACQUIRE) != NULL) {
+            header.vcpu_count++;
+        }
+    }
+    fwrite(&header, sizeof(header), 1, fp);
+
+    trace_record *copy = new trace_record[TRACE_RING_SIZE];
+
+    for (int i = 0; i < TRACE_MAX_VCPUS; i++) {
+        trace_ring *ring = __atomic_load_n(&rings[i], __ATOMIC_ACQUIRE);
+        if (ring == NULL) {
+            continue;
+        }
+
+        uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        uint64_t start = ring->tail;
+        if (head - start > TRACE_RING_SIZE) {
+            ring->lost += head - TRACE_RING_SIZE - start;
+            start = head - TRACE_RING_SIZE;
+        }
+
+        for (uint64_t j = start; j < head; j++) {
+            copy[j - start] = ring->records[j & (TRACE_RING_SIZE - 1)];
+        }
+
+        // Drop records the producer may have overwritten during the copy,
+        // including the slot at new_head it may be writing right now
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        uint64_t new_head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+        uint64_t skip = 0;
+        if (new_head + 1 - start > TRACE_RING_SIZE) {
+            skip = new_head + 1 - TRACE_RING_SIZE - start;
+            if (skip > head - start) {
+                skip = head - start;
+            }
+            ring->lost += skip;
+        }
+
+        trace_file_chunk chunk;
+        chunk.vcpu = i;
+        chunk.count = head - start - skip;
+        chunk.lost = ring->lost;
+        fwrite(&chunk, sizeof(chunk), 1, fp);
+        fwrite(copy + skip, sizeof(trace_record), chunk.count, fp);
+
+        ring->tail = head;
+    }
+
+    delete[] copy;
+
+    if (fclose(fp) != 0) {
+        printf("Trace: Failed to write %s\n", filename);
+        return false;
+    }
+
+    return true;
+}
+
+const char *trace_event_name(uint8_t event)
+{
+    return event < TRACE_EVENT_COUNT ? event_names[event] : "unknown";
+}
@@ -0,0 +1,75 @@
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include <stdint.h>
+
+// Records per vCPU ring; oldest records are overwritten when full
+#define TRACE_RING_SIZE         (1 << 16)
+#define TRACE_MAX_VCPUS         (16)
+#define TRACE_MAGIC             (0x52545648)
+#define TRACE_VERSION           (1)
+
+// Categories, enabled at runtime with trace_enable()
+#define TRACE_CAT_IO            (0x1)
+#define TRACE_CAT_IRQ           (0x2)
+#define TRACE_CAT_TIMER         (0x4)
+#define TRACE_CAT_ALL           (0x7)
+
+typedef enum {
+    // arg0: port, arg1: value, size: access width
+    TRACE_IO_READ,
+    TRACE_IO_WRITE,
+    // arg0: IRQ number, arg1: PIC base port, size: 1 if masked
+    TRACE_IRQ_ASSERT,
+    TRACE_IRQ_ACK,
+    TRACE_IRQ_EOI,
+    // arg1: lateness [ns]
+    TRACE_TIMER_FIRE,
+    TRACE_EVENT_COUNT,
+} trace_event_t;
+
+struct trace_record {
+    uint64_t tsc;
+    uint8_t event;
+    uint8_t size;
+    uint16_t arg0;
+    uint32_t arg1;
+};
+
+// Trace file: trace_file_header, then for each vCPU a trace_file_chunk
+// followed by its records, oldest first
+struct trace_file_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t vcpu_count;
+    uint32_t record_size;
+};
+
+struct trace_file_chunk {
+    uint32_t vcpu;
+    uint32_t count;
+    // Records overwritten before they could be saved
+    uint64_t lost;
+};
+
+extern uint32_t trace_categories;
+
+// Costs a load and a predicted branch when the category is disabled
+#define TRACE(category, event, size, arg0, arg1) \
+    do { \
+        if (__builtin_expect(trace_categories & (category), 0)) { \
+            trace_write((event), (size), (arg0), (arg1)); \
+        } \
+    } while (0)
+
+void trace_enable(uint32_t categories);
+void trace_disable(uint32_t categories);
+// Call from the thread running the vCPU. Events from threads that never
+// register are dropped.
+void trace_register_vcpu(int vcpu);
+void trace_write(uint8_t event, uint8_t size, uint16_t arg0, uint32_t arg1);
+// Drain all rings into a file for trace_decode
+bool trace_save(const char *filename);
+const char *trace_event_name(uint8_t event);
+
+#endif
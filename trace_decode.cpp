@@ -0,0 +1,153 @@
+// Decode a trace written by trace_save()
+//
+// Usage: trace_decode [-q] <trace file>
+//   -q  Only print the interrupt latency summary
+
+#include "pic.h"
+#include "trace.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#define LATENCY_BUCKETS     (32)
+// IRQ lines of master and slave PIC
+#define IRQ_LINES           (16)
+
+struct irq_latency {
+    // TSC of pending assert and ack, 0 if none
+    uint64_t asserted;
+    uint64_t acked;
+    uint64_t assert_to_ack[LATENCY_BUCKETS];
+    uint64_t ack_to_eoi[LATENCY_BUCKETS];
+};
+
+static int bucket(uint64_t cycles)
+{
+    int b = 63 - __builtin_clzll(cycles | 1);
+    return b < LATENCY_BUCKETS ? b : LATENCY_BUCKETS - 1;
+}
+
+static void print_histogram(const char *name, int irq, uint64_t *buckets)
+{
+    uint64_t total = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+        total += buckets[i];
+    }
+    if (total == 0) {
+        return;
+    }
+
+    printf("IRQ %d %s (%llu samples):\n", irq, name,
+            (unsigned long long)total);
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+        if (buckets[i] != 0) {
+            printf("  [%llu, %llu) cycles: %llu\n", 1ULL << i, 1ULL << (i + 1),
+                    (unsigned long long)buckets[i]);
+        }
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    bool quiet = false;
+    const char *filename = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-q") == 0) {
+            quiet = true;
+        } else {
+            filename = argv[i];
+        }
+    }
+    if (filename == NULL) {
+        printf("Usage: %s [-q] <trace file>\n", argv[0]);
+        return 1;
+    }
+
+    FILE *fp = fopen(filename, "rb");
+    if (fp == NULL) {
+        printf("Failed to open %s\n", filename);
+        return 1;
+    }
+
+    trace_file_header header;
+    if (fread(&header, sizeof(header), 1, fp) != 1
+            || header.magic != TRACE_MAGIC
+            || header.version != TRACE_VERSION
+            || header.record_size != sizeof(trace_record)) {
+        printf("%s is not a trace file\n", filename);
+        fclose(fp);
+        return 1;
+    }
+
+    irq_latency irqs[IRQ_LINES];
+    memset(irqs, 0, sizeof(irqs));
+
+    for (uint32_t i = 0; i < header.vcpu_count; i++) {
+        trace_file_chunk chunk;
+        if (fread(&chunk, sizeof(chunk), 1, fp) != 1) {
+            printf("Truncated trace\n");
+            break;
+        }
+        printf("vCPU %u: %u records, %llu lost\n", chunk.vcpu, chunk.count,
+                (unsigned long long)chunk.lost);
+
+        uint64_t first_tsc = 0;
+        for (uint32_t j = 0; j < chunk.count; j++) {
+            trace_record r;
+            if (fread(&r, sizeof(r), 1, fp) != 1) {
+                printf("Truncated trace\n");
+                break;
+            }
+            if (j == 0) {
+                first_tsc = r.tsc;
+            }
+
+            if (!quiet) {
+                printf("%14llu %-10s size=%u arg0=0x%04x arg1=0x%08x\n",
+                        (unsigned long long)(r.tsc - first_tsc),
+                        trace_event_name(r.event), r.size, r.arg0, r.arg1);
+            }
+
+            if (r.event != TRACE_IRQ_ASSERT && r.event != TRACE_IRQ_ACK
+                    && r.event != TRACE_IRQ_EOI) {
+                continue;
+            }
+            // arg1 is the PIC base port; slave lines follow the master's
+            int line = (r.arg0 & 0x7)
+                + (r.arg1 == PIC_SLAVE_BASE_PORT ? PIC_IRQ_COUNT : 0);
+            irq_latency *irq = &irqs[line];
+
+            switch (r.event) {
+            case TRACE_IRQ_ASSERT:
+                // Assert while already pending is coalesced by the PIC
+                if (irq->asserted == 0 && r.size == 0) {
+                    irq->asserted = r.tsc;
+                }
+                break;
+            case TRACE_IRQ_ACK:
+                if (irq->asserted != 0) {
+                    irq->assert_to_ack[bucket(r.tsc - irq->asserted)]++;
+                }
+                irq->asserted = 0;
+                irq->acked = r.tsc;
+                break;
+            case TRACE_IRQ_EOI:
+                if (irq->acked != 0) {
+                    irq->ack_to_eoi[bucket(r.tsc - irq->acked)]++;
+                }
+                irq->acked = 0;
+                break;
+            }
+        }
+    }
+
+    fclose(fp);
+
+    for (int i = 0; i < IRQ_LINES; i++) {
+        print_histogram("assert to ack", i, irqs[i].assert_to_ack);
+        print_histogram("ack to EOI", i, irqs[i].ack_to_eoi);
+    }
+
+    return 0;
+}
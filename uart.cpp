@@ -1,10 +1,23 @@
+#include <errno.h>
+#include <signal.h>
 #include <stdio.h>
 #include <termios.h>
 #include <unistd.h>
 
+#include "log.h"
 #include "uart.h"
 
 UART::UART()
+{
+    backend = NULL;
+    terminal = false;
+    pthread_mutex_init(&input_lock, NULL);
+    input_ready = false;
+
+    reset();
+}
+
+void UART::reset()
 {
     thr = 0;
     rbr = 0;
@@ -17,6 +30,22 @@ UART::UART()
     lsr = 0;
     msr = 0;
     sr = 0;
+}
+
+UART::~UART()
+{
+    if (terminal) {
+        tcsetattr(STDIN_FILENO, TCSANOW, &old_termios);
+    }
+    pthread_mutex_destroy(&input_lock);
+}
+
+void UART::connect_terminal()
+{
+    if (terminal) {
+        return;
+    }
+    terminal = true;
 
     tcgetattr(STDIN_FILENO, &old_termios);
     new_termios = old_termios;
@@ -27,15 +56,15 @@ UART::UART()
     tcsetattr(STDIN_FILENO, TCSANOW, &new_termios);
 }
 
-UART::~UART()
+void UART::connect_backend(CharBackend *backend)
 {
-    tcsetattr(STDIN_FILENO, TCSANOW, &old_termios);
+    this->backend = backend;
 }
 
 void UART::write(uint32_t port, const uint32_t *value, uint8_t size)
 {
     if (size != 1) {
-        printf("PIT: PIT only supports single-byte R/W\n");
+        LOG_WARN("UART: UART only supports single-byte R/W\n");
         return;
     }
 
@@ -46,18 +75,19 @@ void UART::write(uint32_t port, const uint32_t *value, uint8_t size)
             divisor = (divisor & 0xff00) | *value;
         } else {
             thr = *value;
+            tx_chr(thr);
         }
         break;
     case 1:
         if (dlab) {
-            dlh = (divisor & 0x00ff) | (*value << 8);
+            divisor = (divisor & 0x00ff) | (*value << 8);
         } else {
             ier = *value;
         }
         break;
     case 2:
         if (*value & UART_FCR_CLEAR_RX_FIFO) {
-            std::queue<int> empty;
+            std::queue<uint8_t> empty;
             std::swap(rx_buffer, empty);
         }
         fcr = *value & ~(UART_FCR_CLEAR_TX_FIFO | UART_FCR_CLEAR_RX_FIFO);
@@ -69,22 +99,21 @@ void UART::write(uint32_t port, const uint32_t *value, uint8_t size)
         mcr = *value;
         break;
     case 5:
-        printf("UART: LSR is read only\n");
+        LOG_WARN("UART: LSR is read only\n");
         break;
     case 6:
-        printf("UART: MSR is read only\n");
+        LOG_WARN("UART: MSR is read only\n");
         break;
     case 7:
         sr = *value;
-        write_sr(*value);
         break;
     }
 }
 
-void PIT::read(uint32_t port, uint32_t *value, uint8_t size)
+void UART::read(uint32_t port, uint32_t *value, uint8_t size)
 {
     if (size != 1) {
-        printf("PIT: PIT only supports single-byte R/W\n");
+        LOG_WARN("UART: UART only supports single-byte R/W\n");
         return;
     }
 
@@ -94,6 +123,8 @@ void PIT::read(uint32_t port, uint32_t *value, uint8_t size)
         if (dlab) {
             *value = divisor & 0x00ff;
         } else {
+            take_input();
+            rbr = rx_char();
             *value = rbr;
         }
         break;
@@ -114,6 +145,12 @@ void PIT::read(uint32_t port, uint32_t *value, uint8_t size)
         *value = mcr;
         break;
     case 5:
+        take_input();
+        // Transmission is instantaneous, so THR is always empty
+        lsr = UART_LSR_TX_FIN | UART_LSR_TX_BUF_EMPTY;
+        if (!rx_buffer.empty()) {
+            lsr |= UART_LSR_RX;
+        }
         *value = lsr;
         break;
     case 6:
@@ -125,38 +162,112 @@ void PIT::read(uint32_t port, uint32_t *value, uint8_t size)
     }
 }
 
+void UART::write_block(uint32_t port, const uint8_t *data, uint8_t size,
+        uint32_t count)
+{
+    bool dlab = (lcr & 0x80) > 0;
+
+    // Only a string written to THR can bypass per-byte dispatch
+    if (size != 1 || port != UART_BASE_PORT || dlab) {
+        IODevice::write_block(port, data, size, count);
+        return;
+    }
+    if (count == 0) {
+        return;
+    }
+
+    thr = data[count - 1];
+    if (backend != NULL) {
+        backend->write(data, count);
+        return;
+    }
+    fwrite(data, 1, count, stdout);
+    fflush(stdout);
+}
+
 void UART::tx_chr(uint8_t c)
 {
+    if (backend != NULL) {
+        backend->write(&c, 1);
+        return;
+    }
+    putchar(c);
+    fflush(stdout);
 }
 
 void UART::check_for_rx()
 {
+    uint8_t buf[UART_FIFO_SIZE];
+    uint32_t length = 0;
     int c;
-    while ((c = getchar()) != EOF && rx_buffer.size() <= UART_FIFO_SIZE) {
+    while (length + rx_buffer.size() < UART_FIFO_SIZE
+            && (c = getchar()) != EOF) {
         if (errno != EAGAIN) {
             break;
         }
 
-        rx_buffer.push_back((uint8_t)c);
+        buf[length++] = c;
+    }
+
+    if (length > 0) {
+        receive(buf, length);
+    }
+}
+
+void UART::receive(const uint8_t *data, uint32_t length)
+{
+    // Under record/replay, input reaches the guest at a logged point
+    if (replay_mode != REPLAY_OFF) {
+        replay_queue_input(this, data, length);
+        return;
+    }
+
+    pthread_mutex_lock(&input_lock);
+    input.insert(input.end(), data, data + length);
+    __atomic_store_n(&input_ready, true, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&input_lock);
+}
+
+void UART::take_input()
+{
+    if (!__atomic_load_n(&input_ready, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+
+    pthread_mutex_lock(&input_lock);
+    replay_input(input.data(), input.size());
+    input.clear();
+    __atomic_store_n(&input_ready, false, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&input_lock);
+}
+
+void UART::replay_input(const uint8_t *data, uint32_t length)
+{
+    for (uint32_t i = 0; i < length; i++) {
+        rx_buffer.push(data[i]);
     }
 }
 
 uint8_t UART::rx_char()
 {
-    uint8_t c;
+    uint8_t c = 0;
 
     if (rx_buffer.size() > 0) {
         c = rx_buffer.front();
         rx_buffer.pop();
 
-        if (c == 0x03) {
+        if (c == 0x03 && terminal) {
             kill(0, SIGINT);
         }
     }
+
+    return c;
 }
 
 bool UART::poll_irq()
 {
+    take_input();
+
     int rx_trigger_size = 0;
     switch ((fcr & 0xc0) >> 6) {
         case 0:
@@ -176,5 +287,7 @@ bool UART::poll_irq()
     if (rx_buffer.size() > rx_trigger_size) {
         // TODO IRQ
     }
+
+    return false;
 }
 
@@ -1,11 +1,15 @@
 #ifndef __UART_H__
 #define __UART_H__
 
+#include <pthread.h>
 #include <stdint.h>
 #include <termios.h>
 #include <queue>
+#include <vector>
 
+#include "char_backend.h"
 #include "io_device.h"
+#include "replay.h"
 
 #define UART_BASE_PORT          (0x03f8)
 #define UART_FIFO_SIZE          (16)
@@ -23,15 +27,39 @@
 #define UART_FCR_CLEAR_TX_FIFO  (0x4)
 #define UART_FCR_CLEAR_RX_FIFO  (0x2)
 
-class UART : IODevice {
+class UART : public IODevice, public ReplayInput {
 public:
     UART();
     ~UART();
     void write(uint32_t port, const uint32_t *value, uint8_t size);
     void read(uint32_t port, uint32_t *value, uint8_t size);
     bool poll_irq();
+    // Registers back to power-on; characters received from the host are
+    // kept
+    void reset();
+    void write_block(uint32_t port, const uint8_t *data, uint8_t size,
+            uint32_t count);
+    // Send output to backend instead of the terminal
+    void connect_backend(CharBackend *backend);
+    // Put the process's terminal in raw mode for this UART, restored on
+    // destruction. Only one UART per process should do this.
+    void connect_terminal();
+    // Queue characters from host as if they arrived on the line. Callable
+    // from any thread.
+    void receive(const uint8_t *data, uint32_t length);
+    void replay_input(const uint8_t *data, uint32_t length);
     void debug_status();
 private:
+    // Transmit character to host
+    void tx_chr(uint8_t c);
+    // Read available characters from host into rx_buffer
+    void check_for_rx();
+    // Pop next received character
+    uint8_t rx_char();
+    // Move characters handed over by receive() into rx_buffer
+    void take_input();
+
+    CharBackend *backend;
     std::queue<uint8_t> rx_buffer;
 
     // Transmitter Holding Buffer
@@ -48,7 +76,7 @@ private:
     uint8_t lsr;
 
     // Divisor Latch (doesn't matter; it's an emulation)
-    uint8_t divisor;
+    uint16_t divisor;
     // Line Control Register (nothing important other than DLAB)
     uint8_t lcr;
     // Modem Control Register (nothing important here);
@@ -58,6 +86,12 @@ private:
     // Scratch Register (we emulate this just in case)
     uint8_t sr;
 
+    // Characters from receive(), not yet seen by the guest
+    pthread_mutex_t input_lock;
+    std::vector<uint8_t> input;
+    bool input_ready;
+
+    bool terminal;
     struct termios old_termios;
     struct termios new_termios;
 };
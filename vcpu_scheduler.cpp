@@ -0,0 +1,481 @@
+#include "vcpu_scheduler.h"
+
+#include <algorithm>
+#include <stdio.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "host_clock.h"
+
+VCPUTask::VCPUTask()
+{
+    state = VCPU_TASK_PARKED;
+    wake_pending = false;
+    sleeping = false;
+}
+
+WorkStealingDeque::WorkStealingDeque()
+{
+    top = 0;
+    bottom = 0;
+    active = new array;
+    active->size = VCPU_SCHED_DEQUE_SIZE;
+    active->tasks = new VCPUTask*[active->size];
+}
+
+WorkStealingDeque::~WorkStealingDeque()
+{
+    retired.push_back(active);
+    for (size_t i = 0; i < retired.size(); i++) {
+        delete[] retired[i]->tasks;
+        delete retired[i];
+    }
+}
+
+WorkStealingDeque::array *WorkStealingDeque::grow(array *old, int64_t top,
+        int64_t bottom)
+{
+    array *a = new array;
+    a->size = old->size * 2;
+    a->tasks = new VCPUTask*[a->size];
+    for (int64_t i = top; i < bottom; i++) {
+        a->tasks[i & (a->size - 1)] = __atomic_load_n(
+                &old->tasks[i & (old->size - 1)], __ATOMIC_RELAXED);
+    }
+
+    retired.push_back(old);
+    __atomic_store_n(&active, a, __ATOMIC_RELEASE);
+
+    return a;
+}
+
+void WorkStealingDeque::push(VCPUTask *task)
+{
+    int64_t b = __atomic_load_n(&bottom, __ATOMIC_RELAXED);
+    int64_t t = __atomic_load_n(&top, __ATOMIC_ACQUIRE);
+    array *a = __atomic_load_n(&active, __ATOMIC_RELAXED);
+
+    if (b - t > a->size - 1) {
+        a = grow(a, t, b);
+    }
+    __atomic_store_n(&a->tasks[b & (a->size - 1)], task, __ATOMIC_RELAXED);
+    __atomic_store_n(&bottom, b + 1, __ATOMIC_RELEASE);
+}
+
+VCPUTask *WorkStealingDeque::pop()
+{
+    int64_t b = __atomic_load_n(&bottom, __ATOMIC_RELAXED) - 1;
+    array *a = __atomic_load_n(&active, __ATOMIC_RELAXED);
+    __atomic_store_n(&bottom, b, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    int64_t t = __atomic_load_n(&top, __ATOMIC_RELAXED);
+
+    if (t > b) {
+        // Empty
+        __atomic_store_n(&bottom, b + 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+
+    VCPUTask *task = __atomic_load_n(&a->tasks[b & (a->size - 1)],
+            __ATOMIC_RELAXED);
+    if (t == b) {
+        // Last one; race thieves for it
+        if (!__atomic_compare_exchange_n(&top, &t, t + 1, false,
+                    __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+            task = NULL;
+        }
+        __atomic_store_n(&bottom, b + 1, __ATOMIC_RELAXED);
+    }
+
+    return task;
+}
+
+VCPUTask *WorkStealingDeque::steal()
+{
+    int64_t t = __atomic_load_n(&top, __ATOMIC_ACQUIRE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    int64_t b = __atomic_load_n(&bottom, __ATOMIC_ACQUIRE);
+
+    if (t >= b) {
+        return NULL;
+    }
+
+    array *a = __atomic_load_n(&active, __ATOMIC_ACQUIRE);
+    VCPUTask *task = __atomic_load_n(&a->tasks[t & (a->size - 1)],
+            __ATOMIC_RELAXED);
+    if (!__atomic_compare_exchange_n(&top, &t, t + 1, false,
+                __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+        return NULL;
+    }
+
+    return task;
+}
+
+VCPUScheduler::VCPUScheduler(int workers, uint64_t quantum)
+{
+    host_clock_init();
+    if (workers <= 0) {
+        workers = sysconf(_SC_NPROCESSORS_ONLN);
+        if (workers <= 0) {
+            workers = 1;
+        }
+    }
+
+    for (int i = 0; i < workers; i++) {
+        worker *w = new worker;
+        w->scheduler = this;
+        w->index = i;
+        w->random = i * 2654435761U + 1;
+        w->slices = 0;
+        w->steals = 0;
+        this->workers.push_back(w);
+    }
+
+    this->quantum = quantum;
+    running = false;
+    pthread_mutex_init(&lock, NULL);
+    pthread_cond_init(&cond, NULL);
+    has_injected = false;
+    next_wake_time = VCPU_SCHED_NO_DEADLINE;
+    idle_workers = 0;
+}
+
+VCPUScheduler::~VCPUScheduler()
+{
+    stop();
+
+    for (size_t i = 0; i < workers.size(); i++) {
+        delete workers[i];
+    }
+    pthread_cond_destroy(&cond);
+    pthread_mutex_destroy(&lock);
+}
+
+bool VCPUScheduler::start()
+{
+    if (running) {
+        return false;
+    }
+
+    running = true;
+    for (size_t i = 0; i < workers.size(); i++) {
+        if (pthread_create(&workers[i]->thread, NULL, worker_main,
+                    workers[i]) != 0) {
+            printf("VCPUScheduler: Failed to create worker thread\n");
+            // Carry on with the workers that did start
+            for (size_t j = i; j < workers.size(); j++) {
+                delete workers[j];
+            }
+            workers.resize(i);
+            break;
+        }
+    }
+
+    return !workers.empty();
+}
+
+void VCPUScheduler::stop()
+{
+    if (!running) {
+        return;
+    }
+
+    pthread_mutex_lock(&lock);
+    __atomic_store_n(&running, false, __ATOMIC_RELAXED);
+    pthread_cond_broadcast(&cond);
+    pthread_mutex_unlock(&lock);
+
+    for (size_t i = 0; i < workers.size(); i++) {
+        pthread_join(workers[i]->thread, NULL);
+    }
+}
+
+uint64_t VCPUScheduler::get_time()
+{
+    return host_clock_ns();
+}
+
+void VCPUScheduler::add(VCPUTask *task)
+{
+    __atomic_store_n(&task->state, VCPU_TASK_QUEUED, __ATOMIC_RELEASE);
+    inject(task);
+}
+
+void VCPUScheduler::wake(VCPUTask *task)
+{
+    // A running vCPU sees this when it halts; a parked one is queued here
+    __atomic_store_n(&task->wake_pending, true, __ATOMIC_SEQ_CST);
+
+    int expected = VCPU_TASK_PARKED;
+    if (__atomic_compare_exchange_n(&task->state, &expected,
+                VCPU_TASK_QUEUED, false, __ATOMIC_SEQ_CST,
+                __ATOMIC_RELAXED)) {
+        pthread_mutex_lock(&lock);
+        cancel_sleeper(task);
+        pthread_mutex_unlock(&lock);
+        inject(task);
+    }
+}
+
+void VCPUScheduler::inject(VCPUTask *task)
+{
+    pthread_mutex_lock(&lock);
+    injected.push_back(task);
+    __atomic_store_n(&has_injected, true, __ATOMIC_RELEASE);
+    if (idle_workers > 0) {
+        pthread_cond_signal(&cond);
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+void VCPUScheduler::notify_idle()
+{
+    // Let an idle worker come and steal
+    if (__atomic_load_n(&idle_workers, __ATOMIC_RELAXED) == 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&lock);
+    pthread_cond_signal(&cond);
+    pthread_mutex_unlock(&lock);
+}
+
+bool VCPUScheduler::sleeper_later(const sleeper &a, const sleeper &b)
+{
+    return a.wake_time > b.wake_time;
+}
+
+void VCPUScheduler::wake_sleepers(worker *w, uint64_t now)
+{
+    if (__atomic_load_n(&next_wake_time, __ATOMIC_RELAXED) > now) {
+        return;
+    }
+
+    pthread_mutex_lock(&lock);
+    while (!sleepers.empty() && sleepers.front().wake_time <= now) {
+        VCPUTask *task = sleepers.front().task;
+        std::pop_heap(sleepers.begin(), sleepers.end(), sleeper_later);
+        sleepers.pop_back();
+        task->sleeping = false;
+
+        // Whoever queued the vCPU some other way is about to cancel this
+        // entry; the task is still alive until then
+        int expected = VCPU_TASK_PARKED;
+        if (__atomic_compare_exchange_n(&task->state, &expected,
+                    VCPU_TASK_QUEUED, false, __ATOMIC_SEQ_CST,
+                    __ATOMIC_RELAXED)) {
+            w->deque.push(task);
+        }
+    }
+    __atomic_store_n(&next_wake_time, sleepers.empty()
+            ? VCPU_SCHED_NO_DEADLINE : sleepers.front().wake_time,
+            __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&lock);
+}
+
+void VCPUScheduler::cancel_sleeper(VCPUTask *task)
+{
+    if (!task->sleeping) {
+        return;
+    }
+
+    // Few sleepers, so a linear search and rebuilding the heap is enough
+    for (size_t i = 0; i < sleepers.size(); i++) {
+        if (sleepers[i].task == task) {
+            sleepers[i] = sleepers.back();
+            sleepers.pop_back();
+            std::make_heap(sleepers.begin(), sleepers.end(), sleeper_later);
+            break;
+        }
+    }
+    task->sleeping = false;
+    __atomic_store_n(&next_wake_time, sleepers.empty()
+            ? VCPU_SCHED_NO_DEADLINE : sleepers.front().wake_time,
+            __ATOMIC_RELAXED);
+}
+
+VCPUTask *VCPUScheduler::find_task(worker *w)
+{
+    VCPUTask *task = w->deque.pop();
+    if (task != NULL) {
+        return task;
+    }
+
+    if (__atomic_load_n(&has_injected, __ATOMIC_ACQUIRE)) {
+        pthread_mutex_lock(&lock);
+        // Take them all; other workers steal what they need
+        for (size_t i = 0; i < injected.size(); i++) {
+            w->deque.push(injected[i]);
+        }
+        injected.clear();
+        __atomic_store_n(&has_injected, false, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&lock);
+
+        task = w->deque.pop();
+        if (task != NULL) {
+            return task;
+        }
+    }
+
+    // Steal, starting from a random victim so thieves spread out
+    size_t count = workers.size();
+    w->random = w->random * 1103515245 + 12345;
+    size_t start = (w->random >> 16) % count;
+    for (size_t i = 0; i < count; i++) {
+        worker *victim = workers[(start + i) % count];
+        if (victim == w) {
+            continue;
+        }
+        task = victim->deque.steal();
+        if (task != NULL) {
+            __atomic_add_fetch(&w->steals, 1, __ATOMIC_RELAXED);
+            return task;
+        }
+    }
+
+    return NULL;
+}
+
+void VCPUScheduler::run_task(worker *w, VCPUTask *task)
+{
+    __atomic_store_n(&task->state, VCPU_TASK_RUNNING, __ATOMIC_SEQ_CST);
+    // The slice sees anything that woke it so far
+    __atomic_store_n(&task->wake_pending, false, __ATOMIC_SEQ_CST);
+
+    uint64_t wake_time = VCPU_SCHED_NO_DEADLINE;
+    vcpu_slice_t result = task->run_slice(quantum, &wake_time);
+    // Read by get_slice_count from other threads
+    __atomic_add_fetch(&w->slices, 1, __ATOMIC_RELAXED);
+
+    switch (result) {
+    case VCPU_SLICE_RUNNABLE:
+        __atomic_store_n(&task->state, VCPU_TASK_QUEUED, __ATOMIC_RELEASE);
+        w->deque.push(task);
+        notify_idle();
+        break;
+    case VCPU_SLICE_HALTED: {
+        if (wake_time != VCPU_SCHED_NO_DEADLINE) {
+            // Park with the lock held, so that whoever queues the vCPU
+            // from here on finds the entry to cancel
+            sleeper s = {wake_time, task};
+            pthread_mutex_lock(&lock);
+            sleepers.push_back(s);
+            std::push_heap(sleepers.begin(), sleepers.end(), sleeper_later);
+            task->sleeping = true;
+            __atomic_store_n(&next_wake_time, sleepers.front().wake_time,
+                    __ATOMIC_RELAXED);
+            __atomic_store_n(&task->state, VCPU_TASK_PARKED,
+                    __ATOMIC_SEQ_CST);
+            pthread_mutex_unlock(&lock);
+        } else {
+            __atomic_store_n(&task->state, VCPU_TASK_PARKED,
+                    __ATOMIC_SEQ_CST);
+        }
+
+        // Woken while running; whoever wins the state change queues it
+        if (__atomic_load_n(&task->wake_pending, __ATOMIC_SEQ_CST)) {
+            int expected = VCPU_TASK_PARKED;
+            if (__atomic_compare_exchange_n(&task->state, &expected,
+                        VCPU_TASK_QUEUED, false, __ATOMIC_SEQ_CST,
+                        __ATOMIC_RELAXED)) {
+                pthread_mutex_lock(&lock);
+                cancel_sleeper(task);
+                pthread_mutex_unlock(&lock);
+                w->deque.push(task);
+            }
+        }
+    }
+        break;
+    case VCPU_SLICE_DONE:
+        __atomic_store_n(&task->state, VCPU_TASK_DONE, __ATOMIC_RELEASE);
+        break;
+    }
+}
+
+void *VCPUScheduler::worker_main(void *arg)
+{
+    worker *w = (worker*)arg;
+    w->scheduler->run_worker(w);
+
+    return NULL;
+}
+
+void VCPUScheduler::run_worker(worker *w)
+{
+    while (__atomic_load_n(&running, __ATOMIC_RELAXED)) {
+        wake_sleepers(w, get_time());
+
+        VCPUTask *task = find_task(w);
+        if (task != NULL) {
+            run_task(w, task);
+            continue;
+        }
+
+        // Nothing to do until the next sleeper is due or someone adds work
+        pthread_mutex_lock(&lock);
+        if (!__atomic_load_n(&has_injected, __ATOMIC_RELAXED)
+                && __atomic_load_n(&running, __ATOMIC_RELAXED)) {
+            uint64_t now = get_time();
+            uint64_t timeout = VCPU_SCHED_IDLE_WAIT;
+            if (next_wake_time <= now) {
+                timeout = 0;
+            } else if (next_wake_time - now < timeout) {
+                timeout = next_wake_time - now;
+            }
+
+            if (timeout > 0) {
+                struct timeval tv;
+                gettimeofday(&tv, NULL);
+                uint64_t ns = (uint64_t)tv.tv_usec * 1000 + timeout;
+                struct timespec until;
+                until.tv_sec = tv.tv_sec + ns / 1000000000ULL;
+                until.tv_nsec = ns % 1000000000ULL;
+
+                idle_workers++;
+                pthread_cond_timedwait(&cond, &lock, &until);
+                idle_workers--;
+            }
+        }
+        pthread_mutex_unlock(&lock);
+    }
+}
+
+uint64_t VCPUScheduler::get_slice_count()
+{
+    uint64_t count = 0;
+    for (size_t i = 0; i < workers.size(); i++) {
+        count += __atomic_load_n(&workers[i]->slices, __ATOMIC_RELAXED);
+    }
+
+    return count;
+}
+
+uint64_t VCPUScheduler::get_steal_count()
+{
+    uint64_t count = 0;
+    for (size_t i = 0; i < workers.size(); i++) {
+        count += __atomic_load_n(&workers[i]->steals, __ATOMIC_RELAXED);
+    }
+
+    return count;
+}
+
+void VCPUScheduler::debug_status()
+{
+    printf("------------------------------\n");
+    printf("VCPUScheduler:\n");
+    printf("Workers: %zu, quantum: %llu ns\n", workers.size(),
+            (unsigned long long)quantum);
+    for (size_t i = 0; i < workers.size(); i++) {
+        printf("Worker %zu: slices: %llu, steals: %llu\n", i,
+                (unsigned long long)__atomic_load_n(&workers[i]->slices,
+                    __ATOMIC_RELAXED),
+                (unsigned long long)__atomic_load_n(&workers[i]->steals,
+                    __ATOMIC_RELAXED));
+    }
+    pthread_mutex_lock(&lock);
+    printf("Sleeping vCPUs: %zu\n", sleepers.size());
+    pthread_mutex_unlock(&lock);
+    printf("------------------------------\n");
+}
@@ -0,0 +1,145 @@
+#ifndef __VCPU_SCHEDULER_H__
+#define __VCPU_SCHEDULER_H__
+
+#include <pthread.h>
+#include <stdint.h>
+#include <vector>
+
+// Longest a vCPU runs before others get a turn [ns]
+#define VCPU_SCHED_QUANTUM      (1000000)
+// Longest an idle worker sleeps before looking for work again [ns]
+#define VCPU_SCHED_IDLE_WAIT    (10000000)
+#define VCPU_SCHED_NO_DEADLINE  (UINT64_MAX)
+#define VCPU_SCHED_DEQUE_SIZE   (256)
+
+typedef enum {
+    // Still has work; run again when its turn comes
+    VCPU_SLICE_RUNNABLE,
+    // Halted until wake() or its timer deadline
+    VCPU_SLICE_HALTED,
+    // Never run again
+    VCPU_SLICE_DONE,
+} vcpu_slice_t;
+
+typedef enum {
+    VCPU_TASK_PARKED,
+    VCPU_TASK_QUEUED,
+    VCPU_TASK_RUNNING,
+    VCPU_TASK_DONE,
+} vcpu_task_state_t;
+
+// A vCPU that can run on any worker thread, a time slice at a time. A
+// software CPU backend implements this; Hypervisor.framework vCPUs are
+// bound to the thread that created them and can't be.
+class VCPUTask {
+public:
+    VCPUTask();
+    virtual ~VCPUTask() {}
+    // Run the guest for about quantum [ns], then return. When halting,
+    // set *wake_time to the next timer deadline [ns, host_clock_ns] or
+    // leave it at VCPU_SCHED_NO_DEADLINE.
+    virtual vcpu_slice_t run_slice(uint64_t quantum, uint64_t *wake_time) = 0;
+private:
+    friend class VCPUScheduler;
+
+    int state;
+    // Set by wake(); makes a halting vCPU run again
+    bool wake_pending;
+    // Has an entry in the scheduler's sleepers, protected by its lock
+    bool sleeping;
+};
+
+// Chase-Lev deque: the owning worker pushes and pops at the bottom, other
+// workers steal from the top
+class WorkStealingDeque {
+public:
+    WorkStealingDeque();
+    ~WorkStealingDeque();
+    // Owner only
+    void push(VCPUTask *task);
+    VCPUTask *pop();
+    // Any thread; NULL if empty or another thief won
+    VCPUTask *steal();
+private:
+    struct array {
+        int64_t size;
+        VCPUTask **tasks;
+    };
+
+    array *grow(array *old, int64_t top, int64_t bottom);
+
+    int64_t top;
+    int64_t bottom;
+    array *active;
+    // Arrays replaced by grow; thieves may still read them
+    std::vector<array*> retired;
+};
+
+// Runs many vCPUs on one worker thread per host core
+class VCPUScheduler {
+public:
+    // workers == 0 uses one per online host CPU
+    VCPUScheduler(int workers = 0, uint64_t quantum = VCPU_SCHED_QUANTUM);
+    ~VCPUScheduler();
+    bool start();
+    // Workers stop after their current slice
+    void stop();
+    // Hand over a runnable vCPU. Callable from any thread.
+    void add(VCPUTask *task);
+    // Make a halted vCPU runnable, e.g. on an interrupt. Callable from any
+    // thread.
+    void wake(VCPUTask *task);
+
+    uint64_t get_slice_count();
+    uint64_t get_steal_count();
+    void debug_status();
+
+    static uint64_t get_time();
+private:
+    struct worker {
+        VCPUScheduler *scheduler;
+        int index;
+        pthread_t thread;
+        WorkStealingDeque deque;
+        uint32_t random;
+        uint64_t slices;
+        uint64_t steals;
+    };
+
+    struct sleeper {
+        uint64_t wake_time;
+        VCPUTask *task;
+    };
+
+    // Heap order for sleepers, earliest first
+    static bool sleeper_later(const sleeper &a, const sleeper &b);
+    static void *worker_main(void *arg);
+    void run_worker(worker *w);
+    VCPUTask *find_task(worker *w);
+    void run_task(worker *w, VCPUTask *task);
+    // Queue task on the shared injection queue
+    void inject(VCPUTask *task);
+    // Move sleepers whose time has come to w's deque
+    void wake_sleepers(worker *w, uint64_t now);
+    // Drop the sleeper entry of a task that was queued some other way, so
+    // that none outlives the task. Call with lock held.
+    void cancel_sleeper(VCPUTask *task);
+    void notify_idle();
+
+    std::vector<worker*> workers;
+    uint64_t quantum;
+    bool running;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    // Tasks from other threads, protected by lock
+    std::vector<VCPUTask*> injected;
+    bool has_injected;
+    // Min-heap by wake time, protected by lock
+    std::vector<sleeper> sleepers;
+    // Earliest wake time in sleepers, readable without lock
+    uint64_t next_wake_time;
+    int idle_workers;
+};
+
+#endif
@@ -0,0 +1,353 @@
+#include "vga.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "log.h"
+
+#define VGA_CRTC_CURSOR_START   (0x0a)
+#define VGA_CRTC_START_HIGH     (0x0c)
+#define VGA_CRTC_CURSOR_HIGH    (0x0e)
+#define VGA_CRTC_VERTICAL_END   (0x12)
+#define VGA_CRTC_OFFSET         (0x13)
+#define VGA_CRTC_PROTECT        (0x80)
+#define VGA_CURSOR_DISABLE      (0x20)
+#define VGA_ATTR_PALETTE_SOURCE (0x20)
+#define VGA_ATTR_MODE           (0x10)
+#define VGA_GC_MISC             (0x06)
+// Display enable and vertical retrace
+#define VGA_STATUS_TOGGLE       (0x09)
+
+// Register values of BIOS mode 3, 80x25 color text
+static const uint8_t default_seq[VGA_SEQ_COUNT] = {
+    0x03, 0x00, 0x03, 0x00, 0x02,
+};
+static const uint8_t default_gc[VGA_GC_COUNT] = {
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x10, 0x0e, 0x00, 0xff,
+};
+static const uint8_t default_crtc[VGA_CRTC_COUNT] = {
+    0x5f, 0x4f, 0x50, 0x82, 0x55, 0x81, 0xbf, 0x1f,
+    0x00, 0x4f, 0x0d, 0x0e, 0x00, 0x00, 0x00, 0x00,
+    0x9c, 0x8e, 0x8f, 0x28, 0x1f, 0x96, 0xb9, 0xa3,
+    0xff,
+};
+static const uint8_t default_attr[VGA_ATTR_COUNT] = {
+    0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x14, 0x07,
+    0x38, 0x39, 0x3a, 0x3b, 0x3c, 0x3d, 0x3e, 0x3f,
+    0x0c, 0x00, 0x0f, 0x08, 0x00,
+};
+
+VGA::VGA(Memory *memory, EventScheduler *scheduler)
+{
+    this->memory = memory;
+    this->scheduler = scheduler;
+    display = NULL;
+
+    misc_output = 0x67;
+    seq_index = 0;
+    memcpy(seq, default_seq, sizeof(seq));
+    gc_index = 0;
+    memcpy(gc, default_gc, sizeof(gc));
+    crtc_index = 0;
+    memcpy(crtc, default_crtc, sizeof(crtc));
+    attr_index = 0;
+    attr_data_next = false;
+    memcpy(attr, default_attr, sizeof(attr));
+    input_status = 0;
+    dac_mask = 0xff;
+    dac_read_index = 0;
+    dac_write_index = 0;
+    dac_component = 0;
+    memset(dac, 0, sizeof(dac));
+
+    rows = 0;
+    columns = 0;
+    pitch = 0;
+    redraw = true;
+    cursor_row = 0;
+    cursor_column = 0;
+    cursor_visible = false;
+
+    refreshes = 0;
+    frames = 0;
+    cells_drawn = 0;
+}
+
+VGA::~VGA()
+{
+    if (display != NULL) {
+        scheduler->cancel(this);
+    }
+}
+
+void VGA::connect_display(TextDisplay *display)
+{
+    if (this->display != NULL) {
+        scheduler->cancel(this);
+    }
+    this->display = display;
+    redraw = true;
+    if (display != NULL) {
+        scheduler->schedule(this,
+                scheduler->get_time() + VGA_REFRESH_INTERVAL);
+    }
+}
+
+void VGA::write(uint32_t port, const uint32_t *value, uint8_t size)
+{
+    if (size != 1) {
+        LOG_WARN("VGA: VGA only supports single-byte R/W\n");
+        return;
+    }
+
+    uint8_t data = *value;
+    switch (port - VGA_BASE_PORT) {
+    case 0x00:
+        write_attribute(data);
+        break;
+    case 0x02:
+        misc_output = data;
+        break;
+    case 0x04:
+        seq_index = data;
+        break;
+    case 0x05:
+        if (seq_index < VGA_SEQ_COUNT) {
+            seq[seq_index] = data;
+        }
+        break;
+    case 0x06:
+        dac_mask = data;
+        break;
+    case 0x07:
+        dac_read_index = data;
+        dac_component = 0;
+        break;
+    case 0x08:
+        dac_write_index = data;
+        dac_component = 0;
+        break;
+    case 0x09:
+        dac[dac_write_index * 3 + dac_component] = data & 0x3f;
+        if (++dac_component == 3) {
+            dac_component = 0;
+            dac_write_index++;
+        }
+        break;
+    case 0x0e:
+        gc_index = data;
+        break;
+    case 0x0f:
+        if (gc_index < VGA_GC_COUNT) {
+            gc[gc_index] = data;
+        }
+        break;
+    case 0x14:
+        crtc_index = data;
+        break;
+    case 0x15:
+        if (crtc_index >= VGA_CRTC_COUNT) {
+            break;
+        }
+        // Protect bit locks the horizontal timing registers, and all of
+        // the overflow register except line compare bit 8
+        if (crtc_index <= 7 && (crtc[0x11] & VGA_CRTC_PROTECT)) {
+            if (crtc_index == 7) {
+                crtc[7] = (crtc[7] & ~0x10) | (data & 0x10);
+            }
+            break;
+        }
+        crtc[crtc_index] = data;
+        break;
+    case 0x1a:
+        // Feature control
+        break;
+    default:
+        LOG_WARN("VGA: Write to unsupported port 0x%x\n", port);
+        break;
+    }
+}
+
+void VGA::read(uint32_t port, uint32_t *value, uint8_t size)
+{
+    if (size != 1) {
+        LOG_WARN("VGA: VGA only supports single-byte R/W\n");
+        return;
+    }
+
+    switch (port - VGA_BASE_PORT) {
+    case 0x00:
+        *value = attr_index;
+        break;
+    case 0x01:
+        *value = (attr_index & 0x1f) < VGA_ATTR_COUNT
+            ? attr[attr_index & 0x1f] : 0;
+        break;
+    case 0x04:
+        *value = seq_index;
+        break;
+    case 0x05:
+        *value = seq_index < VGA_SEQ_COUNT ? seq[seq_index] : 0;
+        break;
+    case 0x06:
+        *value = dac_mask;
+        break;
+    case 0x08:
+        *value = dac_write_index;
+        break;
+    case 0x09:
+        *value = dac[dac_read_index * 3 + dac_component];
+        if (++dac_component == 3) {
+            dac_component = 0;
+            dac_read_index++;
+        }
+        break;
+    case 0x0c:
+        *value = misc_output;
+        break;
+    case 0x0e:
+        *value = gc_index;
+        break;
+    case 0x0f:
+        *value = gc_index < VGA_GC_COUNT ? gc[gc_index] : 0;
+        break;
+    case 0x14:
+        *value = crtc_index;
+        break;
+    case 0x15:
+        *value = crtc_index < VGA_CRTC_COUNT ? crtc[crtc_index] : 0;
+        break;
+    case 0x1a:
+        input_status ^= VGA_STATUS_TOGGLE;
+        attr_data_next = false;
+        *value = input_status;
+        break;
+    default:
+        // Input status 0, feature control and DAC state read as 0
+        *value = 0;
+        break;
+    }
+}
+
+void VGA::write_attribute(uint8_t value)
+{
+    if (!attr_data_next) {
+        attr_index = value;
+    } else if ((attr_index & 0x1f) < VGA_ATTR_COUNT) {
+        attr[attr_index & 0x1f] = value;
+    }
+    attr_data_next = !attr_data_next;
+}
+
+bool VGA::is_graphics()
+{
+    return (gc[VGA_GC_MISC] & 0x1) || (attr[VGA_ATTR_MODE] & 0x1);
+}
+
+bool VGA::update_geometry()
+{
+    int new_columns = crtc[1] + 1;
+    // Vertical display end has bits 8 and 9 in the overflow register
+    int lines = crtc[VGA_CRTC_VERTICAL_END] | ((crtc[7] & 0x02) << 7)
+        | ((crtc[7] & 0x40) << 3);
+    int new_rows = (lines + 1) / ((crtc[9] & 0x1f) + 1);
+    if (new_columns > VGA_MAX_COLUMNS) {
+        new_columns = VGA_MAX_COLUMNS;
+    }
+    if (new_rows > VGA_MAX_ROWS) {
+        new_rows = VGA_MAX_ROWS;
+    }
+    if (new_rows < 1) {
+        new_rows = 1;
+    }
+    pitch = crtc[VGA_CRTC_OFFSET] * 2;
+
+    if (new_rows == rows && new_columns == columns) {
+        return false;
+    }
+    rows = new_rows;
+    columns = new_columns;
+    return true;
+}
+
+void VGA::handle_event(uint64_t now)
+{
+    refresh();
+    scheduler->schedule(this, now + VGA_REFRESH_INTERVAL);
+}
+
+void VGA::refresh()
+{
+    refreshes++;
+    if (display == NULL || is_graphics()) {
+        return;
+    }
+    const uint16_t *window = (const uint16_t*)memory->get_pointer(
+            VGA_TEXT_BASE, VGA_TEXT_WINDOW);
+    if (window == NULL) {
+        return;
+    }
+
+    bool all = redraw;
+    if (update_geometry() || redraw) {
+        display->resize(rows, columns);
+        shadow.assign(rows * columns, 0);
+        all = true;
+        redraw = false;
+    }
+
+    // Offsets are in cells and wrap around the window
+    const uint32_t wrap = VGA_TEXT_WINDOW / 2 - 1;
+    uint32_t start = (crtc[VGA_CRTC_START_HIGH] << 8)
+        | crtc[VGA_CRTC_START_HIGH + 1];
+    bool changed = all;
+    for (int row = 0; row < rows; row++) {
+        uint32_t offset = (start + row * pitch) & wrap;
+        uint16_t *cells = &shadow[row * columns];
+        // Most rows don't change between refreshes
+        if (!all && offset + columns <= wrap + 1
+                && memcmp(cells, window + offset, columns * 2) == 0) {
+            continue;
+        }
+
+        for (int column = 0; column < columns; column++) {
+            uint16_t cell = window[(offset + column) & wrap];
+            if (!all && cell == cells[column]) {
+                continue;
+            }
+            cells[column] = cell;
+            display->draw_cell(row, column, cell & 0xff, cell >> 8);
+            cells_drawn++;
+            changed = true;
+        }
+    }
+
+    // Cursor position counts from the start of VRAM, not of the screen
+    uint32_t position = (((crtc[VGA_CRTC_CURSOR_HIGH] << 8)
+                | crtc[VGA_CRTC_CURSOR_HIGH + 1]) - start) & wrap;
+    int row = pitch > 0 ? position / pitch : 0;
+    int column = pitch > 0 ? position % pitch : 0;
+    bool visible = !(crtc[VGA_CRTC_CURSOR_START] & VGA_CURSOR_DISABLE)
+        && row < rows && column < columns;
+    if (all || row != cursor_row || column != cursor_column
+            || visible != cursor_visible) {
+        cursor_row = row;
+        cursor_column = column;
+        cursor_visible = visible;
+        display->move_cursor(row, column, visible);
+        changed = true;
+    }
+
+    if (changed) {
+        display->flush();
+        frames++;
+    }
+}
+
+void VGA::debug_status()
+{
+    printf("VGA: %dx%d %s, %llu refreshes, %llu frames, %llu cells drawn\n",
+            columns, rows, is_graphics() ? "graphics" : "text",
+            (unsigned long long)refreshes, (unsigned long long)frames,
+            (unsigned long long)cells_drawn);
+}
@@ -0,0 +1,93 @@
+#ifndef __VGA_H__
+#define __VGA_H__
+
+#include <stdint.h>
+#include <vector>
+
+#include "event_scheduler.h"
+#include "io_device.h"
+#include "memory.h"
+#include "text_display.h"
+
+// 0x3c0-0x3df: attribute, misc, sequencer, DAC, graphics and color CRTC
+#define VGA_BASE_PORT           (0x3c0)
+#define VGA_PORT_COUNT          (0x20)
+// Text mode memory, ordinary guest RAM
+#define VGA_TEXT_BASE           (0xb8000)
+#define VGA_TEXT_WINDOW         (0x8000)
+// Time between refreshes [ns] (25 Hz)
+#define VGA_REFRESH_INTERVAL    (40000000)
+// Largest text mode screen drawn (132x60)
+#define VGA_MAX_COLUMNS         (132)
+#define VGA_MAX_ROWS            (60)
+
+#define VGA_CRTC_COUNT          (0x19)
+#define VGA_SEQ_COUNT           (0x05)
+#define VGA_GC_COUNT            (0x09)
+#define VGA_ATTR_COUNT          (0x15)
+
+// VGA in text mode. The framebuffer is guest RAM, so the guest writes it
+// without exits; a timer on the vCPU thread compares it with a shadow copy
+// at VGA_REFRESH_INTERVAL and hands only the changed cells to the display.
+// Graphics modes keep their registers but aren't drawn.
+class VGA : public IODevice, public EventHandler {
+public:
+    VGA(Memory *memory, EventScheduler *scheduler);
+    ~VGA();
+    void write(uint32_t port, const uint32_t *value, uint8_t size);
+    void read(uint32_t port, uint32_t *value, uint8_t size);
+    // Start refreshing to display, or stop if NULL
+    void connect_display(TextDisplay *display);
+    void handle_event(uint64_t now);
+    // Draw what changed since the last refresh. Only call from the vCPU
+    // thread, or while it's stopped.
+    void refresh();
+    void debug_status();
+private:
+    void write_attribute(uint8_t value);
+    // Geometry from the CRTC registers. Return true if it changed.
+    bool update_geometry();
+    bool is_graphics();
+
+    Memory *memory;
+    EventScheduler *scheduler;
+    TextDisplay *display;
+
+    uint8_t misc_output;
+    uint8_t seq_index;
+    uint8_t seq[VGA_SEQ_COUNT];
+    uint8_t gc_index;
+    uint8_t gc[VGA_GC_COUNT];
+    uint8_t crtc_index;
+    uint8_t crtc[VGA_CRTC_COUNT];
+    // Index and data share a port, selected by a flip-flop that reads of
+    // input status 1 reset
+    uint8_t attr_index;
+    bool attr_data_next;
+    uint8_t attr[VGA_ATTR_COUNT];
+    // Toggles display enable and vertical retrace on each read, so loops
+    // waiting for retrace make progress
+    uint8_t input_status;
+    uint8_t dac_mask;
+    uint8_t dac_read_index;
+    uint8_t dac_write_index;
+    uint8_t dac_component;
+    uint8_t dac[256 * 3];
+
+    int rows;
+    int columns;
+    // Cells from one row to the next in memory
+    int pitch;
+    // Cells as last drawn, and cursor as last shown
+    std::vector<uint16_t> shadow;
+    bool redraw;
+    int cursor_row;
+    int cursor_column;
+    bool cursor_visible;
+
+    uint64_t refreshes;
+    uint64_t frames;
+    uint64_t cells_drawn;
+};
+
+#endif
@@ -0,0 +1,436 @@
+#include "virtio.h"
+
+#include <stdio.h>
+
+#include "log.h"
+
+VirtioDevice::VirtioDevice(Memory *memory, uint64_t base_address,
+        uint32_t device_id, int queue_count)
+{
+    this->memory = memory;
+    this->base_address = base_address;
+    this->device_id = device_id;
+    this->queue_count = queue_count;
+    pic = NULL;
+    irq_number = 0;
+    config_generation = 0;
+    generation = 0;
+
+    if (queue_count > VIRTIO_MAX_QUEUES) {
+        printf("Virtio: Too many queues (%d)\n", queue_count);
+        this->queue_count = VIRTIO_MAX_QUEUES;
+    }
+
+    reset_device();
+}
+
+VirtioDevice::~VirtioDevice()
+{
+}
+
+void VirtioDevice::connect_pic(PIC *pic, uint8_t irq_number)
+{
+    this->pic = pic;
+    this->irq_number = irq_number;
+}
+
+uint64_t VirtioDevice::get_base_address()
+{
+    return base_address;
+}
+
+void VirtioDevice::mmio_write(uint64_t address, const uint64_t *value,
+        uint8_t size)
+{
+    uint32_t offset = address - base_address;
+
+    if (offset >= VIRTIO_MMIO_CONFIG) {
+        write_config(offset - VIRTIO_MMIO_CONFIG, *value, size);
+        return;
+    }
+
+    if (size != 4) {
+        LOG_WARN("Virtio: Registers only support 32-bit R/W\n");
+        return;
+    }
+
+    write_register(offset, *value);
+}
+
+void VirtioDevice::mmio_read(uint64_t address, uint64_t *value, uint8_t size)
+{
+    uint32_t offset = address - base_address;
+
+    if (offset >= VIRTIO_MMIO_CONFIG) {
+        *value = 0;
+        read_config(offset - VIRTIO_MMIO_CONFIG, value, size);
+        return;
+    }
+
+    if (size != 4) {
+        LOG_WARN("Virtio: Registers only support 32-bit R/W\n");
+        *value = 0;
+        return;
+    }
+
+    *value = read_register(offset);
+}
+
+void VirtioDevice::write_register(uint32_t offset, uint32_t value)
+{
+    virtq *q = &queues[queue_sel];
+
+    switch (offset) {
+    case VIRTIO_MMIO_DEVICE_FEATURES_SEL:
+        device_features_sel = value;
+        break;
+    case VIRTIO_MMIO_DRIVER_FEATURES:
+        if (driver_features_sel == 0) {
+            driver_features = (driver_features & ~0xffffffffULL) | value;
+        } else if (driver_features_sel == 1) {
+            driver_features = (driver_features & 0xffffffffULL)
+                | (uint64_t)value << 32;
+        }
+        break;
+    case VIRTIO_MMIO_DRIVER_FEATURES_SEL:
+        driver_features_sel = value;
+        break;
+    case VIRTIO_MMIO_QUEUE_SEL:
+        if (value >= (uint32_t)queue_count) {
+            LOG_WARN("Virtio: Invalid queue %d selected\n", value);
+            break;
+        }
+        queue_sel = value;
+        break;
+    case VIRTIO_MMIO_QUEUE_NUM:
+        // Ring indexes are taken modulo the size
+        if (value == 0 || value > VIRTIO_QUEUE_SIZE
+                || (value & (value - 1)) != 0) {
+            LOG_WARN("Virtio: Invalid queue size %d\n", value);
+            break;
+        }
+        if (q->ready) {
+            LOG_WARN("Virtio: Queue size changed while ready\n");
+            break;
+        }
+        q->num = value;
+        break;
+    case VIRTIO_MMIO_QUEUE_READY:
+        if (!(value & 0x1)) {
+            q->ready = false;
+            q->setup_pending = false;
+        } else if (get_inflight() > 0) {
+            q->setup_pending = true;
+        } else {
+            setup_queue(q);
+        }
+        break;
+    case VIRTIO_MMIO_QUEUE_NOTIFY:
+        if (value < (uint32_t)queue_count && queues[value].ready
+                && !(status & VIRTIO_STATUS_NEEDS_RESET)) {
+            queue_notify(value);
+        }
+        break;
+    case VIRTIO_MMIO_INTERRUPT_ACK:
+        interrupt_status &= ~value;
+        break;
+    case VIRTIO_MMIO_STATUS:
+        if (value == 0) {
+            reset_device();
+        } else {
+            // Only a reset clears needs-reset
+            status = value | (status & VIRTIO_STATUS_NEEDS_RESET);
+        }
+        break;
+    case VIRTIO_MMIO_QUEUE_DESC_LOW:
+        q->desc_address = (q->desc_address & ~0xffffffffULL) | value;
+        break;
+    case VIRTIO_MMIO_QUEUE_DESC_HIGH:
+        q->desc_address = (q->desc_address & 0xffffffffULL)
+            | (uint64_t)value << 32;
+        break;
+    case VIRTIO_MMIO_QUEUE_AVAIL_LOW:
+        q->avail_address = (q->avail_address & ~0xffffffffULL) | value;
+        break;
+    case VIRTIO_MMIO_QUEUE_AVAIL_HIGH:
+        q->avail_address = (q->avail_address & 0xffffffffULL)
+            | (uint64_t)value << 32;
+        break;
+    case VIRTIO_MMIO_QUEUE_USED_LOW:
+        q->used_address = (q->used_address & ~0xffffffffULL) | value;
+        break;
+    case VIRTIO_MMIO_QUEUE_USED_HIGH:
+        q->used_address = (q->used_address & 0xffffffffULL)
+            | (uint64_t)value << 32;
+        break;
+    default:
+        LOG_WARN("Virtio: Register 0x%03x is read only\n", offset);
+        break;
+    }
+}
+
+uint32_t VirtioDevice::read_register(uint32_t offset)
+{
+    uint64_t features = get_features() | 1ULL << VIRTIO_F_VERSION_1;
+    virtq *q = &queues[queue_sel];
+
+    switch (offset) {
+    case VIRTIO_MMIO_MAGIC_VALUE:
+        return VIRTIO_MMIO_MAGIC;
+    case VIRTIO_MMIO_VERSION_REG:
+        return VIRTIO_MMIO_VERSION;
+    case VIRTIO_MMIO_DEVICE_ID:
+        return device_id;
+    case VIRTIO_MMIO_VENDOR_ID:
+        return VIRTIO_VENDOR_ID;
+    case VIRTIO_MMIO_DEVICE_FEATURES:
+        if (device_features_sel == 0) {
+            return features & 0xffffffff;
+        } else if (device_features_sel == 1) {
+            return features >> 32;
+        }
+        return 0;
+    case VIRTIO_MMIO_QUEUE_NUM_MAX:
+        return VIRTIO_QUEUE_SIZE;
+    case VIRTIO_MMIO_QUEUE_READY:
+        return q->ready || q->setup_pending ? 1 : 0;
+    case VIRTIO_MMIO_INTERRUPT_STATUS:
+        return interrupt_status;
+    case VIRTIO_MMIO_STATUS:
+        return status;
+    case VIRTIO_MMIO_CONFIG_GENERATION:
+        return config_generation;
+    }
+
+    return 0;
+}
+
+void VirtioDevice::setup_queue(virtq *q)
+{
+    q->desc = (virtq_desc*)memory->get_pointer(q->desc_address,
+            sizeof(virtq_desc) * q->num);
+    q->avail = (virtq_avail*)memory->get_pointer(q->avail_address,
+            sizeof(virtq_avail) + sizeof(uint16_t) * (q->num + 1));
+    q->used = (virtq_used*)memory->get_pointer(q->used_address,
+            sizeof(virtq_used) + sizeof(virtq_used_elem) * q->num
+            + sizeof(uint16_t));
+
+    if (q->desc == NULL || q->avail == NULL || q->used == NULL) {
+        LOG_WARN("Virtio: Queue is outside of RAM\n");
+        q->ready = false;
+        return;
+    }
+
+    q->last_avail_idx = 0;
+    q->used_pending = false;
+    q->ready = true;
+}
+
+void VirtioDevice::inflight_drained()
+{
+    for (int i = 0; i < queue_count; i++) {
+        if (!queues[i].setup_pending) {
+            continue;
+        }
+        queues[i].setup_pending = false;
+        setup_queue(&queues[i]);
+        // Notifications before now were dropped
+        if (queues[i].ready && !(status & VIRTIO_STATUS_NEEDS_RESET)) {
+            queue_notify(i);
+        }
+    }
+}
+
+void VirtioDevice::reset_device()
+{
+    device_features_sel = 0;
+    driver_features_sel = 0;
+    driver_features = 0;
+    queue_sel = 0;
+    interrupt_status = 0;
+    status = 0;
+    generation++;
+
+    for (int i = 0; i < VIRTIO_MAX_QUEUES; i++) {
+        queues[i].num = VIRTIO_QUEUE_SIZE;
+        queues[i].ready = false;
+        queues[i].setup_pending = false;
+        queues[i].desc_address = 0;
+        queues[i].avail_address = 0;
+        queues[i].used_address = 0;
+        queues[i].desc = NULL;
+        queues[i].avail = NULL;
+        queues[i].used = NULL;
+        queues[i].last_avail_idx = 0;
+        queues[i].used_pending = false;
+    }
+
+    reset();
+}
+
+int VirtioDevice::pop_chain(int queue, struct iovec *iov, int max_iov,
+        int *readable_count, int *writable_count, bool *broken)
+{
+    virtq *q = &queues[queue];
+
+    if (!q->ready || (status & VIRTIO_STATUS_NEEDS_RESET)) {
+        return -1;
+    }
+
+    uint16_t avail_idx = __atomic_load_n(&q->avail->idx, __ATOMIC_ACQUIRE);
+    if (q->last_avail_idx == avail_idx) {
+        return -1;
+    }
+
+    uint16_t head = q->avail->ring[q->last_avail_idx % q->num];
+    q->last_avail_idx++;
+
+    *readable_count = 0;
+    *writable_count = 0;
+    *broken = false;
+
+    uint16_t index = head;
+    // Bounded by queue size so that a looping chain can't hang us
+    for (int i = 0; i < q->num; i++) {
+        // Nothing in the ring can be trusted after a bad index, not even
+        // which chain to return
+        if (index >= q->num) {
+            LOG_WARN("Virtio: Invalid descriptor index %d\n", index);
+            set_needs_reset();
+            return -1;
+        }
+
+        virtq_desc *desc = &q->desc[index];
+        if (!*broken) {
+            int count = *readable_count + *writable_count;
+            void *base = memory->get_pointer(desc->addr, desc->len);
+            if (count >= max_iov) {
+                LOG_WARN("Virtio: Descriptor chain is too long\n");
+                *broken = true;
+            } else if (base == NULL) {
+                LOG_WARN("Virtio: Descriptor buffer is outside of RAM\n");
+                *broken = true;
+            } else if (desc->flags & VIRTQ_DESC_F_WRITE) {
+                iov[count].iov_base = base;
+                iov[count].iov_len = desc->len;
+                (*writable_count)++;
+            } else if (*writable_count > 0) {
+                LOG_WARN("Virtio: Readable descriptor after writable one\n");
+                *broken = true;
+            } else {
+                iov[count].iov_base = base;
+                iov[count].iov_len = desc->len;
+                (*readable_count)++;
+            }
+        }
+
+        // Walk a broken chain to its end anyway to check its indexes
+        if (!(desc->flags & VIRTQ_DESC_F_NEXT)) {
+            return head;
+        }
+        index = desc->next;
+    }
+
+    LOG_WARN("Virtio: Descriptor chain loops\n");
+    set_needs_reset();
+    return -1;
+}
+
+uint8_t *VirtioDevice::get_chain_tail(int queue, uint16_t head)
+{
+    virtq *q = &queues[queue];
+
+    uint16_t index = head;
+    for (int i = 0; i < q->num && index < q->num; i++) {
+        virtq_desc *desc = &q->desc[index];
+        if (!(desc->flags & VIRTQ_DESC_F_NEXT)) {
+            if (!(desc->flags & VIRTQ_DESC_F_WRITE) || desc->len == 0) {
+                return NULL;
+            }
+            uint8_t *base = (uint8_t*)memory->get_pointer(desc->addr,
+                    desc->len);
+            return base != NULL ? base + desc->len - 1 : NULL;
+        }
+        index = desc->next;
+    }
+
+    return NULL;
+}
+
+void VirtioDevice::push_used(int queue, uint16_t head, uint32_t length)
+{
+    virtq *q = &queues[queue];
+    uint16_t used_idx = q->used->idx;
+
+    q->used->ring[used_idx % q->num].id = head;
+    q->used->ring[used_idx % q->num].len = length;
+    // Ring entry must be visible before the index
+    __atomic_store_n(&q->used->idx, (uint16_t)(used_idx + 1),
+            __ATOMIC_RELEASE);
+    if (memory->is_dirty_tracking()) {
+        mark_chain_dirty(q, head);
+    }
+
+    q->used_pending = true;
+}
+
+void VirtioDevice::mark_chain_dirty(virtq *q, uint16_t head)
+{
+    memory->mark_dirty(q->used_address, sizeof(virtq_used)
+            + sizeof(virtq_used_elem) * q->num + sizeof(uint16_t));
+
+    // The device is done with the chain, so its writable buffers hold
+    // whatever it wrote
+    uint16_t index = head;
+    for (int i = 0; i < q->num && index < q->num; i++) {
+        virtq_desc *desc = &q->desc[index];
+        if (desc->flags & VIRTQ_DESC_F_WRITE) {
+            memory->mark_dirty(desc->addr, desc->len);
+        }
+        if (!(desc->flags & VIRTQ_DESC_F_NEXT)) {
+            break;
+        }
+        index = desc->next;
+    }
+}
+
+void VirtioDevice::notify_used(int queue)
+{
+    virtq *q = &queues[queue];
+
+    if (!q->used_pending) {
+        return;
+    }
+    q->used_pending = false;
+
+    if (q->avail->flags & VIRTQ_AVAIL_F_NO_INTERRUPT) {
+        return;
+    }
+
+    raise_irq(VIRTIO_INT_USED_RING);
+}
+
+void VirtioDevice::set_needs_reset()
+{
+    bool was_running = (status & VIRTIO_STATUS_DRIVER_OK)
+        && !(status & VIRTIO_STATUS_NEEDS_RESET);
+    status |= VIRTIO_STATUS_NEEDS_RESET;
+    if (was_running) {
+        notify_config();
+    }
+}
+
+void VirtioDevice::notify_config()
+{
+    config_generation++;
+    raise_irq(VIRTIO_INT_CONFIG);
+}
+
+void VirtioDevice::raise_irq(uint32_t reason)
+{
+    interrupt_status |= reason;
+
+    if (pic != NULL) {
+        pic->push_irq(irq_number);
+    }
+}
@@ -0,0 +1,172 @@
+#ifndef __VIRTIO_H__
+#define __VIRTIO_H__
+
+#include <stdint.h>
+#include <sys/uio.h>
+
+#include "io_device.h"
+#include "memory.h"
+#include "pic.h"
+
+#define VIRTIO_MMIO_SIZE            (0x200)
+#define VIRTIO_MMIO_MAGIC           (0x74726976) // "virt"
+#define VIRTIO_MMIO_VERSION         (2)
+#define VIRTIO_VENDOR_ID            (0x38365648) // "HV86"
+#define VIRTIO_QUEUE_SIZE           (256)
+#define VIRTIO_MAX_QUEUES           (16)
+
+// virtio-mmio register offsets
+#define VIRTIO_MMIO_MAGIC_VALUE     (0x000)
+#define VIRTIO_MMIO_VERSION_REG     (0x004)
+#define VIRTIO_MMIO_DEVICE_ID       (0x008)
+#define VIRTIO_MMIO_VENDOR_ID       (0x00c)
+#define VIRTIO_MMIO_DEVICE_FEATURES (0x010)
+#define VIRTIO_MMIO_DEVICE_FEATURES_SEL (0x014)
+#define VIRTIO_MMIO_DRIVER_FEATURES (0x020)
+#define VIRTIO_MMIO_DRIVER_FEATURES_SEL (0x024)
+#define VIRTIO_MMIO_QUEUE_SEL       (0x030)
+#define VIRTIO_MMIO_QUEUE_NUM_MAX   (0x034)
+#define VIRTIO_MMIO_QUEUE_NUM       (0x038)
+#define VIRTIO_MMIO_QUEUE_READY     (0x044)
+#define VIRTIO_MMIO_QUEUE_NOTIFY    (0x050)
+#define VIRTIO_MMIO_INTERRUPT_STATUS (0x060)
+#define VIRTIO_MMIO_INTERRUPT_ACK   (0x064)
+#define VIRTIO_MMIO_STATUS          (0x070)
+#define VIRTIO_MMIO_QUEUE_DESC_LOW  (0x080)
+#define VIRTIO_MMIO_QUEUE_DESC_HIGH (0x084)
+#define VIRTIO_MMIO_QUEUE_AVAIL_LOW (0x090)
+#define VIRTIO_MMIO_QUEUE_AVAIL_HIGH (0x094)
+#define VIRTIO_MMIO_QUEUE_USED_LOW  (0x0a0)
+#define VIRTIO_MMIO_QUEUE_USED_HIGH (0x0a4)
+#define VIRTIO_MMIO_CONFIG_GENERATION (0x0fc)
+#define VIRTIO_MMIO_CONFIG          (0x100)
+
+// Device status bits
+#define VIRTIO_STATUS_DRIVER_OK     (0x04)
+#define VIRTIO_STATUS_NEEDS_RESET   (0x40)
+
+#define VIRTIO_INT_USED_RING        (0x1)
+#define VIRTIO_INT_CONFIG           (0x2)
+
+#define VIRTIO_F_VERSION_1          (32)
+
+#define VIRTQ_DESC_F_NEXT           (0x1)
+#define VIRTQ_DESC_F_WRITE          (0x2)
+#define VIRTQ_AVAIL_F_NO_INTERRUPT  (0x1)
+
+struct virtq_desc {
+    uint64_t addr;
+    uint32_t len;
+    uint16_t flags;
+    uint16_t next;
+} __attribute__((packed));
+
+struct virtq_avail {
+    uint16_t flags;
+    uint16_t idx;
+    uint16_t ring[];
+} __attribute__((packed));
+
+struct virtq_used_elem {
+    uint32_t id;
+    uint32_t len;
+} __attribute__((packed));
+
+struct virtq_used {
+    uint16_t flags;
+    uint16_t idx;
+    virtq_used_elem ring[];
+} __attribute__((packed));
+
+struct virtq {
+    uint16_t num;
+    bool ready;
+    // Set ready by the guest while requests from before a reset were
+    // still in flight; set up once they are done
+    bool setup_pending;
+    uint64_t desc_address;
+    uint64_t avail_address;
+    uint64_t used_address;
+    // Host pointers into guest memory, resolved when the queue is ready
+    virtq_desc *desc;
+    virtq_avail *avail;
+    virtq_used *used;
+    uint16_t last_avail_idx;
+    // Used buffers pushed since the last interrupt
+    bool used_pending;
+};
+
+// virtio-mmio transport and split virtqueues, shared by virtio devices
+class VirtioDevice : public MMIODevice {
+public:
+    VirtioDevice(Memory *memory, uint64_t base_address, uint32_t device_id,
+            int queue_count);
+    virtual ~VirtioDevice();
+    void mmio_write(uint64_t address, const uint64_t *value, uint8_t size);
+    void mmio_read(uint64_t address, uint64_t *value, uint8_t size);
+    void connect_pic(PIC *pic, uint8_t irq_number);
+    uint64_t get_base_address();
+    // Back to the state before the driver found the device, as a write of
+    // 0 to the status register does
+    void reset_device();
+protected:
+    // Feature bits offered by the device (VIRTIO_F_VERSION_1 is added)
+    virtual uint64_t get_features() = 0;
+    virtual void queue_notify(int queue) = 0;
+    virtual void read_config(uint32_t offset, uint64_t *value,
+            uint8_t size) = 0;
+    virtual void write_config(uint32_t, uint64_t, uint8_t) {}
+    virtual void reset() {}
+    // Requests taken from the rings that the host hasn't finished. Head
+    // indexes come round again after a reset, so queues aren't set up
+    // until these are done.
+    virtual int get_inflight() { return 0; }
+    // Call when get_inflight() drops to 0, to set up held off queues
+    void inflight_drained();
+
+    // Take next available descriptor chain of queue. Device-readable
+    // buffers come first in iov, followed by device-writable ones.
+    // Return head index, or -1 if the queue is empty or the device needs
+    // a reset. A chain with a bad buffer is returned with broken set and
+    // only the buffers before the bad one in iov; it must still be used.
+    int pop_chain(int queue, struct iovec *iov, int max_iov,
+            int *readable_count, int *writable_count, bool *broken);
+    // Last byte of the chain's final buffer if the device may write it,
+    // NULL otherwise
+    uint8_t *get_chain_tail(int queue, uint16_t head);
+    void push_used(int queue, uint16_t head, uint32_t length);
+    // Raise a single interrupt for everything pushed since the last call
+    void notify_used(int queue);
+    void notify_config();
+
+    Memory *memory;
+    int queue_count;
+    virtq queues[VIRTIO_MAX_QUEUES];
+    uint64_t driver_features;
+    uint8_t status;
+    // Bumped by each reset, so that completions from before it can be
+    // told apart and dropped
+    uint32_t generation;
+private:
+    void write_register(uint32_t offset, uint32_t value);
+    uint32_t read_register(uint32_t offset);
+    void setup_queue(virtq *q);
+    // Report the used ring and chain's writable buffers as written
+    void mark_chain_dirty(virtq *q, uint16_t head);
+    // Stop processing after the guest broke the ring
+    void set_needs_reset();
+    void raise_irq(uint32_t reason);
+
+    uint64_t base_address;
+    uint32_t device_id;
+    PIC *pic;
+    uint8_t irq_number;
+
+    uint32_t device_features_sel;
+    uint32_t driver_features_sel;
+    uint32_t queue_sel;
+    uint32_t interrupt_status;
+    uint32_t config_generation;
+};
+
+#endif
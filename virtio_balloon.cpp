@@ -0,0 +1,156 @@
+#include "virtio_balloon.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "log.h"
+
+VirtioBalloon::VirtioBalloon(Memory *memory, uint64_t base_address)
+    : VirtioDevice(memory, base_address, VIRTIO_BALLOON_DEVICE_ID,
+            VIRTIO_BALLOON_QUEUES)
+{
+    num_pages = 0;
+    actual = 0;
+    inflated_pages = 0;
+    deflated_pages = 0;
+    reported_bytes = 0;
+}
+
+uint64_t VirtioBalloon::get_features()
+{
+    return 1ULL << VIRTIO_BALLOON_F_DEFLATE_ON_OOM
+        | 1ULL << VIRTIO_BALLOON_F_PAGE_REPORTING;
+}
+
+void VirtioBalloon::set_target(uint32_t pages)
+{
+    if (pages == num_pages) {
+        return;
+    }
+    num_pages = pages;
+    notify_config();
+}
+
+uint32_t VirtioBalloon::get_actual()
+{
+    return actual;
+}
+
+void VirtioBalloon::read_config(uint32_t offset, uint64_t *value,
+        uint8_t size)
+{
+    uint8_t config[8];
+    memcpy(config + 0, &num_pages, 4);
+    memcpy(config + 4, &actual, 4);
+
+    if (offset + size > sizeof(config)) {
+        return;
+    }
+    memcpy(value, config + offset, size);
+}
+
+void VirtioBalloon::write_config(uint32_t offset, uint64_t value,
+        uint8_t size)
+{
+    // Only actual is writable by the driver
+    uint8_t config[8];
+    memcpy(config + 4, &actual, 4);
+
+    if (offset < 4 || offset + size > sizeof(config)) {
+        return;
+    }
+    memcpy(config + offset, &value, size);
+    memcpy(&actual, config + 4, 4);
+}
+
+void VirtioBalloon::reset()
+{
+    actual = 0;
+}
+
+void VirtioBalloon::inflate(struct iovec *iov, int count)
+{
+    uint64_t run_start = 0;
+    uint64_t run_length = 0;
+
+    for (int i = 0; i < count; i++) {
+        const uint8_t *p = (const uint8_t*)iov[i].iov_base;
+        for (size_t j = 0; j + 4 <= iov[i].iov_len; j += 4) {
+            uint32_t pfn;
+            memcpy(&pfn, p + j, 4);
+            inflated_pages++;
+
+            // Guests tend to hand over neighbouring pages; discard each run
+            // with one call
+            if (run_length > 0 && run_start + run_length == pfn) {
+                run_length++;
+                continue;
+            }
+            if (run_length > 0) {
+                memory->discard(run_start << VIRTIO_BALLOON_PFN_SHIFT,
+                        run_length << VIRTIO_BALLOON_PFN_SHIFT);
+            }
+            run_start = pfn;
+            run_length = 1;
+        }
+    }
+
+    if (run_length > 0) {
+        memory->discard(run_start << VIRTIO_BALLOON_PFN_SHIFT,
+                run_length << VIRTIO_BALLOON_PFN_SHIFT);
+    }
+}
+
+void VirtioBalloon::queue_notify(int queue)
+{
+    struct iovec iov[VIRTIO_BALLOON_MAX_IOV];
+    int readable_count;
+    int writable_count;
+    bool broken;
+    int head;
+
+    while ((head = pop_chain(queue, iov, VIRTIO_BALLOON_MAX_IOV,
+                    &readable_count, &writable_count, &broken)) >= 0) {
+        if (broken) {
+            // Page lists are only hints; skip the whole chain
+            push_used(queue, head, 0);
+            continue;
+        }
+        switch (queue) {
+        case VIRTIO_BALLOON_Q_INFLATE:
+            inflate(iov, readable_count);
+            break;
+        case VIRTIO_BALLOON_Q_DEFLATE:
+            // The guest takes pages back and faults them in when it uses
+            // them; nothing to do
+            for (int i = 0; i < readable_count; i++) {
+                deflated_pages += iov[i].iov_len / 4;
+            }
+            break;
+        case VIRTIO_BALLOON_Q_REPORTING:
+            // Buffers are the free pages themselves
+            for (int i = readable_count;
+                    i < readable_count + writable_count; i++) {
+                memory->discard(memory->get_address(iov[i].iov_base),
+                        iov[i].iov_len);
+                reported_bytes += iov[i].iov_len;
+            }
+            break;
+        default:
+            LOG_WARN("VirtioBalloon: Notify on unknown queue %d\n", queue);
+            break;
+        }
+        push_used(queue, head, 0);
+    }
+
+    notify_used(queue);
+}
+
+void VirtioBalloon::debug_status()
+{
+    printf("VirtioBalloon: target %u pages, actual %u, %llu inflated, "
+            "%llu deflated, %llu MB reported\n", num_pages, actual,
+            (unsigned long long)inflated_pages,
+            (unsigned long long)deflated_pages,
+            (unsigned long long)(reported_bytes >> 20));
+}
@@ -0,0 +1,50 @@
+#ifndef __VIRTIO_BALLOON_H__
+#define __VIRTIO_BALLOON_H__
+
+#include <stdint.h>
+#include <sys/uio.h>
+
+#include "virtio.h"
+
+#define VIRTIO_BALLOON_DEVICE_ID    (5)
+#define VIRTIO_BALLOON_PFN_SHIFT    (12)
+#define VIRTIO_BALLOON_MAX_IOV      (128)
+
+#define VIRTIO_BALLOON_F_DEFLATE_ON_OOM (2)
+#define VIRTIO_BALLOON_F_PAGE_REPORTING (5)
+
+// Without stats and free page hinting, reporting is the third queue
+#define VIRTIO_BALLOON_Q_INFLATE    (0)
+#define VIRTIO_BALLOON_Q_DEFLATE    (1)
+#define VIRTIO_BALLOON_Q_REPORTING  (2)
+#define VIRTIO_BALLOON_QUEUES       (3)
+
+// Memory balloon. The guest inflates it with pages it gives up, which go
+// back to the host, and reports free pages for the same treatment.
+class VirtioBalloon : public VirtioDevice {
+public:
+    VirtioBalloon(Memory *memory, uint64_t base_address);
+    // Ask the guest to hold pages [4 KB] in the balloon
+    void set_target(uint32_t pages);
+    // Pages the guest says are in the balloon
+    uint32_t get_actual();
+    void debug_status();
+protected:
+    uint64_t get_features();
+    void queue_notify(int queue);
+    void read_config(uint32_t offset, uint64_t *value, uint8_t size);
+    void write_config(uint32_t offset, uint64_t value, uint8_t size);
+    void reset();
+private:
+    // Discard the pages whose frame numbers the chain holds
+    void inflate(struct iovec *iov, int count);
+
+    uint32_t num_pages;
+    uint32_t actual;
+
+    uint64_t inflated_pages;
+    uint64_t deflated_pages;
+    uint64_t reported_bytes;
+};
+
+#endif
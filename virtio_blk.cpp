@@ -0,0 +1,263 @@
+#include "virtio_blk.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "log.h"
+
+VirtioBlk::VirtioBlk(Memory *memory, uint64_t base_address, AsyncIO *aio,
+        BlockBackend *disk, bool read_only, int queue_count)
+    : VirtioDevice(memory, base_address, VIRTIO_BLK_DEVICE_ID, queue_count)
+{
+    this->aio = aio;
+    this->disk = disk;
+    this->read_only = read_only;
+    inflight = 0;
+    request_count = 0;
+    batch_count = 0;
+
+    for (int i = 0; i < VIRTIO_MAX_QUEUES; i++) {
+        requests[i] = i < this->queue_count
+            ? new virtio_blk_request[VIRTIO_QUEUE_SIZE] : NULL;
+    }
+}
+
+VirtioBlk::~VirtioBlk()
+{
+    for (int i = 0; i < VIRTIO_MAX_QUEUES; i++) {
+        delete[] requests[i];
+    }
+}
+
+uint64_t VirtioBlk::get_features()
+{
+    uint64_t features = 1ULL << VIRTIO_BLK_F_SEG_MAX
+        | 1ULL << VIRTIO_BLK_F_BLK_SIZE
+        | 1ULL << VIRTIO_BLK_F_FLUSH;
+
+    if (queue_count > 1) {
+        features |= 1ULL << VIRTIO_BLK_F_MQ;
+    }
+    if (read_only) {
+        features |= 1ULL << VIRTIO_BLK_F_RO;
+    }
+
+    return features;
+}
+
+void VirtioBlk::read_config(uint32_t offset, uint64_t *value, uint8_t size)
+{
+    uint8_t config[36];
+    uint64_t capacity = disk->get_size() / BLOCK_SECTOR_SIZE;
+    uint32_t seg_max = VIRTIO_BLK_SEG_MAX;
+    uint32_t blk_size = BLOCK_SECTOR_SIZE;
+    uint16_t num_queues = queue_count;
+
+    memset(config, 0, sizeof(config));
+    memcpy(config + 0, &capacity, 8);
+    memcpy(config + 12, &seg_max, 4);
+    memcpy(config + 20, &blk_size, 4);
+    memcpy(config + 34, &num_queues, 2);
+
+    if (offset + size > sizeof(config)) {
+        return;
+    }
+    memcpy(value, config + offset, size);
+}
+
+void VirtioBlk::queue_notify(int queue)
+{
+    struct iovec iov[VIRTIO_BLK_MAX_IOV];
+    int readable_count;
+    int writable_count;
+    bool broken;
+    int head;
+
+    // Drain the whole ring per notification; each chain becomes one
+    // vectored request
+    while ((head = pop_chain(queue, iov, VIRTIO_BLK_MAX_IOV,
+                    &readable_count, &writable_count, &broken)) >= 0) {
+        virtio_blk_request *request = &requests[queue][head];
+        request->generation = generation;
+        request->queue = queue;
+        request->head = head;
+        request->length = 0;
+        request_count++;
+
+        if (broken) {
+            // Status byte is still at the end of the chain if it's valid
+            request->status = get_chain_tail(queue, head);
+            complete_request(request, VIRTIO_BLK_S_IOERR);
+            continue;
+        }
+        handle_request(request, iov, readable_count, writable_count);
+    }
+
+    // Requests that finished without I/O share one interrupt
+    notify_used(queue);
+}
+
+bool VirtioBlk::handle_request(virtio_blk_request *request, struct iovec *iov,
+        int readable_count, int writable_count)
+{
+    struct iovec *readable = iov;
+    struct iovec *writable = iov + readable_count;
+    uint64_t readable_length = iov_length(readable, readable_count);
+    virtio_blk_outhdr header;
+
+    request->status = NULL;
+
+    if (writable_count == 0 || writable[writable_count - 1].iov_len == 0
+            || readable_length < sizeof(header)) {
+        LOG_WARN("VirtioBlk: Malformed request\n");
+        push_used(request->queue, request->head, 0);
+        return false;
+    }
+
+    // Status is the last byte of the chain
+    struct iovec *last = &writable[writable_count - 1];
+    request->status = (uint8_t*)last->iov_base + last->iov_len - 1;
+    uint64_t writable_length = iov_length(writable, writable_count) - 1;
+
+    struct iovec header_iov[VIRTIO_BLK_MAX_IOV];
+    int header_count = iov_slice(readable, readable_count, 0, sizeof(header),
+            header_iov, VIRTIO_BLK_MAX_IOV);
+    uint8_t *p = (uint8_t*)&header;
+    for (int i = 0; i < header_count; i++) {
+        memcpy(p, header_iov[i].iov_base, header_iov[i].iov_len);
+        p += header_iov[i].iov_len;
+    }
+
+    int count;
+    uint64_t length;
+    switch (header.type) {
+    case VIRTIO_BLK_T_IN:
+        count = iov_slice(writable, writable_count, 0, writable_length,
+                request->iov, VIRTIO_BLK_MAX_IOV);
+        length = writable_length;
+        request->aio.op = AIO_OP_READ;
+        break;
+    case VIRTIO_BLK_T_OUT:
+        if (read_only) {
+            complete_request(request, VIRTIO_BLK_S_IOERR);
+            return false;
+        }
+        count = iov_slice(readable, readable_count, sizeof(header),
+                readable_length - sizeof(header), request->iov,
+                VIRTIO_BLK_MAX_IOV);
+        length = readable_length - sizeof(header);
+        request->aio.op = AIO_OP_WRITE;
+        break;
+    case VIRTIO_BLK_T_FLUSH:
+        count = 0;
+        length = 0;
+        request->aio.op = AIO_OP_FLUSH;
+        break;
+    case VIRTIO_BLK_T_GET_ID: {
+        char id[VIRTIO_BLK_ID_BYTES];
+        memset(id, 0, sizeof(id));
+        strncpy(id, "hv86-virtio-blk", sizeof(id));
+        count = iov_slice(writable, writable_count, 0, writable_length,
+                request->iov, VIRTIO_BLK_MAX_IOV);
+        uint32_t copied = 0;
+        for (int i = 0; i < count && copied < sizeof(id); i++) {
+            uint32_t n = request->iov[i].iov_len;
+            if (n > sizeof(id) - copied) {
+                n = sizeof(id) - copied;
+            }
+            memcpy(request->iov[i].iov_base, id + copied, n);
+            copied += n;
+        }
+        request->length = copied;
+        complete_request(request, VIRTIO_BLK_S_OK);
+        return false;
+    }
+    default:
+        complete_request(request, VIRTIO_BLK_S_UNSUPP);
+        return false;
+    }
+
+    // Sector comes from the guest; check it before it's scaled
+    uint64_t capacity = disk->get_size() / BLOCK_SECTOR_SIZE;
+    if (length % BLOCK_SECTOR_SIZE || header.sector > capacity
+            || length / BLOCK_SECTOR_SIZE > capacity - header.sector) {
+        complete_request(request, VIRTIO_BLK_S_IOERR);
+        return false;
+    }
+    uint64_t offset = header.sector * BLOCK_SECTOR_SIZE;
+
+    request->aio.backend = disk;
+    request->aio.iov = request->iov;
+    request->aio.iovcnt = count;
+    request->aio.offset = offset;
+    request->aio.handler = this;
+    inflight++;
+    aio->submit(&request->aio);
+
+    return true;
+}
+
+void VirtioBlk::aio_complete(aio_request *aio_request)
+{
+    virtio_blk_request *request = (virtio_blk_request*)aio_request;
+    uint64_t expected = iov_length(request->iov, aio_request->iovcnt);
+
+    inflight--;
+    // The ring and status byte of a driver that has since reset the
+    // device are gone
+    if (request->generation == generation) {
+        uint8_t result = VIRTIO_BLK_S_OK;
+        if (aio_request->result < 0
+                || (uint64_t)aio_request->result != expected) {
+            result = VIRTIO_BLK_S_IOERR;
+        } else if (aio_request->op == AIO_OP_READ) {
+            request->length = aio_request->result;
+        }
+        complete_request(request, result);
+    }
+
+    if (inflight == 0) {
+        inflight_drained();
+    }
+}
+
+int VirtioBlk::get_inflight()
+{
+    return inflight;
+}
+
+void VirtioBlk::aio_complete_batch()
+{
+    // One interrupt per queue for all requests completed in this poll
+    for (int i = 0; i < queue_count; i++) {
+        notify_used(i);
+    }
+    batch_count++;
+}
+
+void VirtioBlk::complete_request(virtio_blk_request *request, uint8_t status)
+{
+    if (request->status == NULL) {
+        push_used(request->queue, request->head, 0);
+        return;
+    }
+    *request->status = status;
+    push_used(request->queue, request->head, request->length + 1);
+}
+
+void VirtioBlk::debug_status()
+{
+    printf("------------------------------\n");
+    printf("VirtioBlk:\n");
+    printf("Status: 0x%02x, features: 0x%016llx, queues: %d\n",
+            status, (unsigned long long)driver_features, queue_count);
+    printf("Requests: %llu, interrupt batches: %llu\n",
+            (unsigned long long)request_count,
+            (unsigned long long)batch_count);
+    for (int i = 0; i < queue_count; i++) {
+        printf("Queue %d: %s, size: %d, last avail: %d\n",
+                i, queues[i].ready ? "ready" : "not ready",
+                queues[i].num, queues[i].last_avail_idx);
+    }
+    printf("------------------------------\n");
+}
@@ -0,0 +1,88 @@
+#ifndef __VIRTIO_BLK_H__
+#define __VIRTIO_BLK_H__
+
+#include <stdint.h>
+#include <sys/uio.h>
+
+#include "aio.h"
+#include "block.h"
+#include "virtio.h"
+
+#define VIRTIO_BLK_DEVICE_ID    (2)
+#define VIRTIO_BLK_SEG_MAX      (126)
+// Header, data segments and status byte
+#define VIRTIO_BLK_MAX_IOV      (VIRTIO_BLK_SEG_MAX + 2)
+#define VIRTIO_BLK_ID_BYTES     (20)
+
+#define VIRTIO_BLK_F_SEG_MAX    (2)
+#define VIRTIO_BLK_F_RO         (5)
+#define VIRTIO_BLK_F_BLK_SIZE   (6)
+#define VIRTIO_BLK_F_FLUSH      (9)
+#define VIRTIO_BLK_F_MQ         (12)
+
+#define VIRTIO_BLK_T_IN         (0)
+#define VIRTIO_BLK_T_OUT        (1)
+#define VIRTIO_BLK_T_FLUSH      (4)
+#define VIRTIO_BLK_T_GET_ID     (8)
+
+#define VIRTIO_BLK_S_OK         (0)
+#define VIRTIO_BLK_S_IOERR      (1)
+#define VIRTIO_BLK_S_UNSUPP     (2)
+
+struct virtio_blk_outhdr {
+    uint32_t type;
+    uint32_t reserved;
+    uint64_t sector;
+} __attribute__((packed));
+
+class VirtioBlk;
+
+// In-flight request. aio must be first so that completions can be mapped
+// back to the request.
+struct virtio_blk_request {
+    aio_request aio;
+    // VirtioDevice::generation when taken from the ring
+    uint32_t generation;
+    int queue;
+    uint16_t head;
+    uint8_t *status;
+    // Bytes written to guest buffers, excluding the status byte
+    uint32_t length;
+    // Data segments, pointing straight into guest memory
+    struct iovec iov[VIRTIO_BLK_MAX_IOV];
+};
+
+class VirtioBlk : public VirtioDevice, public AIOHandler {
+public:
+    // One request queue per vCPU
+    VirtioBlk(Memory *memory, uint64_t base_address, AsyncIO *aio,
+            BlockBackend *disk, bool read_only, int queue_count);
+    ~VirtioBlk();
+    void aio_complete(aio_request *request);
+    void aio_complete_batch();
+    void debug_status();
+protected:
+    uint64_t get_features();
+    void queue_notify(int queue);
+    void read_config(uint32_t offset, uint64_t *value, uint8_t size);
+    int get_inflight();
+private:
+    // Parse chain and submit it. Return false if it completed immediately.
+    bool handle_request(virtio_blk_request *request, struct iovec *iov,
+            int readable_count, int writable_count);
+    void complete_request(virtio_blk_request *request, uint8_t status);
+
+    AsyncIO *aio;
+    BlockBackend *disk;
+    bool read_only;
+    // Requests are indexed by head descriptor, which is unique while the
+    // chain is in flight
+    virtio_blk_request *requests[VIRTIO_MAX_QUEUES];
+    // Requests submitted to aio and not completed yet
+    int inflight;
+
+    uint64_t request_count;
+    uint64_t batch_count;
+};
+
+#endif
@@ -0,0 +1,71 @@
+#include "zero_page_scanner.h"
+
+#include <stdio.h>
+
+#define ZERO_SCAN_FIRST_PAGE    (MEMORY_BIOS_END >> MEMORY_PAGE_SHIFT)
+
+ZeroPageScanner::ZeroPageScanner(Memory *memory, EventScheduler *scheduler,
+        AsyncIO *aio)
+{
+    this->memory = memory;
+    this->scheduler = scheduler;
+    this->aio = aio;
+    running = false;
+    next_page = ZERO_SCAN_FIRST_PAGE;
+    passes = 0;
+    discarded = 0;
+    deferred = 0;
+}
+
+ZeroPageScanner::~ZeroPageScanner()
+{
+    stop();
+}
+
+void ZeroPageScanner::start()
+{
+    if (running) {
+        return;
+    }
+    running = true;
+    scheduler->schedule(this, scheduler->get_time() + ZERO_SCAN_INTERVAL);
+}
+
+void ZeroPageScanner::stop()
+{
+    if (!running) {
+        return;
+    }
+    running = false;
+    scheduler->cancel(this);
+}
+
+void ZeroPageScanner::handle_event(uint64_t now)
+{
+    if (aio != NULL && aio->get_inflight() > 0) {
+        deferred++;
+    } else {
+        discarded += memory->discard_zero_pages(next_page, ZERO_SCAN_SLICE);
+        next_page += ZERO_SCAN_SLICE;
+        if (next_page >= memory->get_page_count()) {
+            next_page = ZERO_SCAN_FIRST_PAGE;
+            passes++;
+        }
+    }
+
+    scheduler->schedule(this, now + ZERO_SCAN_INTERVAL);
+}
+
+uint64_t ZeroPageScanner::get_discarded_pages()
+{
+    return discarded;
+}
+
+void ZeroPageScanner::debug_status()
+{
+    printf("ZeroPageScanner: %llu passes, %llu pages discarded (%llu MB), "
+            "%llu slices deferred\n", (unsigned long long)passes,
+            (unsigned long long)discarded,
+            (unsigned long long)(discarded >> (20 - MEMORY_PAGE_SHIFT)),
+            (unsigned long long)deferred);
+}
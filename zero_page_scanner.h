@@ -0,0 +1,41 @@
+#ifndef __ZERO_PAGE_SCANNER_H__
+#define __ZERO_PAGE_SCANNER_H__
+
+#include <stdint.h>
+
+#include "aio.h"
+#include "event_scheduler.h"
+#include "memory.h"
+
+// Time between slices [ns]
+#define ZERO_SCAN_INTERVAL      (50000000)
+// Pages looked at per slice (16 MB)
+#define ZERO_SCAN_SLICE         (4096)
+
+// Finds guest pages that are all zero and gives them back to the host, a
+// slice at a time. Slices run as timers on the vCPU thread, so the guest
+// can't write to a page between the check and the discard, and are put
+// off while DMA is in flight. ROM images below 1 MB are mapped from files,
+// where discarding would bring back the file contents, so they're skipped.
+class ZeroPageScanner : public EventHandler {
+public:
+    ZeroPageScanner(Memory *memory, EventScheduler *scheduler, AsyncIO *aio);
+    ~ZeroPageScanner();
+    void start();
+    void stop();
+    void handle_event(uint64_t now);
+    uint64_t get_discarded_pages();
+    void debug_status();
+private:
+    Memory *memory;
+    EventScheduler *scheduler;
+    AsyncIO *aio;
+    bool running;
+    uint64_t next_page;
+
+    uint64_t passes;
+    uint64_t discarded;
+    uint64_t deferred;
+};
+
+#endif